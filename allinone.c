@@ -3,186 +3,938 @@
 #include <string.h>
 #include <limits.h>
 #include <math.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <glob.h>
+#include <dirent.h>
+#include <malloc.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 char *read_line(FILE *ptr);
-void nonalpha_to_space(char *str);
 int starts_with(char *str, char *pre);
-char *stem(char *word);
+double now_seconds();
+char *append_text(char *text, int *size, int *max_size, char *format, ...);
+double latency_percentile(double *sorted, int n, double p);
+int cmp_latency(const void *a, const void *b);
+int stem_word(char *word, int len, char *buf);
+
+#define POSTING_BLOCK_SIZE 128         // number of documents in a packed block of a document list
+
+#define RANKING_EUCLID 0                // rank documents by the euclidian distance of their TF-IDF vector to the query
+#define RANKING_COSINE 1                // rank documents by the cosine similarity of their TF-IDF vector to the query
+
+#define STEM_CACHE_WORD_SIZE 31         // longest word kept in the stem cache
+
+#define TOKEN_BUFFER_SIZE (1 << 16)     // number of bytes a tokenizer reads at once, longer words are split
+
+#define DEFAULT_MEMORY_BUDGET (256L << 20)  // bytes the words parsed while building an index may occupy before they are written to a run
+
+#define DOCUMENT_PAGE_SIZE 1024         // documents per page of the document table and of the norms (power of 2), snapshots share unchanged pages
+#define REMOVED_DF_PAGE_SIZE 64         // words per page of the counts of removed documents of a segment
+#define NORM_DF_TOLERANCE 0.01          // change of log(df) of a word the sums of the documents containing it may lag behind
+#define MAX_NORM_DRIFTS 4096            // words whose sums may lag behind their df, then the sums of all of them are updated
+
+// runtime counters (see stats.c), the STAT_TIME_ ones count nanoseconds
+#define STAT_SEARCHES 0                 // searches
+#define STAT_CANDIDATES 1               // documents containing an essential search term, looked at by searches
+#define STAT_DOCS_SCORED 2              // documents whose distance to the query was computed in full
+#define STAT_POSTINGS_SCANNED 3         // documents of document lists the cursors of searches moved to
+#define STAT_DOCS_PARSED 4              // documents parsed
+#define STAT_TOKENS 5                   // words of the documents parsed
+#define STAT_STOPWORD_HITS 6            // words of documents left out as stopwords
+#define STAT_STEM_CALLS 7               // words of documents stemmed
+#define STAT_BYTES_READ 8               // bytes of index files mapped, of journals replayed and of text index files imported
+#define STAT_BYTES_WRITTEN 9            // bytes of index files, runs, manifests and journal records written
+#define STAT_TIME_PARSE 10              // parsing documents: reading, tokenizing, stemming, adding their words
+#define STAT_TIME_SCORE 11              // searching
+#define STAT_TIME_MERGE 12              // merging segments in the background (including writing the merged segment)
+#define STAT_TIME_PERSIST 13            // writing index files, manifests and journal records to disk
+#define STAT_TIME_LOAD 14               // loading the index
+#define NR_STATS 15
 
 typedef struct doc {
     int id;                             // index of the document in the filebase
-    double tf;                          // number of occurances in this document
+    int count;                          // number of occurances in this document
 } doc_t, *doc_p;
 
+typedef struct posting_block {
+    int last_id;                        // id of the last document in the block
+    int offset;                         // position of the packed block in the data of the document list (in 32 bit words)
+    unsigned char nr_docs;              // number of documents in the block (POSTING_BLOCK_SIZE except for the last block)
+    unsigned char id_bits;              // bits per packed id gap
+    unsigned char count_bits;           // bits per packed count
+    unsigned char reserved;
+} posting_block_t, *posting_block_p;
+
 typedef struct indexed_word {
-    struct indexed_word *next;          // next indexed word
-    char *stem;                         // stem of this word
+    char *stem;                         // stem of this word (stored in the stem blocks of the index)
     int nr_docs;                        // number of documents in filebase containing this word or variations of it
-    doc_t documents[];                  // list of these documents' index in the filebase
+    int nr_blocks;                      // number of packed blocks of the document list
+    int max_blocks;                     // number of blocks the list below has room for (0 = blocks and data are not owned by the word)
+    int data_size;                      // number of 32 bit words used by the packed blocks
+    int max_data;                       // number of 32 bit words the packed data has room for
+    int nr_tail;                        // number of documents in the tail
+    int max_tail;                       // number of documents the tail has room for
+    posting_block_p blocks;             // skip list: id range and position of each packed block (ordered by index)
+    unsigned int *data;                 // packed blocks: id gaps followed by the counts, bit packed
+    doc_p tail;                         // documents after the last packed block, not packed yet (ordered by index)
+    int positions_size;                 // number of bytes of the position lists
+    int max_positions;                  // number of bytes the position lists have room for (0 = not owned by the word)
+    int tail_positions;                 // offset of the position list of the first document of the tail
+    int *block_positions;               // per packed block: offset of the position list of its first document (owned with the blocks)
+    unsigned char *positions;           // position lists of the documents, in the order of the list (NULL = none recorded)
+    int stamp;                          // snapshot the document list was last copied for (words in memory, see own_word)
 } indexed_word_t, *indexed_word_p;
 
+typedef struct posting_cursor {
+    indexed_word_p word;                // word of the document list
+    int block;                          // block of the cursor (nr_blocks = tail)
+    int pos;                            // position of the cursor in the block
+    int nr_docs;                        // number of documents in the block
+    doc_t docs[POSTING_BLOCK_SIZE];     // decoded documents of the block
+    int list_doc;                       // document of the block whose position list was looked up last (-1 = none)
+    int list_offset;                    // offset of that position list
+} posting_cursor_t, *posting_cursor_p;
+
+typedef struct doc_norm {
+    double tf2;                         // sum of TF^2 over the words of the document
+    double tf2_log;                     // sum of TF^2 * log(df) over the words of the document
+    double tf2_log2;                    // sum of TF^2 * log(df)^2 over the words of the document
+} doc_norm_t, *doc_norm_p;
+
+typedef struct norm_drift {
+    char *stem;                         // stem of the word (NULL = empty slot)
+    unsigned int hash;                  // hash of the stem
+    int df;                             // number of documents containing the word the sums of these documents use
+} norm_drift_t, *norm_drift_p;
+
+typedef struct stem_cache_entry {
+    unsigned char len;                  // length of the word (0 = empty entry)
+    unsigned char stem_len;             // length of the stem of the word
+    char word[STEM_CACHE_WORD_SIZE];    // the word (not \0 terminated)
+    char stem[STEM_CACHE_WORD_SIZE];    // the stem of the word (not \0 terminated)
+} stem_cache_entry_t, *stem_cache_entry_p;
+
+typedef struct stem_cache {
+    stem_cache_entry_p entries;         // entries of the cache, a word can only be kept in the entry its hash selects
+    int nr_entries;                     // number of entries (power of 2)
+    long hits;                          // number of words whose stem was found in the cache
+    long misses;                        // number of words stemmed
+} stem_cache_t, *stem_cache_p;
+
+typedef struct tokenizer {
+    int fd;                             // file the text is read from (-1 = the text is a string)
+    char *buffer;                       // text read so far, words are turned to lower case in place
+    int pos;                            // position of the next character to look at
+    int end;                            // number of characters in the buffer
+    int eof;                            // 1 if there is no more text to read
+} tokenizer_t, *tokenizer_p;
+
+typedef struct stopword_set {
+    int nr_words;                       // number of stopwords
+    int nr_buckets;                     // number of buckets the first hash distributes the stopwords to
+    int nr_slots;                       // number of slots of the hash table (usually nr_words)
+    int *seeds;                         // per bucket: seed of the second hash placing its stopwords (< 0: -1 - slot of its only stopword)
+    char **slots;                       // per slot: the stopword placed there (NULL = empty slot)
+    int *lengths;                       // per slot: length of the stopword
+    unsigned long length_mask;          // bit n is set if a stopword has n letters (bit 63: 63 letters or more)
+    char *words;                        // \0 terminated stopwords, one after another, alphabetically ordered
+    int size;                           // number of bytes of the stopwords
+} stopword_set_t, *stopword_set_p;
+
+typedef struct stem_block {
+    struct stem_block *next;            // previously filled block
+    int size;                           // number of bytes available in this block
+    int used;                           // number of bytes used in this block
+    char stems[];                       // \0 terminated stems, one after another
+} stem_block_t, *stem_block_p;
+
+typedef struct word_slot {
+    unsigned int hash;                  // hash of the stem of the word in this slot
+    int word;                           // index of the word in the list of indexed words + 1 (0 = empty slot)
+} word_slot_t, *word_slot_p;
+
 typedef struct indexed_document {
-    char *name;                         // name of the document
+    char *name;                         // name of the document (NULL = removed from the filebase)
     int nr_words;                       // number of words in the document
 } indexed_document_t, *indexed_document_p;
 
 typedef struct index {
-   indexed_word_p words;                // linked list of indexed words
+   indexed_word_p words;                // list of indexed words (unordered, see sort_words)
+   word_slot_p slots;                   // open addressing hash table of the indexed words
+   int nr_slots;                        // number of slots in the hash table (power of 2)
+   int max_words;                       // number of words the list of indexed words has room for
+   stem_block_p stems;                  // memory blocks containing the stems of all indexed words
+   doc_norm_p *norms;                   // pages of the sums giving the length of the TF-IDF vector of each document (NULL = not computed)
+   int *norm_stamps;                    // per page of the sums: snapshot the page was last copied for (see own_memory)
+   norm_drift_p norm_drifts;            // open addressing hash table of the words whose df changed after their sums were updated
+   int nr_norm_drifts;                  // number of words in the table (2 * MAX_NORM_DRIFTS slots)
+   int ranking;                         // RANKING_EUCLID or RANKING_COSINE
+   int positions;                       // 1 = record the positions of the words in the documents (for phrases and NEAR)
+   stem_cache_p stem_cache;             // stems of recently parsed words (NULL = stem every word)
+   stopword_set_p stopwords;            // words left out of the index and of search queries (NULL = none)
+   long memory_budget;                  // bytes the words parsed while building the index file may occupy (see index_builder)
    int nr_docs;                         // number of documents in the filebase
    int nr_words;                        // number of different words in the filebase
-   indexed_document_t documents[];      // list of the names of the documents in the filebase
+   int nr_doc_ids;                      // number of document ids handed out (ids of removed documents are not reused)
+   int max_doc_ids;                     // number of documents the lists below have room for (whole pages)
+   indexed_document_p *documents;       // pages of the list of the documents in the filebase, the id of a document is its index (see get_document)
+   int *document_stamps;                // per page of the documents: snapshot the page was last copied for (NULL = pages of another index)
+   int *by_name;                        // ids of the documents in the filebase, alphabetically ordered by name
+   char *map;                           // memory mapped segment file the words are read from, NULL = none
+   size_t map_size;                     // size of the mapped segment file in bytes
+   int generation;                      // number of segments written (the journal belongs to one generation)
+   FILE *journal;                       // journal of the changes since the last segment was written, NULL = none
+   long journal_size;                   // size of the journal in bytes
+   struct index_segment *segments;      // segments holding the words of the documents before the words in memory, ordered by document id
+   int nr_segments;                     // number of segments
+   int next_segment;                    // number of the next segment file
+   int *removed;                        // ids of removed documents whose words are still in segment files
+   int nr_removed;                      // number of these documents
+   int max_removed;                     // number of ids the list above has room for
+   struct segment_merge *merge;         // background merge of segments (NULL = none running)
+   struct snapshot_list *snapshots;     // snapshots of the index published for searches (NULL = none yet)
+   int nr_snapshots;                    // number of snapshots published, memory stamped with a lower number may be shared with them
 } index_t, *index_p;
 
-index_p add_file(index_p db, char *file);
+typedef struct index_segment {
+    int number;                         // number of the segment file (0 = index file written before there were segments)
+    int first_doc;                      // id of the first document of the segment
+    int last_doc;                       // id after the last document of the segment
+    index_t words;                      // words of the segment, read from the mapped segment file (documents are kept by the index)
+    int **removed_df;                   // pages of REMOVED_DF_PAGE_SIZE words of the segment: per word the number of removed documents
+                                        // containing it (NULL = none, a page is NULL if none of its words lost a document)
+    int *removed_df_stamps;             // per page of removed_df: snapshot the page was last copied for (see own_memory)
+    int removed_df_stamp;               // snapshot the list of pages was last copied for
+} index_segment_t, *index_segment_p;
+
+typedef struct index_run {
+    int fd;                             // temporary file the words of the run were written to (-1 = words in memory)
+    FILE *file;                         // the file while the runs are merged
+    char *buffer;                       // buffer of the file while the runs are merged
+    indexed_word_p *words;              // words in memory, alphabetically ordered
+    int nr_words;                       // number of words in memory
+    int pos;                            // position of the next word in memory
+    char *stem;                         // stem of the next word of the run (NULL = no words left)
+    int max_stem;                       // number of bytes stem has room for (words read from the file)
+    int nr_docs;                        // number of documents of the next word (words read from the file)
+    unsigned char *positions;           // position list read from the file
+    int max_positions;                  // number of bytes positions has room for
+} index_run_t, *index_run_p;
+
+typedef struct index_builder {
+    index_p index;                      // index the words are added to
+    index_t words;                      // words of the documents parsed since the last run was written (shares the documents with the index)
+    index_run_p runs;                   // sources of the words in the order of their documents (words in memory, runs written, words parsed last)
+    int nr_runs;                        // number of runs
+    int *heap;                          // runs with words left, ordered by the stem of their next word (then by run)
+    int heap_size;                      // number of runs in the heap
+    char *merged_stem;                  // stem of the word merged, as returned by next_merged_word
+    int max_merged_stem;                // number of bytes merged_stem has room for
+    int merging;                        // run whose documents of the word merged are read (-1 = none left)
+    int merged_doc;                     // id of the last document read from the run (runs written)
+    posting_cursor_t cursor;            // next document of the word merged in the run (words in memory)
+} index_builder_t, *index_builder_p;
+
+typedef struct search_hit {
+    char *name;                         // name of the document
+    double score;                       // euclidian distance or cosine similarity to TF-IDF of the words in the query
+    char *terms;                        // search terms found in this document, separated by ', '
+} search_hit_t, *search_hit_p;
+
+typedef struct search_result {
+    int nr_hits;                        // number of documents found
+    search_hit_t hits[];                // documents found, best first
+} search_result_t, *search_result_p;
+
+void add_file(index_p db, char *file);
 void remove_file(index_p db, int doc_id);
-index_p search_index(index_p *index, char *query);
-void rebuild_index(index_p index);
+search_result_p search_index(index_p index, char *query);
+void close_search_result(search_result_p result);
+void rebuild_index(index_p index, int nr_threads);
 index_p load_index();
+void export_index(index_p db);
 void close_index(index_p db);
+int insert_document(index_p index, char *file);
+int insert_documents(index_p index, char **files, int nr_files);
+void delete_document(index_p index, int doc_id);
+int parse_file_for_index(index_p index, int doc_id, int **words);
+int find_document(index_p db, char *file);
+void change_stopwords(index_p index, char *file);
+void merge_names(index_p index, int *ids, int nr_ids);
+void reserve_documents(index_p index, int nr_doc_ids);
+indexed_document_p get_document(index_p index, int doc_id);
+indexed_document_p change_document(index_p index, int doc_id);
+void init_index(index_p index);
+void clear_index(index_p index);
+
+void init_words(index_p index);
+void clear_words(index_p index);
+long words_memory(index_p index);
+int find_word(index_p index, char *stem);
+int find_or_add_word(index_p index, char *stem);
+void remove_word(index_p index, int word);
+indexed_word_p *sort_words(index_p index);
+unsigned int hash_stem(char *stem);
+
+int add_posting(indexed_word_p w, int doc_id, int count);
+void set_positions(indexed_word_p w, int *positions, int nr_positions);
+void set_position_list(indexed_word_p w, unsigned char *list, int size);
+unsigned char *last_position_list(indexed_word_p w, int *size);
+void append_postings(indexed_word_p w, indexed_word_p other);
+int remove_posting(indexed_word_p w, int doc_id);
+void seal_postings(indexed_word_p w);
+int pack_documents(doc_p docs, int nr_docs, int prev, posting_block_p b, unsigned int *data);
+void free_postings(indexed_word_p w);
+void own_postings(indexed_word_p w);
+void copy_postings(indexed_word_p w, indexed_word_p other);
+void open_cursor(posting_cursor_p c, indexed_word_p w);
+int cursor_doc(posting_cursor_p c);
+int cursor_count(posting_cursor_p c);
+unsigned char *cursor_position_list(posting_cursor_p c, int *size);
+int cursor_positions(posting_cursor_p c, int *positions);
+void cursor_next(posting_cursor_p c);
+int cursor_read(posting_cursor_p c, int *count, unsigned char **list, int *size);
+int cursor_seek(posting_cursor_p c, int doc_id);
+int encode_number(unsigned char *p, unsigned int n);
+unsigned int decode_number(unsigned char **p);
+
+int write_index_file(index_p index, char *file, index_builder_p builder, int first, int last);
+int map_index_file(index_p index, index_p words, char *file);
+void unmap_index_file(index_p index);
+int is_mapped(index_p index, void *ptr);
+int read_document_words(index_p words, int doc_id, int **numbers);
+
+void open_journal(index_p index, char *file);
+void reset_journal(index_p index, char *file);
+void close_journal(index_p index);
+void journal_add(index_p index, int doc_id, int *words, int nr_terms);
+void journal_remove(index_p index, int doc_id);
+
+void parse_documents(index_p index, int first, int last, int nr_threads);
+
+void update_norms(index_p index);
+void clear_norms(index_p index);
+doc_norm_p change_norm(index_p index, int doc_id);
+void update_word_norms(index_p index, char *stem, int old_df, int doc_id);
+void settle_norms(index_p index);
+double document_norm(index_p index, int doc_id, double log_n);
+
+stem_cache_p new_stem_cache();
+void free_stem_cache(stem_cache_p cache);
+int cached_stem(stem_cache_p cache, char *word, int len, char *buf);
+void print_stem_cache(stem_cache_p cache);
+
+stopword_set_p load_stopwords(char *file);
+stopword_set_p new_stopwords(char *text, int size);
+void free_stopwords(stopword_set_p set);
+int is_stopword(stopword_set_p set, char *word, int len);
+unsigned int stopword_hash(unsigned int seed, char *word, int len);
+
+int open_tokenizer(tokenizer_p t, char *file);
+void string_tokenizer(tokenizer_p t, char *str);
+void close_tokenizer(tokenizer_p t);
+int next_token(tokenizer_p t, char **word);
+
+void add_files(index_p index, char *spec, int nr_threads);
+
+void build_index(index_p index, int first, int last, int nr_threads, int report);
+index_builder_p new_index_builder(index_p index);
+void add_words_run(index_builder_p builder, index_p words);
+void free_index_builder(index_builder_p builder);
+void start_merge(index_builder_p builder);
+char *next_merged_word(index_builder_p builder);
+int next_merged_posting(index_builder_p builder, int *count, unsigned char **list, int *size);
+
+int load_segments(index_p index);
+void flush_segment(index_p index, index_builder_p builder);
+void clear_segments(index_p index);
+index_segment_p document_segment(index_p index, int doc_id);
+int remove_segment_document(index_p index, index_segment_p segment, int doc_id, int **words);
+int *change_removed_df(index_p index, index_segment_p segment, int wid);
+void free_removed_df(index_segment_p segment);
+void add_removed(index_p index, int doc_id);
+int word_df(index_p index, char *stem);
+int check_merge(index_p index);
+void wait_for_merge(index_p index);
+
+void publish_snapshot(index_p index);
+index_p acquire_snapshot(index_p index);
+void release_snapshot(index_p index, index_p snapshot);
+void retire_memory(index_p index, void *memory);
+void retire_segment(index_p index, index_segment_p segment);
+void retire_stopwords(index_p index, stopword_set_p set);
+void *own_memory(index_p index, void *memory, int *stamp, size_t size);
+void own_word(index_p index, indexed_word_p w);
+void retire_words(index_p index);
+void retire_postings(index_p index, indexed_word_p w);
+void close_snapshots(index_p index);
+
+struct server *start_server(index_p index, char *address, int nr_threads);
+void stop_server(struct server *server);
+void wait_for_server(struct server *server);
+
+void search_batch(index_p index, char *queries, char *results, int json, int nr_threads);
+
+void count_stat(int stat, long n);
+void count_time(int stat, double start);
+void reset_stats();
+void print_stats(FILE *f);
+
+// number of letters at the end of a word whose consonant/vowel pattern is kept,
+// the steps of the algorithm never look back further than 30 letters from the end of the original word
+#define STEM_WINDOW 64
+
+// bit i is set if the i-th letter of the alphabet is a vowel (a, e, i, o, u)
+#define VOWELS 0x104111
+
+// condition of a rule: the suffix is only replaced if it follows an s or a t
+#define AFTER_S_OR_T -1
+
+// replaces a suffix if the m value of the rest of the word exceeds min_m, leaves the switch if the word ends with the suffix
+// (the rules are selected by the last letter, the next to last one rules out most of them before the call)
+#define RULE(__w, __s, __r, __m) \
+if ((__w)->len >= (int) sizeof(__s) - 1 && (__w)->word[(__w)->len - 2] == __s[sizeof(__s) - 3] \
+        && replace_if(__w, __s, sizeof(__s) - 1, __r, sizeof(__r) - 1, __m)) { \
+    break; \
+}
 
-#define _REPLACE_SUFFIX(__w, __s, __r) \
-BEGIN_REPLACE_SUFFIX(__w, __s, __r) \
-_END_REPLACE_OR
-
-#define _REPLACE_SUFFIX_COND(__w, __s, __r, __c) \
-_BEGIN_REPLACE_SUFFIX_COND(__w, __s, __r, __c) \
-_END_REPLACE_OR
-
-#define _BEGIN_REPLACE_SUFFIX(__w, __s, __r) \
-if (ends_with(__w, __s)) { \
-    __w = replace_suffix(__w, strlen(__s), __r);
-
-#define _BEGIN_REPLACE_SUFFIX_COND(__w, __s, __r, __c) \
-if (ends_with(__w, __s)) { \
-    if (__c) { \
-        __w = replace_suffix(__w, strlen(__s), __r); \
-    _END_REPLACE_COND
-
-#define _OR_REPLACE_SUFFIX(__w, __s, __r) \
-} else _BEGIN_REPLACE_SUFFIX(__w, __s, __r)
-
-#define _OR_REPLACE_SUFFIX_COND(__w, __s, __r, __c) \
-_OR_REPLACE_SUFFIX_COND_NE(__w, __s, __r, __c) \
-    _END_REPLACE_COND
-
-#define _OR_REPLACE_SUFFIX_COND_NE(__w, __s, __r, __c) \
-} else if (ends_with(__w, __s)) { \
-    if (__c) { \
-        __w = replace_suffix(__w, strlen(__s), __r);
+typedef struct stem_buffer {
+    char *word;                   // word being stemmed
+    int len;                      // current length of the word
+    int nr_pattern;               // number of letters at the start of the word whose pattern is determined
+    int base;                     // position of the first letter whose pattern is kept
+    int first_vowel;              // position of the first vowel among these letters (INT_MAX = none)
+    int head_consonant;           // 1 if the letter before base is a consonant
+    int head_m;                   // m value of the word up to base
+    char consonant[STEM_WINDOW];  // 1 if the letter at base + i is a consonant
+    int m[STEM_WINDOW];           // m value of the word up to and including the letter at base + i
+} stem_buffer_t, *stem_buffer_p;
+
+void set_pattern(stem_buffer_p s);
+int is_consonant(stem_buffer_p s, int i);
+int calculate_m(stem_buffer_p s, int len);
+int contains_vowel(stem_buffer_p s, int len);
+int ends_with(stem_buffer_p s, char *suffix, int suffix_len);
+int ends_with_double_consonant(stem_buffer_p s);
+int ends_with_cvc(stem_buffer_p s, int suffix_len);
+void replace_suffix(stem_buffer_p s, int suffix_len, char *replacement, int replacement_len);
+int replace_if(stem_buffer_p s, char *suffix, int suffix_len, char *replacement, int replacement_len, int min_m);
+void step2(stem_buffer_p s);
+void step3(stem_buffer_p s);
+void step4(stem_buffer_p s);
 
-#define _END_REPLACE_COND }
-#define _END_REPLACE_OR }
+#define MAX_SEARCH_RESULTS 10
+#define STOPWORD_FILE "stopwords"
 
-int calculate_m(char *word, int suffix_len);
-int is_consonant(char *word, int i);
-int contains_vowel(char *word, int suffix_len);
-int ends_with(char *word, char *suffix);
-int ends_with_double_consonant(char *word);
-int ends_with_cvc(char *word, int suffix_len);
-char *replace_suffix(char *word, int suffix_length, char *replacement);
+// the words in memory are written to a segment of their own once the journal exceeds this size
+#define FLUSH_JOURNAL_SIZE (1 << 20)
 
-#define MAX_SEARCH_RESULTS 10
+// search terms of a query looked for, one bit each in the flag of a document found (further terms are ignored)
+#define MAX_QUERY_TERMS 64
 
-void write_index_to_file(index_p index);
-void parse_file_for_index(index_p index, char *file);
-void load_stopwords();
-void release_stopwords();
-int is_stopword(char *word);
-int find_str(void *objs, int struct_len, char *str, int min, int max);
-int find_int(void *objs, int struct_len, int i, int min, int max);
+int import_index(index_p index);
+void compact_documents(index_p index);
+int new_document(index_p index, char *file);
+int find_name_pos(index_p index, char *file);
+int cmp_document_name(const void *a, const void *b);
+stopword_set_p read_stopword_file(char *file);
 
 int cmp_doc_found_desc(const void *a, const void *b);
-
-static int nr_stopwords = 0;
-static char **stopwords = NULL;
+int cmp_term_cursor(const void *a, const void *b);
+int cmp_str(const void *a, const void *b);
+int cmp_occurance(const void *a, const void *b);
+
+typedef struct query_term {
+    char *stem;             // stem of the search term
+    int count;              // number of occurances in the query
+    int nr_docs;            // number of documents containing the search term (0 = not indexed)
+} query_term_t, *query_term_p;
+
+typedef struct query_phrase {
+    int nr_words;           // number of words of the phrase (2 for words joined by NEAR)
+    int *terms;             // per word: number of its search term
+    int *offsets;           // per word: position relative to the first word of the phrase (stopwords count)
+    int distance;           // NEAR/k: most words the two words may be apart (-1 = the words form a phrase)
+} query_phrase_t, *query_phrase_p;
+
+query_term_p parse_query(index_p index, char *query, int *nr_terms, int *nr_words, query_phrase_p *phrases, int *nr_phrases);
+query_phrase_p add_phrase(query_phrase_p *phrases, int *nr_phrases, int distance);
+void add_phrase_word(query_phrase_p phrase, int term, int offset);
+void close_query(query_term_p terms, int nr_terms, query_phrase_p phrases, int nr_phrases);
 
 typedef struct doc_found {
     int doc_id;             // document id
-    double dist;            // euclidian distance to TF-IDF of the words in the queue
+    char *name;             // name of the document
+    double dist;            // euclidian distance to TF-IDF of the words in the queue (negative cosine similarity if ranked by cosine)
     unsigned long flag;     // if the n-th most significant bit is set, the n-th search term was found in this document (ignoring stopwords)
 } doc_found_t, *doc_found_p;
 
+typedef struct document_name {
+    char *name;             // name of the document
+    int doc_id;             // document id
+} document_name_t, *document_name_p;
+
+typedef struct term_cursor {
+    posting_cursor_t postings;  // position in the document list of the word
+    double idf;             // IDF of the word
+    double q_idf;           // IDF of the word if the query counts as a document
+    double q_tfidf;         // TF-IDF of the word in the query
+    double penalty;         // squared distance added to documents not containing the word
+    int qid;                // number of the search term
+    int phrase;             // 1 = the word belongs to a phrase (its cursor leaves a document after scoring it)
+    int *positions;         // positions of the word in the document positions_doc
+    int nr_positions;       // number of these positions (0 = not recorded)
+    int max_positions;      // number of positions the list has room for
+    int positions_doc;      // document the positions were decoded for (-1 = none)
+} term_cursor_t, *term_cursor_p;
+
+int add_to_heap(doc_found_p heap, int *nr_found, int max_found, doc_found_p found);
+int match_phrases(term_cursor_p cursors, int *term_cursors, query_phrase_p phrases, int nr_phrases, int doc_id);
+void term_positions(term_cursor_p c, int doc_id);
+
+#define INITIAL_NR_SLOTS 1024
+#define STEM_BLOCK_SIZE 65536
+
+int find_slot(index_p index, char *stem, unsigned int hash);
+void grow_slots(index_p index);
+char *store_stem(index_p index, char *stem);
+int cmp_word_stem(const void *a, const void *b);
+
+#define INDEX_MAGIC "I2AINDEX"
+#define INDEX_VERSION 6
+#define INDEX_MIN_VERSION 2
+#define INDEX_BYTE_ORDER 0x01020304
+
+#define JOURNAL_MAGIC "I2AJRNAL"
+#define JOURNAL_VERSION 1
+#define JOURNAL_BYTE_ORDER 0x01020304
+
+#define RECORD_ADD 1
+#define RECORD_REMOVE 2
+#define RECORD_ADD_POSITIONS 3
+
+// number of chunks of documents per thread, threads done with short documents take over the remaining chunks
+#define CHUNKS_PER_THREAD 8
+
+typedef struct rebuild_chunk {
+    int first;                  // id of the first document of the chunk
+    int last;                   // id of the first document after the chunk
+    index_t words;              // words of the documents in the chunk (shares the list of documents with the index)
+    int done;                   // 1 = all documents of the chunk are parsed
+} rebuild_chunk_t, *rebuild_chunk_p;
+
+typedef struct rebuild {
+    index_p index;              // index the documents are added to
+    rebuild_chunk_p chunks;     // consecutive ranges of document ids, parsed independently
+    int nr_chunks;              // number of chunks
+    int next_chunk;             // next chunk to be parsed by a thread
+    pthread_mutex_t lock;       // protects next_chunk and the done flags of the chunks
+    pthread_cond_t chunk_done;  // signalled when a chunk is parsed
+} rebuild_t, *rebuild_p;
+
+void *parse_chunks(void *arg);
+void merge_chunk(index_p index, rebuild_chunk_p chunk);
+
+// number of entries of a stem cache (64 bytes each), enough for the vocabulary of most collections
+#define STEM_CACHE_ENTRIES (1 << 14)
+
+// number of seeds tried for a bucket before the hash table is enlarged
+#define MAX_STOPWORD_SEED (1 << 16)
+
+int build_stopword_table(stopword_set_p set, char **words);
+int cmp_stopword(const void *a, const void *b);
+int cmp_bucket_size_desc(const void *a, const void *b);
+
+typedef struct stopword_bucket {
+    int bucket;             // number of the bucket
+    int size;               // number of stopwords in the bucket
+} stopword_bucket_t, *stopword_bucket_p;
+
+// letter of the C locale: turning the bit 0x20 on maps 'A'..'Z' to 'a'..'z' and leaves 'a'..'z' as they are
+#define IS_LETTER(c) ((unsigned char) (((c) | 0x20) - 'a') < 26)
+
+int fill_tokenizer(tokenizer_p t);
+
+typedef struct file_list {
+    char **files;               // names of the files found
+    int nr_files;               // number of files found
+    int max_files;              // number of names the list has room for
+    long size;                  // total size of the files in bytes
+} file_list_t, *file_list_p;
+
+void collect_files(file_list_p list, char *path);
+void collect_directory(file_list_p list, char *dir);
+void collect_manifest(file_list_p list, char *manifest);
+void add_to_file_list(file_list_p list, char *file, long size);
+int cmp_file_name(const void *a, const void *b);
+
+#define RUN_FILE "index.run"
+
+// bytes buffered while a run is written, runs being merged share a quarter of the memory budget (within the limits)
+#define RUN_BUFFER_SIZE (1 << 20)
+#define MIN_RUN_BUFFER_SIZE (1 << 12)
+
+// most documents parsed at once, the documents of a batch are also limited to a quarter of the memory budget
+#define MAX_BATCH_DOCS 10000
+
+void write_run(index_builder_p builder);
+index_run_p add_run(index_builder_p builder);
+void next_run_word(index_run_p run);
+void open_run_postings(index_builder_p builder);
+void push_run(index_builder_p builder, int r);
+int pop_run(index_builder_p builder);
+int cmp_run(index_builder_p builder, int a, int b);
+void write_number(FILE *f, unsigned int n);
+unsigned int read_number(FILE *f);
+
+#define INDEX_FILE "index.bin"
+#define MANIFEST_FILE "index.segments"
+#define JOURNAL_FILE "index.log"
+
+#define MANIFEST_MAGIC "I2ASEGMT"
+#define MANIFEST_VERSION 1
+#define MANIFEST_BYTE_ORDER 0x01020304
+
+// segments are merged MERGE_FACTOR at a time, once that many neighbouring segments are in the same tier
+#define MERGE_FACTOR 4
+
+// segment files up to this size are in the lowest tier, each tier above holds files MERGE_FACTOR times larger
+#define MIN_TIER_SIZE (1L << 20)
+
+#define RETIRED_MEMORY 0                // memory block, released by free
+#define RETIRED_SEGMENT 1               // segment, its file is unmapped
+#define RETIRED_STOPWORDS 2             // set of stopwords
+
+typedef struct retired_object {
+    int type;                   // RETIRED_MEMORY, RETIRED_SEGMENT or RETIRED_STOPWORDS
+    void *object;               // the object
+} retired_object_t, *retired_object_p;
+
+typedef struct snapshot {
+    index_t index;              // the index as it was published, never changed (first member, readers get a pointer to it)
+    int refs;                   // number of readers using the snapshot, +1 while it is the current snapshot
+    struct snapshot *next;      // next newer snapshot (NULL = current snapshot)
+    retired_object_p retired;   // objects the index let go of while this snapshot was current
+    int nr_retired;             // number of these objects
+    int max_retired;            // number of objects the list above has room for
+} snapshot_t, *snapshot_p;
+
+typedef struct snapshot_list {
+    pthread_mutex_t lock;       // protects the reference counts and the list
+    snapshot_p oldest;          // oldest snapshot kept, the others follow by age
+    snapshot_p current;         // snapshot new readers get
+} snapshot_list_t, *snapshot_list_p;
+
+void *copy_memory(void *memory, size_t size);
+void retire(index_p index, int type, void *object);
+snapshot_p take_unused_snapshots(snapshot_list_p list);
+void free_snapshots(snapshot_p s);
+void release_object(int type, void *object);
+
+// connections open at once, further ones wait in the backlog of the listening socket until one is closed
+#define SERVER_MAX_CONNECTIONS 256
+
+// seconds a connection may wait for its next request, the server closes it afterwards
+#define SERVER_IDLE_TIMEOUT 60
+
+// seconds a worker waits for the rest of a request or for the client to take the response
+#define SERVER_IO_TIMEOUT 5
+
+// longest request accepted, the connection is closed after a longer one
+#define MAX_REQUEST_SIZE (1 << 16)
+
+typedef struct server {
+    index_p index;              // index searched, through its snapshots
+    int listen_fd;              // socket accepting connections
+    char *path;                 // file of the unix domain socket (NULL = TCP socket)
+    int wake[2];                // pipe waking the polling thread when a connection is handed back or the server stops
+    pthread_t poller;           // thread accepting connections and waiting for their requests
+    pthread_t *workers;         // threads answering requests
+    int nr_workers;             // number of these threads
+    int *connections;           // per worker: socket of the connection whose request it answers (-1 = none)
+    int nr_connections;         // number of connections open
+    int queue[SERVER_MAX_CONNECTIONS];  // sockets of the connections with a request not answered yet (ring buffer)
+    int queue_start;            // position of the oldest connection in the queue
+    int queue_size;             // number of connections in the queue
+    int returned[SERVER_MAX_CONNECTIONS];   // sockets of the connections answered, to be watched for the next request
+    int nr_returned;            // number of these connections
+    int stopping;               // 1 = the server is stopping
+    pthread_mutex_t lock;       // protects the queue, the connections and stopping
+    pthread_cond_t changed;     // signalled when the queue changes or the server stops
+} server_t, *server_p;
+
+typedef struct server_worker {
+    server_p server;            // server of the worker
+    int nr;                     // number of the worker
+} server_worker_t, *server_worker_p;
+
+int open_listen_socket(server_p server, char *address);
+void *poll_connections(void *arg);
+int accept_connection(server_p server);
+void *serve_requests(void *arg);
+int serve_request(server_p server, int fd);
+void hand_back_connection(server_p server, int fd, int open);
+char *handle_request(server_p server, char *request, int *size);
+int read_fully(int fd, void *buffer, int size);
+int write_fully(int fd, void *buffer, int size);
+
+// queries a thread takes at once, their results are written together
+#define QUERIES_PER_CHUNK 256
+
+// chunks taken per thread before the results of the oldest one are written, threads wait beyond that
+#define CHUNKS_AHEAD_PER_THREAD 4
+
+typedef struct batch_chunk {
+    char **lines;               // lines of the queries ("<id>\t<query>" or "<query>")
+    int *line_nrs;              // per query: number of its line in the input
+    int nr_queries;             // number of queries in the chunk
+    double *latencies;          // per query: seconds the search took
+    char *output;               // results of the queries, in the output format
+    int size;                   // number of bytes of the results
+    int max_size;               // number of bytes the output has room for
+    int done;                   // 1 = all queries of the chunk are searched
+} batch_chunk_t, *batch_chunk_p;
+
+typedef struct batch {
+    index_p index;              // snapshot searched
+    FILE *in;                   // queries, one per line
+    FILE *out;                  // results
+    int json;                   // 1 = JSON lines, 0 = tab separated values
+    int nr_lines;               // number of lines read from the input
+    int end_of_input;           // 1 = all queries are read
+    batch_chunk_p chunks;       // chunks being searched or waiting to be written (ring buffer, by number of chunk)
+    int nr_chunks;              // number of chunks the ring buffer has room for
+    int next_chunk;             // number of the next chunk read from the input
+    int next_written;           // number of the next chunk written to the output
+    double *latencies;          // seconds each query written so far took
+    int nr_queries;             // number of these queries
+    int max_queries;            // number of latencies the list has room for
+    pthread_mutex_t lock;       // protects the input, the output and everything above but index and json
+    pthread_cond_t changed;     // signalled when a chunk is written or the input ends
+} batch_t, *batch_p;
+
+void *search_chunks(void *arg);
+void search_chunk(batch_p batch, batch_chunk_p chunk);
+char *append_json_string(char *text, int *size, int *max_size, char *s);
+
+// names of the counters, by number
+char *stat_names[NR_STATS] = {
+    "searches", "candidates", "docs_scored", "postings_scanned", "docs_parsed", "tokens", "stopword_hits",
+    "stem_calls", "bytes_read", "bytes_written", "time_parse", "time_score", "time_merge", "time_persist", "time_load"
+};
+
+// the counters of the process (all indexes, snapshots and threads count together), changed by atomic operations
+long stat_counters[NR_STATS];
+
 int main(int argc, void *argv) {
-    load_stopwords();
     index_p index = load_index();
+    struct server *server = NULL;
 
     int exit = 0;
     while (!exit) {
         printf(" > ");
         char *command = read_line(stdin);
+        if (!command) {
+            // end of input: a server goes on serving until the process is ended
+            if (server) {
+                printf("End of input, serving until the process is ended.\n");
+                wait_for_server(server);
+            }
+            break;
+        }
+
+        // commands which change the index set this to 1
+        int changed = 0;
 
         if (!strcmp(command, "exit")) {
             // exit command
             exit = 1;
             printf("Exit requested..\n");
 
-		} else if (!strcmp(command, "rebuild index")) {
-            // rebuild index command
-            rebuild_index(index);
+		} else if (!strcmp(command, "rebuild index") || starts_with(command, "rebuild index ")) {
+            // rebuild index [<number of threads>] command
+            rebuild_index(index, atoi(command + 13));
+            changed = 1;
+        } else if (!strcmp(command, "export index")) {
+            // export index command: write the index in the text format (filebase and index files)
+            export_index(index);
+        } else if (!strcmp(command, "ranking euclid")) {
+            // ranking euclid command: rank search results by euclidian distance of the TF-IDF vectors (default)
+            index->ranking = RANKING_EUCLID;
+            changed = 1;
+        } else if (!strcmp(command, "ranking cosine")) {
+            // ranking cosine command: rank search results by cosine similarity of the TF-IDF vectors
+            index->ranking = RANKING_COSINE;
+            changed = 1;
+        } else if (!strcmp(command, "positions on")) {
+            // positions on command: record where the words occur in the documents parsed from now on (default)
+            index->positions = 1;
+        } else if (!strcmp(command, "positions off")) {
+            // positions off command: don't record positions, phrases only match by their words in the documents parsed from now on
+            index->positions = 0;
+        } else if (!strcmp(command, "stem cache")) {
+            // stem cache command: print how many words were found in the stem cache
+            print_stem_cache(index->stem_cache);
+        } else if (!strcmp(command, "stats")) {
+            // stats command: print the runtime counters
+            print_stats(stdout);
+        } else if (!strcmp(command, "stats reset")) {
+            // stats reset command: start counting from 0
+            reset_stats();
+        } else if (starts_with(command, "stats ")) {
+            // stats <file> command: write the runtime counters to a file
+            FILE *f = fopen(command + 6, "w");
+            if (f) {
+                print_stats(f);
+                fclose(f);
+            } else {
+                printf("Cannot open %s!\n", command + 6);
+            }
+        } else if (starts_with(command, "memory budget ")) {
+            // memory budget <MB> command: memory the words may occupy while building a segment, then they are written to runs
+            long budget = atol(command + 14);
+            index->memory_budget = budget > 0 ? budget << 20 : DEFAULT_MEMORY_BUDGET;
+        } else if (starts_with(command, "stopwords ")) {
+            // stopwords <file> command: rebuild the index leaving out the words in this file instead
+            change_stopwords(index, command + 10);
+            changed = 1;
 		} else if (starts_with(command, "search for ")) {
-            // search for <search_query> command
+            // search for <search_query> command ("words in quotes" are a phrase, <word> NEAR/<k> <word> a proximity search)
             char *query = (char *) malloc(strlen(command) - 10);
             memcpy(query, command+11, strlen(command) - 10);
 
-            index_p result = search_index(&index, query);
+            // the search reads the snapshot published after the last change, not the index itself
+            index_p snapshot = acquire_snapshot(index);
+            search_result_p result = search_index(snapshot, query);
+            release_snapshot(index, snapshot);
 
             printf("Results (showing no more than 10, there might be more):\n");
             if (result) {
                 // print result
-                int count = 0;
-                indexed_word_p w = result->words;
-                if (!w) {
+                if (!result->nr_hits) {
                     printf("No documents found for search term %s\n", query);
                 }
 
-                while (w) {
-                    printf("Documents containing %s:\n", w->stem);
-
-                    int i;
-                    for (i = 0; i < w->nr_docs; i++, count++) {
-                        printf(" [%d] %s\n", count, result->documents[w->documents[i].id].name);
+                int i;
+                for (i = 0; i < result->nr_hits; i++) {
+                    // documents are grouped by the search terms they contain
+                    if (!i || strcmp(result->hits[i].terms, result->hits[i-1].terms)) {
+                        printf("Documents containing %s:\n", result->hits[i].terms);
                     }
 
-                    w = w->next;
+                    printf(" [%d] %08.5f %s\n", i, result->hits[i].score, result->hits[i].name);
                 }
 
-                close_index(result);
+                close_search_result(result);
             } else {
                 printf("No documents found for search term %s\n", query);
             }
 
             free(query);
 
+        } else if (starts_with(command, "search batch ")) {
+            // search batch <queries file> <results file> [tsv|json] [<number of threads>] command: search many queries
+            // in parallel, - = standard input / output
+            char *args[4] = { NULL, NULL, NULL, NULL };
+            int nr_args = 0;
+            char *arg = strtok(command + 13, " ");
+            while (arg && nr_args < 4) {
+                args[nr_args++] = arg;
+                arg = strtok(NULL, " ");
+            }
+
+            if (nr_args < 2 || (args[2] && strcmp(args[2], "tsv") && strcmp(args[2], "json"))) {
+                printf("Usage: search batch <queries file> <results file> [tsv|json] [<number of threads>]\n");
+            } else {
+                search_batch(index, args[0], args[1], args[2] && !strcmp(args[2], "json"), args[3] ? atoi(args[3]) : 0);
+            }
+
+        } else if (starts_with(command, "serve ")) {
+            // serve <port|socket path> [<number of threads>] command: answer searches of other programs in the background
+            char *address = command + 6;
+            char *threads = strchr(address, ' ');
+            if (threads) {
+                *threads++ = '\0';
+            }
+
+            if (server) {
+                printf("Error: already serving.\n");
+            } else {
+                server = start_server(index, address, threads ? atoi(threads) : 0);
+            }
+
+        } else if (!strcmp(command, "stop serving")) {
+            // stop serving command
+            if (server) {
+                stop_server(server);
+                server = NULL;
+            } else {
+                printf("Error: not serving.\n");
+            }
+
+        } else if (starts_with(command, "add files ")) {
+            // add files <directory|glob|@manifest> command: add many files at once, they are written to one new segment
+            add_files(index, command + 10, 0);
+            changed = 1;
+
         } else if (starts_with(command, "add file ")) {
             // add file <file> command
             char *file = (char*) malloc(strlen(command) - 8);
             memcpy(file, command+9, strlen(command) - 8);
 
-			index = add_file(index, file);
+			add_file(index, file);
             free(file);
+            changed = 1;
 
         } else if (starts_with(command, "remove file ")) {
             // remove file <file> command
             char *file = (char*) malloc(strlen(command) - 11);
             memcpy(file, command+12, strlen(command) - 11);
 
-            // obtain document id a.k.a. index in filebase
-            int doc_id = find_str(&index->documents[0].name, sizeof(indexed_document_t), file, 0, index->nr_docs - 1);
+            // obtain document id
+            int doc_id = find_document(index, file);
 
             if (doc_id < 0) {
                 printf("Error: %s is not in the filebase!\n", file);
             } else {
                 remove_file(index, doc_id);
+                changed = 1;
             }
 
             free(file);
         }
 
         free(command);
+
+        // put a background merge of segments into effect once it is done
+        if (check_merge(index)) {
+            changed = 1;
+        }
+
+        // the following searches see the changes
+        if (changed && !exit) {
+            publish_snapshot(index);
+        }
+    }
+
+    if (server) {
+        stop_server(server);
     }
 
     // release memory
-    release_stopwords();
     close_index(index);
 
     return 0;
@@ -211,6 +963,7 @@ char *read_line(FILE *ptr) {
         // string buffer full => double the size
         if (--len == 0) {
             len = lenmax;
+            size_t used = line - linep;
             char * linen = realloc(linep, lenmax *= 2);
 
             if (linen == NULL) {
@@ -218,7 +971,7 @@ char *read_line(FILE *ptr) {
                 return NULL;
             }
 
-            line = linen + (line - linep);
+            line = linen + used;
             linep = linen;
         }
 
@@ -231,7 +984,8 @@ char *read_line(FILE *ptr) {
     *line = '\0';
 
     // nothing read => return NULL
-    if (strlen(linep) == 0) {
+    if (line == linep) {
+        free(linep);
         return NULL;
     }
 
@@ -240,7 +994,7 @@ char *read_line(FILE *ptr) {
         *(line - 1) = '\0';
 
         // special case Windows (DOH!) -> remove \r as well
-        if (*(line - 2) == '\r') {
+        if (line - 1 > linep && *(line - 2) == '\r') {
             *(line - 2) = '\0';
         }
     }
@@ -249,357 +1003,544 @@ char *read_line(FILE *ptr) {
 }
 
 /*
- * Turns non alpha characters into spaces
+ * Checks if pre is a prefix of str
  */
-void nonalpha_to_space(char *str) {
-    char *c;
-    for(c = str; *c; c++) {
-        if(!isalpha(*c)) {
-            *c = ' ';
-        } else {
-            *c = tolower(*c);
+int starts_with(char *str, char *pre) {
+    return strncmp(pre, str, strlen(pre)) == 0;
+}
+
+/*
+ * Returns the time in seconds on a clock that only moves forward (CLOCK_MONOTONIC)
+ */
+double now_seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * Appends formatted text to a growing buffer, returns the buffer (it may move)
+ *  size: number of bytes in the buffer, max_size: number of bytes it has room for
+ */
+char *append_text(char *text, int *size, int *max_size, char *format, ...) {
+    for (;;) {
+        va_list args;
+        va_start(args, format);
+        int len = vsnprintf(text + *size, *max_size - *size, format, args);
+        va_end(args);
+
+        if (*size + len < *max_size) {
+            *size += len;
+            return text;
         }
+
+        // buffer full => double the size (room for the \0 vsnprintf writes)
+        while (*size + len >= *max_size) {
+            *max_size *= 2;
+        }
+        text = (char *) realloc(text, *max_size);
     }
 }
 
 /*
- * Checks if pre is a prefix of str
+ * Returns the p-th percentile of n sorted latencies (nearest rank)
  */
-int starts_with(char *str, char *pre) {
-    return strncmp(pre, str, strlen(pre)) == 0;
+double latency_percentile(double *sorted, int n, double p) {
+    int rank = (int) ceil(p / 100 * n);
+
+    return sorted[rank > 0 ? rank - 1 : 0];
 }
 
 /*
- * Calculates m value for a word
+ * Compares two latencies, shortest first
  */
-int calculate_m(char *word, int suffix_len) {
-    if (strlen(word) <= suffix_len) {
-        return 0;
-    }
+int cmp_latency(const void *a, const void *b) {
+    double x = *(double *) a, y = *(double *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Determines the consonant/vowel pattern and the m values of the letters not determined yet
+ * (only done when needed: most words don't end with a suffix whose removal depends on the pattern)
+ */
+void set_pattern(stem_buffer_p s) {
+    int from = s->nr_pattern;
+    int prev = from > s->base ? s->consonant[from - 1 - s->base] : s->head_consonant;
+    int m = from > s->base ? s->m[from - 1 - s->base] : s->head_m;
 
-    int parts = 1;
+    int i;
+    for (i = from; i < s->len; i++) {
+        // y is a vowel if it follows a consonant
+        // (combined without branches, the sequence of vowels and consonants is hard to predict)
+        unsigned int c = s->word[i] - 'a';
+        int consonant = !(((VOWELS >> (c & 31)) & (c < 26)) | ((c == 'y' - 'a') & (i > 0) & prev));
 
-    // type (consonant = 1, vowel = 0) of first letter
-    char first_type = is_consonant(word, 0);
+        // each vowel followed by a consonant adds to m
+        m += (i > 0) & !prev & consonant;
 
-    // type of last checked letter
-    char tmp_type = first_type;
+        if (!consonant && s->first_vowel > i) {
+            s->first_vowel = i;
+        }
 
-    int i = 0;
-    while (i < strlen(word) - suffix_len) {
-        // if last checked type is different from current type, we enter a new part of the word
-        if (tmp_type != is_consonant(word, i)) {
-            tmp_type = !tmp_type;
-            parts++;
+        if (i < s->base) {
+            s->head_consonant = consonant;
+            s->head_m = m;
+        } else {
+            s->consonant[i - s->base] = consonant;
+            s->m[i - s->base] = m;
         }
-        i++;
+
+        prev = consonant;
     }
 
-    //       remove optional initial consonant   remove optional vowel ending
-    return (        parts - first_type         -    (parts - first_type)%2    ) / 2;
+    s->nr_pattern = s->len;
 }
 
 /*
- * Checkes whether i-th character of word is a consonant
+ * Checks whether i-th character of word is a consonant (positions before the start of the word count as consonants)
  */
-int is_consonant(char *word, int i) {
-    char c = tolower(word[i]);
-    return c != 'a' && c != 'e' && c != 'i' && c != 'o' & c != 'u' && !(c == 'y' && i > 0 && is_consonant(word, i-1));
+int is_consonant(stem_buffer_p s, int i) {
+    if (s->nr_pattern < s->len) {
+        set_pattern(s);
+    }
+
+    return i < 0 || s->consonant[i - s->base];
 }
 
 /*
- * Checks whether word contains a vowel
+ * Returns the m value of the first len letters of the word
  */
-int contains_vowel(char *word, int suffix_len) {
-    if (strlen(word) <= suffix_len) {
-        return 0;
+int calculate_m(stem_buffer_p s, int len) {
+    if (s->nr_pattern < s->len) {
+        set_pattern(s);
     }
 
-    int i = 0;
-    while (i < strlen(word) - suffix_len) {
-        if (!is_consonant(word, i)) {
-            return 1;
-        }
+    return len > 0 ? s->m[len - 1 - s->base] : 0;
+}
 
-        i++;
+/*
+ * Checks whether the first len letters of the word contain a vowel
+ */
+int contains_vowel(stem_buffer_p s, int len) {
+    if (s->nr_pattern < s->len) {
+        set_pattern(s);
     }
 
-    return 0;
+    return s->first_vowel < len;
 }
 
 /*
- * Checks wether a word ends with a specific suffix
+ * Checks wether the word ends with a specific suffix
  */
-int ends_with(char *word, char *suffix) {
-    return strlen(word) >= strlen(suffix) && !memcmp(word + strlen(word) - strlen(suffix), suffix, strlen(suffix));
+int ends_with(stem_buffer_p s, char *suffix, int suffix_len) {
+    if (s->len < suffix_len) {
+        return 0;
+    }
+
+    // compare from the end, most suffixes are ruled out by the last letter
+    char *w = s->word + s->len;
+    int i;
+    for (i = suffix_len - 1; i >= 0; i--) {
+        if (*--w != suffix[i]) {
+            return 0;
+        }
+    }
+
+    return 1;
 }
 
 /*
  * Checks whether word ends with a double consonant
  */
-int ends_with_double_consonant(char *word) {
-    int l = strlen(word);
-    return word[l-1] == word[l-2] && is_consonant(word, l-1);
+int ends_with_double_consonant(stem_buffer_p s) {
+    int l = s->len;
+    return l >= 2 && s->word[l-1] == s->word[l-2] && is_consonant(s, l-1);
 }
 
 /*
  * Checks whether word ands with a consonant-vowel-consonant combination where the last consonant is not W, X or Y
  */
-int ends_with_cvc(char *word, int suffix_len) {
-    if (strlen(word) <= suffix_len) {
+int ends_with_cvc(stem_buffer_p s, int suffix_len) {
+    if (s->len <= suffix_len) {
+        return 0;
+    }
+
+    int l = s->len - 1 - suffix_len;
+    char c = s->word[l];
+    return is_consonant(s, l-2) && !is_consonant(s, l-1) && is_consonant(s, l) && c != 'w' && c != 'x' && c != 'y';
+}
+
+/*
+ * Replaces a suffix of the word, the word never grows beyond its original length
+ */
+void replace_suffix(stem_buffer_p s, int suffix_len, char *replacement, int replacement_len) {
+    int from = s->len - suffix_len;
+    memcpy(s->word + from, replacement, replacement_len);
+    s->len = from + replacement_len;
+    s->word[s->len] = '\0';
+
+    // the pattern of the replacement is determined when needed
+    if (s->nr_pattern > from) {
+        s->nr_pattern = from;
+        if (s->first_vowel >= from) {
+            s->first_vowel = INT_MAX;
+        }
+    }
+}
+
+/*
+ * Replaces a suffix of the word if the rest of the word meets a condition, returns 1 if the word ends with the suffix
+ *  min_m: the suffix is replaced if the m value of the rest of the word exceeds this (or AFTER_S_OR_T)
+ */
+int replace_if(stem_buffer_p s, char *suffix, int suffix_len, char *replacement, int replacement_len, int min_m) {
+    if (!ends_with(s, suffix, suffix_len)) {
         return 0;
     }
 
-    int l = strlen(word) - 1 - suffix_len;
-    return is_consonant(word, l-2) && !is_consonant(word, l-1) && is_consonant(word, l) && word[l] != 'w' && word[l] != 'x' && word[l] != 'y';
+    int len = s->len - suffix_len;
+    if (min_m == AFTER_S_OR_T ? len > 0 && (s->word[len-1] == 's' || s->word[len-1] == 't') : calculate_m(s, len) > min_m) {
+        replace_suffix(s, suffix_len, replacement, replacement_len);
+    }
+
+    return 1;
+}
+
+/*
+ * Step 2 of the algorithm: maps double suffixes to single ones
+ * only the first suffix the word ends with is considered, so the rules are grouped by their last letter
+ */
+void step2(stem_buffer_p s) {
+    switch (s->word[s->len - 1]) {
+    case 'l':
+        RULE(s, "ational", "ate", 0)
+        RULE(s, "tional", "tion", 0)
+        break;
+    case 'i':
+        RULE(s, "enci", "ence", 0)
+        RULE(s, "anci", "ance", 0)
+        RULE(s, "abli", "able", 0)
+        RULE(s, "alli", "al", 0)
+        RULE(s, "entli", "ent", 0)
+        RULE(s, "eli", "e", 0)
+        RULE(s, "ousli", "ous", 0)
+        RULE(s, "aliti", "al", 0)
+        RULE(s, "iviti", "ive", 0)
+        RULE(s, "biliti", "ble", 0)
+        break;
+    case 'r':
+        RULE(s, "izer", "ize", 0)
+        RULE(s, "ator", "ate", 0)
+        break;
+    case 'n':
+        RULE(s, "ization", "ize", 0)
+        RULE(s, "ation", "ate", 0)
+        break;
+    case 'm':
+        RULE(s, "alism", "al", 0)
+        break;
+    case 's':
+        RULE(s, "ivenes", "ive", 0)
+        RULE(s, "fulness", "ful", 0)
+        RULE(s, "ousness", "ous", 0)
+        break;
+    }
 }
 
 /*
- * Replaces a suffix of a word
+ * Step 3 of the algorithm: removes or shortens -ic-, -full, -ness etc.
  */
-char *replace_suffix(char *word, int suffix_length, char *replacement) {
-    if (suffix_length < strlen(replacement)) {
-        word = (char *) realloc(word, strlen(word) - suffix_length + strlen(replacement) + 1);
+void step3(stem_buffer_p s) {
+    switch (s->word[s->len - 1]) {
+    case 'e':
+        RULE(s, "icate", "ic", 0)
+        RULE(s, "ative", "", 0)
+        RULE(s, "alize", "al", 0)
+        break;
+    case 'i':
+        RULE(s, "aciti", "ic", 0)
+        break;
+    case 'l':
+        RULE(s, "ical", "ic", 0)
+        RULE(s, "ful", "", 0)
+        break;
+    case 's':
+        RULE(s, "ness", "", 0)
+        break;
     }
+}
 
-    // copy whole replacement string, including \0 string terminator
-    memcpy(word + strlen(word) - suffix_length, replacement, strlen(replacement) + 1);
-    return word;
+/*
+ * Step 4 of the algorithm: removes -ant, -ence etc. if m > 1
+ */
+void step4(stem_buffer_p s) {
+    switch (s->word[s->len - 1]) {
+    case 'l':
+        RULE(s, "al", "", 1)
+        break;
+    case 'e':
+        RULE(s, "ance", "", 1)
+        RULE(s, "ence", "", 1)
+        RULE(s, "able", "", 1)
+        RULE(s, "ible", "", 1)
+        RULE(s, "ate", "", 1)
+        RULE(s, "ive", "", 1)
+        RULE(s, "ize", "", 1)
+        break;
+    case 'r':
+        RULE(s, "er", "", 1)
+        break;
+    case 'c':
+        RULE(s, "ic", "", 1)
+        break;
+    case 't':
+        RULE(s, "ant", "", 1)
+        RULE(s, "ement", "", 1)
+        RULE(s, "ment", "", 1)
+        RULE(s, "ent", "", 1)
+        break;
+    case 'n':
+        RULE(s, "ion", "", AFTER_S_OR_T)
+        break;
+    case 'u':
+        RULE(s, "ou", "", 1)
+        break;
+    case 'm':
+        RULE(s, "ism", "", 1)
+        break;
+    case 'i':
+        RULE(s, "iti", "", 1)
+        break;
+    case 's':
+        RULE(s, "ous", "", 1)
+        break;
+    }
 }
 
 /*
- * Runs Porter Stemming Algorithm on a word
+ * Runs Porter Stemming Algorithm on a word of lower case letters, returns the length of the stem
+ *  buf: receives the \0 terminated stem, room for len + 1 characters (may be the word itself)
  */
-char *stem(char *word) {
-    // copy word to new memory location
-    char *result = (char *) malloc(strlen(word) + 1);
-    memcpy(result, word, strlen(word) + 1);
+int stem_word(char *word, int len, char *buf) {
+    if (buf != word) {
+        memcpy(buf, word, len);
+    }
+    buf[len] = '\0';
+
+    stem_buffer_t s;
+    s.word = buf;
+    s.len = len;
+    s.base = len > STEM_WINDOW ? len - STEM_WINDOW : 0;
+    s.nr_pattern = 0;
+    s.first_vowel = INT_MAX;
+    s.head_consonant = 1;
+    s.head_m = 0;
 
     /* STEP 1a */
-    _BEGIN_REPLACE_SUFFIX(result, "sses", "ss")
-    _OR_REPLACE_SUFFIX(result, "ies", "i")
-    _OR_REPLACE_SUFFIX(result, "ss", "ss")
-    _OR_REPLACE_SUFFIX(result, "s", "")
-    _END_REPLACE_OR
+    if (ends_with(&s, "sses", 4)) {
+        replace_suffix(&s, 4, "ss", 2);
+    } else if (ends_with(&s, "ies", 3)) {
+        replace_suffix(&s, 3, "i", 1);
+    } else if (!ends_with(&s, "ss", 2) && ends_with(&s, "s", 1)) {
+        replace_suffix(&s, 1, "", 0);
+    }
 
     /* STEP 1b */
     int cont = 0;
-    int vowel = contains_vowel(result, 3);
-    _BEGIN_REPLACE_SUFFIX_COND(result, "eed", "ee", calculate_m(result, 3) > 0)
-    _OR_REPLACE_SUFFIX_COND_NE(result, "ing", "", vowel)
-        cont = 1;
-    _END_REPLACE_COND
-    _OR_REPLACE_SUFFIX_COND_NE(result, "ed", "", vowel || !is_consonant(result, strlen(result) - 3))
-        cont = 1;
-    _END_REPLACE_COND
-    _END_REPLACE_OR
-
-    int l = strlen(result) - 1;
+    if (ends_with(&s, "eed", 3)) {
+        if (calculate_m(&s, s.len - 3) > 0) {
+            replace_suffix(&s, 3, "ee", 2);
+        }
+    } else if (ends_with(&s, "ing", 3)) {
+        if (contains_vowel(&s, s.len - 3)) {
+            replace_suffix(&s, 3, "", 0);
+            cont = 1;
+        }
+    } else if (ends_with(&s, "ed", 2)) {
+        if (contains_vowel(&s, s.len - 2)) {
+            replace_suffix(&s, 2, "", 0);
+            cont = 1;
+        }
+    }
+
     if (cont) {
-        _BEGIN_REPLACE_SUFFIX(result, "at", "ate")
-        _OR_REPLACE_SUFFIX(result, "bl", "ble")
-        _OR_REPLACE_SUFFIX(result, "iz", "ize")
-        _OR_REPLACE_SUFFIX_COND_NE(result, "", "", ends_with_double_consonant(result) && result[l] != 'l' && result[l] != 's' && result[l] != 'z')
+        char last = s.word[s.len - 1];
+        if (ends_with(&s, "at", 2)) {
+            replace_suffix(&s, 2, "ate", 3);
+        } else if (ends_with(&s, "bl", 2)) {
+            replace_suffix(&s, 2, "ble", 3);
+        } else if (ends_with(&s, "iz", 2)) {
+            replace_suffix(&s, 2, "ize", 3);
+        } else if (ends_with_double_consonant(&s) && last != 'l' && last != 's' && last != 'z') {
             // removes the last consonant of the consonant pair at the end of the word
-            result[l] = '\0';
-        _END_REPLACE_COND
-        _OR_REPLACE_SUFFIX_COND(result, "", "e", calculate_m(result, 0) == 1 && ends_with_cvc(result, 0))
-        _END_REPLACE_OR
+            replace_suffix(&s, 1, "", 0);
+        }
+
+        // no e is appended to short stems ending with consonant-vowel-consonant (hop -> hope),
+        // the stems in existing indexes were built that way
     }
 
     /* STEP 1c */
-    _REPLACE_SUFFIX_COND(result, "y", "i", contains_vowel(result, 1))
+    if (ends_with(&s, "y", 1) && contains_vowel(&s, s.len - 1)) {
+        replace_suffix(&s, 1, "i", 1);
+    }
+
+    if (!s.len) {
+        return 0;
+    }
 
     /* STEP 2 */
-    int m7 = calculate_m(result, 7);
-    int m6 = m7 > 0 ? m7 : calculate_m(result, 6);
-    int m5 = m6 > 0 ? m6 : calculate_m(result, 5);
-    int m4 = m5 > 0 ? m5 : calculate_m(result, 4);
-    int m3 = m4 > 0 ? m4 : calculate_m(result, 3);
-    _BEGIN_REPLACE_SUFFIX_COND(result, "ational", "ate", m7 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "tional", "tion", m6 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "enci", "ence", m4 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "anci", "ance", m4 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "izer", "ize", m4 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "abli", "able", m4 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "alli", "al", m4 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "entli", "ent", m5 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "eli", "e", m3 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "ousli", "ous", m5 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "ization", "ize", m7 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "ation", "ate", m5 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "ator", "ate", m4 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "alism", "al", m5 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "ivenes", "ive", m6 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "fulness", "ful", m7 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "ousness", "ous", m7 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "aliti", "al", m5 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "iviti", "ive", m5 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "biliti", "ble", m6 > 0)
-    _END_REPLACE_OR
+    step2(&s);
 
     /* STEP 3 */
-    m5 = calculate_m(result, 5);
-    m4 = m5 > 0 ? m5 : calculate_m(result, 4);
-    m3 = m4 > 0 ? m4 : calculate_m(result, 3);
-    _BEGIN_REPLACE_SUFFIX_COND(result, "icate", "ic", m5 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "ative", "", m5 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "alize", "al", m5 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "aciti", "ic", m5 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "ical", "ic", m4 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "ful", "", m3 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "ness", "", m4 > 0)
-    _END_REPLACE_OR
+    step3(&s);
 
     /* STEP 4 */
-    l = strlen(result) - 1;
-    m5 = calculate_m(result, 5);
-    m4 = m5 > 1 ? m5 : calculate_m(result, 4);
-    m3 = m4 > 1 ? m4 : calculate_m(result, 3);
-    int m2 = m3 > 1 ? m3 : calculate_m(result, 2);
-    _BEGIN_REPLACE_SUFFIX_COND(result, "al", "", m2 > 1)
-    _OR_REPLACE_SUFFIX_COND(result, "ance", "", m4 > 1)
-    _OR_REPLACE_SUFFIX_COND(result, "ence", "", m4 > 1)
-    _OR_REPLACE_SUFFIX_COND(result, "er", "", m2 > 1)
-    _OR_REPLACE_SUFFIX_COND(result, "ic", "", m2 > 1)
-    _OR_REPLACE_SUFFIX_COND(result, "able", "", m4 > 1)
-    _OR_REPLACE_SUFFIX_COND(result, "ible", "", m4 > 1)
-    _OR_REPLACE_SUFFIX_COND(result, "ant", "", m3 > 1)
-    _OR_REPLACE_SUFFIX_COND(result, "ement", "", m5 > 1)
-    _OR_REPLACE_SUFFIX_COND(result, "ment", "", m4 > 1)
-    _OR_REPLACE_SUFFIX_COND(result, "ent", "", m3 > 1)
-    _OR_REPLACE_SUFFIX_COND(result, "ion", "", result[l-3] == 's' || result[l-3] == 't')
-    _OR_REPLACE_SUFFIX_COND(result, "ou", "", m2 > 1)
-    _OR_REPLACE_SUFFIX_COND(result, "ism", "", m3 > 1)
-    _OR_REPLACE_SUFFIX_COND(result, "ate", "", m3 > 1)
-    _OR_REPLACE_SUFFIX_COND(result, "iti", "", m3 > 1)
-    _OR_REPLACE_SUFFIX_COND(result, "ous", "", m3 > 1)
-    _OR_REPLACE_SUFFIX_COND(result, "ive", "", m3 > 1)
-    _OR_REPLACE_SUFFIX_COND(result, "ize", "", m3 > 1)
-    _END_REPLACE_OR
+    step4(&s);
 
     /* STEP 5a */
-    int m1 = calculate_m(result, 1);
-    _REPLACE_SUFFIX_COND(result, "e", "", m1 > 1 || (m1 == 1 && !ends_with_cvc(result, 1)))
-
-    /* STEP 5b */
-    _REPLACE_SUFFIX_COND(result, "l", "", calculate_m(result, 0) > 1 && ends_with_double_consonant(result))
-
-    return result;
-}
-
-/*
- * Loads stopwords array from the stopwords file
- */
-void load_stopwords() {
-    // open file or print error message
-    FILE *sw_file = fopen("stopwords", "r");
-    if (!sw_file) {
-        printf("stopwords file not found.\nCan't remove stopwords!\n");
-        return;
-    }
-
-    // count number of stopwords
-    nr_stopwords = 0;
-    char c;
-    while ((c = getc(sw_file)) != EOF) {
-        if (c == '\n') {
-            nr_stopwords++;
+    if (ends_with(&s, "e", 1)) {
+        int m = calculate_m(&s, s.len - 1);
+        if (m > 1 || (m == 1 && !ends_with_cvc(&s, 1))) {
+            replace_suffix(&s, 1, "", 0);
         }
     }
 
-    stopwords = (char**) malloc(sizeof(char *) * nr_stopwords);
-    rewind(sw_file);
-
-    // load stopwords into array
-    int i;
-    for (i = 0; i < nr_stopwords; i++) {
-        stopwords[i] = read_line(sw_file);
+    /* STEP 5b */
+    if (ends_with(&s, "l", 1) && calculate_m(&s, s.len) > 1 && ends_with_double_consonant(&s)) {
+        replace_suffix(&s, 1, "", 0);
     }
 
-    fclose(sw_file);
+    return s.len;
 }
 
 /*
- * Releases the memory allocated for the stopwords array
+ * Loads a set of stopwords from a file or prints an error message
  */
-void release_stopwords() {
-    if (stopwords) {
-        int i;
-        for (i = 0; i < nr_stopwords; i++) {
-            free(stopwords[i]);
-        }
-        free(stopwords);
+stopword_set_p read_stopword_file(char *file) {
+    stopword_set_p set = load_stopwords(file);
+    if (!set) {
+        printf("%s file not found.\nCan't remove stopwords!\n", file);
     }
+
+    return set;
 }
 
 /*
- * Checks whether a word is a stopwords
+ * Replaces the stopwords of the index by the ones in a file and rebuilds the index with them
  */
-int is_stopword(char *word) {
-    if (!stopwords) {
-        load_stopwords();
+void change_stopwords(index_p index, char *file) {
+    stopword_set_p set = load_stopwords(file);
+    if (!set) {
+        printf("Error: couldn't read %s.\nStopwords not changed.\n", file);
+        return;
     }
 
-    return find_str(stopwords, sizeof(char *), word, 0, nr_stopwords - 1) != -1;
+    retire_stopwords(index, index->stopwords);
+    index->stopwords = set;
+
+    // the segment files keep the stopwords the index was built with
+    rebuild_index(index, 0);
 }
 
 /*
  * Adds a file to the index
  */
-index_p add_file(index_p index, char *file) {
+void add_file(index_p index, char *file) {
     // check if file exists and can be read
     FILE *f = fopen(file, "r");
     if (!f) {
         printf("Cannot open %s!\nIndex not updated.\n", file);
-        return index;
+        return;
     }
     fclose(f);
 
-    // insert file into file list (alphabetically ordered)
-    int doc_id = 0;
-
-    // always insert temporary search document in the beginning
-    if (strcmp(file, "._tmp_search_doc")) {
-        for (doc_id = 0; doc_id < index->nr_docs; doc_id++) {
-            int cmp = strcmp(index->documents[doc_id].name, file);
+    int doc_id = insert_document(index, file);
+    if (doc_id < 0) {
+        printf("%s is already in the filebase.\n", file);
+        return;
+    }
 
-            if (!cmp) {
-                printf("%s is already in the filebase.\n", file);
-                return index;
-            } else if (0 < cmp) {
-                // right position in list found
-                break;
-            }
+    // parse file contents and add words to index
+    int *words;
+    int nr_terms = parse_file_for_index(index, doc_id, &words);
+
+    // the document is the only new entry in the lists of its words
+    int k;
+    for (k = 0; k < nr_terms; k++) {
+        indexed_word_p w = &index->words[words[k]];
+        if (index->norms) {
+            update_word_norms(index, w->stem, word_df(index, w->stem) - 1, doc_id);
         }
     }
 
-    // insert document in list
-    index = (index_p) realloc(index, sizeof(index_t) + sizeof(indexed_document_t) * (index->nr_docs + 1));
-    memmove(&index->documents[doc_id+1], &index->documents[doc_id], sizeof(indexed_document_t) * (index->nr_docs - doc_id));
+    // only the document itself is written, the words in memory go to a new segment from time to time
+    journal_add(index, doc_id, words, nr_terms);
+    free(words);
+
+    if (index->journal_size > FLUSH_JOURNAL_SIZE) {
+        flush_segment(index, NULL);
+    }
+}
+
+/*
+ * Adds a document to the filebase (without indexing its words), returns the id of the document
+ * or -1 if the filebase already contains a document with this name
+ */
+int insert_document(index_p index, char *file) {
+    // find position of the file in the alphabetically ordered list of names
+    int pos = find_name_pos(index, file);
+    if (pos < index->nr_docs && !strcmp(get_document(index, index->by_name[pos])->name, file)) {
+        return -1;
+    }
+
+    // the document gets the next free id
+    int doc_id = new_document(index, file);
 
-    index->documents[doc_id].name = (char *) malloc(strlen(file) + 1);
-    memcpy(index->documents[doc_id].name, file, strlen(file) + 1);
-    index->documents[doc_id].nr_words = 0;
+    // insert id in list of names
+    memmove(&index->by_name[pos+1], &index->by_name[pos], sizeof(int) * (index->nr_docs - pos));
+    index->by_name[pos] = doc_id;
     index->nr_docs++;
 
-    // update indices: increase indices which are greater or equal to doc_id of added document
-    indexed_word_p w = index->words;
-    while (w) {
-        int i;
-        for (i = 0; i < w->nr_docs; i++) {
-            if (w->documents[i].id >= doc_id) {
-                w->documents[i].id++;
-            }
-        }
+    return doc_id;
+}
+
+/*
+ * Adds documents to the filebase at once (without indexing their words), returns the id of the first one
+ * the documents get consecutive ids
+ *  files: names of documents not in the filebase yet, alphabetically ordered without duplicates
+ */
+int insert_documents(index_p index, char **files, int nr_files) {
+    int first = index->nr_doc_ids;
+    int *ids = (int *) malloc(sizeof(int) * (nr_files + 1));
+    int i;
+    for (i = 0; i < nr_files; i++) {
+        ids[i] = new_document(index, files[i]);
+    }
 
-        w = w->next;
+    merge_names(index, ids, nr_files);
+    free(ids);
+
+    return first;
+}
+
+/*
+ * Merges documents into the alphabetically ordered list of names
+ *  ids: documents not in the list yet, ordered by name
+ */
+void merge_names(index_p index, int *ids, int nr_ids) {
+    // merge starting at the end, so every name moves once
+    int i, old = index->nr_docs - 1, k = index->nr_docs + nr_ids - 1;
+    for (i = nr_ids - 1; i >= 0; k--) {
+        if (old >= 0 && strcmp(get_document(index, index->by_name[old])->name, get_document(index, ids[i])->name) > 0) {
+            index->by_name[k] = index->by_name[old--];
+        } else {
+            index->by_name[k] = ids[i--];
+        }
     }
 
-    // parse file contents and add words to index
-    parse_file_for_index(index, file);
-    write_index_to_file(index);
-    return index;
+    index->nr_docs += nr_ids;
 }
 
 /*
@@ -612,673 +1553,7008 @@ void remove_file(index_p index, int doc_id) {
         return;
     }
 
-    if (doc_id < 0 || doc_id >= index->nr_docs) {
+    if (doc_id < 0 || doc_id >= index->nr_doc_ids || !get_document(index, doc_id)->name) {
         printf("Error: illegal document id. No document removed!\n");
+        return;
     }
 
-    // remove document from list in index
-    free(index->documents[doc_id].name);
-    memmove(&index->documents[doc_id], &index->documents[doc_id+1], sizeof(indexed_document_t) * (index->nr_docs - 1 - doc_id));
-    index->nr_docs--;
+    delete_document(index, doc_id);
+
+    // commit changes to the journal
+    journal_remove(index, doc_id);
+}
 
-    indexed_word_p w = index->words;    // current word
-    indexed_word_p p = NULL;            // previous word
+/*
+ * Removes a document from the filebase and its words from the index
+ */
+void delete_document(index_p index, int doc_id) {
+    indexed_document_p doc = change_document(index, doc_id);
 
-    // remove document from the list of each indexed word
-    while (w) {
-        // find index of removed document in list (or of first document with higher id)
-        int i;
-        int remove = 0;
-        for (i = 0; i < w->nr_docs; i++) {
-            if (w->documents[i].id == doc_id) {
-                w->nr_docs--;
-                // document found in list, indicate removal
-                remove = 1;
-                break;
-            } else if (w->documents[i].id > doc_id) {
-                break;
+    // remove document from list of names, its id is not handed out again
+    int pos = find_name_pos(index, doc->name);
+    memmove(&index->by_name[pos], &index->by_name[pos+1], sizeof(int) * (index->nr_docs - 1 - pos));
+    index->nr_docs--;
+
+    if (!is_mapped(index, doc->name)) {
+        retire_memory(index, doc->name);
+    }
+    doc->name = NULL;
+    doc->nr_words = 0;
+
+    index_segment_p segment = document_segment(index, doc_id);
+    if (segment) {
+        // the segment keeps the words of the document, they just don't count anymore
+        add_removed(index, doc_id);
+
+        int *words;
+        int nr_terms = remove_segment_document(index, segment, doc_id, &words);
+
+        int k;
+        for (k = 0; k < nr_terms && index->norms; k++) {
+            // the IDF of the word changed for the remaining documents containing it
+            char *stem = segment->words.words[words[k]].stem;
+            int df = word_df(index, stem);
+            if (df) {
+                update_word_norms(index, stem, df + 1, -1);
             }
         }
 
-        // reduce document id of all documents with id > removed document id
-        // and shift array items (in order to remove entry of the document we want to remove) if neccessary
-        for (; i < w->nr_docs; i++) {
-            w->documents[i] = w->documents[i+remove];
-            w->documents[i].id--;
+        free(words);
+        return;
+    }
+
+    // remove document from the list of each word in memory
+    int wid = 0;
+    while (wid < index->nr_words) {
+        indexed_word_p w = &index->words[wid];
+
+        // only the document lists containing the document change, snapshots keep the old ones
+        posting_cursor_t c;
+        open_cursor(&c, w);
+        if (cursor_seek(&c, doc_id) == doc_id) {
+            own_word(index, w);
         }
 
-        if (w->nr_docs == 0) {
-            // only occurance of this word is in removed document -> remove word from index
-            if (!p) {
-                index->words = w->next;
-            } else {
-                p->next = w->next;
+        if (remove_posting(w, doc_id) && index->norms) {
+            // the IDF of the word changed for the remaining documents containing it
+            int df = word_df(index, w->stem);
+            if (df) {
+                update_word_norms(index, w->stem, df + 1, -1);
             }
+        }
 
-            index->nr_words--;
-
-            indexed_word_p n = w->next;
-            free(w->stem);
-            free(w);
-            w = n;
+        if (w->nr_docs == 0) {
+            // only occurance of this word in memory is in removed document -> remove word from the index
+            // (the last word in the list takes over its index, so don't advance)
+            remove_word(index, wid);
         } else {
             // get next indexed word
-            p = w;
-            w = w->next;
+            wid++;
         }
     }
+}
+
+/*
+ * Appends a document to the list of documents, returns the id of the document
+ */
+int new_document(index_p index, char *file) {
+    reserve_documents(index, index->nr_doc_ids + 1);
+
+    int doc_id = index->nr_doc_ids++;
+    if (index->norms) {
+        memset(change_norm(index, doc_id), 0, sizeof(doc_norm_t));
+    }
+
+    indexed_document_p doc = change_document(index, doc_id);
+    doc->name = (char *) malloc(strlen(file) + 1);
+    memcpy(doc->name, file, strlen(file) + 1);
+    doc->nr_words = 0;
 
-    // commit changes to file
-    write_index_to_file(index);
+    return doc_id;
 }
 
 /*
- * Searches index for indexed words and returns documents containing these words
+ * Makes room for the documents with ids up to nr_doc_ids - 1
  */
-index_p search_index(index_p *in, char *query) {
-    nonalpha_to_space(query);
+void reserve_documents(index_p index, int nr_doc_ids) {
+    if (nr_doc_ids <= index->max_doc_ids) {
+        return;
+    }
 
-    FILE *search_file = fopen("._tmp_search_doc", "w");
-    if (!search_file) {
-        printf("Error: couldn't create temporary file to write.\nUnable to search\n");
-        return NULL;
+    // pages full => double the number of pages
+    int nr_pages = index->max_doc_ids / DOCUMENT_PAGE_SIZE;
+    int max_pages = nr_pages ? nr_pages * 2 : 1;
+    while ((long) max_pages * DOCUMENT_PAGE_SIZE < nr_doc_ids) {
+        max_pages *= 2;
+    }
+    index->max_doc_ids = max_pages * DOCUMENT_PAGE_SIZE;
+
+    // snapshots have page tables of their own, only the pages are shared
+    index->documents = (indexed_document_p *) realloc(index->documents, sizeof(indexed_document_p) * max_pages);
+    index->document_stamps = (int *) realloc(index->document_stamps, sizeof(int) * max_pages);
+    index->by_name = (int *) realloc(index->by_name, sizeof(int) * index->max_doc_ids);
+    if (index->norms) {
+        index->norms = (doc_norm_p *) realloc(index->norms, sizeof(doc_norm_p) * max_pages);
+        index->norm_stamps = (int *) realloc(index->norm_stamps, sizeof(int) * max_pages);
+    }
+
+    int p;
+    for (p = nr_pages; p < max_pages; p++) {
+        index->documents[p] = (indexed_document_p) malloc(sizeof(indexed_document_t) * DOCUMENT_PAGE_SIZE);
+        index->document_stamps[p] = index->nr_snapshots;
+        if (index->norms) {
+            index->norms[p] = (doc_norm_p) calloc(DOCUMENT_PAGE_SIZE, sizeof(doc_norm_t));
+            index->norm_stamps[p] = index->nr_snapshots;
+        }
     }
+}
 
-    fprintf(search_file, "%s\n", query);
-    fclose(search_file);
+/*
+ * Returns a document of the filebase to be read
+ */
+indexed_document_p get_document(index_p index, int doc_id) {
+    return &index->documents[doc_id / DOCUMENT_PAGE_SIZE][doc_id % DOCUMENT_PAGE_SIZE];
+}
 
-    *in = add_file(*in, "._tmp_search_doc");
-    index_p index = *in;
+/*
+ * Returns a document of the filebase to be changed, its page is copied first if snapshots share it
+ * (the pages another index shares with this one are changed in place)
+ */
+indexed_document_p change_document(index_p index, int doc_id) {
+    int page = doc_id / DOCUMENT_PAGE_SIZE;
+    if (index->document_stamps) {
+        index->documents[page] = (indexed_document_p) own_memory(index, index->documents[page],
+            &index->document_stamps[page], sizeof(indexed_document_t) * DOCUMENT_PAGE_SIZE);
+    }
 
-    // compute TF-IDF vector for search document
-    double *q_tfidf = (double *) malloc(sizeof(double) * index->nr_words);
+    return &index->documents[page][doc_id % DOCUMENT_PAGE_SIZE];
+}
 
-    // threshold for the search, based on the distance of the search term to the empty document
-    double euclid_threshold = 0;
+/*
+ * Looks up the id of a document by its name, returns -1 if the document is not in the filebase
+ */
+int find_document(index_p index, char *file) {
+    int pos = find_name_pos(index, file);
+    if (pos < index->nr_docs && !strcmp(get_document(index, index->by_name[pos])->name, file)) {
+        return index->by_name[pos];
+    }
 
-    // document offset for each word where we need to continue searching (make use of sorted document ids)
-    int *w_offset = (int *) malloc(sizeof(int) * index->nr_words);
+    return -1;
+}
 
-    // calculate TF-IDF, threshold and offsets
-    int wid = 0;
-    indexed_word_p w = index->words;
-    while (w) {
-        if (!w->documents[0].id) {
-            q_tfidf[wid] = w->documents[0].tf * logf(index->nr_docs / w->nr_docs);
-            euclid_threshold += q_tfidf[wid] * q_tfidf[wid];
-            w_offset[wid] = 1;
+/*
+ * Binary search the alphabetically ordered list of document names for the position of a name
+ * (position of the first name which is not less than the given name)
+ */
+int find_name_pos(index_p index, char *file) {
+    int min = 0, max = index->nr_docs;
+    while (min < max) {
+        int middle = (min + max) / 2;
+        if (strcmp(get_document(index, index->by_name[middle])->name, file) < 0) {
+            min = middle + 1;
         } else {
-            q_tfidf[wid] = 0;
-            w_offset[wid] = 0;
+            max = middle;
         }
-
-        w = w->next;
-        wid++;
     }
 
-    // threshold is the euclidian distance to the empty document
-    euclid_threshold = sqrt(euclid_threshold);
+    return min;
+}
 
-    // euclidian distance of all documents to the search term (based on TF-IDF)
-    doc_found_p euclid_dist = (doc_found_p) malloc(sizeof(doc_found_t) * index->nr_docs);
-    memset(euclid_dist, 0, sizeof(doc_found_t) * index->nr_docs);
+/*
+ * Searches index for indexed words and returns documents containing these words
+ */
+search_result_p search_index(index_p index, char *query) {
+    double start = now_seconds();
 
-    // array of all search terms without stopwords
-    char *words[index->documents[0].nr_words];
-    memset(words, 0, sizeof(char *) * index->documents[0].nr_words);
+    int nr_terms, nr_words, nr_phrases;
+    query_phrase_p phrases;
+    query_term_p terms = parse_query(index, query, &nr_terms, &nr_words, &phrases, &nr_phrases);
 
-    // index of last processed word in the search term
-    int qid = 0;
+    // the query is weighted as if it was an additional document of the filebase: IDF = log(N + 1) - log(df)
+    double log_n = log(index->nr_docs + 1);
+    int cosine = index->ranking == RANKING_COSINE;
 
-    // compute euclidian distance for all documents; ignore temporary search document at index 0
-    int d;
-    int nr_results = 0;
-    for (d = 1; d < index->nr_docs; d++) {
-        euclid_dist[nr_results].dist = 0;
-        euclid_dist[nr_results].flag = 0;
-        euclid_dist[nr_results].doc_id = d;
-
-        // compute TF-IDF for all words and sum the difference to the TF-IDF of the queue in euclid_dist
-        qid = 0;
-        int wid = 0;
-        w = index->words;
-        while (w) {
-            int i = w_offset[wid];
-            if (i < w->nr_docs && w->documents[i].id == d) {
-                // word occurs in document -> calculate TF-IDF and subtract TF-IDF of queue; then square
-                euclid_dist[nr_results].dist += pow(w->documents[i].tf * logf(index->nr_docs / w->nr_docs) - q_tfidf[wid], 2);
+    // the TF-IDF vector lengths of the documents are kept up to date from loading the index on
+    update_norms(index);
 
-                // update bit mask (set qid-th most significant bit to 1)
-                if (!w->documents[0].id) {
-                    euclid_dist[nr_results].flag |= 1 << (sizeof(unsigned long) * 8 - 1 - qid);
-                }
+    // squared length of the TF-IDF vector of the query
+    double q_norm = 0;
 
-                w_offset[wid]++;
-            } else {
-                // word doesn't occur in document -> TF-IDF = 0 -> just square TF-IDF of queue
-                euclid_dist[nr_results].dist += q_tfidf[wid] * q_tfidf[wid];
-            }
+    // minimal squared distance of any document: search terms which are not indexed don't occur in any document
+    double min_dist = 0;
 
-            if (!w->documents[0].id) {
-                // this word is part of the search term
-                if (!words[qid]) {
-                    words[qid] = w->stem;
-                }
-                qid++;
-            }
+    // cursors in the document lists of the indexed search terms
+    term_cursor_p cursors = (term_cursor_p) malloc(sizeof(term_cursor_t) * (nr_terms + 1));
+    int nr_cursors = 0;
 
-            w = w->next;
-            wid++;
+    int q;
+    for (q = 0; q < nr_terms; q++) {
+        if (!terms[q].nr_docs) {
+            double q_tfidf = (double) terms[q].count / nr_words * log_n;
+            q_norm += q_tfidf * q_tfidf;
+            min_dist += q_tfidf * q_tfidf;
+            continue;
+        }
+
+        term_cursor_p c = &cursors[nr_cursors++];
+
+        // the query counts as an additional document containing this word
+        // (compared by cosine, query and documents are weighted by the same IDF)
+        c->idf = log_n - log(terms[q].nr_docs);
+        c->q_idf = cosine ? c->idf : log_n - log(terms[q].nr_docs + 1);
+        c->q_tfidf = (double) terms[q].count / nr_words * c->q_idf;
+        c->penalty = c->q_tfidf * c->q_tfidf;
+        c->qid = q;
+        c->phrase = 0;
+        c->positions = NULL;
+        c->nr_positions = 0;
+        c->max_positions = 0;
+        c->positions_doc = -1;
+        q_norm += c->penalty;
+    }
+
+    // sort cursors by the penalty for documents not containing their word
+    qsort(cursors, nr_cursors, sizeof(term_cursor_t), cmp_term_cursor);
+
+    // the phrases find the cursors of their words by search term, no document matches a phrase with a word not indexed
+    int *term_cursors = (int *) malloc(sizeof(int) * (nr_terms + 1));
+    int i, matchable = 1;
+    for (q = 0; q < nr_terms; q++) {
+        term_cursors[q] = -1;
+    }
+    for (i = 0; i < nr_cursors; i++) {
+        term_cursors[cursors[i].qid] = i;
+    }
+    for (q = 0; q < nr_phrases; q++) {
+        for (i = 0; i < phrases[q].nr_words; i++) {
+            if (term_cursors[phrases[q].terms[i]] < 0) {
+                matchable = 0;
+            } else {
+                cursors[term_cursors[phrases[q].terms[i]]].phrase = 1;
+            }
+        }
+    }
+
+    // penalty[i] = minimal squared distance of documents containing none of the words of cursors i..nr_cursors-1
+    double *penalty = (double *) malloc(sizeof(double) * (nr_cursors + 1));
+    penalty[nr_cursors] = min_dist;
+    for (i = nr_cursors - 1; i >= 0; i--) {
+        penalty[i] = penalty[i+1] + cursors[i].penalty;
+    }
+
+    // threshold for the search: the euclidian distance of the search term to the empty document
+    double euclid_threshold = sqrt(q_norm);
+
+    // squared distance a document has to beat to get into the result (lowered when the heap of results is full)
+    double theta = q_norm;
+
+    // the best documents found so far, the worst one of them at the top
+    doc_found_p heap = (doc_found_p) malloc(sizeof(doc_found_t) * MAX_SEARCH_RESULTS);
+    int nr_results = 0;
+
+    // cursors 0..essential-1 are non-essential: a document containing only their words can't beat the threshold
+    int essential = 0;
+
+    // counted for the runtime counters
+    long nr_candidates = 0, nr_scored = 0, nr_postings = 0;
+
+    // the segments (and the words in memory) are searched one after another, in the order of their documents
+    indexed_word_t none;
+    memset(&none, 0, sizeof(indexed_word_t));
+
+    int s;
+    for (s = 0; s <= index->nr_segments && matchable; s++) {
+        index_p words = s < index->nr_segments ? &index->segments[s].words : index;
+        for (i = 0; i < nr_cursors; i++) {
+            int wid = find_word(words, terms[cursors[i].qid].stem);
+            open_cursor(&cursors[i].postings, wid >= 0 ? &words->words[wid] : &none);
+        }
+
+        int d = -1;
+        for (;;) {
+            // the cursors of essential words of phrases leave the document looked at last
+            // (they stay there until it is scored, so its phrases can be checked)
+            for (i = essential; i < nr_cursors && nr_phrases; i++) {
+                if (cursors[i].phrase && cursor_doc(&cursors[i].postings) == d) {
+                    cursor_next(&cursors[i].postings);
+                    nr_postings++;
+                }
+            }
+
+            // next document containing any essential word
+            d = INT_MAX;
+            for (i = essential; i < nr_cursors; i++) {
+                int id = cursor_doc(&cursors[i].postings);
+                if (id < d) {
+                    d = id;
+                }
+            }
+
+            if (d == INT_MAX) {
+                break;
+            }
+
+            indexed_document_p doc = get_document(index, d);
+            if (!doc->name) {
+                // removed document, its segment still contains it
+                for (i = essential; i < nr_cursors; i++) {
+                    if (cursor_doc(&cursors[i].postings) == d) {
+                        cursor_next(&cursors[i].postings);
+                        nr_postings++;
+                    }
+                }
+                continue;
+            }
+
+            nr_candidates++;
+
+            // lower bound of the squared distance of the document and correction of |d|^2 + |q|^2 by the search terms
+            double bound = min_dist, dist = 0;
+
+            // dot product of the TF-IDF vectors of document and query
+            double dot = 0;
+            unsigned long flag = 0;
+
+            // score essential words first, then probe the non-essential words as long as the document can make it
+            for (i = nr_cursors - 1; i >= 0; i--) {
+                term_cursor_p c = &cursors[i];
+
+                if (i < essential) {
+                    if (bound > theta * (1 + 1e-9)) {
+                        // document can't beat the threshold even if it contains all remaining words
+                        break;
+                    }
+
+                    cursor_seek(&c->postings, d);
+                    nr_postings++;
+                }
+
+                if (cursor_doc(&c->postings) != d) {
+                    // word doesn't occur in document -> just square TF-IDF of queue
+                    bound += c->penalty;
+                    continue;
+                }
+
+                // word occurs in document: replace its contribution to |d|^2 by the squared difference to the query
+                double tf = (double) cursor_count(&c->postings) / doc->nr_words;
+                if (cosine) {
+                    dot += tf * c->idf * c->q_tfidf;
+                } else {
+                    double tfidf = tf * c->idf;
+                    double d_tfidf = tf * c->q_idf;
+                    dist += d_tfidf * d_tfidf - 2 * d_tfidf * c->q_tfidf - tfidf * tfidf;
+                }
+
+                // update bit mask (set qid-th most significant bit to 1)
+                flag |= 1UL << (sizeof(unsigned long) * 8 - 1 - c->qid);
+
+                if (i >= essential && !c->phrase) {
+                    cursor_next(&c->postings);
+                    nr_postings++;
+                }
+            }
+
+            if (i >= 0) {
+                // document pruned
+                continue;
+            }
+
+            nr_scored++;
+
+            doc_found_t found;
+            found.doc_id = d;
+            found.name = doc->name;
+            found.flag = flag;
+
+            if (cosine) {
+                // no pruning: every document sharing a word with the query is ranked by the angle between them
+                double d_norm = document_norm(index, d, log_n);
+                if (d_norm <= 0 || q_norm <= 0) {
+                    continue;
+                }
+
+                found.dist = -dot / sqrt(d_norm * q_norm);
+
+                // the positions are only looked at for documents making it into the results
+                if (nr_phrases && (nr_results < MAX_SEARCH_RESULTS || cmp_doc_found_desc(&found, &heap[0]) < 0)
+                        && !match_phrases(cursors, term_cursors, phrases, nr_phrases, d)) {
+                    continue;
+                }
+
+                add_to_heap(heap, &nr_results, MAX_SEARCH_RESULTS, &found);
+                continue;
+            }
+
+            // |d - q|^2 = |d|^2 + |q|^2 - 2 d.q, corrected by the partial sums of the search terms
+            dist += document_norm(index, d, log_n) + q_norm;
+            found.dist = sqrt(dist > 0 ? dist : 0);
+
+            // ignore documents above threshold
+            if (found.dist >= euclid_threshold) {
+                continue;
+            }
+
+            // ignore documents without the phrases, for documents making it into the results only
+            if (nr_phrases && (nr_results < MAX_SEARCH_RESULTS || cmp_doc_found_desc(&found, &heap[0]) < 0)
+                    && !match_phrases(cursors, term_cursors, phrases, nr_phrases, d)) {
+                continue;
+            }
+
+            // ignore documents worse than the results so far
+            if (!add_to_heap(heap, &nr_results, MAX_SEARCH_RESULTS, &found)) {
+                continue;
+            }
+
+            if (nr_results == MAX_SEARCH_RESULTS) {
+                // raise the bar to the worst result and move words which can't lift a document over it to the non-essential ones
+                theta = heap[0].dist * heap[0].dist;
+                while (essential < nr_cursors && penalty[essential + 1] > theta * (1 + 1e-9)) {
+                    essential++;
+                }
+            }
+        }
+    }
+
+    for (i = 0; i < nr_cursors; i++) {
+        free(cursors[i].positions);
+    }
+
+    free(cursors);
+    free(penalty);
+    free(term_cursors);
+
+    // sort documents by euclidian distance to query (or by cosine similarity)
+    doc_found_p euclid_dist = heap;
+    qsort(euclid_dist, nr_results, sizeof(doc_found_t), cmp_doc_found_desc);
+
+
+    // create result list
+    search_result_p result = (search_result_p) malloc(sizeof(search_result_t) + sizeof(search_hit_t) * nr_results);
+    result->nr_hits = nr_results;
+
+    for (i = 0; i < nr_results; i++) {
+        search_hit_p hit = &result->hits[i];
+
+        // create a string of all search terms found in this document
+        hit->terms = (char *) malloc(1);
+        *hit->terms = '\0';
+
+        int k;
+        for (k = 0; k < nr_terms; k++) {
+            // check whether k-th most significant bit is set
+            if (euclid_dist[i].flag & (1UL << (sizeof(unsigned long) * 8 - 1 - k))) {
+                hit->terms = (char *) realloc(hit->terms, strlen(hit->terms) + strlen(terms[k].stem) + 3);
+                strcat(hit->terms, terms[k].stem);
+                strcat(hit->terms, ", ");
+            }
+        }
+
+        // remove final ', '
+        *(hit->terms + strlen(hit->terms) - 2) = '\0';
+
+        // copy name of the document into result list
+        char *d = euclid_dist[i].name;
+        hit->name = (char *) malloc(strlen(d) + 1);
+        memcpy(hit->name, d, strlen(d) + 1);
+        hit->score = cosine ? -euclid_dist[i].dist : euclid_dist[i].dist;
+    }
+
+    free(euclid_dist);
+    close_query(terms, nr_terms, phrases, nr_phrases);
+
+    count_stat(STAT_SEARCHES, 1);
+    count_stat(STAT_CANDIDATES, nr_candidates);
+    count_stat(STAT_DOCS_SCORED, nr_scored);
+    count_stat(STAT_POSTINGS_SCANNED, nr_postings);
+    count_time(STAT_TIME_SCORE, start);
+
+    return result;
+}
+
+/*
+ * Splits a search query into stemmed search terms (without stopwords), alphabetically ordered
+ * words in double quotes form a phrase: they have to occur in this order, at the same distances as in the query
+ * (stopwords count). NEAR/k (in capitals) between two words means they have to occur at most k words apart.
+ *  nr_terms: returns the number of distinct search terms
+ *  nr_words: returns the total number of words in the query
+ *  phrases: returns the phrases and the words joined by NEAR (NULL = none)
+ *  nr_phrases: returns the number of phrases
+ */
+query_term_p parse_query(index_p index, char *query, int *nr_terms, int *nr_words, query_phrase_p *phrases, int *nr_phrases) {
+    query_term_p terms = NULL;
+    *nr_terms = 0;
+    *nr_words = 0;
+    *phrases = NULL;
+    *nr_phrases = 0;
+
+    // split a copy of the query into words, the query itself stays as typed
+    char *copy = (char *) malloc(strlen(query) + 1);
+    memcpy(copy, query, strlen(query) + 1);
+
+    tokenizer_t t;
+    string_tokenizer(&t, copy);
+
+    // phrase the words in quotes are added to (-1 = none yet) and its first position,
+    // distance of a NEAR waiting for its second word (-1 = none) and the search term before it
+    int phrase = -1, phrase_start = 0, in_quotes = 0, near = -1, last_term = -1;
+
+    // number of words of the query so far, stopwords included, and characters of the query looked at for quotes
+    int position = 0, scanned = 0;
+
+    // number of words of search terms beyond MAX_QUERY_TERMS
+    int ignored = 0;
+
+    char *word;
+    int len;
+    while ((len = next_token(&t, &word))) {
+        // quotes between the previous word and this one open or close a phrase
+        int offset = word - copy;
+        for (; scanned < offset; scanned++) {
+            if (query[scanned] == '"') {
+                in_quotes = !in_quotes;
+                phrase = -1;
+            }
+        }
+        scanned = offset + len;
+
+        if (!in_quotes && len == 4 && !strncmp(query + offset, "NEAR", 4) && query[offset + 4] == '/'
+                && isdigit((unsigned char) query[offset + 5])) {
+            near = atoi(query + offset + 5);
+            continue;
+        }
+
+        position++;
+
+        // ignore stopwords
+        if (is_stopword(index->stopwords, word, len)) {
+            continue;
+        }
+
+        // the stem replaces the word in the copy of the query
+        len = cached_stem(index->stem_cache, word, len, word);
+
+        if (!len) {
+            continue;
+        }
+
+        // count occurances of each search term
+        int q;
+        for (q = 0; q < *nr_terms; q++) {
+            if (!strcmp(terms[q].stem, word)) {
+                break;
+            }
+        }
+
+        if (q < *nr_terms) {
+            terms[q].count++;
+        } else if (*nr_terms == MAX_QUERY_TERMS) {
+            if (!ignored++) {
+                printf("Warning: a query has more than %d search terms, the others are ignored.\n", MAX_QUERY_TERMS);
+            }
+            continue;
+        } else {
+            terms = (query_term_p) realloc(terms, sizeof(query_term_t) * (*nr_terms + 1));
+            terms[q].stem = (char *) malloc(len + 1);
+            memcpy(terms[q].stem, word, len + 1);
+            terms[q].count = 1;
+            terms[q].nr_docs = word_df(index, word);
+            (*nr_terms)++;
+        }
+
+        (*nr_words)++;
+
+        if (near >= 0 && last_term >= 0) {
+            query_phrase_p p = add_phrase(phrases, nr_phrases, near);
+            add_phrase_word(p, last_term, 0);
+            add_phrase_word(p, q, 0);
+        }
+        near = -1;
+        last_term = q;
+
+        if (in_quotes) {
+            if (phrase < 0) {
+                add_phrase(phrases, nr_phrases, -1);
+                phrase = *nr_phrases - 1;
+                phrase_start = position;
+            }
+
+            add_phrase_word(&(*phrases)[phrase], q, position - phrase_start);
+        }
+    }
+
+    close_tokenizer(&t);
+    free(copy);
+
+    // a phrase of a single word is just a search term
+    int p, k, nr_kept = 0;
+    for (p = 0; p < *nr_phrases; p++) {
+        if ((*phrases)[p].nr_words < 2) {
+            free((*phrases)[p].terms);
+            free((*phrases)[p].offsets);
+        } else {
+            (*phrases)[nr_kept++] = (*phrases)[p];
+        }
+    }
+    *nr_phrases = nr_kept;
+
+    // number search terms alphabetically, the words of the phrases follow their terms
+    char **stems = (char **) malloc(sizeof(char *) * (*nr_terms + 1));
+    int q;
+    for (q = 0; q < *nr_terms; q++) {
+        stems[q] = terms[q].stem;
+    }
+
+    qsort(terms, *nr_terms, sizeof(query_term_t), cmp_str);
+
+    for (p = 0; p < *nr_phrases; p++) {
+        for (k = 0; k < (*phrases)[p].nr_words; k++) {
+            char *stem = stems[(*phrases)[p].terms[k]];
+            for (q = 0; terms[q].stem != stem; q++);
+            (*phrases)[p].terms[k] = q;
+        }
+    }
+
+    free(stems);
+    return terms;
+}
+
+/*
+ * Appends an empty phrase to the phrases of a query, returns the phrase (valid until the next one is added)
+ *  distance: most words the two words joined by NEAR may be apart (-1 = the words form a phrase)
+ */
+query_phrase_p add_phrase(query_phrase_p *phrases, int *nr_phrases, int distance) {
+    *phrases = (query_phrase_p) realloc(*phrases, sizeof(query_phrase_t) * (*nr_phrases + 1));
+
+    query_phrase_p phrase = &(*phrases)[(*nr_phrases)++];
+    phrase->nr_words = 0;
+    phrase->terms = NULL;
+    phrase->offsets = NULL;
+    phrase->distance = distance;
+
+    return phrase;
+}
+
+/*
+ * Appends a word to a phrase
+ *  term: number of the search term of the word
+ *  offset: position of the word relative to the first word of the phrase
+ */
+void add_phrase_word(query_phrase_p phrase, int term, int offset) {
+    phrase->terms = (int *) realloc(phrase->terms, sizeof(int) * (phrase->nr_words + 1));
+    phrase->offsets = (int *) realloc(phrase->offsets, sizeof(int) * (phrase->nr_words + 1));
+    phrase->terms[phrase->nr_words] = term;
+    phrase->offsets[phrase->nr_words] = offset;
+    phrase->nr_words++;
+}
+
+/*
+ * Frees the memory occupied by a list of search terms and the phrases of the query
+ */
+void close_query(query_term_p terms, int nr_terms, query_phrase_p phrases, int nr_phrases) {
+    int q;
+    for (q = 0; q < nr_terms; q++) {
+        free(terms[q].stem);
+    }
+
+    for (q = 0; q < nr_phrases; q++) {
+        free(phrases[q].terms);
+        free(phrases[q].offsets);
+    }
+
+    free(terms);
+    free(phrases);
+}
+
+/*
+ * Checks whether a document contains the phrases of a query, the cursors of the words of the phrases are at
+ * the document if it contains the words; the words of documents without recorded positions are enough
+ *  term_cursors: per search term: index of its cursor
+ */
+int match_phrases(term_cursor_p cursors, int *term_cursors, query_phrase_p phrases, int nr_phrases, int doc_id) {
+    int p;
+    for (p = 0; p < nr_phrases; p++) {
+        query_phrase_p phrase = &phrases[p];
+
+        int k, recorded = 1;
+        for (k = 0; k < phrase->nr_words; k++) {
+            term_cursor_p c = &cursors[term_cursors[phrase->terms[k]]];
+            if (cursor_doc(&c->postings) != doc_id) {
+                return 0;
+            }
+
+            term_positions(c, doc_id);
+            if (!c->nr_positions) {
+                recorded = 0;
+            }
+        }
+
+        if (!recorded) {
+            continue;
+        }
+
+        if (phrase->distance >= 0) {
+            // both lists ascending: move on in the one behind until two positions are close enough
+            term_cursor_p a = &cursors[term_cursors[phrase->terms[0]]];
+            term_cursor_p b = &cursors[term_cursors[phrase->terms[1]]];
+            int i = 0, j = 0;
+            while (i < a->nr_positions && j < b->nr_positions && abs(a->positions[i] - b->positions[j]) > phrase->distance) {
+                if (a->positions[i] < b->positions[j]) {
+                    i++;
+                } else {
+                    j++;
+                }
+            }
+
+            if (i == a->nr_positions || j == b->nr_positions) {
+                return 0;
+            }
+            continue;
+        }
+
+        // each position of the first word gives the positions of the others, which only grow from one to the next
+        term_cursor_p first = &cursors[term_cursors[phrase->terms[0]]];
+        int next[phrase->nr_words];
+        memset(next, 0, sizeof(next));
+
+        int i, found = 0;
+        for (i = 0; i < first->nr_positions && !found; i++) {
+            int start = first->positions[i] - phrase->offsets[0];
+
+            for (k = 1; k < phrase->nr_words; k++) {
+                term_cursor_p c = &cursors[term_cursors[phrase->terms[k]]];
+                int pos = start + phrase->offsets[k];
+                while (next[k] < c->nr_positions && c->positions[next[k]] < pos) {
+                    next[k]++;
+                }
+
+                if (next[k] == c->nr_positions || c->positions[next[k]] != pos) {
+                    break;
+                }
+            }
+
+            found = k == phrase->nr_words;
+        }
+
+        if (!found) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Decodes the positions of the word of a cursor in the document at the cursor, unless they already are
+ */
+void term_positions(term_cursor_p c, int doc_id) {
+    if (c->positions_doc == doc_id) {
+        return;
+    }
+
+    int count = cursor_count(&c->postings);
+    if (count > c->max_positions) {
+        c->max_positions = count;
+        c->positions = (int *) realloc(c->positions, sizeof(int) * c->max_positions);
+    }
+
+    c->nr_positions = cursor_positions(&c->postings, c->positions);
+    c->positions_doc = doc_id;
+}
+
+/*
+ * Frees the memory occupied by a search result
+ */
+void close_search_result(search_result_p result) {
+    int i;
+    for (i = 0; i < result->nr_hits; i++) {
+        free(result->hits[i].name);
+        free(result->hits[i].terms);
+    }
+
+    free(result);
+}
+
+/*
+ * Compares two doc_found structs based on euclidian distance to the search term (1st priority) and the name of the document (2nd priority)
+ */
+int cmp_doc_found_desc(const void *a, const void *b) {
+   doc_found_p aa = (doc_found_p) a;
+   doc_found_p bb = (doc_found_p) b;
+
+   if (aa->dist == bb->dist) {
+       return strcmp(aa->name, bb->name);
+   } else {
+       return (aa->dist < bb->dist) ? -1 : (aa->dist > bb->dist);
+   }
+}
+
+/*
+ * Compares two term cursors based on the penalty for documents not containing their word
+ */
+int cmp_term_cursor(const void *a, const void *b) {
+    double pa = ((term_cursor_p) a)->penalty;
+    double pb = ((term_cursor_p) b)->penalty;
+
+    return (pa < pb) ? -1 : (pa > pb);
+}
+
+/*
+ * Adds a document to a bounded max-heap of the best documents found (worst document at the top)
+ * returns 0 if the heap is full and the document is worse than all documents in the heap, 1 otherwise
+ */
+int add_to_heap(doc_found_p heap, int *nr_found, int max_found, doc_found_p found) {
+    int i;
+    if (*nr_found < max_found) {
+        // heap not full yet: sift up from the end
+        i = (*nr_found)++;
+        while (i > 0 && cmp_doc_found_desc(&heap[(i - 1) / 2], found) < 0) {
+            heap[i] = heap[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+
+        heap[i] = *found;
+        return 1;
+    }
+
+    if (cmp_doc_found_desc(found, &heap[0]) >= 0) {
+        return 0;
+    }
+
+    // replace worst document: sift down from the top
+    i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= max_found) {
+            break;
+        }
+
+        if (child + 1 < max_found && cmp_doc_found_desc(&heap[child + 1], &heap[child]) > 0) {
+            child++;
+        }
+
+        if (cmp_doc_found_desc(&heap[child], found) <= 0) {
+            break;
+        }
+
+        heap[i] = heap[child];
+        i = child;
+    }
+
+    heap[i] = *found;
+    return 1;
+}
+
+/*
+ * Compares two occurances of words in a document (see parse_file_for_index) by word, then by position
+ */
+int cmp_occurance(const void *a, const void *b) {
+    unsigned long aa = *(unsigned long *) a;
+    unsigned long bb = *(unsigned long *) b;
+
+    return (aa < bb) ? -1 : (aa > bb);
+}
+
+/*
+ * Compares two documents based on their names
+ */
+int cmp_document_name(const void *a, const void *b) {
+    return strcmp(((document_name_p) a)->name, ((document_name_p) b)->name);
+}
+
+/*
+ * Compares two pointers to strings (or structs starting with a pointer to a string)
+ */
+int cmp_str(const void *a, const void *b) {
+    return strcmp(*(char **) a, *(char **) b);
+}
+
+/*
+ * Regenerates the index based on the files in the filebase
+ *  nr_threads: number of threads parsing the files (0 = one per processor)
+ */
+void rebuild_index(index_p index, int nr_threads) {
+    // clear index but keep filebase
+    clear_segments(index);
+    retire_words(index);
+    init_words(index);
+    clear_norms(index);
+
+    // no words refer to the documents now, so the ids of removed documents can be handed out again
+    compact_documents(index);
+
+    // rescan every document and save them as a single segment
+    build_index(index, 0, index->nr_doc_ids, nr_threads, 0);
+}
+
+/*
+ * Numbers the documents in the filebase from 0 on, leaving out removed documents
+ * the index mustn't contain any words
+ */
+void compact_documents(index_p index) {
+    int *new_id = (int *) malloc(sizeof(int) * (index->nr_doc_ids + 1));
+    int i, nr_ids = 0;
+    for (i = 0; i < index->nr_doc_ids; i++) {
+        new_id[i] = nr_ids;
+
+        indexed_document_t doc = *get_document(index, i);
+        if (doc.name) {
+            *change_document(index, nr_ids++) = doc;
+        }
+    }
+
+    for (i = 0; i < index->nr_docs; i++) {
+        index->by_name[i] = new_id[index->by_name[i]];
+    }
+
+    index->nr_doc_ids = nr_ids;
+    free(new_id);
+}
+
+/*
+ * Parses a file and adds its words to the index, returns the number of different words in the file
+ *  words: returns the indexes of these words if not NULL (to be freed by the caller)
+ */
+int parse_file_for_index(index_p index, int doc_id, int **words) {
+    double start = now_seconds();
+
+    // words occuring in this document
+    int *doc_words = NULL;
+    int nr_doc_words = 0, max_doc_words = 0;
+
+    // where the words occur: index of the word in the upper, number of the word in the document in the lower 32 bits
+    unsigned long *occurances = NULL;
+    int nr_occurances = 0, max_occurances = 0;
+
+    if (words) {
+        *words = NULL;
+    }
+
+    // open file or print error message
+    indexed_document_p doc = change_document(index, doc_id);
+    char *file = doc->name;
+    tokenizer_t t;
+    if (!open_tokenizer(&t, file)) {
+        printf("Cannot open %s!\nIndex not updated.\n", file);
+        return 0;
+    }
+
+    char *word;
+    int len, nr_tokens = 0, nr_stopwords = 0;
+    while ((len = next_token(&t, &word))) {
+        nr_tokens++;
+
+        // ignore stopwords
+        if (is_stopword(index->stopwords, word, len)) {
+            nr_stopwords++;
+            continue;
+        }
+
+        // the stem replaces the word in the buffer of the tokenizer
+        if (!cached_stem(index->stem_cache, word, len, word)) {
+            continue;
+        }
+
+        // insert document into index / add new stem to index
+        int wid = find_or_add_word(index, word);
+        if (index->positions) {
+            if (nr_occurances == max_occurances) {
+                max_occurances = max_occurances ? max_occurances * 2 : 256;
+                occurances = (unsigned long *) realloc(occurances, sizeof(unsigned long) * max_occurances);
+            }
+
+            occurances[nr_occurances++] = (unsigned long) wid << 32 | (nr_tokens - 1);
+        }
+
+        // the document list changes, snapshots keep the old one
+        own_word(index, &index->words[wid]);
+        if (add_posting(&index->words[wid], doc_id, 1)) {
+            // first occurance of this word in this document, remember it
+            if (nr_doc_words == max_doc_words) {
+                max_doc_words = max_doc_words ? max_doc_words * 2 : 64;
+                doc_words = (int *) realloc(doc_words, sizeof(int) * max_doc_words);
+            }
+
+            doc_words[nr_doc_words++] = wid;
+        }
+
+        // increase counter for total number of words in this document
+        doc->nr_words++;
+    }
+
+    close_tokenizer(&t);
+
+    if (nr_occurances) {
+        // the positions of each word, in ascending order
+        qsort(occurances, nr_occurances, sizeof(unsigned long), cmp_occurance);
+
+        int *positions = (int *) malloc(sizeof(int) * nr_occurances);
+        int first = 0;
+        while (first < nr_occurances) {
+            int wid = occurances[first] >> 32, nr_positions = 0;
+            while (first + nr_positions < nr_occurances && (int) (occurances[first + nr_positions] >> 32) == wid) {
+                positions[nr_positions] = (int) (occurances[first + nr_positions] & 0xffffffff);
+                nr_positions++;
+            }
+
+            set_positions(&index->words[wid], positions, nr_positions);
+            first += nr_positions;
+        }
+
+        free(positions);
+    }
+    free(occurances);
+
+    if (words) {
+        *words = doc_words;
+    } else {
+        free(doc_words);
+    }
+
+    count_stat(STAT_DOCS_PARSED, 1);
+    count_stat(STAT_TOKENS, nr_tokens);
+    count_stat(STAT_STOPWORD_HITS, nr_stopwords);
+    count_stat(STAT_STEM_CALLS, nr_tokens - nr_stopwords);
+    count_time(STAT_TIME_PARSE, start);
+
+    return nr_doc_words;
+}
+
+/*
+ * Writes index to the text index files (filebase and index)
+ */
+void export_index(index_p index) {
+    // STEP 1: write filebase to file
+    FILE *fb_file = fopen("filebase", "w");
+    if (!fb_file) {
+        printf("Error: couldn't open filebase file to write.\nUnable to write index to file\n");
+        return;
+    }
+
+    // each line contains the name (relative path) to one document in the filebase and the number of words in this document
+    // format: <path/to/file>|<nr_words>
+    // ids of removed documents are skipped, so the ids in the file are the ids in memory minus the number of gaps before them
+    int *file_id = (int *) malloc(sizeof(int) * (index->nr_doc_ids + 1));
+    int i, nr_file_ids = 0;
+    for (i = 0; i < index->nr_doc_ids; i++) {
+        file_id[i] = nr_file_ids;
+
+        indexed_document_p doc = get_document(index, i);
+        if (doc->name) {
+            fprintf(fb_file, "%s|%d\n", doc->name, doc->nr_words);
+            nr_file_ids++;
+        }
+    }
+
+    fclose(fb_file);
+
+    // STEP 2: write index to file
+    FILE *index_file = fopen("index", "w");
+    if (!index_file) {
+        printf("Error: couldn't open index file to write.\nUnable to write index to file\n");
+        free(file_id);
+        return;
+    }
+
+    // write one word in each line, alphabetically ordered
+    // format: <stem>:<n>:doc_id_1/<count_stem_1>|doc_id_2/<count_stem_2>|..|doc_id_n/<count_stem_n>
+    // (count = number of occurances of the stem in the document, TF = count / nr_words of the document)
+    // the lists of the segments and of the words in memory are merged the same way as when segments are merged
+    index_builder_p builder = new_index_builder(index);
+    for (i = 0; i < index->nr_segments; i++) {
+        add_words_run(builder, &index->segments[i].words);
+    }
+    add_words_run(builder, index);
+    start_merge(builder);
+
+    // the documents of a word are listed in a line of their own before the line is written, as their number comes first
+    int max_line = 1024;
+    char *line = (char *) malloc(max_line);
+    char *stem;
+    while ((stem = next_merged_word(builder))) {
+        // the lists of the segments still contain removed documents, words of removed documents only are left out
+        int nr_docs = 0, line_size = 0, doc, count, size;
+        unsigned char *list;
+        while ((doc = next_merged_posting(builder, &count, &list, &size)) != INT_MAX) {
+            if (!get_document(index, doc)->name) {
+                continue;
+            }
+
+            // line full => double the size (an entry takes 24 bytes at most)
+            if (line_size + 25 > max_line) {
+                max_line *= 2;
+                line = (char *) realloc(line, max_line);
+            }
+            line_size += sprintf(line + line_size, nr_docs++ ? "|%i/%i" : "%i/%i", file_id[doc], count);
+        }
+
+        if (nr_docs) {
+            // list all documents containing this word (or variations of it)
+            fprintf(index_file, "%s:%i:%s\n", stem, nr_docs, line);
+        }
+    }
+    free(line);
+
+    free_index_builder(builder);
+    free(file_id);
+    fclose(index_file);
+}
+
+/*
+ * Loads the index: maps the segment files, or imports the text index files if there are no segments yet
+ */
+index_p load_index() {
+    double start = now_seconds();
+
+    // create index struct
+    index_p index = (index_p) malloc(sizeof(index_t));
+    init_index(index);
+    index->stem_cache = new_stem_cache();
+
+    if (load_segments(index)) {
+        // index files written before they kept the stopwords rely on the stopwords file
+        if (!index->stopwords) {
+            index->stopwords = read_stopword_file(STOPWORD_FILE);
+        }
+
+        publish_snapshot(index);
+        count_time(STAT_TIME_LOAD, start);
+        return index;
+    }
+
+    // convert to the binary format, so the next start doesn't have to parse the text files again
+    // the stopwords file only matters for new indexes, afterwards the segment files keep the stopwords
+    index->stopwords = read_stopword_file(STOPWORD_FILE);
+    import_index(index);
+    flush_segment(index, NULL);
+    publish_snapshot(index);
+    count_time(STAT_TIME_LOAD, start);
+
+    return index;
+}
+
+/*
+ * Initializes an empty index
+ */
+void init_index(index_p index) {
+    index->documents = NULL;
+    index->document_stamps = NULL;
+    index->by_name = NULL;
+    index->nr_docs = 0;
+    index->nr_doc_ids = 0;
+    index->max_doc_ids = 0;
+    index->norms = NULL;
+    index->norm_stamps = NULL;
+    index->ranking = RANKING_EUCLID;
+    index->positions = 1;
+    index->stem_cache = NULL;
+    index->stopwords = NULL;
+    index->memory_budget = DEFAULT_MEMORY_BUDGET;
+    index->map = NULL;
+    index->map_size = 0;
+    index->generation = 0;
+    index->journal = NULL;
+    index->journal_size = 0;
+    index->segments = NULL;
+    index->nr_segments = 0;
+    index->next_segment = 1;
+    index->removed = NULL;
+    index->nr_removed = 0;
+    index->max_removed = 0;
+    index->merge = NULL;
+    index->snapshots = NULL;
+    index->nr_snapshots = 0;
+    init_words(index);
+}
+
+/*
+ * Parses and loads contents of the text index files (filebase and index) into an empty index struct
+ * returns 1 if both files were read, 0 otherwise
+ */
+int import_index(index_p index) {
+    // STEP 1: populate list of all documents
+    FILE *fb_file = fopen("filebase", "r");
+    if (!fb_file) {
+        printf("Error: filebase file not found.\nIndex not loaded!\n");
+        return 0;
+    }
+
+    // load all documents in a list, the line number is the id of the document
+    char *line;
+    long size = 0;
+    while ((line = read_line(fb_file))) {
+        size += strlen(line) + 1;
+
+        // copy name to index
+        char *tmp;
+        char *doc = strtok(line, "|");
+        int doc_id = new_document(index, doc);
+
+        // copy number of words to index
+        doc = strtok(NULL, "|");
+        change_document(index, doc_id)->nr_words = strtol(doc, &tmp, 10);
+
+        free(line);
+    }
+
+    fclose(fb_file);
+
+    // create alphabetically ordered list of the documents
+    document_name_p sorted = (document_name_p) malloc(sizeof(document_name_t) * (index->nr_doc_ids + 1));
+    int i;
+    for (i = 0; i < index->nr_doc_ids; i++) {
+        sorted[i].name = get_document(index, i)->name;
+        sorted[i].doc_id = i;
+    }
+
+    qsort(sorted, index->nr_doc_ids, sizeof(document_name_t), cmp_document_name);
+
+    for (i = 0; i < index->nr_doc_ids; i++) {
+        index->by_name[i] = sorted[i].doc_id;
+    }
+
+    index->nr_docs = index->nr_doc_ids;
+    free(sorted);
+
+    // STEP 2: populate list of all words
+    FILE * index_file = fopen("index", "r");
+    if (!index_file) {
+        printf("Error: index file not found.\nIndex not loaded!\n");
+        return 0;
+    }
+
+    char *stem, *docs, *doc;
+    while ((line = read_line(index_file))) {
+        size += strlen(line) + 1;
+
+        // get the stem
+        stem = strtok(line, ":");
+
+        // ignore empty lines
+        if (!stem) {
+            continue;
+        }
+
+        // skip number of documents for this word
+        strtok(NULL, ":");
+
+        // create struct for stem
+        int wid = find_or_add_word(index, stem);
+        indexed_word_p w = &index->words[wid];
+
+        // get list of documents containing this stem
+        docs = strtok(NULL, ":");
+
+        // read each document
+        doc = strtok(docs, "|");
+
+        while(doc != NULL) {
+            int id;
+            double count;
+            sscanf(doc, "%i/%lf", &id, &count);
+
+            if (strchr(doc, '.')) {
+                // older files hold the TF (rounded to 6 decimals) instead of the number of occurances
+                count *= get_document(index, id)->nr_words;
+            }
+
+            add_posting(w, id, (int) (count + 0.5));
+
+            // get next document
+            doc = strtok(NULL, "|");
+        }
+
+        free(line);
+    }
+
+    fclose(index_file);
+    count_stat(STAT_BYTES_READ, size);
+
+	return 1;
+}
+
+/*
+ * Frees the memory occupied by a index struct
+ */
+void close_index(index_p index) {
+    wait_for_merge(index);
+    clear_index(index);
+    free(index);
+}
+
+/*
+ * Releases everything the index holds, except the index struct itself
+ */
+void clear_index(index_p index) {
+    // no search may use a snapshot anymore
+    close_snapshots(index);
+
+    int i;
+    for (i = 0; i < index->nr_doc_ids; i++) {
+        indexed_document_p doc = get_document(index, i);
+        if (!is_mapped(index, doc->name)) {
+            free(doc->name);
+        }
+    }
+
+    for (i = 0; i < index->max_doc_ids / DOCUMENT_PAGE_SIZE; i++) {
+        free(index->documents[i]);
+    }
+    free(index->documents);
+    free(index->document_stamps);
+    free(index->by_name);
+
+    for (i = 0; i < index->nr_segments; i++) {
+        free_removed_df(&index->segments[i]);
+        clear_index(&index->segments[i].words);
+    }
+    free(index->segments);
+    free(index->removed);
+
+    clear_words(index);
+    clear_norms(index);
+    free_stem_cache(index->stem_cache);
+    index->stem_cache = NULL;
+    free_stopwords(index->stopwords);
+    index->stopwords = NULL;
+    close_journal(index);
+    unmap_index_file(index);
+}
+
+/*
+ * Initializes an empty vocabulary
+ */
+void init_words(index_p index) {
+    index->words = NULL;
+    index->max_words = 0;
+    index->nr_words = 0;
+    index->stems = NULL;
+
+    index->nr_slots = INITIAL_NR_SLOTS;
+    index->slots = (word_slot_p) calloc(index->nr_slots, sizeof(word_slot_t));
+}
+
+/*
+ * Releases all indexed words including their document lists
+ */
+void clear_words(index_p index) {
+    int i;
+    for (i = 0; i < index->nr_words; i++) {
+        free_postings(&index->words[i]);
+    }
+
+    stem_block_p b;
+    while ((b = index->stems)) {
+        index->stems = b->next;
+        free(b);
+    }
+
+    free(index->words);
+    free(index->slots);
+
+    index->words = NULL;
+    index->slots = NULL;
+    index->max_words = 0;
+    index->nr_words = 0;
+    index->nr_slots = 0;
+}
+
+/*
+ * Returns the number of bytes occupied by the vocabulary and the document lists it owns
+ */
+long words_memory(index_p index) {
+    long size = sizeof(indexed_word_t) * (long) index->max_words + sizeof(word_slot_t) * (long) index->nr_slots;
+
+    int i;
+    for (i = 0; i < index->nr_words; i++) {
+        indexed_word_p w = &index->words[i];
+        size += sizeof(posting_block_t) * (long) w->max_blocks + sizeof(unsigned int) * (long) w->max_data + sizeof(doc_t) * (long) w->max_tail;
+        size += sizeof(int) * (long) w->max_blocks + w->max_positions;
+    }
+
+    stem_block_p b;
+    for (b = index->stems; b; b = b->next) {
+        size += sizeof(stem_block_t) + b->size;
+    }
+
+    return size;
+}
+
+/*
+ * Looks up a stem in the vocabulary, returns index of the word or -1
+ */
+int find_word(index_p index, char *stem) {
+    int s = find_slot(index, stem, hash_stem(stem));
+    return index->slots[s].word - 1;
+}
+
+/*
+ * Looks up a stem in the vocabulary and adds it if it's not indexed yet, returns index of the word
+ */
+int find_or_add_word(index_p index, char *stem) {
+    // keep the hash table at most half full
+    if ((index->nr_words + 1) * 2 > index->nr_slots) {
+        grow_slots(index);
+    }
+
+    unsigned int hash = hash_stem(stem);
+    int s = find_slot(index, stem, hash);
+
+    if (index->slots[s].word) {
+        // stem is already indexed
+        return index->slots[s].word - 1;
+    }
+
+    // stem is not indexed yet, append it to the list of words
+    if (index->nr_words == index->max_words) {
+        index->max_words = index->max_words ? index->max_words * 2 : INITIAL_NR_SLOTS / 2;
+        index->words = (indexed_word_p) realloc(index->words, sizeof(indexed_word_t) * index->max_words);
+    }
+
+    indexed_word_p w = &index->words[index->nr_words];
+    memset(w, 0, sizeof(indexed_word_t));
+    w->stem = store_stem(index, stem);
+    w->stamp = index->nr_snapshots;
+
+    index->slots[s].hash = hash;
+    index->slots[s].word = ++index->nr_words;
+
+    return index->nr_words - 1;
+}
+
+/*
+ * Removes a word from the vocabulary; the last word in the list takes over its index
+ */
+void remove_word(index_p index, int word) {
+    int mask = index->nr_slots - 1;
+
+    // find slot of the word
+    int i = hash_stem(index->words[word].stem) & mask;
+    while (index->slots[i].word != word + 1) {
+        i = (i + 1) & mask;
+    }
+
+    // close the gap: move back following entries which would be unreachable otherwise
+    int j = i;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (!index->slots[j].word) {
+            break;
+        }
+
+        // home slot of the entry, entry stays where it is if its home lies cyclically in (i, j]
+        int k = index->slots[j].hash & mask;
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) {
+            continue;
+        }
+
+        index->slots[i] = index->slots[j];
+        i = j;
+    }
+    index->slots[i].word = 0;
+
+    // snapshots may still read a document list made before they were published
+    if (index->words[word].stamp == index->nr_snapshots) {
+        free_postings(&index->words[word]);
+    } else {
+        retire_postings(index, &index->words[word]);
+    }
+
+    // move last word into the gap in the list of words
+    int last = index->nr_words - 1;
+    if (word != last) {
+        index->words[word] = index->words[last];
+
+        i = hash_stem(index->words[word].stem) & mask;
+        while (index->slots[i].word != last + 1) {
+            i = (i + 1) & mask;
+        }
+        index->slots[i].word = word + 1;
+    }
+
+    index->nr_words--;
+}
+
+/*
+ * Returns a list of pointers to all indexed words, alphabetically ordered
+ * the list has to be freed by the caller and is invalidated by adding words to the index
+ */
+indexed_word_p *sort_words(index_p index) {
+    indexed_word_p *sorted = (indexed_word_p *) malloc(sizeof(indexed_word_p) * (index->nr_words + 1));
+
+    int i;
+    for (i = 0; i < index->nr_words; i++) {
+        sorted[i] = &index->words[i];
+    }
+
+    qsort(sorted, index->nr_words, sizeof(indexed_word_p), cmp_word_stem);
+    return sorted;
+}
+
+/*
+ * Compares two pointers to indexed words based on their stems
+ */
+int cmp_word_stem(const void *a, const void *b) {
+    return strcmp((*(indexed_word_p *) a)->stem, (*(indexed_word_p *) b)->stem);
+}
+
+/*
+ * Computes FNV-1a hash of a stem
+ */
+unsigned int hash_stem(char *stem) {
+    unsigned int hash = 2166136261u;
+    while (*stem) {
+        hash ^= (unsigned char) *stem++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/*
+ * Finds the slot of a stem in the hash table, or the empty slot where it would be inserted
+ */
+int find_slot(index_p index, char *stem, unsigned int hash) {
+    int mask = index->nr_slots - 1;
+    int s = hash & mask;
+
+    // linear probing
+    while (index->slots[s].word) {
+        if (index->slots[s].hash == hash && !strcmp(index->words[index->slots[s].word - 1].stem, stem)) {
+            break;
+        }
+
+        s = (s + 1) & mask;
+    }
+
+    return s;
+}
+
+/*
+ * Doubles the size of the hash table
+ */
+void grow_slots(index_p index) {
+    word_slot_p old = index->slots;
+    int nr_old = index->nr_slots;
+
+    index->nr_slots *= 2;
+    index->slots = (word_slot_p) calloc(index->nr_slots, sizeof(word_slot_t));
+
+    // reinsert all words, stems are unique so there is no need to compare them
+    int mask = index->nr_slots - 1;
+    int i;
+    for (i = 0; i < nr_old; i++) {
+        if (old[i].word) {
+            int s = old[i].hash & mask;
+            while (index->slots[s].word) {
+                s = (s + 1) & mask;
+            }
+
+            index->slots[s] = old[i];
+        }
+    }
+
+    free(old);
+}
+
+/*
+ * Copies a stem into the stem blocks of the index
+ */
+char *store_stem(index_p index, char *stem) {
+    int len = strlen(stem) + 1;
+
+    stem_block_p b = index->stems;
+    if (!b || b->size - b->used < len) {
+        // current block full => start a new one
+        int size = len > STEM_BLOCK_SIZE ? len : STEM_BLOCK_SIZE;
+        b = (stem_block_p) malloc(sizeof(stem_block_t) + size);
+        b->next = index->stems;
+        b->size = size;
+        b->used = 0;
+        index->stems = b;
+    }
+
+    char *s = b->stems + b->used;
+    memcpy(s, stem, len);
+    b->used += len;
+
+    return s;
+}
+
+/*
+ * Document lists are stored as blocks of POSTING_BLOCK_SIZE documents. A block holds the gaps between the ids
+ * (minus 1, starting at the last id of the previous block) and the counts (minus 1), each bit packed with the
+ * smallest number of bits that fits all values of the block, in 32 bit words. A full block of b bit values
+ * takes exactly 4 * b words. All blocks except the last one are full; documents appended to the list are
+ * collected in an unpacked tail until a block is complete.
+ *
+ * Each document of a list has an entry in the position lists of the word, in the same order: the number of
+ * bytes of its positions followed by the positions (numbers of the words in the document, counting stopwords)
+ * as gaps, all in 7 bit groups. An empty entry means the positions weren't recorded. The offset of the entry
+ * of the first document of each block is kept with the block, so a cursor only skips entries of its block.
+ */
+
+void pack_block(indexed_word_p w, doc_p docs, int nr_docs);
+int unpack_block(indexed_word_p w, int block, doc_p docs);
+void pack_bits(unsigned int *data, unsigned int *values, int nr_values, int bits);
+void unpack_bits(unsigned int *data, unsigned int *values, int nr_values, int bits);
+int bits_needed(unsigned int max);
+int packed_size(int nr_values, int bits);
+void load_block(posting_cursor_p c, int block);
+void reserve_positions(indexed_word_p w, int size);
+int number_size(unsigned int n);
+
+/*
+ * Adds occurances of a word in a document to its document list, returns 1 if the document is new in the list
+ * the document mustn't have a lower id than any document in the list
+ */
+int add_posting(indexed_word_p w, int doc_id, int count) {
+    if (w->nr_tail && w->tail[w->nr_tail - 1].id == doc_id) {
+        // document is already indexed for this word
+        w->tail[w->nr_tail - 1].count += count;
+        return 0;
+    }
+
+    own_postings(w);
+
+    if (!w->nr_tail && w->nr_blocks && w->blocks[w->nr_blocks - 1].nr_docs < POSTING_BLOCK_SIZE) {
+        // last block isn't full (list from the index file) => continue it in the tail
+        w->max_tail = POSTING_BLOCK_SIZE;
+        w->tail = (doc_p) realloc(w->tail, sizeof(doc_t) * w->max_tail);
+        w->nr_tail = unpack_block(w, w->nr_blocks - 1, w->tail);
+
+        w->nr_blocks--;
+        w->data_size = w->blocks[w->nr_blocks].offset;
+        w->tail_positions = w->block_positions[w->nr_blocks];
+    }
+
+    if (w->nr_tail == POSTING_BLOCK_SIZE) {
+        // tail complete => pack it
+        pack_block(w, w->tail, w->nr_tail);
+        w->nr_tail = 0;
+    }
+
+    // tail full => double the size
+    if (w->nr_tail == w->max_tail) {
+        w->max_tail = w->max_tail ? w->max_tail * 2 : 4;
+        w->tail = (doc_p) realloc(w->tail, sizeof(doc_t) * w->max_tail);
+    }
+
+    w->tail[w->nr_tail].id = doc_id;
+    w->tail[w->nr_tail].count = count;
+    w->nr_tail++;
+    w->nr_docs++;
+
+    // no positions recorded for the document yet
+    reserve_positions(w, 1);
+    w->positions[w->positions_size++] = 0;
+
+    return 1;
+}
+
+/*
+ * Records the positions of a word in the last document of its list (which has none recorded yet)
+ *  positions: numbers of the words in the document where the word occurs, ascending
+ */
+void set_positions(indexed_word_p w, int *positions, int nr_positions) {
+    if (!nr_positions) {
+        return;
+    }
+
+    int i, size = 0;
+    for (i = 0; i < nr_positions; i++) {
+        size += number_size(i ? positions[i] - positions[i - 1] : positions[0]);
+    }
+
+    // the empty entry of the document is replaced
+    w->positions_size--;
+    reserve_positions(w, number_size(size) + size);
+
+    unsigned char *p = w->positions + w->positions_size;
+    p += encode_number(p, size);
+    for (i = 0; i < nr_positions; i++) {
+        p += encode_number(p, i ? positions[i] - positions[i - 1] : positions[0]);
+    }
+    w->positions_size = p - w->positions;
+}
+
+/*
+ * Gives the last document in the list of a word (which has no positions recorded yet) an encoded position list,
+ * as returned by cursor_position_list
+ */
+void set_position_list(indexed_word_p w, unsigned char *list, int size) {
+    if (!size) {
+        return;
+    }
+
+    w->positions_size--;
+    reserve_positions(w, number_size(size) + size);
+
+    w->positions_size += encode_number(w->positions + w->positions_size, size);
+    memcpy(w->positions + w->positions_size, list, size);
+    w->positions_size += size;
+}
+
+/*
+ * Returns the encoded position list of the last document in the list of a word (as cursor_position_list)
+ * the document has to be in the tail
+ */
+unsigned char *last_position_list(indexed_word_p w, int *size) {
+    *size = 0;
+    if (!w->positions || !w->nr_tail) {
+        return NULL;
+    }
+
+    unsigned char *p = w->positions + w->tail_positions;
+    int i;
+    for (i = 0; i < w->nr_tail - 1; i++) {
+        int n = decode_number(&p);
+        p += n;
+    }
+
+    *size = decode_number(&p);
+    return p;
+}
+
+/*
+ * Appends the document list of another word to the document list of a word,
+ * all documents in the other list have higher ids than the documents in the list of the word
+ */
+void append_postings(indexed_word_p w, indexed_word_p other) {
+    posting_cursor_t c;
+    open_cursor(&c, other);
+
+    while (cursor_doc(&c) != INT_MAX) {
+        int size;
+        unsigned char *list = cursor_position_list(&c, &size);
+
+        add_posting(w, cursor_doc(&c), cursor_count(&c));
+        set_position_list(w, list, size);
+        cursor_next(&c);
+    }
+}
+
+/*
+ * Removes a document from the document list of a word, returns 1 if the list contained the document
+ */
+int remove_posting(indexed_word_p w, int doc_id) {
+    posting_cursor_t c;
+    open_cursor(&c, w);
+    if (cursor_seek(&c, doc_id) != doc_id) {
+        return 0;
+    }
+
+    // blocks before the one containing the document stay as they are, the rest of the list is added again
+    int block = c.block, nr_docs = 0;
+    doc_p docs = (doc_p) malloc(sizeof(doc_t) * (w->nr_docs + 1));
+
+    // position lists of the documents added again, one after another
+    int *list_sizes = (int *) malloc(sizeof(int) * (w->nr_docs + 1));
+    unsigned char *lists = (unsigned char *) malloc(w->positions_size + 1);
+    int lists_size = 0;
+
+    open_cursor(&c, w);
+    load_block(&c, block);
+    while (cursor_doc(&c) != INT_MAX) {
+        if (cursor_doc(&c) != doc_id) {
+            docs[nr_docs].id = cursor_doc(&c);
+            docs[nr_docs].count = cursor_count(&c);
+
+            unsigned char *list = cursor_position_list(&c, &list_sizes[nr_docs]);
+            if (list) {
+                memcpy(lists + lists_size, list, list_sizes[nr_docs]);
+                lists_size += list_sizes[nr_docs];
+            }
+            nr_docs++;
+        }
+        cursor_next(&c);
+    }
+
+    // all blocks but the last one are full
+    own_postings(w);
+    if (block < w->nr_blocks) {
+        w->nr_blocks = block;
+        w->data_size = w->blocks[block].offset;
+        w->tail_positions = w->block_positions[block];
+    }
+    w->nr_docs = w->nr_blocks * POSTING_BLOCK_SIZE;
+    w->nr_tail = 0;
+    w->positions_size = w->tail_positions;
+
+    int i;
+    lists_size = 0;
+    for (i = 0; i < nr_docs; i++) {
+        add_posting(w, docs[i].id, docs[i].count);
+        set_position_list(w, lists + lists_size, list_sizes[i]);
+        lists_size += list_sizes[i];
+    }
+
+    free(docs);
+    free(list_sizes);
+    free(lists);
+    return 1;
+}
+
+/*
+ * Packs the tail of a document list (as the last block), so the list consists of packed blocks only
+ */
+void seal_postings(indexed_word_p w) {
+    if (w->nr_tail) {
+        pack_block(w, w->tail, w->nr_tail);
+        w->nr_tail = 0;
+    }
+}
+
+/*
+ * Releases the document list of a word
+ */
+void free_postings(indexed_word_p w) {
+    // packed blocks in the mapped index file are not owned by the word
+    if (w->max_blocks) {
+        free(w->blocks);
+        free(w->data);
+        free(w->block_positions);
+    }
+
+    if (w->max_positions) {
+        free(w->positions);
+    }
+
+    free(w->tail);
+}
+
+/*
+ * Copies the packed blocks and the position lists of a word to the heap if they are still in the mapped index file,
+ * so they can be modified; a list without positions gets an empty entry for each document
+ */
+void own_postings(indexed_word_p w) {
+    if (!w->max_blocks && w->nr_blocks) {
+        posting_block_p blocks = (posting_block_p) malloc(sizeof(posting_block_t) * w->nr_blocks);
+        memcpy(blocks, w->blocks, sizeof(posting_block_t) * w->nr_blocks);
+
+        unsigned int *data = (unsigned int *) malloc(sizeof(unsigned int) * (w->data_size + 1));
+        memcpy(data, w->data, sizeof(unsigned int) * w->data_size);
+
+        // the empty entries take a byte per document, all blocks but the last one are full
+        int *block_positions = (int *) malloc(sizeof(int) * w->nr_blocks);
+        int b;
+        for (b = 0; b < w->nr_blocks; b++) {
+            block_positions[b] = w->positions ? w->block_positions[b] : b * POSTING_BLOCK_SIZE;
+        }
+
+        w->blocks = blocks;
+        w->max_blocks = w->nr_blocks;
+        w->data = data;
+        w->max_data = w->data_size + 1;
+        w->block_positions = block_positions;
+    }
+
+    if (!w->max_positions) {
+        unsigned char *positions = (unsigned char *) malloc(w->positions ? w->positions_size + 1 : w->nr_docs + 1);
+        if (w->positions) {
+            memcpy(positions, w->positions, w->positions_size);
+        } else {
+            memset(positions, 0, w->nr_docs);
+            w->positions_size = w->nr_docs;
+            w->tail_positions = w->nr_docs - w->nr_tail;
+        }
+
+        w->positions = positions;
+        w->max_positions = w->positions_size + 1;
+    }
+}
+
+/*
+ * Gives a word a copy of the document list of another word (in the heap, even if the other list is mapped)
+ */
+void copy_postings(indexed_word_p w, indexed_word_p other) {
+    w->nr_docs = other->nr_docs;
+    w->nr_blocks = 0;
+    w->max_blocks = 0;
+    w->data_size = 0;
+    w->max_data = 0;
+    w->blocks = NULL;
+    w->data = NULL;
+    w->block_positions = NULL;
+
+    if (other->nr_blocks) {
+        // the blocks are owned by the word as soon as there are any (max_blocks > 0)
+        w->blocks = other->blocks;
+        w->data = other->data;
+        w->block_positions = other->block_positions;
+        w->nr_blocks = other->nr_blocks;
+        w->data_size = other->data_size;
+    }
+
+    w->nr_tail = other->nr_tail;
+    w->max_tail = other->nr_tail;
+    w->tail = (doc_p) malloc(sizeof(doc_t) * (w->nr_tail + 1));
+    memcpy(w->tail, other->tail, sizeof(doc_t) * w->nr_tail);
+
+    // the position lists are copied with the blocks
+    w->positions = other->positions;
+    w->positions_size = other->positions_size;
+    w->max_positions = 0;
+    w->tail_positions = other->tail_positions;
+    own_postings(w);
+}
+
+/*
+ * Positions a cursor at the first document in the document list of a word
+ */
+void open_cursor(posting_cursor_p c, indexed_word_p w) {
+    c->word = w;
+    load_block(c, 0);
+}
+
+/*
+ * Returns the id of the document at the cursor, INT_MAX if the end of the list is reached
+ */
+int cursor_doc(posting_cursor_p c) {
+    return c->pos < c->nr_docs ? c->docs[c->pos].id : INT_MAX;
+}
+
+/*
+ * Returns the number of occurances of the word in the document at the cursor
+ */
+int cursor_count(posting_cursor_p c) {
+    return c->docs[c->pos].count;
+}
+
+/*
+ * Returns the encoded position list of the document at the cursor (NULL and size 0 = no positions recorded),
+ * valid until the document list changes
+ *  size: returns the number of bytes of the list
+ */
+unsigned char *cursor_position_list(posting_cursor_p c, int *size) {
+    indexed_word_p w = c->word;
+    *size = 0;
+    if (!w->positions) {
+        return NULL;
+    }
+
+    // the entries of the block are skipped up to the document, from the one looked up last on
+    if (c->list_doc < 0 || c->list_doc > c->pos) {
+        c->list_doc = 0;
+        c->list_offset = c->block < w->nr_blocks ? w->block_positions[c->block] : w->tail_positions;
+    }
+
+    unsigned char *p = w->positions + c->list_offset;
+    while (c->list_doc < c->pos) {
+        int n = decode_number(&p);
+        p += n;
+        c->list_doc++;
+    }
+    c->list_offset = p - w->positions;
+
+    *size = decode_number(&p);
+    return *size ? p : NULL;
+}
+
+/*
+ * Decodes the positions of the word in the document at the cursor, returns their number (0 = not recorded)
+ *  positions: room for cursor_count positions
+ */
+int cursor_positions(posting_cursor_p c, int *positions) {
+    int size;
+    unsigned char *p = cursor_position_list(c, &size);
+    if (!size) {
+        return 0;
+    }
+
+    unsigned char *end = p + size;
+    int n = 0, pos = 0, count = cursor_count(c);
+    while (p < end && n < count) {
+        pos += decode_number(&p);
+        positions[n++] = pos;
+    }
+
+    return n;
+}
+
+/*
+ * Moves a cursor to the next document
+ */
+void cursor_next(posting_cursor_p c) {
+    c->pos++;
+
+    if (c->pos == c->nr_docs && c->block < c->word->nr_blocks) {
+        load_block(c, c->block + 1);
+    }
+}
+
+/*
+ * Returns the document of a cursor (INT_MAX = end of the list) and moves the cursor to the next document
+ *  count: returns the number of occurances of the word in the document
+ *  list: returns the encoded position list of the document (as cursor_position_list)
+ *  size: returns the number of bytes of the position list
+ */
+int cursor_read(posting_cursor_p c, int *count, unsigned char **list, int *size) {
+    int doc = cursor_doc(c);
+    if (doc != INT_MAX) {
+        *count = cursor_count(c);
+        *list = cursor_position_list(c, size);
+        cursor_next(c);
+    }
+
+    return doc;
+}
+
+/*
+ * Moves a cursor forward to the first document with an id >= doc_id, returns the id of that document
+ */
+int cursor_seek(posting_cursor_p c, int doc_id) {
+    if (cursor_doc(c) >= doc_id) {
+        return cursor_doc(c);
+    }
+
+    indexed_word_p w = c->word;
+    if (c->docs[c->nr_docs - 1].id < doc_id) {
+        if (c->block == w->nr_blocks) {
+            // end of the tail
+            c->pos = c->nr_docs;
+            return INT_MAX;
+        }
+
+        // document is beyond the current block: find the first following block which reaches it in the skip list
+        int min = c->block + 1, max = w->nr_blocks;
+        while (min < max) {
+            int middle = (min + max) / 2;
+            if (w->blocks[middle].last_id < doc_id) {
+                min = middle + 1;
+            } else {
+                max = middle;
+            }
+        }
+
+        // no block left => tail
+        load_block(c, min);
+        if (!c->nr_docs || c->docs[c->nr_docs - 1].id < doc_id) {
+            c->pos = c->nr_docs;
+            return INT_MAX;
+        }
+    }
+
+    // binary search the block
+    int min = c->pos, max = c->nr_docs - 1;
+    while (min < max) {
+        int middle = (min + max) / 2;
+        if (c->docs[middle].id < doc_id) {
+            min = middle + 1;
+        } else {
+            max = middle;
+        }
+    }
+
+    c->pos = min;
+    return cursor_doc(c);
+}
+
+/*
+ * Decodes a block of a document list into the cursor (block nr_blocks is the tail)
+ */
+void load_block(posting_cursor_p c, int block) {
+    indexed_word_p w = c->word;
+
+    c->block = block;
+    c->pos = 0;
+    c->list_doc = -1;
+
+    if (block < w->nr_blocks) {
+        c->nr_docs = unpack_block(w, block, c->docs);
+    } else {
+        c->nr_docs = w->nr_tail;
+        if (w->nr_tail) {
+            memcpy(c->docs, w->tail, sizeof(doc_t) * w->nr_tail);
+        }
+    }
+}
+
+/*
+ * Packs a list of documents into a new block at the end of the document list of a word
+ */
+void pack_block(indexed_word_p w, doc_p docs, int nr_docs) {
+    own_postings(w);
+
+    // block list full => double the size
+    if (w->nr_blocks == w->max_blocks) {
+        w->max_blocks = w->max_blocks ? w->max_blocks * 2 : 4;
+        w->blocks = (posting_block_p) realloc(w->blocks, sizeof(posting_block_t) * w->max_blocks);
+        w->block_positions = (int *) realloc(w->block_positions, sizeof(int) * w->max_blocks);
+    }
+
+    // the documents packed are the ones of the tail
+    w->block_positions[w->nr_blocks] = w->tail_positions;
+    w->tail_positions = w->positions_size;
+
+    unsigned int data[2 * POSTING_BLOCK_SIZE];
+    posting_block_p b = &w->blocks[w->nr_blocks];
+    int size = pack_documents(docs, nr_docs, w->nr_blocks ? w->blocks[w->nr_blocks - 1].last_id : -1, b, data);
+    b->offset = w->data_size;
+    w->nr_blocks++;
+
+    if (w->data_size + size > w->max_data) {
+        while (w->data_size + size > w->max_data) {
+            w->max_data = w->max_data ? w->max_data * 2 : 64;
+        }
+        w->data = (unsigned int *) realloc(w->data, sizeof(unsigned int) * w->max_data);
+    }
+
+    memcpy(&w->data[b->offset], data, sizeof(unsigned int) * size);
+    w->data_size += size;
+}
+
+/*
+ * Packs a list of documents into a block (all fields but the offset of its data),
+ * returns the number of 32 bit words of the data
+ *  prev: id of the last document of the previous block (-1 = first block)
+ *  data: returns the packed data, room for 2 * POSTING_BLOCK_SIZE words
+ */
+int pack_documents(doc_p docs, int nr_docs, int prev, posting_block_p b, unsigned int *data) {
+    unsigned int gaps[POSTING_BLOCK_SIZE], counts[POSTING_BLOCK_SIZE];
+    unsigned int max_gap = 0, max_count = 0;
+
+    int i;
+    for (i = 0; i < nr_docs; i++) {
+        gaps[i] = docs[i].id - prev - 1;
+        counts[i] = docs[i].count - 1;
+        prev = docs[i].id;
+
+        max_gap |= gaps[i];
+        max_count |= counts[i];
+    }
+
+    b->last_id = prev;
+    b->nr_docs = nr_docs;
+    b->id_bits = bits_needed(max_gap);
+    b->count_bits = bits_needed(max_count);
+    b->reserved = 0;
+
+    pack_bits(data, gaps, nr_docs, b->id_bits);
+    pack_bits(&data[packed_size(nr_docs, b->id_bits)], counts, nr_docs, b->count_bits);
+    return packed_size(nr_docs, b->id_bits) + packed_size(nr_docs, b->count_bits);
+}
+
+/*
+ * Decodes a packed block of a document list, returns the number of documents in the block
+ */
+int unpack_block(indexed_word_p w, int block, doc_p docs) {
+    posting_block_p b = &w->blocks[block];
+    unsigned int gaps[POSTING_BLOCK_SIZE], counts[POSTING_BLOCK_SIZE];
+
+    unpack_bits(&w->data[b->offset], gaps, b->nr_docs, b->id_bits);
+    unpack_bits(&w->data[b->offset + packed_size(b->nr_docs, b->id_bits)], counts, b->nr_docs, b->count_bits);
+
+    int i, prev = block ? w->blocks[block - 1].last_id : -1;
+    for (i = 0; i < b->nr_docs; i++) {
+        prev += gaps[i] + 1;
+        docs[i].id = prev;
+        docs[i].count = counts[i] + 1;
+    }
+
+    return b->nr_docs;
+}
+
+/*
+ * Packs values with the given number of bits each into consecutive 32 bit words
+ */
+void pack_bits(unsigned int *data, unsigned int *values, int nr_values, int bits) {
+    unsigned long long buffer = 0;
+    int i, buffered = 0;
+
+    for (i = 0; i < nr_values; i++) {
+        buffer |= (unsigned long long) values[i] << buffered;
+        buffered += bits;
+
+        if (buffered >= 32) {
+            *data++ = (unsigned int) buffer;
+            buffer >>= 32;
+            buffered -= 32;
+        }
+    }
+
+    if (buffered) {
+        *data = (unsigned int) buffer;
+    }
+}
+
+/*
+ * Unpacks values with the given number of bits each from consecutive 32 bit words
+ */
+void unpack_bits(unsigned int *data, unsigned int *values, int nr_values, int bits) {
+    unsigned long long mask = (1ULL << bits) - 1;
+    unsigned long long buffer = 0;
+    int i, buffered = 0;
+
+    for (i = 0; i < nr_values; i++) {
+        if (buffered < bits) {
+            buffer |= (unsigned long long) *data++ << buffered;
+            buffered += 32;
+        }
+
+        values[i] = (unsigned int) (buffer & mask);
+        buffer >>= bits;
+        buffered -= bits;
+    }
+}
+
+/*
+ * Returns the number of bits needed to store a value
+ */
+int bits_needed(unsigned int max) {
+    int bits = 0;
+    while (max) {
+        bits++;
+        max >>= 1;
+    }
+
+    return bits;
+}
+
+/*
+ * Returns the number of 32 bit words taken by packed values
+ */
+int packed_size(int nr_values, int bits) {
+    return (nr_values * bits + 31) / 32;
+}
+
+/*
+ * Makes room for size more bytes of position lists of a word
+ */
+void reserve_positions(indexed_word_p w, int size) {
+    own_postings(w);
+
+    if (w->positions_size + size > w->max_positions) {
+        while (w->positions_size + size > w->max_positions) {
+            w->max_positions = w->max_positions * 2;
+        }
+        w->positions = (unsigned char *) realloc(w->positions, w->max_positions);
+    }
+}
+
+/*
+ * Writes a number in groups of 7 bits, lowest first, the highest bit of each byte tells if more follow,
+ * returns the number of bytes written
+ */
+int encode_number(unsigned char *p, unsigned int n) {
+    int size = 1;
+    while (n >= 0x80) {
+        *p++ = (n & 0x7f) | 0x80;
+        n >>= 7;
+        size++;
+    }
+
+    *p = n;
+    return size;
+}
+
+/*
+ * Reads a number written by encode_number and moves the pointer behind it
+ */
+unsigned int decode_number(unsigned char **p) {
+    unsigned int n = 0;
+    int shift = 0;
+    unsigned char *q = *p;
+    while (*q & 0x80) {
+        n |= (unsigned int) (*q++ & 0x7f) << shift;
+        shift += 7;
+    }
+    n |= (unsigned int) *q++ << shift;
+
+    *p = q;
+    return n;
+}
+
+/*
+ * Returns the number of bytes encode_number takes for a number
+ */
+int number_size(unsigned int n) {
+    int size = 1;
+    while (n >= 0x80) {
+        n >>= 7;
+        size++;
+    }
+
+    return size;
+}
+
+/*
+ * Layout of the binary index file of a segment (all numbers in host byte order, sections aligned to 8 bytes):
+ *  header
+ *  document table      nr_doc_ids x file_document_t, entry i belongs to the document with id first_doc + i
+ *  name table          nr_docs x int, ids of the documents ordered by name
+ *  names               \0 terminated names of the documents
+ *  document lists      packed document lists of all words: posting_block_t list followed by the packed blocks,
+ *                      then (since version 5) the offsets of the position lists of the blocks (nr_blocks x int)
+ *                      followed by the position lists, unless no document of the word has positions recorded
+ *  vocabulary table    nr_words x file_word_t, alphabetically ordered
+ *  position table      nr_words x file_positions_t, in the order of the vocabulary table (since version 5)
+ *  slots               nr_slots x word_slot_t, hash table over the vocabulary table
+ *  stems               \0 terminated stems of the words
+ *  stopwords           \0 terminated stopwords the index was built with (since version 3)
+ *  document words      (nr_doc_ids + 1) x long, offset of the words of each document relative to the end of these offsets,
+ *                      followed by the words of each document: their numbers in the vocabulary table in ascending order,
+ *                      as gaps (encode_number), so removing a document needn't look for it in every list (since version 6)
+ *
+ * Up to version 3 a file held all documents with ids from 0 on, without removed documents in between.
+ */
+typedef struct index_header {
+    char magic[8];              // INDEX_MAGIC
+    int version;                // INDEX_VERSION
+    int byte_order;             // INDEX_BYTE_ORDER as written by the host
+    int nr_docs;                // number of documents (not counting removed ones)
+    int nr_words;               // number of words
+    int nr_slots;               // number of slots of the hash table (power of 2)
+    int generation;             // number of checkpoints the index has seen when the file was written
+    long size;                  // total size of the file in bytes
+    long docs;                  // offset of the document table
+    long by_name;               // offset of the name table
+    long names;                 // offset of the names
+    long postings;              // offset of the document lists
+    long words;                 // offset of the vocabulary table
+    long slots;                 // offset of the hash table
+    long stems;                 // offset of the stems
+    long stopwords;             // offset of the stopwords (version 3)
+    long stopwords_size;        // number of bytes of the stopwords (version 3)
+    int first_doc;              // id of the first document of the segment (version 4)
+    int nr_doc_ids;             // number of entries of the document table (version 4)
+    long positions;             // offset of the position table (version 5)
+    long doc_words;             // offset of the words of the documents (version 6)
+} index_header_t, *index_header_p;
+
+typedef struct file_document {
+    int name;                   // offset of the name relative to the names section (-1 = removed document)
+    int nr_words;               // number of words in the document
+} file_document_t, *file_document_p;
+
+typedef struct file_word {
+    int stem;                   // offset of the stem relative to the stems section
+    int nr_docs;                // number of documents containing this word
+    int nr_blocks;              // number of packed blocks of the document list
+    int data_size;              // number of 32 bit words of the packed blocks
+    long documents;             // offset of the document list relative to the document lists section
+} file_word_t, *file_word_p;
+
+typedef struct document_words {
+    unsigned char *list;        // numbers of the words of the document in the vocabulary table not spilled yet, as gaps
+    int size;                   // number of bytes of the list
+    int max_size;               // number of bytes the list has room for
+    int last;                   // number of the last word of the list + 1 (0 = none yet)
+    long total;                 // number of bytes of the whole list, including the parts spilled
+} document_words_t, *document_words_p;
+
+typedef struct document_words_buffer {
+    document_words_p docs;      // lists of the documents of the segment
+    int nr_docs;                // number of documents
+    long size;                  // number of bytes of the lists in memory
+    long max_size;              // number of bytes the lists may occupy before they are spilled
+    char *file;                 // name of the temporary file the lists are spilled to
+    FILE *f;                    // temporary file (NULL = nothing spilled yet)
+    long *runs;                 // offsets of the spills in the temporary file
+    int nr_runs;                // number of spills
+    int failed;                 // 1 if spilling failed
+} document_words_buffer_t, *document_words_buffer_p;
+
+typedef struct list_buffer {
+    unsigned char *bytes;       // bytes in memory
+    long size;                  // number of bytes in memory
+    long max_bytes;             // number of bytes bytes has room for
+    long max_size;              // number of bytes kept in memory before they are spilled
+    char *file;                 // name of the temporary file the bytes are spilled to
+    FILE *f;                    // temporary file (NULL = nothing spilled yet)
+    long spilled;               // number of bytes spilled
+    int failed;                 // 1 if spilling failed
+} list_buffer_t, *list_buffer_p;
+
+typedef struct list_writer {
+    doc_t docs[POSTING_BLOCK_SIZE];     // documents of the block being collected
+    int nr_block_docs;                  // number of documents collected
+    int nr_docs;                        // number of documents of the list
+    int nr_blocks;                      // number of blocks packed
+    int max_blocks;                     // number of blocks the block table has room for
+    posting_block_p blocks;             // block table
+    int *block_positions;               // per block: offset of the position list of its first document
+    int data_size;                      // number of 32 bit words of the packed blocks
+    list_buffer_t data;                 // packed blocks
+    list_buffer_t positions;            // position lists of the documents
+} list_writer_t, *list_writer_p;
+
+typedef struct file_positions {
+    long offset;                // offset of the block offsets relative to the document lists section (-1 = no positions)
+    int size;                   // number of bytes of the position lists following the block offsets
+    int reserved;
+} file_positions_t, *file_positions_p;
+
+long align_file(FILE *f);
+int check_index_file(index_header_p header, char *map, long size);
+int in_file(long offset, long count, long entry_size, long size);
+void add_document_word(document_words_buffer_p buffer, int doc, int word);
+void spill_document_words(document_words_buffer_p buffer);
+int write_document_words(document_words_buffer_p buffer, FILE *f);
+void add_list_posting(list_writer_p w, int doc_id, int count, unsigned char *list, int size);
+void pack_list_block(list_writer_p w);
+void write_list(list_writer_p w, FILE *f, file_word_p fw, file_positions_p fp, long postings);
+void add_list_bytes(list_buffer_p b, void *bytes, long size);
+void write_list_bytes(list_buffer_p b, FILE *f);
+void close_list_buffer(list_buffer_p b);
+
+/*
+ * Writes the documents with ids from first to last - 1 and their words to the binary index file of a segment
+ * the file is written under a temporary name and renamed afterwards, so a mapping of an old file stays valid
+ *  builder: the words are merged from the runs of the builder (NULL = the words of the index)
+ * returns 1 on success, 0 otherwise
+ */
+int write_index_file(index_p index, char *file, index_builder_p builder, int first, int last) {
+    double start = now_seconds();
+
+    char tmp_file[strlen(file) + 5];
+    sprintf(tmp_file, "%s.tmp", file);
+
+    FILE *f = fopen(tmp_file, "wb");
+    if (!f) {
+        printf("Error: couldn't open %s to write.\nUnable to write index to file\n", tmp_file);
+        return 0;
+    }
+
+    index_header_t header;
+    memset(&header, 0, sizeof(index_header_t));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.version = INDEX_VERSION;
+    header.byte_order = INDEX_BYTE_ORDER;
+    header.generation = index->generation;
+    header.first_doc = first;
+    header.nr_doc_ids = last - first;
+
+    // header is rewritten once all offsets are known
+    fwrite(&header, sizeof(index_header_t), 1, f);
+
+    // STEP 1: documents, removed ones keep their entries so the ids stay the same
+    header.docs = align_file(f);
+    int i, name = 0;
+    for (i = first; i < last; i++) {
+        file_document_t doc;
+        doc.name = get_document(index, i)->name ? name : -1;
+        doc.nr_words = get_document(index, i)->name ? get_document(index, i)->nr_words : 0;
+        fwrite(&doc, sizeof(file_document_t), 1, f);
+
+        if (get_document(index, i)->name) {
+            name += strlen(get_document(index, i)->name) + 1;
+        }
+    }
+
+    header.by_name = align_file(f);
+    for (i = 0; i < index->nr_docs; i++) {
+        int id = index->by_name[i];
+        if (id >= first && id < last && get_document(index, id)->name) {
+            fwrite(&id, sizeof(int), 1, f);
+            header.nr_docs++;
+        }
+    }
+
+    header.names = align_file(f);
+    for (i = first; i < last; i++) {
+        if (get_document(index, i)->name) {
+            fwrite(get_document(index, i)->name, strlen(get_document(index, i)->name) + 1, 1, f);
+        }
+    }
+
+    // STEP 2: document lists of the words, alphabetically ordered
+    // (the words of a builder are merged from its runs one after another, so only their stems are kept)
+    indexed_word_p *sorted = NULL;
+    if (builder) {
+        start_merge(builder);
+    } else {
+        sorted = sort_words(index);
+    }
+
+    int max_words = 1024;
+    file_word_p words = (file_word_p) malloc(sizeof(file_word_t) * max_words);
+    file_positions_p positions = (file_positions_p) malloc(sizeof(file_positions_t) * max_words);
+    long stems_size = 0, max_stems = 1 << 16;
+    char *stems = (char *) malloc(max_stems);
+
+    // per document the numbers of its words, they are visited in the order of the vocabulary table
+    // (spilled to a temporary file whenever they outgrow a quarter of the memory budget, or a short list per document)
+    char words_file[strlen(file) + 11];
+    sprintf(words_file, "%s.words.tmp", file);
+
+    document_words_buffer_t doc_words;
+    memset(&doc_words, 0, sizeof(document_words_buffer_t));
+    doc_words.docs = (document_words_p) calloc(last - first + 1, sizeof(document_words_t));
+    doc_words.nr_docs = last - first;
+    doc_words.max_size = index->memory_budget / 4;
+    if (doc_words.max_size < 64L * doc_words.nr_docs) {
+        doc_words.max_size = 64L * doc_words.nr_docs;
+    }
+    doc_words.file = words_file;
+
+    // the documents of a word are packed into blocks as they are read, the packed blocks and the position lists
+    // are kept in memory up to an eighth of the memory budget each, longer lists are spilled to temporary files
+    char data_file[strlen(file) + 10], positions_file[strlen(file) + 15];
+    sprintf(data_file, "%s.data.tmp", file);
+    sprintf(positions_file, "%s.positions.tmp", file);
+
+    list_writer_t list;
+    memset(&list, 0, sizeof(list_writer_t));
+    list.data.max_size = index->memory_budget / 8;
+    list.data.file = data_file;
+    list.positions.max_size = index->memory_budget / 8;
+    list.positions.file = positions_file;
+
+    header.postings = align_file(f);
+    char *stem;
+    posting_cursor_t c;
+    int next = 0;
+    while ((stem = builder ? next_merged_word(builder) : next < index->nr_words ? sorted[next]->stem : NULL)) {
+        if (!builder) {
+            open_cursor(&c, sorted[next++]);
+        }
+
+        // removed documents are left out
+        int doc_id, count, size;
+        unsigned char *position_list;
+        while ((doc_id = builder ? next_merged_posting(builder, &count, &position_list, &size)
+                : cursor_read(&c, &count, &position_list, &size)) != INT_MAX) {
+            if (get_document(index, doc_id)->name) {
+                add_list_posting(&list, doc_id, count, position_list, size);
+                add_document_word(&doc_words, doc_id - first, header.nr_words);
+            }
+        }
+
+        // words of removed documents only are left out
+        if (!list.nr_docs) {
+            continue;
+        }
+
+        // lists full => double the size
+        if (header.nr_words == max_words) {
+            max_words *= 2;
+            words = (file_word_p) realloc(words, sizeof(file_word_t) * max_words);
+            positions = (file_positions_p) realloc(positions, sizeof(file_positions_t) * max_words);
+        }
+
+        int len = strlen(stem);
+        while (stems_size + len + 1 > max_stems) {
+            max_stems *= 2;
+            stems = (char *) realloc(stems, max_stems);
+        }
+
+        file_word_p fw = &words[header.nr_words];
+        fw->stem = stems_size;
+        memcpy(stems + stems_size, stem, len + 1);
+        stems_size += len + 1;
+
+        write_list(&list, f, fw, &positions[header.nr_words], header.postings);
+        header.nr_words++;
+    }
+
+    int lists_written = !list.data.failed && !list.positions.failed;
+    free(list.blocks);
+    free(list.block_positions);
+    close_list_buffer(&list.data);
+    close_list_buffer(&list.positions);
+
+    // STEP 3: vocabulary
+    header.words = align_file(f);
+    fwrite(words, sizeof(file_word_t), header.nr_words, f);
+
+    header.positions = align_file(f);
+    fwrite(positions, sizeof(file_positions_t), header.nr_words, f);
+    free(positions);
+
+    // hash table for the alphabetically ordered words, at most half full
+    header.nr_slots = 1024;
+    while (header.nr_slots < 2 * header.nr_words) {
+        header.nr_slots *= 2;
+    }
+
+    word_slot_p slots = (word_slot_p) calloc(header.nr_slots, sizeof(word_slot_t));
+    for (i = 0; i < header.nr_words; i++) {
+        unsigned int hash = hash_stem(stems + words[i].stem);
+        int s = hash & (header.nr_slots - 1);
+        while (slots[s].word) {
+            s = (s + 1) & (header.nr_slots - 1);
+        }
+
+        slots[s].hash = hash;
+        slots[s].word = i + 1;
+    }
+
+    header.slots = align_file(f);
+    fwrite(slots, sizeof(word_slot_t), header.nr_slots, f);
+    free(slots);
+    free(words);
+
+    header.stems = align_file(f);
+    fwrite(stems, 1, stems_size, f);
+    free(stems);
+
+    // STEP 4: stopwords, so words are left out the same way after the stopwords file changed
+    header.stopwords = align_file(f);
+    if (index->stopwords) {
+        header.stopwords_size = index->stopwords->size;
+        fwrite(index->stopwords->words, index->stopwords->size, 1, f);
+    }
+
+    free(sorted);
+
+    // STEP 5: words of the documents
+    header.doc_words = align_file(f);
+    int words_written = write_document_words(&doc_words, f);
+
+    header.size = ftell(f);
+    rewind(f);
+    fwrite(&header, sizeof(index_header_t), 1, f);
+
+    // the manifest may list the file right after it is renamed
+    if (!lists_written || !words_written || fflush(f) || fsync(fileno(f)) || ferror(f)) {
+        printf("Error: couldn't write %s.\nUnable to write index to file\n", tmp_file);
+        fclose(f);
+        remove(tmp_file);
+        return 0;
+    }
+
+    fclose(f);
+    count_stat(STAT_BYTES_WRITTEN, header.size);
+    count_time(STAT_TIME_PERSIST, start);
+
+    return !rename(tmp_file, file);
+}
+
+/*
+ * Maps the binary index file of a segment into memory and sets up a vocabulary to use its words in place
+ * documents of the file the index doesn't know yet are added to it, known ones take over their names in the file
+ *  words: empty vocabulary for the words of the segment
+ * returns 1 on success, 0 if the file doesn't exist or is not a valid index file
+ */
+int map_index_file(index_p index, index_p words, char *file) {
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size < sizeof(index_header_t)) {
+        close(fd);
+        return 0;
+    }
+
+    char *map = (char *) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        return 0;
+    }
+
+    // check whether the file is an index file this version can read
+    index_header_p header = (index_header_p) map;
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) || header->version < INDEX_MIN_VERSION
+            || header->version > INDEX_VERSION
+            || header->byte_order != INDEX_BYTE_ORDER || header->size != st.st_size
+            || !check_index_file(header, map, st.st_size)) {
+        printf("Error: %s is not a valid index file.\n", file);
+        munmap(map, st.st_size);
+        return 0;
+    }
+
+    words->map = map;
+    words->map_size = st.st_size;
+    count_stat(STAT_BYTES_READ, st.st_size);
+    words->generation = header->generation;
+
+    // STEP 1: documents, names stay in the mapped file
+    int first = header->version >= 4 ? header->first_doc : 0;
+    int nr_doc_ids = header->version >= 4 ? header->nr_doc_ids : header->nr_docs;
+    int known = index->nr_doc_ids;
+    reserve_documents(index, first + nr_doc_ids);
+
+    // documents between the ones known and the segment were removed before it was written
+    for (; index->nr_doc_ids < first; index->nr_doc_ids++) {
+        indexed_document_p doc = change_document(index, index->nr_doc_ids);
+        doc->name = NULL;
+        doc->nr_words = 0;
+    }
+
+    file_document_p docs = (file_document_p) (map + header->docs);
+    int i;
+    for (i = 0; i < nr_doc_ids; i++) {
+        indexed_document_p doc = change_document(index, first + i);
+        char *name = docs[i].name >= 0 ? map + header->names + docs[i].name : NULL;
+
+        if (first + i >= known) {
+            doc->name = name;
+            doc->nr_words = docs[i].nr_words;
+        } else if (doc->name && name) {
+            if (!is_mapped(index, doc->name)) {
+                retire_memory(index, doc->name);
+            }
+            doc->name = name;
+        }
+    }
+
+    if (first + nr_doc_ids > index->nr_doc_ids) {
+        index->nr_doc_ids = first + nr_doc_ids;
+    }
+
+    // the new documents join the list of names
+    int *by_name = (int *) (map + header->by_name);
+    int *ids = (int *) malloc(sizeof(int) * (header->nr_docs + 1));
+    int nr_ids = 0;
+    for (i = 0; i < header->nr_docs; i++) {
+        if (by_name[i] >= known) {
+            ids[nr_ids++] = by_name[i];
+        }
+    }
+
+    merge_names(index, ids, nr_ids);
+    free(ids);
+
+    // STEP 2: vocabulary, stems and document lists stay in the mapped file
+    file_word_p file_words = (file_word_p) (map + header->words);
+    words->max_words = header->nr_words ? header->nr_words : 1;
+    words->words = (indexed_word_p) malloc(sizeof(indexed_word_t) * words->max_words);
+
+    for (i = 0; i < header->nr_words; i++) {
+        indexed_word_p w = &words->words[i];
+        memset(w, 0, sizeof(indexed_word_t));
+        w->stem = map + header->stems + file_words[i].stem;
+        w->nr_docs = file_words[i].nr_docs;
+        w->nr_blocks = file_words[i].nr_blocks;
+        w->data_size = file_words[i].data_size;
+        w->blocks = (posting_block_p) (map + header->postings + file_words[i].documents);
+        w->data = (unsigned int *) (w->blocks + w->nr_blocks);
+
+        // older files have no positions
+        file_positions_p fp = header->version >= 5 ? (file_positions_p) (map + header->positions) + i : NULL;
+        if (fp && fp->offset >= 0) {
+            w->block_positions = (int *) (map + header->postings + fp->offset);
+            w->positions = (unsigned char *) (w->block_positions + w->nr_blocks);
+            w->positions_size = fp->size;
+            w->tail_positions = fp->size;
+        }
+    }
+
+    words->nr_words = header->nr_words;
+
+    free(words->slots);
+    words->nr_slots = header->nr_slots;
+    words->slots = (word_slot_p) malloc(sizeof(word_slot_t) * header->nr_slots);
+    memcpy(words->slots, map + header->slots, sizeof(word_slot_t) * header->nr_slots);
+
+    // STEP 3: stopwords (older files don't have them, their index has to use the stopwords file)
+    if (header->version >= 3) {
+        words->stopwords = new_stopwords(map + header->stopwords, header->stopwords_size);
+    }
+
+    return 1;
+}
+
+/*
+ * Checks that the sections of a mapped index file and the entries of its tables lie within the file, so a truncated
+ * or corrupt file is rejected instead of being read beyond the mapping (the packed blocks themselves aren't checked,
+ * that would read the whole file), returns 1 if the file is usable, 0 otherwise
+ *  size: size of the file in bytes
+ */
+int check_index_file(index_header_p header, char *map, long size) {
+    int nr_doc_ids = header->version >= 4 ? header->nr_doc_ids : header->nr_docs;
+    int first = header->version >= 4 ? header->first_doc : 0;
+    if (first < 0 || nr_doc_ids < 0 || header->nr_docs > nr_doc_ids || (long) first + nr_doc_ids > INT_MAX
+            || header->nr_words < 0 || header->nr_slots <= 0 || (header->nr_slots & (header->nr_slots - 1))
+            || header->nr_slots <= header->nr_words) {
+        return 0;
+    }
+
+    // names and stems end with a \0 before the next section
+    long stems_end = header->version >= 3 ? header->stopwords : size;
+    if (!in_file(header->docs, nr_doc_ids, sizeof(file_document_t), size)
+            || !in_file(header->by_name, header->nr_docs, sizeof(int), size)
+            || !in_file(header->names, header->postings - header->names, 1, size)
+            || !in_file(header->postings, 0, 1, size)
+            || !in_file(header->words, header->nr_words, sizeof(file_word_t), size)
+            || (header->version >= 5 && !in_file(header->positions, header->nr_words, sizeof(file_positions_t), size))
+            || !in_file(header->slots, header->nr_slots, sizeof(word_slot_t), size)
+            || !in_file(header->stems, stems_end - header->stems, 1, size)
+            || (header->version >= 3 && (!in_file(header->stopwords, header->stopwords_size, 1, size)
+                || header->stopwords_size > INT_MAX))
+            || (header->version >= 6 && !in_file(header->doc_words, (long) nr_doc_ids + 1, sizeof(long), size))) {
+        return 0;
+    }
+
+    long names_size = header->postings - header->names;
+    long stems_size = stems_end - header->stems;
+    if ((names_size && map[header->postings - 1]) || (stems_size && map[stems_end - 1])) {
+        return 0;
+    }
+
+    file_document_p docs = (file_document_p) (map + header->docs);
+    int i;
+    for (i = 0; i < nr_doc_ids; i++) {
+        if (docs[i].name >= names_size || docs[i].name < -1) {
+            return 0;
+        }
+    }
+
+    int *by_name = (int *) (map + header->by_name);
+    for (i = 0; i < header->nr_docs; i++) {
+        if (by_name[i] < first || by_name[i] >= first + nr_doc_ids || docs[by_name[i] - first].name < 0) {
+            return 0;
+        }
+    }
+
+    // the document lists and position lists of the words
+    file_word_p words = (file_word_p) (map + header->words);
+    file_positions_p positions = header->version >= 5 ? (file_positions_p) (map + header->positions) : NULL;
+    for (i = 0; i < header->nr_words; i++) {
+        file_word_p w = &words[i];
+        if (w->stem < 0 || w->stem >= stems_size || w->nr_docs < 0 || w->nr_blocks < 0 || w->data_size < 0
+                || !in_file(header->postings + w->documents, w->nr_blocks, sizeof(posting_block_t), size)
+                || !in_file(header->postings + w->documents + (long) w->nr_blocks * sizeof(posting_block_t),
+                    w->data_size, sizeof(unsigned int), size)) {
+            return 0;
+        }
+
+        if (positions && positions[i].offset >= 0 && (positions[i].size < 0
+                || !in_file(header->postings + positions[i].offset, w->nr_blocks, sizeof(int), size)
+                || !in_file(header->postings + positions[i].offset + (long) w->nr_blocks * sizeof(int),
+                    positions[i].size, 1, size))) {
+            return 0;
+        }
+    }
+
+    word_slot_p slots = (word_slot_p) (map + header->slots);
+    for (i = 0; i < header->nr_slots; i++) {
+        if (slots[i].word < 0 || slots[i].word > header->nr_words) {
+            return 0;
+        }
+    }
+
+    // the words of the documents, the last number of the last list ends the section
+    if (header->version >= 6) {
+        long *offsets = (long *) (map + header->doc_words);
+        long lists = header->doc_words + sizeof(long) * ((long) nr_doc_ids + 1);
+        for (i = 0; i < nr_doc_ids; i++) {
+            if (offsets[i] < 0 || offsets[i] > offsets[i + 1]) {
+                return 0;
+            }
+        }
+
+        if (offsets[0] < 0 || !in_file(lists, offsets[nr_doc_ids], 1, size)
+                || (offsets[nr_doc_ids] && (unsigned char) map[lists + offsets[nr_doc_ids] - 1] >= 0x80)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Checks whether a section of count entries of entry_size bytes each at offset lies within a file of size bytes
+ */
+int in_file(long offset, long count, long entry_size, long size) {
+    return offset >= 0 && count >= 0 && offset <= size && count <= (size - offset) / entry_size;
+}
+
+/*
+ * Releases the mapping of the index file
+ */
+void unmap_index_file(index_p index) {
+    if (index->map) {
+        munmap(index->map, index->map_size);
+        index->map = NULL;
+        index->map_size = 0;
+    }
+}
+
+/*
+ * Checks whether a pointer points into a mapped segment file of the index (and must not be freed or modified)
+ */
+int is_mapped(index_p index, void *ptr) {
+    if (index->map && (char *) ptr >= index->map && (char *) ptr < index->map + index->map_size) {
+        return 1;
+    }
+
+    int s;
+    for (s = 0; s < index->nr_segments; s++) {
+        if (is_mapped(&index->segments[s].words, ptr)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Returns the numbers of the words of a document of a segment file in the vocabulary table, in ascending order,
+ * or -1 if the file doesn't record the words of its documents (written before version 6)
+ *  words: vocabulary of the segment (see map_index_file)
+ *  numbers: returns the numbers (to be freed by the caller)
+ */
+int read_document_words(index_p words, int doc_id, int **numbers) {
+    index_header_p header = (index_header_p) words->map;
+    if (header->version < 6) {
+        return -1;
+    }
+
+    long *offsets = (long *) (words->map + header->doc_words);
+    unsigned char *lists = (unsigned char *) (offsets + header->nr_doc_ids + 1);
+    unsigned char *p = lists + offsets[doc_id - header->first_doc];
+    unsigned char *end = lists + offsets[doc_id - header->first_doc + 1];
+
+    // each number takes a byte at least
+    *numbers = (int *) malloc(sizeof(int) * (end - p + 1));
+    int nr_numbers = 0, word = -1;
+    while (p < end) {
+        word += decode_number(&p);
+        if (word < 0 || word >= words->nr_words) {
+            // corrupt list, the caller looks for the document in the lists of the words instead
+            free(*numbers);
+            *numbers = NULL;
+            return -1;
+        }
+        (*numbers)[nr_numbers++] = word;
+    }
+
+    return nr_numbers;
+}
+
+/*
+ * Adds a word to the words of a document written to a segment file, spills the lists if they take too much memory
+ *  doc: index of the document in the lists
+ *  word: number of the word in the vocabulary table, higher than the ones added before
+ */
+void add_document_word(document_words_buffer_p buffer, int doc, int word) {
+    document_words_p d = &buffer->docs[doc];
+
+    // a number takes 5 bytes at most
+    if (d->size + 5 > d->max_size) {
+        int max_size = d->max_size ? d->max_size * 2 : 64;
+        d->list = (unsigned char *) realloc(d->list, max_size);
+        buffer->size += max_size - d->max_size;
+        d->max_size = max_size;
+    }
+
+    int size = encode_number(d->list + d->size, word + 1 - d->last);
+    d->size += size;
+    d->total += size;
+    d->last = word + 1;
+
+    if (buffer->size > buffer->max_size) {
+        spill_document_words(buffer);
+    }
+}
+
+/*
+ * Appends the lists in memory to the temporary file and releases them, the gaps go on from the last words spilled
+ * a spill holds per document the number of bytes of its list followed by the bytes
+ */
+void spill_document_words(document_words_buffer_p buffer) {
+    if (!buffer->f && !buffer->failed) {
+        buffer->f = fopen(buffer->file, "w+b");
+        if (!buffer->f) {
+            printf("Error: couldn't open %s to write.\n", buffer->file);
+            buffer->failed = 1;
+        }
+    }
+
+    if (buffer->f) {
+        buffer->runs = (long *) realloc(buffer->runs, sizeof(long) * (buffer->nr_runs + 1));
+        buffer->runs[buffer->nr_runs++] = ftell(buffer->f);
+    }
+
+    int i;
+    for (i = 0; i < buffer->nr_docs; i++) {
+        document_words_p d = &buffer->docs[i];
+        if (buffer->f) {
+            fwrite(&d->size, sizeof(int), 1, buffer->f);
+            if (d->size) {
+                fwrite(d->list, 1, d->size, buffer->f);
+            }
+        }
+
+        free(d->list);
+        d->list = NULL;
+        d->size = 0;
+        d->max_size = 0;
+    }
+
+    count_stat(STAT_BYTES_WRITTEN, buffer->f ? ftell(buffer->f) - buffer->runs[buffer->nr_runs - 1] : 0);
+    buffer->size = 0;
+}
+
+/*
+ * Writes the words of the documents section: the offsets of the lists, then per document the parts of its list
+ * spilled one after another and the part still in memory; releases the lists and removes the temporary file
+ * returns 1 on success, 0 if the spilled lists couldn't be read back
+ */
+int write_document_words(document_words_buffer_p buffer, FILE *f) {
+    long offset = 0;
+    int i, r;
+    for (i = 0; i <= buffer->nr_docs; i++) {
+        fwrite(&offset, sizeof(long), 1, f);
+        offset += i < buffer->nr_docs ? buffer->docs[i].total : 0;
+    }
+
+    // each spill is read on its own, the lists of a document are taken from all of them in turn
+    FILE **runs = (FILE **) calloc(buffer->nr_runs + 1, sizeof(FILE *));
+    if (buffer->f && !buffer->failed) {
+        if (fflush(buffer->f) || ferror(buffer->f)) {
+            buffer->failed = 1;
+        }
+
+        for (r = 0; r < buffer->nr_runs && !buffer->failed; r++) {
+            runs[r] = fopen(buffer->file, "rb");
+            if (!runs[r] || fseek(runs[r], buffer->runs[r], SEEK_SET)) {
+                buffer->failed = 1;
+            }
+        }
+    }
+
+    int max_copy = 0;
+    unsigned char *copy = NULL;
+    for (i = 0; i < buffer->nr_docs && !buffer->failed; i++) {
+        for (r = 0; r < buffer->nr_runs; r++) {
+            int size;
+            if (fread(&size, sizeof(int), 1, runs[r]) != 1 || size < 0) {
+                buffer->failed = 1;
+                break;
+            }
+
+            if (size > max_copy) {
+                max_copy = size;
+                copy = (unsigned char *) realloc(copy, max_copy);
+            }
+
+            if (size && (fread(copy, 1, size, runs[r]) != (size_t) size || fwrite(copy, 1, size, f) != (size_t) size)) {
+                buffer->failed = 1;
+                break;
+            }
+        }
+
+        if (buffer->docs[i].size) {
+            fwrite(buffer->docs[i].list, 1, buffer->docs[i].size, f);
+        }
+    }
+    free(copy);
+
+    for (r = 0; r < buffer->nr_runs; r++) {
+        if (runs[r]) {
+            fclose(runs[r]);
+        }
+    }
+    free(runs);
+
+    if (buffer->f) {
+        fclose(buffer->f);
+        remove(buffer->file);
+    }
+
+    for (i = 0; i < buffer->nr_docs; i++) {
+        free(buffer->docs[i].list);
+    }
+    free(buffer->docs);
+    free(buffer->runs);
+
+    if (buffer->failed) {
+        printf("Error: couldn't spill the words of the documents to %s.\n", buffer->file);
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Adds a document to the document list being written, the documents are added in the order of their ids
+ *  list: encoded position list of the document (as cursor_position_list)
+ *  size: number of bytes of the position list (0 = no positions recorded)
+ */
+void add_list_posting(list_writer_p w, int doc_id, int count, unsigned char *list, int size) {
+    if (!w->nr_block_docs) {
+        // block table full => double the size
+        if (w->nr_blocks == w->max_blocks) {
+            w->max_blocks = w->max_blocks ? w->max_blocks * 2 : 64;
+            w->blocks = (posting_block_p) realloc(w->blocks, sizeof(posting_block_t) * w->max_blocks);
+            w->block_positions = (int *) realloc(w->block_positions, sizeof(int) * w->max_blocks);
+        }
+
+        w->block_positions[w->nr_blocks] = w->positions.spilled + w->positions.size;
+    }
+
+    w->docs[w->nr_block_docs].id = doc_id;
+    w->docs[w->nr_block_docs].count = count;
+    w->nr_block_docs++;
+    w->nr_docs++;
+
+    // the number of bytes of the position list, followed by the list
+    unsigned char number[5];
+    add_list_bytes(&w->positions, number, encode_number(number, size));
+    if (size) {
+        add_list_bytes(&w->positions, list, size);
+    }
+
+    if (w->nr_block_docs == POSTING_BLOCK_SIZE) {
+        pack_list_block(w);
+    }
+}
+
+/*
+ * Packs the documents collected into the next block of the document list being written
+ */
+void pack_list_block(list_writer_p w) {
+    unsigned int data[2 * POSTING_BLOCK_SIZE];
+    posting_block_p b = &w->blocks[w->nr_blocks];
+    int size = pack_documents(w->docs, w->nr_block_docs, w->nr_blocks ? w->blocks[w->nr_blocks - 1].last_id : -1, b, data);
+    b->offset = w->data_size;
+
+    add_list_bytes(&w->data, data, sizeof(unsigned int) * size);
+    w->data_size += size;
+    w->nr_blocks++;
+    w->nr_block_docs = 0;
+}
+
+/*
+ * Writes the document list being written to the index file and starts the next one:
+ * the block table and the packed blocks, then the block offsets and the position lists (unless all are empty)
+ *  fw: returns the vocabulary entry of the word, except for its stem
+ *  fp: returns the position table entry of the word
+ *  postings: offset of the document lists section
+ */
+void write_list(list_writer_p w, FILE *f, file_word_p fw, file_positions_p fp, long postings) {
+    if (w->nr_block_docs) {
+        pack_list_block(w);
+    }
+
+    fw->nr_docs = w->nr_docs;
+    fw->nr_blocks = w->nr_blocks;
+    fw->data_size = w->data_size;
+    fw->documents = ftell(f) - postings;
+
+    fwrite(w->blocks, sizeof(posting_block_t), w->nr_blocks, f);
+    write_list_bytes(&w->data, f);
+
+    // position lists, left out if all of them are empty (a byte per document)
+    long positions_size = w->positions.spilled + w->positions.size;
+    fp->offset = -1;
+    fp->size = 0;
+    fp->reserved = 0;
+    if (positions_size > w->nr_docs) {
+        fp->offset = ftell(f) - postings;
+        fp->size = positions_size;
+        fwrite(w->block_positions, sizeof(int), w->nr_blocks, f);
+        write_list_bytes(&w->positions, f);
+        align_file(f);
+    } else {
+        write_list_bytes(&w->positions, NULL);
+    }
+
+    w->nr_docs = 0;
+    w->nr_blocks = 0;
+    w->data_size = 0;
+}
+
+/*
+ * Appends bytes to a list buffer, the bytes in memory are spilled to its temporary file first if there are too many
+ */
+void add_list_bytes(list_buffer_p b, void *bytes, long size) {
+    if (b->size && b->size + size > b->max_size && !b->failed) {
+        if (!b->f) {
+            b->f = fopen(b->file, "w+b");
+        }
+
+        if (!b->f || fwrite(b->bytes, 1, b->size, b->f) != b->size) {
+            printf("Error: couldn't write %s.\n", b->file);
+            b->failed = 1;
+        } else {
+            b->spilled += b->size;
+            b->size = 0;
+        }
+    }
+
+    // buffer full => double the size
+    if (b->size + size > b->max_bytes) {
+        while (b->size + size > b->max_bytes) {
+            b->max_bytes = b->max_bytes ? b->max_bytes * 2 : 1 << 12;
+        }
+        b->bytes = (unsigned char *) realloc(b->bytes, b->max_bytes);
+    }
+
+    memcpy(b->bytes + b->size, bytes, size);
+    b->size += size;
+}
+
+/*
+ * Writes the bytes spilled and the bytes in memory of a list buffer to a file and empties the buffer
+ *  f: file to write to (NULL = the bytes are dropped)
+ */
+void write_list_bytes(list_buffer_p b, FILE *f) {
+    if (b->spilled && f && !b->failed) {
+        unsigned char copy[1 << 13];
+        long left = b->spilled;
+        if (fseek(b->f, 0, SEEK_SET)) {
+            b->failed = 1;
+        }
+
+        while (left && !b->failed) {
+            long n = fread(copy, 1, left < sizeof(copy) ? left : sizeof(copy), b->f);
+            if (n <= 0 || fwrite(copy, 1, n, f) != n) {
+                printf("Error: couldn't read %s.\n", b->file);
+                b->failed = 1;
+            }
+            left -= n;
+        }
+    }
+
+    if (f && b->size) {
+        fwrite(b->bytes, 1, b->size, f);
+    }
+
+    // the next list is spilled from the start of the file again
+    if (b->f) {
+        fseek(b->f, 0, SEEK_SET);
+    }
+    b->spilled = 0;
+    b->size = 0;
+}
+
+/*
+ * Releases a list buffer and removes its temporary file
+ */
+void close_list_buffer(list_buffer_p b) {
+    if (b->f) {
+        fclose(b->f);
+        remove(b->file);
+    }
+    free(b->bytes);
+}
+
+/*
+ * Pads the file with zeros to the next multiple of 8 bytes, returns the new position
+ */
+long align_file(FILE *f) {
+    long pos = ftell(f);
+    while (pos % 8) {
+        fputc(0, f);
+        pos++;
+    }
+
+    return pos;
+}
+
+/*
+ * Layout of the journal (all numbers in host byte order):
+ *  header
+ *  records             journal_record_t followed by its payload, one per change of the index since the last segment was written
+ *
+ * payload of RECORD_ADD:    int nr_words, int nr_terms, \0 terminated name of the document,
+ *                           nr_terms x (int count, \0 terminated stem)
+ * payload of RECORD_REMOVE: int doc_id
+ * payload of RECORD_ADD_POSITIONS: as RECORD_ADD, each stem followed by int size and the position list of the word
+ *                           in the document (size bytes, encoded as in the document list)
+ *
+ * The ids of the documents are the ids after loading the segments and replaying the preceding records.
+ */
+typedef struct journal_header {
+    char magic[8];              // JOURNAL_MAGIC
+    int version;                // JOURNAL_VERSION
+    int byte_order;             // JOURNAL_BYTE_ORDER as written by the host
+    int generation;             // generation of the segments the journal continues
+    int reserved;
+} journal_header_t, *journal_header_p;
+
+typedef struct journal_record {
+    int type;                   // RECORD_ADD or RECORD_REMOVE
+    int size;                   // size of the payload in bytes
+    unsigned int checksum;      // checksum of the payload
+    int reserved;
+} journal_record_t, *journal_record_p;
+
+typedef struct journal_buffer {
+    char *data;
+    int size;
+    int max_size;
+} journal_buffer_t, *journal_buffer_p;
+
+int replay_record(index_p index, journal_record_p record, char *payload);
+void append_record(index_p index, int type, journal_buffer_p payload);
+void append_to_buffer(journal_buffer_p buffer, void *data, int size);
+unsigned int journal_checksum(char *data, int size);
+
+/*
+ * Opens the journal of the index and replays the changes recorded since the last segment was written
+ * a journal belonging to another generation of the segments is discarded, a torn record at the end is cut off
+ */
+void open_journal(index_p index, char *file) {
+    FILE *f = fopen(file, "r+b");
+    if (!f) {
+        reset_journal(index, file);
+        return;
+    }
+
+    journal_header_t header;
+    if (fread(&header, sizeof(journal_header_t), 1, f) != 1
+            || memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) || header.version != JOURNAL_VERSION
+            || header.byte_order != JOURNAL_BYTE_ORDER || header.generation != index->generation) {
+        // changes are already part of a segment (or the journal is unusable)
+        fclose(f);
+        reset_journal(index, file);
+        return;
+    }
+
+    // replay records until the end of the journal or the first incomplete record
+    long size = sizeof(journal_header_t);
+
+    struct stat st;
+    long file_size = fstat(fileno(f), &st) ? 0 : st.st_size;
+
+    journal_record_t record;
+    while (fread(&record, sizeof(journal_record_t), 1, f) == 1) {
+        // a payload larger than the rest of the file belongs to a torn record, its size isn't to be trusted
+        if (record.size < 0 || record.size > file_size - size - (long) sizeof(journal_record_t)) {
+            break;
+        }
+
+        char *payload = (char *) malloc(record.size + 1);
+        if (fread(payload, 1, record.size, f) != (size_t) record.size
+                || journal_checksum(payload, record.size) != record.checksum
+                || !replay_record(index, &record, payload)) {
+            free(payload);
+            break;
+        }
+
+        free(payload);
+        size += sizeof(journal_record_t) + record.size;
+    }
+
+    count_stat(STAT_BYTES_READ, size);
+
+    // cut off what couldn't be replayed, new records are appended after the last valid one
+    fflush(f);
+    if (ftruncate(fileno(f), size)) {
+        printf("Error: couldn't truncate %s.\n", file);
+    }
+    fseek(f, size, SEEK_SET);
+
+    index->journal = f;
+    index->journal_size = size;
+}
+
+/*
+ * Starts an empty journal for the current generation of the segments
+ */
+void reset_journal(index_p index, char *file) {
+    close_journal(index);
+
+    FILE *f = fopen(file, "w+b");
+    if (!f) {
+        printf("Error: couldn't open %s to write.\nChanges to the index won't be saved!\n", file);
+        return;
+    }
+
+    journal_header_t header;
+    memset(&header, 0, sizeof(journal_header_t));
+    memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+    header.version = JOURNAL_VERSION;
+    header.byte_order = JOURNAL_BYTE_ORDER;
+    header.generation = index->generation;
+
+    fwrite(&header, sizeof(journal_header_t), 1, f);
+    fflush(f);
+    fsync(fileno(f));
+
+    index->journal = f;
+    index->journal_size = sizeof(journal_header_t);
+}
+
+/*
+ * Closes the journal of the index
+ */
+void close_journal(index_p index) {
+    if (index->journal) {
+        fclose(index->journal);
+        index->journal = NULL;
+        index->journal_size = 0;
+    }
+}
+
+/*
+ * Records a document added to the index together with the number of occurances and the positions of its words
+ *  words: indexes of the words occuring in the document
+ */
+void journal_add(index_p index, int doc_id, int *words, int nr_terms) {
+    journal_buffer_t payload = {NULL, 0, 0};
+    indexed_document_p doc = get_document(index, doc_id);
+
+    append_to_buffer(&payload, &doc->nr_words, sizeof(int));
+    append_to_buffer(&payload, &nr_terms, sizeof(int));
+    append_to_buffer(&payload, doc->name, strlen(doc->name) + 1);
+
+    int k;
+    for (k = 0; k < nr_terms; k++) {
+        indexed_word_p w = &index->words[words[k]];
+
+        // the document has the highest id, so its entry is the last one of the list (in the tail)
+        append_to_buffer(&payload, &w->tail[w->nr_tail - 1].count, sizeof(int));
+        append_to_buffer(&payload, w->stem, strlen(w->stem) + 1);
+
+        int size;
+        unsigned char *list = last_position_list(w, &size);
+        append_to_buffer(&payload, &size, sizeof(int));
+        if (list) {
+            append_to_buffer(&payload, list, size);
+        }
+    }
+
+    append_record(index, RECORD_ADD_POSITIONS, &payload);
+    free(payload.data);
+}
+
+/*
+ * Records a document removed from the index
+ */
+void journal_remove(index_p index, int doc_id) {
+    journal_buffer_t payload = {NULL, 0, 0};
+    append_to_buffer(&payload, &doc_id, sizeof(int));
+
+    append_record(index, RECORD_REMOVE, &payload);
+    free(payload.data);
+}
+
+/*
+ * Applies a record of the journal to the index, returns 0 if the record is malformed
+ */
+int replay_record(index_p index, journal_record_p record, char *payload) {
+    char *end = payload + record->size;
+
+    if (record->type == RECORD_REMOVE) {
+        int doc_id;
+        if (record->size != sizeof(int)) {
+            return 0;
+        }
+
+        memcpy(&doc_id, payload, sizeof(int));
+        if (doc_id < 0 || doc_id >= index->nr_doc_ids) {
+            return 0;
+        }
+
+        // the manifest written by a merge of segments may list the document as removed already
+        if (get_document(index, doc_id)->name) {
+            delete_document(index, doc_id);
+        }
+        return 1;
+    }
+
+    if ((record->type != RECORD_ADD && record->type != RECORD_ADD_POSITIONS) || record->size < 2 * sizeof(int)) {
+        return 0;
+    }
+
+    // records written before positions were recorded have none
+    int positions = record->type == RECORD_ADD_POSITIONS;
+
+    int nr_words, nr_terms;
+    memcpy(&nr_words, payload, sizeof(int));
+    memcpy(&nr_terms, payload + sizeof(int), sizeof(int));
+    payload += 2 * sizeof(int);
+
+    // strings have to be terminated within the record
+    *end = '\0';
+    char *name = payload;
+    payload += strlen(name) + 1;
+    if (payload > end || nr_terms < 0 || (nr_terms && nr_words <= 0)) {
+        return 0;
+    }
+
+    // check the terms before the document is added
+    char *terms = payload;
+    int k;
+    for (k = 0; k < nr_terms; k++) {
+        int count;
+        if (payload + sizeof(int) >= end) {
+            return 0;
+        }
+
+        memcpy(&count, payload, sizeof(int));
+        if (count <= 0) {
+            return 0;
+        }
+
+        payload += sizeof(int);
+        payload += strlen(payload) + 1;
+        if (payload > end) {
+            return 0;
+        }
+
+        if (positions) {
+            int size;
+            if (payload + sizeof(int) > end) {
+                return 0;
+            }
+
+            memcpy(&size, payload, sizeof(int));
+            payload += sizeof(int);
+            if (size < 0 || size > end - payload) {
+                return 0;
+            }
+            payload += size;
+        }
+    }
+
+    int doc_id = insert_document(index, name);
+    if (doc_id < 0) {
+        return 0;
+    }
+
+    change_document(index, doc_id)->nr_words = nr_words;
+
+    payload = terms;
+    for (k = 0; k < nr_terms; k++) {
+        int count;
+        memcpy(&count, payload, sizeof(int));
+        char *stem = payload + sizeof(int);
+        payload = stem + strlen(stem) + 1;
+
+        int wid = find_or_add_word(index, stem);
+        own_word(index, &index->words[wid]);
+        add_posting(&index->words[wid], doc_id, count);
+
+        if (positions) {
+            int size;
+            memcpy(&size, payload, sizeof(int));
+            set_position_list(&index->words[wid], (unsigned char *) payload + sizeof(int), size);
+            payload += sizeof(int) + size;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Appends a record to the journal and forces it to disk
+ */
+void append_record(index_p index, int type, journal_buffer_p payload) {
+    if (!index->journal) {
+        return;
+    }
+
+    double start = now_seconds();
+
+    journal_record_t record;
+    record.type = type;
+    record.size = payload->size;
+    record.checksum = journal_checksum(payload->data, payload->size);
+    record.reserved = 0;
+
+    fwrite(&record, sizeof(journal_record_t), 1, index->journal);
+    fwrite(payload->data, 1, payload->size, index->journal);
+
+    if (fflush(index->journal) || fsync(fileno(index->journal))) {
+        printf("Error: couldn't write to the journal.\nChanges to the index won't be saved!\n");
+        close_journal(index);
+        return;
+    }
+
+    index->journal_size += sizeof(journal_record_t) + payload->size;
+    count_stat(STAT_BYTES_WRITTEN, sizeof(journal_record_t) + payload->size);
+    count_time(STAT_TIME_PERSIST, start);
+}
+
+/*
+ * Appends data to a growing buffer
+ */
+void append_to_buffer(journal_buffer_p buffer, void *data, int size) {
+    if (buffer->size + size > buffer->max_size) {
+        while (buffer->size + size > buffer->max_size) {
+            buffer->max_size = buffer->max_size ? buffer->max_size * 2 : 256;
+        }
+        buffer->data = (char *) realloc(buffer->data, buffer->max_size);
+    }
+
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+}
+
+/*
+ * Computes FNV-1a hash of the payload of a record
+ */
+unsigned int journal_checksum(char *data, int size) {
+    unsigned int hash = 2166136261u;
+    int i;
+    for (i = 0; i < size; i++) {
+        hash ^= (unsigned char) data[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/*
+ * Parses the documents with ids from first to last - 1 and adds their words to the index
+ * the index mustn't contain words of these or later documents yet
+ *  nr_threads: number of threads parsing documents (0 = one per processor)
+ * the result doesn't depend on the number of threads
+ */
+void parse_documents(index_p index, int first, int last, int nr_threads) {
+    if (nr_threads <= 0) {
+        nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    int nr_chunks = nr_threads > 1 ? nr_threads * CHUNKS_PER_THREAD : 1;
+    if (nr_chunks > last - first) {
+        nr_chunks = last - first;
+    }
+
+    if (nr_chunks <= 1) {
+        // nothing to share: parse the documents one after another
+        int i;
+        for (i = first; i < last; i++) {
+            if (get_document(index, i)->name) {
+                change_document(index, i)->nr_words = 0;
+                parse_file_for_index(index, i, NULL);
+            }
+        }
+
+        return;
+    }
+
+    if (nr_threads > nr_chunks) {
+        nr_threads = nr_chunks;
+    }
+
+    rebuild_t rebuild;
+    rebuild.index = index;
+    rebuild.nr_chunks = nr_chunks;
+    rebuild.next_chunk = 0;
+    rebuild.chunks = (rebuild_chunk_p) malloc(sizeof(rebuild_chunk_t) * nr_chunks);
+    pthread_mutex_init(&rebuild.lock, NULL);
+    pthread_cond_init(&rebuild.chunk_done, NULL);
+
+    int c;
+    for (c = 0; c < nr_chunks; c++) {
+        rebuild_chunk_p chunk = &rebuild.chunks[c];
+        chunk->first = first + (long) (last - first) * c / nr_chunks;
+        chunk->last = first + (long) (last - first) * (c + 1) / nr_chunks;
+        chunk->done = 0;
+    }
+
+    pthread_t *threads = (pthread_t *) malloc(sizeof(pthread_t) * nr_threads);
+    int i, nr_started = 0;
+    for (i = 0; i < nr_threads; i++) {
+        if (!pthread_create(&threads[nr_started], NULL, parse_chunks, &rebuild)) {
+            nr_started++;
+        }
+    }
+
+    if (!nr_started) {
+        // no threads available: parse all chunks in this thread
+        parse_chunks(&rebuild);
+    }
+
+    // merge the chunks in the order of their documents while the threads parse the following ones
+    for (c = 0; c < nr_chunks; c++) {
+        pthread_mutex_lock(&rebuild.lock);
+        while (!rebuild.chunks[c].done) {
+            pthread_cond_wait(&rebuild.chunk_done, &rebuild.lock);
+        }
+        pthread_mutex_unlock(&rebuild.lock);
+
+        merge_chunk(index, &rebuild.chunks[c]);
+    }
+
+    for (i = 0; i < nr_started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    free(threads);
+    free(rebuild.chunks);
+    pthread_mutex_destroy(&rebuild.lock);
+    pthread_cond_destroy(&rebuild.chunk_done);
+}
+
+/*
+ * Thread parsing the next unparsed chunk of documents until all chunks are taken
+ */
+void *parse_chunks(void *arg) {
+    rebuild_p rebuild = (rebuild_p) arg;
+    index_p index = rebuild->index;
+
+    // each thread stems with a cache of its own
+    stem_cache_p cache = index->stem_cache ? new_stem_cache() : NULL;
+
+    for (;;) {
+        pthread_mutex_lock(&rebuild->lock);
+        int c = rebuild->next_chunk++;
+        pthread_mutex_unlock(&rebuild->lock);
+
+        if (c >= rebuild->nr_chunks) {
+            break;
+        }
+
+        // the words of the chunk go into a partial index of their own,
+        // the threads only write the word counts of their own documents to the shared list of documents
+        rebuild_chunk_p chunk = &rebuild->chunks[c];
+        init_words(&chunk->words);
+        chunk->words.documents = index->documents;
+        chunk->words.document_stamps = NULL;
+        chunk->words.nr_snapshots = 0;
+        chunk->words.nr_doc_ids = index->nr_doc_ids;
+        chunk->words.stem_cache = cache;
+        chunk->words.stopwords = index->stopwords;
+        chunk->words.positions = index->positions;
+
+        int i;
+        for (i = chunk->first; i < chunk->last; i++) {
+            if (get_document(index, i)->name) {
+                change_document(index, i)->nr_words = 0;
+                parse_file_for_index(&chunk->words, i, NULL);
+            }
+        }
+
+        pthread_mutex_lock(&rebuild->lock);
+        chunk->done = 1;
+        pthread_cond_broadcast(&rebuild->chunk_done);
+        pthread_mutex_unlock(&rebuild->lock);
+    }
+
+    if (cache) {
+        pthread_mutex_lock(&rebuild->lock);
+        index->stem_cache->hits += cache->hits;
+        index->stem_cache->misses += cache->misses;
+        pthread_mutex_unlock(&rebuild->lock);
+
+        free_stem_cache(cache);
+    }
+
+    return NULL;
+}
+
+/*
+ * Adds the words of a parsed chunk to the index and releases the partial index of the chunk
+ * all documents of the chunk have higher ids than the documents merged before
+ */
+void merge_chunk(index_p index, rebuild_chunk_p chunk) {
+    int k;
+    for (k = 0; k < chunk->words.nr_words; k++) {
+        indexed_word_p part = &chunk->words.words[k];
+
+        int wid = find_or_add_word(index, part->stem);
+        indexed_word_p w = &index->words[wid];
+
+        if (!w->nr_docs) {
+            // first occurance of the word: take over the document list of the chunk
+            char *stem = w->stem;
+            *w = *part;
+            w->stem = stem;
+            w->stamp = index->nr_snapshots;
+
+            part->max_blocks = 0;
+            part->max_positions = 0;
+            part->tail = NULL;
+        } else {
+            own_word(index, w);
+            append_postings(w, part);
+        }
+    }
+
+    clear_words(&chunk->words);
+}
+
+/*
+ * The TF-IDF weight of a word in a document is TF * (log(N + 1) - log(df)), N being the number of documents
+ * in the filebase (a query counts as an additional document) and df the number of documents containing the word.
+ * Each document keeps the sums of TF^2, TF^2 * log(df) and TF^2 * log(df)^2 over its words, so the length of
+ * its TF-IDF vector follows for any N, and a change of df only concerns the documents containing the word.
+ * The df of a word counts the documents of all segments and of the words in memory (except removed ones).
+ *
+ * Updating the sums of all documents containing a word each time a document with the word is added or removed
+ * would cost the length of its document list per word of the document. Instead the sums of a word lag behind
+ * its df until log(df) moved by more than NORM_DF_TOLERANCE, the df they use is kept in a table of drifts; so
+ * the TF-IDF weight of a word in a document is off by TF * NORM_DF_TOLERANCE at most, and a list of df
+ * documents is gone through about once per df * NORM_DF_TOLERANCE changes. All sums are brought up to date
+ * when the table is full and when the words in memory are written to a segment.
+ */
+
+norm_drift_p find_norm_drift(index_p index, char *stem, int df);
+void settle_word_norms(index_p index, char *stem, int old_df);
+
+/*
+ * Computes the sums of each document, if not done yet
+ */
+void update_norms(index_p index) {
+    if (index->norms) {
+        return;
+    }
+
+    // the sums are kept in pages like the documents
+    int nr_pages = index->max_doc_ids / DOCUMENT_PAGE_SIZE, p;
+    index->norm_drifts = (norm_drift_p) calloc(2 * MAX_NORM_DRIFTS, sizeof(norm_drift_t));
+    index->nr_norm_drifts = 0;
+    index->norms = (doc_norm_p *) malloc(sizeof(doc_norm_p) * (nr_pages + 1));
+    index->norm_stamps = (int *) malloc(sizeof(int) * (nr_pages + 1));
+    for (p = 0; p < nr_pages; p++) {
+        index->norms[p] = (doc_norm_p) calloc(DOCUMENT_PAGE_SIZE, sizeof(doc_norm_t));
+        index->norm_stamps[p] = index->nr_snapshots;
+    }
+
+    int s, wid;
+    for (s = 0; s <= index->nr_segments; s++) {
+        index_p words = s < index->nr_segments ? &index->segments[s].words : index;
+
+        for (wid = 0; wid < words->nr_words; wid++) {
+            indexed_word_p w = &words->words[wid];
+            double log_df = log(word_df(index, w->stem));
+
+            posting_cursor_t c;
+            for (open_cursor(&c, w); cursor_doc(&c) != INT_MAX; cursor_next(&c)) {
+                int d = cursor_doc(&c);
+                indexed_document_p doc = get_document(index, d);
+                if (!doc->name) {
+                    // removed document, still in its segment
+                    continue;
+                }
+
+                double tf = (double) cursor_count(&c) / doc->nr_words;
+
+                doc_norm_p n = &index->norms[d / DOCUMENT_PAGE_SIZE][d % DOCUMENT_PAGE_SIZE];
+                n->tf2 += tf * tf;
+                n->tf2_log += tf * tf * log_df;
+                n->tf2_log2 += tf * tf * log_df * log_df;
+            }
+        }
+    }
+}
+
+/*
+ * Discards the sums of the documents (snapshots may still read their pages)
+ */
+void clear_norms(index_p index) {
+    if (!index->norms) {
+        return;
+    }
+
+    int p;
+    for (p = 0; p < index->max_doc_ids / DOCUMENT_PAGE_SIZE; p++) {
+        retire_memory(index, index->norms[p]);
+    }
+
+    for (p = 0; p < 2 * MAX_NORM_DRIFTS; p++) {
+        free(index->norm_drifts[p].stem);
+    }
+    free(index->norm_drifts);
+    index->norm_drifts = NULL;
+
+    free(index->norms);
+    free(index->norm_stamps);
+    index->norms = NULL;
+    index->norm_stamps = NULL;
+}
+
+/*
+ * Returns the sums of a document to be changed, their page is copied first if snapshots share it
+ * (the sums must have been computed)
+ */
+doc_norm_p change_norm(index_p index, int doc_id) {
+    int page = doc_id / DOCUMENT_PAGE_SIZE;
+    index->norms[page] = (doc_norm_p) own_memory(index, index->norms[page], &index->norm_stamps[page],
+        sizeof(doc_norm_t) * DOCUMENT_PAGE_SIZE);
+
+    return &index->norms[page][doc_id % DOCUMENT_PAGE_SIZE];
+}
+
+/*
+ * Updates the sums of the documents containing a word after the number of these documents changed
+ * (those of the other documents only once the change is large enough, see above)
+ *  old_df: previous number of documents containing the word
+ *  doc_id: document just added to the word (-1 = none), the word is added to its sums
+ */
+void update_word_norms(index_p index, char *stem, int old_df, int doc_id) {
+    if (!index->norms) {
+        return;
+    }
+
+    int df = word_df(index, stem);
+    norm_drift_p drift = find_norm_drift(index, stem, old_df);
+    if (!drift->df) {
+        // new word, the document is the only one containing it
+        drift->df = df;
+    }
+
+    if (doc_id >= 0) {
+        // the document gets the df the sums of the other documents containing the word use
+        int wid = find_word(index, stem);
+        posting_cursor_t c;
+        if (wid >= 0) {
+            open_cursor(&c, &index->words[wid]);
+        }
+
+        if (wid >= 0 && cursor_seek(&c, doc_id) == doc_id) {
+            double tf = (double) cursor_count(&c) / get_document(index, doc_id)->nr_words;
+            double log_df = log(drift->df);
+
+            doc_norm_p n = change_norm(index, doc_id);
+            n->tf2 += tf * tf;
+            n->tf2_log += tf * tf * log_df;
+            n->tf2_log2 += tf * tf * log_df * log_df;
+        }
+    }
+
+    if (df && fabs(log(df) - log(drift->df)) > NORM_DF_TOLERANCE) {
+        settle_word_norms(index, stem, drift->df);
+        drift->df = df;
+    }
+}
+
+/*
+ * Brings the sums of all documents up to date with the df of their words and empties the table of drifts
+ */
+void settle_norms(index_p index) {
+    if (!index->norms) {
+        return;
+    }
+
+    int i;
+    for (i = 0; i < 2 * MAX_NORM_DRIFTS; i++) {
+        norm_drift_p drift = &index->norm_drifts[i];
+        if (!drift->stem) {
+            continue;
+        }
+
+        // words no document contains anymore have no sums to update
+        int df = word_df(index, drift->stem);
+        if (df && df != drift->df) {
+            settle_word_norms(index, drift->stem, drift->df);
+        }
+
+        free(drift->stem);
+        drift->stem = NULL;
+    }
+
+    index->nr_norm_drifts = 0;
+}
+
+/*
+ * Returns the entry of a word in the table of drifts, a word not in the table is added with the df given
+ * (if the table is full, all sums are brought up to date first)
+ */
+norm_drift_p find_norm_drift(index_p index, char *stem, int df) {
+    unsigned int hash = hash_stem(stem);
+    int mask = 2 * MAX_NORM_DRIFTS - 1;
+    int s = hash & mask;
+    while (index->norm_drifts[s].stem) {
+        norm_drift_p drift = &index->norm_drifts[s];
+        if (drift->hash == hash && !strcmp(drift->stem, stem)) {
+            return drift;
+        }
+        s = (s + 1) & mask;
+    }
+
+    if (index->nr_norm_drifts == MAX_NORM_DRIFTS) {
+        settle_norms(index);
+        s = hash & mask;
+    }
+
+    norm_drift_p drift = &index->norm_drifts[s];
+    drift->stem = (char *) malloc(strlen(stem) + 1);
+    strcpy(drift->stem, stem);
+    drift->hash = hash;
+    drift->df = df;
+    index->nr_norm_drifts++;
+
+    return drift;
+}
+
+/*
+ * Updates the sums of the documents containing a word from one df to another
+ *  old_df: number of documents containing the word the sums use
+ */
+void settle_word_norms(index_p index, char *stem, int old_df) {
+    double old_log = old_df ? log(old_df) : 0;
+    double new_log = log(word_df(index, stem));
+
+    // the documents containing the word are spread over the segments
+    int s;
+    for (s = 0; s <= index->nr_segments; s++) {
+        index_p words = s < index->nr_segments ? &index->segments[s].words : index;
+        int wid = find_word(words, stem);
+        if (wid < 0) {
+            continue;
+        }
+
+        // the pages are looked up once for all documents of the list in them
+        int page = -1;
+        indexed_document_p docs = NULL;
+        doc_norm_p norms = NULL;
+
+        posting_cursor_t c;
+        for (open_cursor(&c, &words->words[wid]); cursor_doc(&c) != INT_MAX; cursor_next(&c)) {
+            int d = cursor_doc(&c);
+            if (d / DOCUMENT_PAGE_SIZE != page) {
+                page = d / DOCUMENT_PAGE_SIZE;
+                docs = index->documents[page];
+                norms = change_norm(index, page * DOCUMENT_PAGE_SIZE);
+            }
+
+            indexed_document_p doc = &docs[d % DOCUMENT_PAGE_SIZE];
+            if (!doc->name) {
+                continue;
+            }
+
+            double tf = (double) cursor_count(&c) / doc->nr_words;
+
+            doc_norm_p n = &norms[d % DOCUMENT_PAGE_SIZE];
+            n->tf2_log += tf * tf * (new_log - old_log);
+            n->tf2_log2 += tf * tf * (new_log * new_log - old_log * old_log);
+        }
+    }
+}
+
+/*
+ * Returns the squared length of the TF-IDF vector of a document
+ *  log_n: log(N + 1)
+ */
+double document_norm(index_p index, int doc_id, double log_n) {
+    doc_norm_p n = &index->norms[doc_id / DOCUMENT_PAGE_SIZE][doc_id % DOCUMENT_PAGE_SIZE];
+    double norm = log_n * log_n * n->tf2 - 2 * log_n * n->tf2_log + n->tf2_log2;
+
+    // rounding errors mustn't make it negative
+    return norm > 0 ? norm : 0;
+}
+
+/*
+ * Creates an empty stem cache
+ */
+stem_cache_p new_stem_cache() {
+    stem_cache_p cache = (stem_cache_p) malloc(sizeof(stem_cache_t));
+    cache->nr_entries = STEM_CACHE_ENTRIES;
+    cache->entries = (stem_cache_entry_p) calloc(cache->nr_entries, sizeof(stem_cache_entry_t));
+    cache->hits = 0;
+    cache->misses = 0;
+
+    return cache;
+}
+
+/*
+ * Releases a stem cache
+ */
+void free_stem_cache(stem_cache_p cache) {
+    if (cache) {
+        free(cache->entries);
+        free(cache);
+    }
+}
+
+/*
+ * Stems a word like stem_word, words seen before are looked up in the cache instead (cache may be NULL)
+ * a word replaces the word cached in the same entry, words too long for the cache are always stemmed
+ */
+int cached_stem(stem_cache_p cache, char *word, int len, char *buf) {
+    if (!cache) {
+        return stem_word(word, len, buf);
+    }
+
+    if (!len || len > STEM_CACHE_WORD_SIZE) {
+        cache->misses++;
+        return stem_word(word, len, buf);
+    }
+
+    // FNV-1a hash of the word selects the entry
+    unsigned int hash = 2166136261u;
+    int i;
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char) word[i];
+        hash *= 16777619u;
+    }
+
+    stem_cache_entry_p e = &cache->entries[hash & (cache->nr_entries - 1)];
+    if (e->len == len && !memcmp(e->word, word, len)) {
+        cache->hits++;
+        memcpy(buf, e->stem, e->stem_len);
+        buf[e->stem_len] = '\0';
+        return e->stem_len;
+    }
+
+    // the word has to be kept before it is stemmed, buf may be the word itself
+    cache->misses++;
+    e->len = len;
+    memcpy(e->word, word, len);
+    e->stem_len = stem_word(word, len, buf);
+    memcpy(e->stem, buf, e->stem_len);
+
+    return e->stem_len;
+}
+
+/*
+ * Prints how often the cache saved stemming a word
+ */
+void print_stem_cache(stem_cache_p cache) {
+    if (!cache) {
+        printf("No stem cache.\n");
+        return;
+    }
+
+    long lookups = cache->hits + cache->misses;
+    printf("Stem cache: %ld words, %ld found in the cache (%.1f%%), %ld stemmed\n",
+            lookups, cache->hits, lookups ? 100.0 * cache->hits / lookups : 0.0, cache->misses);
+}
+
+/*
+ * The stopwords are kept in a minimal perfect hash table (hash and displace): a first hash distributes the
+ * stopwords to buckets, each bucket stores the seed of a second hash that places all its stopwords in
+ * different slots (or directly the slot of its only stopword). So a lookup hashes the word at most twice and
+ * compares it to the one stopword in its slot. Most words are ruled out by their length before hashing.
+ */
+
+/*
+ * Loads a set of stopwords from a file (one or more stopwords per line, in any order)
+ * returns NULL if the file can't be read
+ */
+stopword_set_p load_stopwords(char *file) {
+    FILE *f = fopen(file, "r");
+    if (!f) {
+        return NULL;
+    }
+
+    // read the whole file at once
+    int size = 0, max_size = 4096;
+    char *text = (char *) malloc(max_size);
+    int n;
+    while ((n = fread(text + size, 1, max_size - size, f)) > 0) {
+        size += n;
+        if (size == max_size) {
+            max_size *= 2;
+            text = (char *) realloc(text, max_size);
+        }
+    }
+
+    fclose(f);
+
+    stopword_set_p set = new_stopwords(text, size);
+    free(text);
+
+    return set;
+}
+
+/*
+ * Creates a set of stopwords
+ *  text: the stopwords, separated by whitespace or \0 (in any order, duplicates allowed)
+ *  size: length of text in bytes
+ */
+stopword_set_p new_stopwords(char *text, int size) {
+    stopword_set_p set = (stopword_set_p) malloc(sizeof(stopword_set_t));
+
+    // split a lower case copy of the text into words
+    char *copy = (char *) malloc(size + 1);
+    char **words = (char **) malloc(sizeof(char *) * (size / 2 + 1));
+    int i, nr_words = 0;
+    for (i = 0; i < size; i++) {
+        copy[i] = isspace(text[i]) ? '\0' : tolower(text[i]);
+        if (copy[i] && (!i || !copy[i - 1])) {
+            words[nr_words++] = copy + i;
+        }
+    }
+    copy[size] = '\0';
+
+    // order the words and drop duplicates
+    qsort(words, nr_words, sizeof(char *), cmp_stopword);
+
+    set->nr_words = 0;
+    for (i = 0; i < nr_words; i++) {
+        if (!set->nr_words || strcmp(words[set->nr_words - 1], words[i])) {
+            words[set->nr_words++] = words[i];
+        }
+    }
+
+    // keep the words one after another, \0 terminated
+    set->size = 0;
+    for (i = 0; i < set->nr_words; i++) {
+        set->size += strlen(words[i]) + 1;
+    }
+
+    set->words = (char *) malloc(set->size + 1);
+    char *w = set->words;
+    set->length_mask = 0;
+    for (i = 0; i < set->nr_words; i++) {
+        int len = strlen(words[i]);
+        memcpy(w, words[i], len + 1);
+        words[i] = w;
+        w += len + 1;
+
+        set->length_mask |= 1ul << (len < 63 ? len : 63);
+    }
+
+    // at least as many slots as words, there are more only if no seeds could be found for a minimal table
+    set->nr_buckets = set->nr_words ? set->nr_words : 1;
+    set->nr_slots = set->nr_buckets;
+    while (!build_stopword_table(set, words)) {
+        set->nr_slots += set->nr_slots / 4 + 1;
+    }
+
+    free(words);
+    free(copy);
+
+    return set;
+}
+
+/*
+ * Releases a set of stopwords (set may be NULL)
+ */
+void free_stopwords(stopword_set_p set) {
+    if (set) {
+        free(set->seeds);
+        free(set->slots);
+        free(set->lengths);
+        free(set->words);
+        free(set);
+    }
+}
+
+/*
+ * Checks whether a word is a stopword (set may be NULL = no stopwords)
+ *  len: length of the word
+ */
+int is_stopword(stopword_set_p set, char *word, int len) {
+    if (!set || !(set->length_mask & (1ul << (len < 63 ? len : 63)))) {
+        return 0;
+    }
+
+    int seed = set->seeds[stopword_hash(0, word, len) % set->nr_buckets];
+    int slot = seed < 0 ? -1 - seed : stopword_hash(seed, word, len) % set->nr_slots;
+
+    return set->lengths[slot] == len && !memcmp(set->slots[slot], word, len);
+}
+
+/*
+ * FNV-1a hash of a word, the seed selects one of a family of hash functions
+ */
+unsigned int stopword_hash(unsigned int seed, char *word, int len) {
+    unsigned int hash = 2166136261u ^ (seed * 2654435761u);
+    int i;
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char) word[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/*
+ * Places alphabetically ordered stopwords in the slots of the hash table (set->nr_slots), sets the seeds of the buckets
+ * returns 1 on success, 0 if the words of a bucket couldn't be placed
+ */
+int build_stopword_table(stopword_set_p set, char **words) {
+    set->seeds = (int *) calloc(set->nr_buckets, sizeof(int));
+    set->slots = (char **) calloc(set->nr_slots, sizeof(char *));
+    set->lengths = (int *) calloc(set->nr_slots, sizeof(int));
+
+    // group the words by bucket
+    int *bucket_of = (int *) malloc(sizeof(int) * (set->nr_words + 1));
+    int *first = (int *) calloc(set->nr_buckets + 1, sizeof(int));
+    int *members = (int *) malloc(sizeof(int) * (set->nr_words + 1));
+    int i, j;
+    for (i = 0; i < set->nr_words; i++) {
+        bucket_of[i] = stopword_hash(0, words[i], strlen(words[i])) % set->nr_buckets;
+        first[bucket_of[i] + 1]++;
+    }
+
+    for (i = 0; i < set->nr_buckets; i++) {
+        first[i + 1] += first[i];
+    }
+
+    int *fill = (int *) malloc(sizeof(int) * set->nr_buckets);
+    memcpy(fill, first, sizeof(int) * set->nr_buckets);
+    for (i = 0; i < set->nr_words; i++) {
+        members[fill[bucket_of[i]]++] = i;
+    }
+
+    // largest buckets first, while there are many free slots
+    stopword_bucket_p buckets = (stopword_bucket_p) malloc(sizeof(stopword_bucket_t) * set->nr_buckets);
+    for (i = 0; i < set->nr_buckets; i++) {
+        buckets[i].bucket = i;
+        buckets[i].size = first[i + 1] - first[i];
+    }
+
+    qsort(buckets, set->nr_buckets, sizeof(stopword_bucket_t), cmp_bucket_size_desc);
+
+    int ok = 1, free_slot = 0, b;
+    int *placed = (int *) malloc(sizeof(int) * (set->nr_words + 1));
+    for (b = 0; ok && b < set->nr_buckets && buckets[b].size; b++) {
+        int *m = members + first[buckets[b].bucket];
+        int size = buckets[b].size;
+
+        if (size == 1) {
+            // a single word goes to the next free slot, no second hash needed
+            while (set->slots[free_slot]) {
+                free_slot++;
+            }
+
+            set->seeds[buckets[b].bucket] = -1 - free_slot;
+            set->slots[free_slot] = words[m[0]];
+            set->lengths[free_slot] = strlen(words[m[0]]);
+            continue;
+        }
+
+        // try seeds until all words of the bucket get different free slots
+        int seed;
+        for (seed = 1; seed <= MAX_STOPWORD_SEED; seed++) {
+            for (i = 0; i < size; i++) {
+                placed[i] = stopword_hash(seed, words[m[i]], strlen(words[m[i]])) % set->nr_slots;
+                if (set->slots[placed[i]]) {
+                    break;
+                }
+
+                for (j = 0; j < i && placed[j] != placed[i]; j++);
+                if (j < i) {
+                    break;
+                }
+            }
+
+            if (i == size) {
+                break;
+            }
+        }
+
+        if (seed > MAX_STOPWORD_SEED) {
+            ok = 0;
+            break;
+        }
+
+        set->seeds[buckets[b].bucket] = seed;
+        for (i = 0; i < size; i++) {
+            set->slots[placed[i]] = words[m[i]];
+            set->lengths[placed[i]] = strlen(words[m[i]]);
+        }
+    }
+
+    free(placed);
+    free(buckets);
+    free(fill);
+    free(members);
+    free(first);
+    free(bucket_of);
+
+    if (!ok) {
+        free(set->seeds);
+        free(set->slots);
+        free(set->lengths);
+    }
+
+    return ok;
+}
+
+/*
+ * Compares two stopwords alphabetically
+ */
+int cmp_stopword(const void *a, const void *b) {
+    return strcmp(*(char **) a, *(char **) b);
+}
+
+/*
+ * Compares two buckets by their number of stopwords, largest first
+ */
+int cmp_bucket_size_desc(const void *a, const void *b) {
+    stopword_bucket_p ba = (stopword_bucket_p) a;
+    stopword_bucket_p bb = (stopword_bucket_p) b;
+
+    if (ba->size != bb->size) {
+        return bb->size - ba->size;
+    }
+
+    return ba->bucket - bb->bucket;
+}
+
+/*
+ * A tokenizer splits a text into words (runs of letters) and turns them to lower case, every other character
+ * separates words. Files are read in chunks of TOKEN_BUFFER_SIZE bytes, so a tokenizer needs the same memory
+ * for files of any size and lines of any length. The words are returned in place, each tokenizer has a buffer
+ * of its own.
+ */
+
+/*
+ * Sets up a tokenizer reading a file
+ * returns 1 on success, 0 if the file can't be opened
+ */
+int open_tokenizer(tokenizer_p t, char *file) {
+    t->fd = open(file, O_RDONLY);
+    if (t->fd < 0) {
+        return 0;
+    }
+
+    // one more byte to terminate a word at the end of the buffer
+    t->buffer = (char *) malloc(TOKEN_BUFFER_SIZE + 1);
+    t->pos = 0;
+    t->end = 0;
+    t->eof = 0;
+
+    return 1;
+}
+
+/*
+ * Sets up a tokenizer splitting a \0 terminated string, the words are turned to lower case in the string itself
+ */
+void string_tokenizer(tokenizer_p t, char *str) {
+    t->fd = -1;
+    t->buffer = str;
+    t->pos = 0;
+    t->end = strlen(str);
+    t->eof = 1;
+}
+
+/*
+ * Releases a tokenizer (the string of a string tokenizer stays)
+ */
+void close_tokenizer(tokenizer_p t) {
+    if (t->fd >= 0) {
+        close(t->fd);
+        free(t->buffer);
+    }
+
+    t->fd = -1;
+    t->buffer = NULL;
+}
+
+/*
+ * Finds the next word, returns its length (0 = no more words)
+ *  word: returns the \0 terminated lower case word, valid until the next call (room for length + 1 characters)
+ */
+int next_token(tokenizer_p t, char **word) {
+    char *b = t->buffer;
+
+    for (;;) {
+        // skip everything up to the next letter
+        while (t->pos < t->end && !IS_LETTER(b[t->pos])) {
+            t->pos++;
+        }
+
+        if (t->pos == t->end) {
+            // buffer used up, start over with the next chunk
+            t->pos = 0;
+            t->end = 0;
+            if (!fill_tokenizer(t)) {
+                return 0;
+            }
+
+            continue;
+        }
+
+        int start = t->pos;
+        while (t->pos < t->end && IS_LETTER(b[t->pos])) {
+            b[t->pos++] |= 0x20;
+        }
+
+        // the word might go on in the next chunk: move it to the front of the buffer and read on
+        while (t->pos == t->end && !t->eof) {
+            if (start) {
+                memmove(b, b + start, t->end - start);
+                t->end -= start;
+                t->pos = t->end;
+                start = 0;
+            } else if (t->end == TOKEN_BUFFER_SIZE) {
+                // the word fills the whole buffer, it is cut off
+                break;
+            }
+
+            if (fill_tokenizer(t)) {
+                while (t->pos < t->end && IS_LETTER(b[t->pos])) {
+                    b[t->pos++] |= 0x20;
+                }
+            }
+        }
+
+        // the character after the word is no letter (or beyond the text), so it can take the terminating \0
+        *word = b + start;
+        int len = t->pos - start;
+        if (t->pos < t->end) {
+            t->pos++;
+        }
+        b[start + len] = '\0';
+
+        return len;
+    }
+}
+
+/*
+ * Appends the next chunk of the file to the buffer
+ * returns the number of bytes read (0 = end of the file)
+ */
+int fill_tokenizer(tokenizer_p t) {
+    if (t->eof) {
+        return 0;
+    }
+
+    int n;
+    do {
+        n = read(t->fd, t->buffer + t->end, TOKEN_BUFFER_SIZE - t->end);
+    } while (n < 0 && errno == EINTR);
+
+    if (n <= 0) {
+        t->eof = 1;
+        return 0;
+    }
+
+    t->end += n;
+    return n;
+}
+
+/*
+ * Adds many files to the index in one pass: the documents get their ids at once, their words are merged
+ * into the index batch by batch (parsed by several threads) and written to a new segment at the end
+ *  spec: a directory (searched recursively), a glob pattern or @ followed by a manifest file listing one path per line
+ *  nr_threads: number of threads parsing documents (0 = one per processor)
+ */
+void add_files(index_p index, char *spec, int nr_threads) {
+    double start = now_seconds();
+
+    // STEP 1: find the files
+    file_list_t list;
+    list.files = NULL;
+    list.nr_files = 0;
+    list.max_files = 0;
+    list.size = 0;
+
+    if (spec[0] == '@') {
+        collect_manifest(&list, spec + 1);
+    } else if (strpbrk(spec, "*?[")) {
+        glob_t g;
+        if (!glob(spec, 0, NULL, &g)) {
+            int i;
+            for (i = 0; i < g.gl_pathc; i++) {
+                collect_files(&list, g.gl_pathv[i]);
+            }
+        }
+        globfree(&g);
+    } else {
+        collect_files(&list, spec);
+    }
+
+    // STEP 2: leave out files found twice and files already in the filebase
+    qsort(list.files, list.nr_files, sizeof(char *), cmp_file_name);
+
+    int i, nr_new = 0, nr_skipped = 0;
+    for (i = 0; i < list.nr_files; i++) {
+        if ((nr_new && !strcmp(list.files[nr_new - 1], list.files[i])) || find_document(index, list.files[i]) >= 0) {
+            nr_skipped++;
+            free(list.files[i]);
+        } else {
+            list.files[nr_new++] = list.files[i];
+        }
+    }
+
+    if (nr_skipped) {
+        printf("%d files skipped (already in the filebase).\n", nr_skipped);
+    }
+
+    if (!nr_new) {
+        printf("No files to add.\nIndex not updated.\n");
+        free(list.files);
+        return;
+    }
+
+    // STEP 3: parse the documents and write their segment, the lengths of the TF-IDF vectors are computed
+    // once the IDFs are known
+    printf("Adding %d files (%.1f MB)..\n", nr_new, list.size / 1048576.0);
+
+    clear_norms(index);
+    int first = insert_documents(index, list.files, nr_new);
+    build_index(index, first, first + nr_new, nr_threads, 1);
+
+    double seconds = now_seconds() - start;
+    printf("Added %d files in %.2f s (%.0f files/s, %.1f MB/s).\n", nr_new, seconds,
+        nr_new / seconds, list.size / 1048576.0 / seconds);
+
+    for (i = 0; i < nr_new; i++) {
+        free(list.files[i]);
+    }
+    free(list.files);
+}
+
+/*
+ * Adds a file to the list, or the files in it if it is a directory
+ */
+void collect_files(file_list_p list, char *path) {
+    struct stat st;
+    if (stat(path, &st)) {
+        printf("Cannot open %s!\n", path);
+        return;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        collect_directory(list, path);
+    } else if (S_ISREG(st.st_mode) && !access(path, R_OK)) {
+        add_to_file_list(list, path, st.st_size);
+    } else {
+        printf("Cannot open %s!\n", path);
+    }
+}
+
+/*
+ * Adds the files in a directory and its subdirectories to the list
+ * (links to directories are not followed, so links can't lead into a cycle)
+ */
+void collect_directory(file_list_p list, char *dir) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        printf("Cannot open %s!\n", dir);
+        return;
+    }
+
+    // the path of an entry is the path of the directory without trailing '/' followed by '/' and the name
+    int dir_len = strlen(dir);
+    while (dir_len > 1 && dir[dir_len - 1] == '/') {
+        dir_len--;
+    }
+
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) {
+            continue;
+        }
+
+        char *path = (char *) malloc(dir_len + strlen(e->d_name) + 2);
+        memcpy(path, dir, dir_len);
+        path[dir_len] = '/';
+        strcpy(path + dir_len + 1, e->d_name);
+
+        struct stat st;
+        if (!lstat(path, &st) && S_ISDIR(st.st_mode)) {
+            collect_directory(list, path);
+        } else if (!stat(path, &st) && S_ISREG(st.st_mode) && !access(path, R_OK)) {
+            add_to_file_list(list, path, st.st_size);
+        }
+
+        free(path);
+    }
+
+    closedir(d);
+}
+
+/*
+ * Adds the files listed in a manifest file to the list, one file (or directory) per line
+ */
+void collect_manifest(file_list_p list, char *manifest) {
+    FILE *f = fopen(manifest, "r");
+    if (!f) {
+        printf("Cannot open %s!\n", manifest);
+        return;
+    }
+
+    char *line;
+    while ((line = read_line(f))) {
+        // ignore empty lines
+        if (line[0]) {
+            collect_files(list, line);
+        }
+
+        free(line);
+    }
+
+    fclose(f);
+}
+
+/*
+ * Appends a copy of a file name to the list
+ */
+void add_to_file_list(file_list_p list, char *file, long size) {
+    // list full => double the size
+    if (list->nr_files == list->max_files) {
+        list->max_files = list->max_files ? list->max_files * 2 : 1024;
+        list->files = (char **) realloc(list->files, sizeof(char *) * list->max_files);
+    }
+
+    list->files[list->nr_files] = (char *) malloc(strlen(file) + 1);
+    memcpy(list->files[list->nr_files], file, strlen(file) + 1);
+    list->nr_files++;
+    list->size += size;
+}
+
+/*
+ * Compares two file names alphabetically
+ */
+int cmp_file_name(const void *a, const void *b) {
+    return strcmp(*(char **) a, *(char **) b);
+}
+
+/*
+ * An index builder keeps the words of the documents it parses in an index of its own until they occupy
+ * half the memory budget of the index. Then it writes them to a run: a temporary file with the words in
+ * alphabetical order, each followed by its document list (numbers in 7 bit groups, ids as gaps) and the
+ * position lists of the documents.
+ * A segment file is written by merging the words in memory, the runs and the words parsed last:
+ * the sources are read one word after another, so memory use doesn't depend on the size of the index.
+ * All documents of a source have lower ids than the documents of the following sources, so the document
+ * lists of a word are merged by reading them one after another, a document at a time. Merging segments works the same way, with the words
+ * of the segments as the runs.
+ */
+
+/*
+ * Parses the documents with ids from first to last - 1 and writes a segment with their words and
+ * the words in memory
+ * the index mustn't contain words of these or later documents
+ *  nr_threads: number of threads parsing documents (0 = one per processor)
+ *  report: 1 = print the progress after each batch of documents
+ */
+void build_index(index_p index, int first, int last, int nr_threads, int report) {
+    double start = now_seconds();
+
+    // the words in memory belong to the documents before the ones parsed
+    index_builder_p builder = new_index_builder(index);
+    add_words_run(builder, index);
+
+    int doc = first;
+    while (doc < last) {
+        // next batch of documents, their text takes at most a quarter of the memory budget
+        long text_size = 0;
+        int end = doc;
+        while (end < last && end - doc < MAX_BATCH_DOCS) {
+            struct stat st;
+            char *name = get_document(index, end)->name;
+            long size = name && !stat(name, &st) ? st.st_size : 0;
+            if (end > doc && text_size + size > index->memory_budget / 4) {
+                break;
+            }
+
+            text_size += size;
+            end++;
+        }
+
+        parse_documents(&builder->words, doc, end, nr_threads);
+        doc = end;
+
+        if (words_memory(&builder->words) > index->memory_budget / 2) {
+            write_run(builder);
+        }
+
+        if (report) {
+            printf(" %d/%d files, %.0f files/s\n", doc - first, last - first, (doc - first) / (now_seconds() - start));
+        }
+    }
+
+    if (report && builder->nr_runs > 1) {
+        printf("Merging %d runs..\n", builder->nr_runs - 1);
+    }
+
+    // the words parsed last stay in memory
+    add_words_run(builder, &builder->words);
+
+    flush_segment(index, builder);
+    free_index_builder(builder);
+}
+
+/*
+ * Creates a builder adding words to an index (without runs)
+ */
+index_builder_p new_index_builder(index_p index) {
+    index_builder_p builder = (index_builder_p) malloc(sizeof(index_builder_t));
+    builder->index = index;
+
+    // the words share the documents (and the way they are parsed) with the index,
+    // the pages of the documents parsed belong to the index already and are changed in place
+    init_words(&builder->words);
+    builder->words.documents = index->documents;
+    builder->words.document_stamps = NULL;
+    builder->words.nr_snapshots = 0;
+    builder->words.nr_doc_ids = index->nr_doc_ids;
+    builder->words.stem_cache = index->stem_cache;
+    builder->words.stopwords = index->stopwords;
+    builder->words.positions = index->positions;
+
+    builder->runs = NULL;
+    builder->nr_runs = 0;
+    builder->heap = NULL;
+    builder->heap_size = 0;
+    builder->merged_stem = NULL;
+    builder->max_merged_stem = 0;
+    builder->merging = -1;
+
+    return builder;
+}
+
+/*
+ * Appends a run with the words of a vocabulary in memory
+ * the words mustn't change until the builder is released
+ */
+void add_words_run(index_builder_p builder, index_p words) {
+    index_run_p run = add_run(builder);
+    run->words = sort_words(words);
+    run->nr_words = words->nr_words;
+}
+
+/*
+ * Releases a builder, its run files are deleted
+ */
+void free_index_builder(index_builder_p builder) {
+    int r;
+    for (r = 0; r < builder->nr_runs; r++) {
+        index_run_p run = &builder->runs[r];
+        if (run->file) {
+            fclose(run->file);
+        } else if (run->fd >= 0) {
+            close(run->fd);
+        }
+
+        if (run->fd >= 0) {
+            free(run->buffer);
+            free(run->stem);
+            free(run->positions);
+        }
+
+        free(run->words);
+    }
+
+    clear_words(&builder->words);
+    free(builder->merged_stem);
+    free(builder->runs);
+    free(builder->heap);
+    free(builder);
+}
+
+/*
+ * Writes the words parsed so far to a new run and clears them
+ */
+void write_run(index_builder_p builder) {
+    // the file is deleted right away, it stays accessible until it is closed
+    char name[sizeof(RUN_FILE) + 12];
+    sprintf(name, "%s.%d", RUN_FILE, builder->nr_runs);
+
+    FILE *f = fopen(name, "w+b");
+    if (!f) {
+        printf("Error: couldn't open %s to write.\nWords kept in memory\n", name);
+        return;
+    }
+    remove(name);
+
+    char *buffer = (char *) malloc(RUN_BUFFER_SIZE);
+    setvbuf(f, buffer, _IOFBF, RUN_BUFFER_SIZE);
+
+    // format: length of the stem, stem, number of documents, id gap, count and position list of each document
+    indexed_word_p *sorted = sort_words(&builder->words);
+    int i;
+    for (i = 0; i < builder->words.nr_words; i++) {
+        indexed_word_p w = sorted[i];
+        int len = strlen(w->stem);
+        write_number(f, len);
+        fwrite(w->stem, 1, len, f);
+        write_number(f, w->nr_docs);
+
+        int prev = 0;
+        posting_cursor_t c;
+        for (open_cursor(&c, w); cursor_doc(&c) != INT_MAX; cursor_next(&c)) {
+            write_number(f, cursor_doc(&c) - prev);
+            write_number(f, cursor_count(&c));
+            prev = cursor_doc(&c);
+
+            int size;
+            unsigned char *list = cursor_position_list(&c, &size);
+            write_number(f, size);
+            if (list) {
+                fwrite(list, 1, size, f);
+            }
+        }
+    }
+
+    // an empty stem ends the run
+    write_number(f, 0);
+    free(sorted);
+
+    // only the file descriptor is kept until the runs are merged, the buffer is released
+    int fd = fflush(f) || ferror(f) ? -1 : dup(fileno(f));
+    count_stat(STAT_BYTES_WRITTEN, ftell(f));
+    fclose(f);
+    free(buffer);
+
+    if (fd < 0) {
+        printf("Error: couldn't write %s.\nWords kept in memory\n", name);
+        return;
+    }
+
+    index_run_p run = add_run(builder);
+    run->fd = fd;
+
+    clear_words(&builder->words);
+    init_words(&builder->words);
+}
+
+/*
+ * Appends an empty run to the runs of a builder
+ */
+index_run_p add_run(index_builder_p builder) {
+    builder->runs = (index_run_p) realloc(builder->runs, sizeof(index_run_t) * (builder->nr_runs + 1));
+
+    index_run_p run = &builder->runs[builder->nr_runs++];
+    memset(run, 0, sizeof(index_run_t));
+    run->fd = -1;
+
+    return run;
+}
+
+/*
+ * Prepares to merge the runs of a builder: the first word of each run is read
+ */
+void start_merge(index_builder_p builder) {
+    builder->heap = (int *) malloc(sizeof(int) * builder->nr_runs);
+    builder->heap_size = 0;
+
+    long buffer_size = builder->index->memory_budget / 4 / builder->nr_runs;
+    if (buffer_size > RUN_BUFFER_SIZE) {
+        buffer_size = RUN_BUFFER_SIZE;
+    } else if (buffer_size < MIN_RUN_BUFFER_SIZE) {
+        buffer_size = MIN_RUN_BUFFER_SIZE;
+    }
+
+    int r;
+    for (r = 0; r < builder->nr_runs; r++) {
+        index_run_p run = &builder->runs[r];
+        if (run->fd >= 0) {
+            lseek(run->fd, 0, SEEK_SET);
+            run->file = fdopen(run->fd, "rb");
+            run->buffer = (char *) malloc(buffer_size);
+            setvbuf(run->file, run->buffer, _IOFBF, buffer_size);
+        }
+
+        next_run_word(run);
+        if (run->stem) {
+            push_run(builder, r);
+        }
+    }
+}
+
+/*
+ * Returns the stem of the alphabetically next word of all runs (NULL = no words left), the stem is valid until the
+ * next call; its documents in all runs are read with next_merged_posting (the ones not read are skipped)
+ */
+char *next_merged_word(index_builder_p builder) {
+    int count, size;
+    unsigned char *list;
+    while (next_merged_posting(builder, &count, &list, &size) != INT_MAX) {
+    }
+
+    if (!builder->heap_size) {
+        return NULL;
+    }
+
+    char *stem = builder->runs[builder->heap[0]].stem;
+    int len = strlen(stem);
+    if (len + 1 > builder->max_merged_stem) {
+        builder->max_merged_stem = len + 1;
+        builder->merged_stem = (char *) realloc(builder->merged_stem, builder->max_merged_stem);
+    }
+    memcpy(builder->merged_stem, stem, len + 1);
+
+    builder->merging = pop_run(builder);
+    open_run_postings(builder);
+
+    return builder->merged_stem;
+}
+
+/*
+ * Reads the next document of the word returned by next_merged_word, returns its id (INT_MAX = no documents left)
+ *  count: returns the number of occurances of the word in the document
+ *  list: returns the encoded position list of the document (as cursor_position_list), valid until the next call
+ *  size: returns the number of bytes of the position list
+ */
+int next_merged_posting(index_builder_p builder, int *count, unsigned char **list, int *size) {
+    while (builder->merging >= 0) {
+        index_run_p run = &builder->runs[builder->merging];
+        if (run->fd < 0) {
+            int doc = cursor_read(&builder->cursor, count, list, size);
+            if (doc != INT_MAX) {
+                return doc;
+            }
+        }
+
+        if (run->fd >= 0 && run->nr_docs) {
+            run->nr_docs--;
+            builder->merged_doc += read_number(run->file);
+            *count = read_number(run->file);
+
+            *size = read_number(run->file);
+            if (*size > run->max_positions) {
+                run->max_positions = *size;
+                run->positions = (unsigned char *) realloc(run->positions, run->max_positions);
+            }
+
+            *list = run->positions;
+            if (fread(run->positions, 1, *size, run->file) != *size) {
+                *size = 0;
+            }
+            return builder->merged_doc;
+        }
+
+        // runs with the same stem come out of the heap in the order of their documents
+        next_run_word(run);
+        if (run->stem) {
+            push_run(builder, builder->merging);
+        }
+
+        builder->merging = -1;
+        if (builder->heap_size && !strcmp(builder->runs[builder->heap[0]].stem, builder->merged_stem)) {
+            builder->merging = pop_run(builder);
+            open_run_postings(builder);
+        }
+    }
+
+    return INT_MAX;
+}
+
+/*
+ * Prepares to read the documents of the current word of the run being merged
+ */
+void open_run_postings(index_builder_p builder) {
+    index_run_p run = &builder->runs[builder->merging];
+    if (run->fd < 0) {
+        open_cursor(&builder->cursor, run->words[run->pos - 1]);
+    }
+    builder->merged_doc = 0;
+}
+
+/*
+ * Moves a run on to its next word (stem = NULL if there is none)
+ */
+void next_run_word(index_run_p run) {
+    if (run->fd < 0) {
+        run->stem = run->pos < run->nr_words ? run->words[run->pos++]->stem : NULL;
+        return;
+    }
+
+    int len = read_number(run->file);
+    if (!len) {
+        free(run->stem);
+        run->stem = NULL;
+        run->max_stem = 0;
+        return;
+    }
+
+    if (len + 1 > run->max_stem) {
+        run->max_stem = len + 1;
+        run->stem = (char *) realloc(run->stem, run->max_stem);
+    }
+
+    if (fread(run->stem, 1, len, run->file) != len) {
+        len = 0;
+    }
+    run->stem[len] = '\0';
+    run->nr_docs = read_number(run->file);
+}
+
+/*
+ * Adds a run to the heap of runs
+ */
+void push_run(index_builder_p builder, int r) {
+    int *heap = builder->heap;
+    int i = builder->heap_size++;
+
+    // move up while the parent comes later
+    while (i && cmp_run(builder, r, heap[(i - 1) / 2]) < 0) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+
+    heap[i] = r;
+}
+
+/*
+ * Removes the run with the alphabetically first stem from the heap of runs and returns it
+ */
+int pop_run(index_builder_p builder) {
+    int *heap = builder->heap;
+    int top = heap[0];
+    int r = heap[--builder->heap_size];
+
+    // move the last run down from the top while a child comes earlier
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= builder->heap_size) {
+            break;
+        }
+
+        if (child + 1 < builder->heap_size && cmp_run(builder, heap[child + 1], heap[child]) < 0) {
+            child++;
+        }
+
+        if (cmp_run(builder, heap[child], r) >= 0) {
+            break;
+        }
+
+        heap[i] = heap[child];
+        i = child;
+    }
+
+    heap[i] = r;
+    return top;
+}
+
+/*
+ * Compares two runs by the stems of their next words, then by their order
+ */
+int cmp_run(index_builder_p builder, int a, int b) {
+    int cmp = strcmp(builder->runs[a].stem, builder->runs[b].stem);
+    return cmp ? cmp : a - b;
+}
+
+/*
+ * Writes a number in groups of 7 bits, lowest first, the highest bit of each byte tells if more follow
+ */
+void write_number(FILE *f, unsigned int n) {
+    while (n >= 0x80) {
+        putc((n & 0x7f) | 0x80, f);
+        n >>= 7;
+    }
+
+    putc(n, f);
+}
+
+/*
+ * Reads a number written by write_number (0 at the end of the file)
+ */
+unsigned int read_number(FILE *f) {
+    unsigned int n = 0;
+    int shift = 0, c;
+    while ((c = getc(f)) != EOF) {
+        n |= (unsigned int) (c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            break;
+        }
+        shift += 7;
+    }
+
+    return n;
+}
+
+/*
+ * Layout of the manifest (all numbers in host byte order):
+ *  header
+ *  segments            nr_segments x manifest_segment_t, ordered by document id
+ *  removed             nr_removed x int, ids of removed documents whose words are still in the segment files
+ */
+typedef struct manifest_header {
+    char magic[8];              // MANIFEST_MAGIC
+    int version;                // MANIFEST_VERSION
+    int byte_order;             // MANIFEST_BYTE_ORDER as written by the host
+    int generation;             // generation of the index (the journal continues it)
+    int nr_segments;            // number of segments
+    int nr_removed;             // number of removed documents
+    int next_segment;           // number of the next segment file
+} manifest_header_t, *manifest_header_p;
+
+typedef struct manifest_segment {
+    int number;                 // number of the segment file
+    int first_doc;              // id of the first document of the segment
+    int last_doc;               // id after the last document of the segment
+    int reserved;
+} manifest_segment_t, *manifest_segment_p;
+
+typedef struct segment_merge {
+    pthread_t thread;           // thread writing the merged segment
+    int first;                  // position of the first segment merged in the list of segments
+    int nr_segments;            // number of segments merged
+    int first_doc;              // id of the first document of these segments
+    int last_doc;               // id after the last document of these segments
+    char **files;               // files of these segments
+    int number;                 // number of the merged segment file
+    char *file;                 // merged segment file
+    char *removed;              // per document: 1 = removed before the merge started (left out of the merged segment)
+    long memory_budget;         // memory the runs may use while merging (the memory budget of the index)
+    int ok;                     // 1 = merged segment written
+    int done;                   // 1 = thread finished
+    pthread_mutex_t lock;       // protects done
+} segment_merge_t, *segment_merge_p;
+
+char *segment_file(int number);
+index_segment_p add_segment(index_p index, int number, int first_doc, int last_doc);
+int write_manifest(index_p index);
+void remove_unused_segments(index_p index);
+int segment_tier(index_segment_p segment);
+void start_segment_merge(index_p index);
+void *run_segment_merge(void *arg);
+void finish_segment_merge(index_p index);
+void free_segment_merge(segment_merge_p m);
+
+/*
+ * The words of the index are kept in segments: immutable index files, each with the documents of a range of ids.
+ * New documents go to the words in memory (and the journal) until these are written to a segment of their own,
+ * so adding documents never rewrites the words of older ones. Segments aren't modified in memory either, snapshots
+ * of the index share them (see snapshots.c): a removed document stays in its segment, it is just skipped and the
+ * document frequencies of its words are corrected per segment. The manifest names the segments and lists the
+ * documents removed from them; it is replaced at once whenever they change.
+ * Once MERGE_FACTOR neighbouring segments are in the same tier (their files have about the same size), a thread
+ * merges them into one in the background, leaving out removed documents. Merging doesn't change the ids of the
+ * documents, so the words in memory and the journal stay valid meanwhile. Searches and the TF-IDF weights take
+ * the words of all segments together.
+ */
+
+/*
+ * Loads the segments listed in the manifest (or the index file of a version without segments) and replays the journal
+ * returns 1 on success, 0 if there is no index to load
+ */
+int load_segments(index_p index) {
+    FILE *f = fopen(MANIFEST_FILE, "rb");
+    int ok = 1, i;
+
+    if (!f) {
+        // index written before there were segments: a single file with all documents
+        index_segment_p segment = add_segment(index, 0, 0, 0);
+        ok = map_index_file(index, &segment->words, INDEX_FILE);
+        segment->last_doc = index->nr_doc_ids;
+        index->generation = segment->words.generation;
+        index->next_segment = 1;
+    } else {
+        manifest_header_t header;
+        ok = fread(&header, sizeof(manifest_header_t), 1, f) == 1
+            && !memcmp(header.magic, MANIFEST_MAGIC, sizeof(header.magic)) && header.version == MANIFEST_VERSION
+            && header.byte_order == MANIFEST_BYTE_ORDER && header.nr_segments > 0 && header.nr_removed >= 0;
+
+        for (i = 0; ok && i < header.nr_segments; i++) {
+            manifest_segment_t entry;
+            ok = fread(&entry, sizeof(manifest_segment_t), 1, f) == 1;
+            if (ok) {
+                index_segment_p segment = add_segment(index, entry.number, entry.first_doc, entry.last_doc);
+                char *file = segment_file(entry.number);
+                ok = map_index_file(index, &segment->words, file);
+                free(file);
+            }
+        }
+
+        // documents removed after their segment was written
+        for (i = 0; ok && i < header.nr_removed; i++) {
+            int doc_id;
+            ok = fread(&doc_id, sizeof(int), 1, f) == 1;
+            if (ok && doc_id >= 0 && doc_id < index->nr_doc_ids && get_document(index, doc_id)->name) {
+                delete_document(index, doc_id);
+            }
+        }
+
+        fclose(f);
+
+        if (!ok) {
+            printf("Error: %s is not a valid manifest.\n", MANIFEST_FILE);
+        } else {
+            index->generation = header.generation;
+            index->next_segment = header.next_segment;
+        }
+    }
+
+    if (!ok) {
+        // start over with an empty index (keeping the stem cache)
+        stem_cache_p stem_cache = index->stem_cache;
+        index->stem_cache = NULL;
+        clear_index(index);
+        init_index(index);
+        index->stem_cache = stem_cache;
+        return 0;
+    }
+
+    // the index keeps the stopwords of the newest segment
+    index_segment_p last = &index->segments[index->nr_segments - 1];
+    index->stopwords = last->words.stopwords;
+    last->words.stopwords = NULL;
+
+    // apply the changes made since the last segment was written
+    open_journal(index, JOURNAL_FILE);
+    return 1;
+}
+
+/*
+ * Writes the words in memory to a new segment with the documents from the end of the last segment on,
+ * then starts a new journal
+ *  builder: the words of the segment are merged from the runs of the builder instead (NULL = none),
+ *           the runs have to include the words in memory
+ */
+void flush_segment(index_p index, index_builder_p builder) {
+    int first = index->nr_segments ? index->segments[index->nr_segments - 1].last_doc : 0;
+    int last = index->nr_doc_ids;
+
+    index->generation++;
+
+    // the sums of the documents lagging behind the df of their words catch up once per segment
+    settle_norms(index);
+
+    // the first segment is written even without documents, it keeps the stopwords
+    if (last > first || !index->nr_segments) {
+        int number = index->next_segment++;
+        char *file = segment_file(number);
+
+        if (!write_index_file(index, file, builder, first, last)) {
+            index->generation--;
+            free(file);
+            return;
+        }
+
+        index_segment_p segment = add_segment(index, number, first, last);
+        if (!map_index_file(index, &segment->words, file)) {
+            printf("Error: couldn't map %s.\nChanges to the index won't be saved!\n", file);
+            clear_index(&segment->words);
+            index->nr_segments--;
+            index->generation--;
+            close_journal(index);
+            free(file);
+            return;
+        }
+
+        free(file);
+
+        // the words in memory are part of the segment now
+        retire_words(index);
+        init_words(index);
+    }
+
+    // the journal of the previous generation stays valid until the manifest lists the new segment
+    if (!write_manifest(index)) {
+        return;
+    }
+
+    reset_journal(index, JOURNAL_FILE);
+    remove_unused_segments(index);
+    check_merge(index);
+}
+
+/*
+ * Releases all segments (a running merge is finished first), the names of the documents are copied from the
+ * segment files; the files are deleted once the manifest doesn't list them anymore
+ */
+void clear_segments(index_p index) {
+    wait_for_merge(index);
+
+    int i;
+    for (i = 0; i < index->nr_doc_ids; i++) {
+        char *name = get_document(index, i)->name;
+        if (name && is_mapped(index, name)) {
+            change_document(index, i)->name = (char *) malloc(strlen(name) + 1);
+            memcpy(get_document(index, i)->name, name, strlen(name) + 1);
+        }
+    }
+
+    // snapshots may still search the segments
+    for (i = 0; i < index->nr_segments; i++) {
+        retire_segment(index, &index->segments[i]);
+    }
+
+    free(index->segments);
+    index->segments = NULL;
+    index->nr_segments = 0;
+    index->nr_removed = 0;
+}
+
+/*
+ * Returns the segment containing the words of a document, NULL if they are in memory
+ */
+index_segment_p document_segment(index_p index, int doc_id) {
+    // binary search the segments for the first one ending after the document
+    int min = 0, max = index->nr_segments;
+    while (min < max) {
+        int middle = (min + max) / 2;
+        if (index->segments[middle].last_doc <= doc_id) {
+            min = middle + 1;
+        } else {
+            max = middle;
+        }
+    }
+
+    if (min < index->nr_segments && index->segments[min].first_doc <= doc_id) {
+        return &index->segments[min];
+    }
+
+    return NULL;
+}
+
+/*
+ * Takes a removed document out of the document frequencies of the words of its segment (the segment file
+ * keeps its words), returns the number of words of the document
+ *  words: returns the indexes of these words in the segment if not NULL (to be freed by the caller)
+ */
+int remove_segment_document(index_p index, index_segment_p segment, int doc_id, int **words) {
+    int *doc_words = NULL;
+    int nr_doc_words = read_document_words(&segment->words, doc_id, &doc_words);
+
+    if (nr_doc_words < 0) {
+        // older segment files don't record the words of their documents, look for the document in every list
+        int max_doc_words = 0, wid;
+        nr_doc_words = 0;
+        for (wid = 0; wid < segment->words.nr_words; wid++) {
+            posting_cursor_t c;
+            open_cursor(&c, &segment->words.words[wid]);
+            if (cursor_seek(&c, doc_id) != doc_id) {
+                continue;
+            }
+
+            if (nr_doc_words == max_doc_words) {
+                max_doc_words = max_doc_words ? max_doc_words * 2 : 64;
+                doc_words = (int *) realloc(doc_words, sizeof(int) * max_doc_words);
+            }
+
+            doc_words[nr_doc_words++] = wid;
+        }
+    }
+
+    int k;
+    for (k = 0; k < nr_doc_words; k++) {
+        (*change_removed_df(index, segment, doc_words[k]))++;
+    }
+
+    if (words) {
+        *words = doc_words;
+    } else {
+        free(doc_words);
+    }
+
+    return nr_doc_words;
+}
+
+/*
+ * Returns the number of removed documents containing a word of a segment to be changed, the pages of the counts
+ * are copied first if snapshots share them (pages are added as needed)
+ *  wid: index of the word in the segment
+ */
+int *change_removed_df(index_p index, index_segment_p segment, int wid) {
+    int nr_pages = segment->words.nr_words / REMOVED_DF_PAGE_SIZE + 1;
+    if (!segment->removed_df) {
+        segment->removed_df = (int **) calloc(nr_pages, sizeof(int *));
+        segment->removed_df_stamps = (int *) malloc(sizeof(int) * nr_pages);
+        segment->removed_df_stamp = index->nr_snapshots;
+    }
+
+    segment->removed_df = (int **) own_memory(index, segment->removed_df, &segment->removed_df_stamp,
+        sizeof(int *) * nr_pages);
+
+    int page = wid / REMOVED_DF_PAGE_SIZE;
+    if (!segment->removed_df[page]) {
+        segment->removed_df[page] = (int *) calloc(REMOVED_DF_PAGE_SIZE, sizeof(int));
+        segment->removed_df_stamps[page] = index->nr_snapshots;
+    }
+
+    segment->removed_df[page] = (int *) own_memory(index, segment->removed_df[page], &segment->removed_df_stamps[page],
+        sizeof(int) * REMOVED_DF_PAGE_SIZE);
+
+    return &segment->removed_df[page][wid % REMOVED_DF_PAGE_SIZE];
+}
+
+/*
+ * Releases the counts of removed documents of a segment
+ */
+void free_removed_df(index_segment_p segment) {
+    if (!segment->removed_df) {
+        return;
+    }
+
+    int p;
+    for (p = 0; p <= segment->words.nr_words / REMOVED_DF_PAGE_SIZE; p++) {
+        free(segment->removed_df[p]);
+    }
+
+    free(segment->removed_df);
+    free(segment->removed_df_stamps);
+}
+
+/*
+ * Remembers a document removed from a segment, the segment file still contains its words
+ */
+void add_removed(index_p index, int doc_id) {
+    // list full => double the size
+    if (index->nr_removed == index->max_removed) {
+        index->max_removed = index->max_removed ? index->max_removed * 2 : 64;
+        index->removed = (int *) realloc(index->removed, sizeof(int) * index->max_removed);
+    }
+
+    index->removed[index->nr_removed++] = doc_id;
+}
+
+/*
+ * Returns the number of documents of all segments and of the words in memory containing a word (removed ones don't count)
+ */
+int word_df(index_p index, char *stem) {
+    int df = 0, s;
+    for (s = 0; s <= index->nr_segments; s++) {
+        index_p words = s < index->nr_segments ? &index->segments[s].words : index;
+        int wid = find_word(words, stem);
+        if (wid >= 0) {
+            df += words->words[wid].nr_docs;
+
+            int **removed_df = s < index->nr_segments ? index->segments[s].removed_df : NULL;
+            if (removed_df && removed_df[wid / REMOVED_DF_PAGE_SIZE]) {
+                df -= removed_df[wid / REMOVED_DF_PAGE_SIZE][wid % REMOVED_DF_PAGE_SIZE];
+            }
+        }
+    }
+
+    return df;
+}
+
+/*
+ * Puts a finished background merge into effect and starts the next merge if segments are due to be merged
+ * returns 1 if the segments changed, 0 otherwise
+ */
+int check_merge(index_p index) {
+    int merged = 0;
+    if (index->merge) {
+        pthread_mutex_lock(&index->merge->lock);
+        int done = index->merge->done;
+        pthread_mutex_unlock(&index->merge->lock);
+
+        if (!done) {
+            return 0;
+        }
+
+        finish_segment_merge(index);
+        merged = 1;
+    }
+
+    start_segment_merge(index);
+    return merged;
+}
+
+/*
+ * Waits for a running background merge and puts it into effect
+ */
+void wait_for_merge(index_p index) {
+    if (index->merge) {
+        finish_segment_merge(index);
+    }
+}
+
+/*
+ * Returns the name of a segment file (to be freed by the caller)
+ */
+char *segment_file(int number) {
+    char *file = (char *) malloc(sizeof(INDEX_FILE) + 12);
+    if (number) {
+        sprintf(file, "%s.%d", INDEX_FILE, number);
+    } else {
+        strcpy(file, INDEX_FILE);
+    }
+
+    return file;
+}
+
+/*
+ * Appends an empty segment to the segments of the index
+ */
+index_segment_p add_segment(index_p index, int number, int first_doc, int last_doc) {
+    index->segments = (index_segment_p) realloc(index->segments, sizeof(index_segment_t) * (index->nr_segments + 1));
+
+    index_segment_p segment = &index->segments[index->nr_segments++];
+    segment->number = number;
+    segment->first_doc = first_doc;
+    segment->last_doc = last_doc;
+    segment->removed_df = NULL;
+    segment->removed_df_stamps = NULL;
+    init_index(&segment->words);
+
+    return segment;
+}
+
+/*
+ * Writes the manifest, under a temporary name first so the old one stays valid until the new one is complete
+ * returns 1 on success, 0 otherwise
+ */
+int write_manifest(index_p index) {
+    double start = now_seconds();
+
+    char tmp_file[] = MANIFEST_FILE ".tmp";
+
+    FILE *f = fopen(tmp_file, "wb");
+    if (!f) {
+        printf("Error: couldn't open %s to write.\nChanges to the segments won't be saved!\n", tmp_file);
+        return 0;
+    }
+
+    manifest_header_t header;
+    memset(&header, 0, sizeof(manifest_header_t));
+    memcpy(header.magic, MANIFEST_MAGIC, sizeof(header.magic));
+    header.version = MANIFEST_VERSION;
+    header.byte_order = MANIFEST_BYTE_ORDER;
+    header.generation = index->generation;
+    header.nr_segments = index->nr_segments;
+    header.nr_removed = index->nr_removed;
+    header.next_segment = index->next_segment;
+    fwrite(&header, sizeof(manifest_header_t), 1, f);
+
+    int i;
+    for (i = 0; i < index->nr_segments; i++) {
+        manifest_segment_t entry;
+        entry.number = index->segments[i].number;
+        entry.first_doc = index->segments[i].first_doc;
+        entry.last_doc = index->segments[i].last_doc;
+        entry.reserved = 0;
+        fwrite(&entry, sizeof(manifest_segment_t), 1, f);
+    }
+
+    if (index->nr_removed) {
+        fwrite(index->removed, sizeof(int), index->nr_removed, f);
+    }
+
+    if (fflush(f) || fsync(fileno(f)) || ferror(f)) {
+        printf("Error: couldn't write %s.\nChanges to the segments won't be saved!\n", tmp_file);
+        fclose(f);
+        remove(tmp_file);
+        return 0;
+    }
+
+    count_stat(STAT_BYTES_WRITTEN, ftell(f));
+    fclose(f);
+    count_time(STAT_TIME_PERSIST, start);
+
+    return !rename(tmp_file, MANIFEST_FILE);
+}
+
+/*
+ * Deletes the segment files the manifest doesn't list (merged into others or left over from an interrupted write)
+ */
+void remove_unused_segments(index_p index) {
+    glob_t g;
+    if (glob(INDEX_FILE "*", 0, NULL, &g)) {
+        return;
+    }
+
+    int i, s;
+    for (i = 0; i < g.gl_pathc; i++) {
+        // index.bin is segment 0, index.bin.<n> segment n (temporary files are left alone)
+        char *end = g.gl_pathv[i] + strlen(INDEX_FILE);
+        int number = 0;
+        if (*end) {
+            number = *end == '.' ? strtol(end + 1, &end, 10) : 0;
+            if (*end || number <= 0) {
+                continue;
+            }
+        }
+
+        // the merged segment isn't listed until the merge is put into effect
+        if (index->merge && number == index->merge->number) {
+            continue;
+        }
+
+        for (s = 0; s < index->nr_segments && index->segments[s].number != number; s++);
+        if (s == index->nr_segments) {
+            remove(g.gl_pathv[i]);
+        }
+    }
+
+    globfree(&g);
+}
+
+/*
+ * Returns the tier of a segment: 0 for files up to MIN_TIER_SIZE bytes, one more for each factor MERGE_FACTOR
+ */
+int segment_tier(index_segment_p segment) {
+    int tier = 0;
+    long size = MIN_TIER_SIZE;
+    while (segment->words.map_size > size) {
+        tier++;
+        size *= MERGE_FACTOR;
+    }
+
+    return tier;
+}
+
+/*
+ * Starts merging the newest MERGE_FACTOR neighbouring segments of the same tier in the background, if there are any
+ */
+void start_segment_merge(index_p index) {
+    if (index->merge) {
+        return;
+    }
+
+    int first, k;
+    for (first = index->nr_segments - MERGE_FACTOR; first >= 0; first--) {
+        int tier = segment_tier(&index->segments[first]);
+        for (k = 1; k < MERGE_FACTOR && segment_tier(&index->segments[first + k]) == tier; k++);
+        if (k == MERGE_FACTOR) {
+            break;
+        }
+    }
+
+    if (first < 0) {
+        return;
+    }
+
+    segment_merge_p m = (segment_merge_p) malloc(sizeof(segment_merge_t));
+    m->first = first;
+    m->nr_segments = MERGE_FACTOR;
+    m->first_doc = index->segments[first].first_doc;
+    m->last_doc = index->segments[first + MERGE_FACTOR - 1].last_doc;
+    m->files = (char **) malloc(sizeof(char *) * MERGE_FACTOR);
+    for (k = 0; k < MERGE_FACTOR; k++) {
+        m->files[k] = segment_file(index->segments[first + k].number);
+    }
+    m->number = index->next_segment++;
+    m->file = segment_file(m->number);
+    m->memory_budget = index->memory_budget;
+    m->ok = 0;
+    m->done = 0;
+    pthread_mutex_init(&m->lock, NULL);
+
+    // the documents removed by now are left out, the ones removed while merging are taken out afterwards
+    m->removed = (char *) malloc(m->last_doc - m->first_doc + 1);
+    int d;
+    for (d = m->first_doc; d < m->last_doc; d++) {
+        m->removed[d - m->first_doc] = !get_document(index, d)->name;
+    }
+
+    if (pthread_create(&m->thread, NULL, run_segment_merge, m)) {
+        printf("Error: couldn't start merging segments.\n");
+        free_segment_merge(m);
+        return;
+    }
+
+    index->merge = m;
+}
+
+/*
+ * Writes the merged segment (thread function): the segment files are mapped once more, so the thread
+ * doesn't touch anything the index may change meanwhile
+ */
+void *run_segment_merge(void *arg) {
+    segment_merge_p m = (segment_merge_p) arg;
+    double start = now_seconds();
+
+    // the documents of the segments, with the ids they have in the index
+    index_t merged;
+    init_index(&merged);
+    merged.memory_budget = m->memory_budget;
+
+    index_p segments = (index_p) malloc(sizeof(index_t) * m->nr_segments);
+    int i, ok = 1;
+    for (i = 0; i < m->nr_segments; i++) {
+        init_index(&segments[i]);
+        ok = ok && map_index_file(&merged, &segments[i], m->files[i]);
+    }
+
+    if (ok) {
+        int d;
+        for (d = m->first_doc; d < m->last_doc; d++) {
+            if (m->removed[d - m->first_doc]) {
+                change_document(&merged, d)->name = NULL;
+            }
+        }
+
+        merged.stopwords = segments[m->nr_segments - 1].stopwords;
+        segments[m->nr_segments - 1].stopwords = NULL;
+
+        index_builder_p builder = new_index_builder(&merged);
+        for (i = 0; i < m->nr_segments; i++) {
+            add_words_run(builder, &segments[i]);
+        }
+
+        ok = write_index_file(&merged, m->file, builder, m->first_doc, m->last_doc);
+        free_index_builder(builder);
+    }
+
+    // the names of the documents are in the segment files
+    merged.nr_doc_ids = 0;
+    clear_index(&merged);
+
+    for (i = 0; i < m->nr_segments; i++) {
+        clear_index(&segments[i]);
+    }
+    free(segments);
+
+    count_time(STAT_TIME_MERGE, start);
+
+    pthread_mutex_lock(&m->lock);
+    m->ok = ok;
+    m->done = 1;
+    pthread_mutex_unlock(&m->lock);
+
+    return NULL;
+}
+
+/*
+ * Waits for the background merge and replaces the segments merged by the merged segment
+ */
+void finish_segment_merge(index_p index) {
+    segment_merge_p m = index->merge;
+    pthread_join(m->thread, NULL);
+    index->merge = NULL;
+
+    index_segment_t merged;
+    merged.number = m->number;
+    merged.first_doc = m->first_doc;
+    merged.last_doc = m->last_doc;
+    merged.removed_df = NULL;
+    merged.removed_df_stamps = NULL;
+    init_index(&merged.words);
+
+    if (!m->ok || !map_index_file(index, &merged.words, m->file)) {
+        printf("Error: couldn't merge segments.\n");
+        clear_index(&merged.words);
+        remove(m->file);
+        free_segment_merge(m);
+        return;
+    }
+
+    // documents removed while merging are still in the merged segment
+    int d, i;
+    for (d = m->first_doc; d < m->last_doc; d++) {
+        if (!get_document(index, d)->name && !m->removed[d - m->first_doc]) {
+            remove_segment_document(index, &merged, d, NULL);
+        }
+    }
+
+    // the documents left out don't have to be listed in the manifest anymore
+    int nr_removed = 0;
+    for (i = 0; i < index->nr_removed; i++) {
+        d = index->removed[i];
+        if (d < m->first_doc || d >= m->last_doc || !m->removed[d - m->first_doc]) {
+            index->removed[nr_removed++] = d;
+        }
+    }
+    index->nr_removed = nr_removed;
+
+    // the merged segment takes the place of the segments merged (snapshots may still search them)
+    for (i = 0; i < m->nr_segments; i++) {
+        retire_segment(index, &index->segments[m->first + i]);
+    }
+
+    index->segments[m->first] = merged;
+    memmove(&index->segments[m->first + 1], &index->segments[m->first + m->nr_segments],
+        sizeof(index_segment_t) * (index->nr_segments - m->first - m->nr_segments));
+    index->nr_segments -= m->nr_segments - 1;
+
+    if (write_manifest(index)) {
+        remove_unused_segments(index);
+    }
+
+    free_segment_merge(m);
+}
+
+/*
+ * Releases a merge
+ */
+void free_segment_merge(segment_merge_p m) {
+    int i;
+    for (i = 0; i < m->nr_segments; i++) {
+        free(m->files[i]);
+    }
+
+    free(m->files);
+    free(m->file);
+    free(m->removed);
+    pthread_mutex_destroy(&m->lock);
+    free(m);
+}
+
+/*
+ * Searches don't read the index but a snapshot of it. A snapshot shares everything with the index, copying
+ * only the tables the index changes in place: the page tables of the documents and of the norms, the list
+ * of segments and the vocabulary in memory (but not the document lists of its words). The pages and the
+ * document lists are stamped with the number of snapshots published when the index made them; before the
+ * index changes one stamped earlier, it goes on with a copy (own_memory, own_word), so a change copies
+ * only the pieces it touches. The segments are never modified (see segments.c).
+ * The index publishes a new snapshot after each change; a reader pins the current one and may search it
+ * however long the index keeps changing meanwhile, readers never wait for the index and the index never
+ * waits for readers. Whatever the index lets go of while a snapshot is current (pages it copied, names of
+ * removed documents, merged segments, ..) is retired instead of released: it is released with that snapshot,
+ * once neither the snapshot nor an older one has readers left.
+ */
+
+/*
+ * Publishes a snapshot of the index as it is now, the following searches use it
+ * (only the thread changing the index may call this)
+ */
+void publish_snapshot(index_p index) {
+    // readers don't compute anything, the sums of the documents have to be there
+    update_norms(index);
+
+    snapshot_p s = (snapshot_p) malloc(sizeof(snapshot_t));
+    s->refs = 1;
+    s->next = NULL;
+    s->retired = NULL;
+    s->nr_retired = 0;
+    s->max_retired = 0;
+
+    index_p copy = &s->index;
+    *copy = *index;
+
+    // the pages are shared, searches don't look up documents by name
+    int nr_pages = index->max_doc_ids / DOCUMENT_PAGE_SIZE;
+    copy->documents = (indexed_document_p *) copy_memory(index->documents, sizeof(indexed_document_p) * nr_pages);
+    copy->norms = (doc_norm_p *) copy_memory(index->norms, sizeof(doc_norm_p) * nr_pages);
+    copy->document_stamps = NULL;
+    copy->norm_stamps = NULL;
+    copy->by_name = NULL;
+    copy->segments = (index_segment_p) copy_memory(index->segments, sizeof(index_segment_t) * index->nr_segments);
+
+    // the words in memory with their stems and document lists are shared
+    copy->words = (indexed_word_p) copy_memory(index->words, sizeof(indexed_word_t) * index->nr_words);
+    copy->max_words = index->nr_words;
+    copy->slots = (word_slot_p) copy_memory(index->slots, sizeof(word_slot_t) * index->nr_slots);
+    copy->stems = NULL;
+
+    // readers stem their queries without the stem cache, they'd have to take turns using it
+    copy->stem_cache = NULL;
+    copy->map = NULL;
+    copy->map_size = 0;
+    copy->journal = NULL;
+    copy->removed = NULL;
+    copy->nr_removed = 0;
+    copy->max_removed = 0;
+    copy->merge = NULL;
+    copy->snapshots = NULL;
+
+    // whatever the index made before is shared from now on
+    index->nr_snapshots++;
+
+    if (!index->snapshots) {
+        index->snapshots = (snapshot_list_p) malloc(sizeof(snapshot_list_t));
+        pthread_mutex_init(&index->snapshots->lock, NULL);
+        index->snapshots->oldest = NULL;
+        index->snapshots->current = NULL;
+    }
+
+    snapshot_list_p list = index->snapshots;
+    pthread_mutex_lock(&list->lock);
+
+    if (list->current) {
+        list->current->next = s;
+        list->current->refs--;
+    } else {
+        list->oldest = s;
+    }
+    list->current = s;
+
+    snapshot_p unused = take_unused_snapshots(list);
+    pthread_mutex_unlock(&list->lock);
+
+    free_snapshots(unused);
+}
+
+/*
+ * Pins the current snapshot of the index and returns it, to be searched like the index until it is released
+ * (a snapshot must have been published)
+ */
+index_p acquire_snapshot(index_p index) {
+    snapshot_list_p list = index->snapshots;
+
+    pthread_mutex_lock(&list->lock);
+    snapshot_p s = list->current;
+    s->refs++;
+    pthread_mutex_unlock(&list->lock);
+
+    return &s->index;
+}
+
+/*
+ * Releases a snapshot returned by acquire_snapshot, the last reader of old snapshots releases them
+ */
+void release_snapshot(index_p index, index_p snapshot) {
+    snapshot_list_p list = index->snapshots;
+    snapshot_p s = (snapshot_p) snapshot;
+
+    pthread_mutex_lock(&list->lock);
+    s->refs--;
+    snapshot_p unused = take_unused_snapshots(list);
+    pthread_mutex_unlock(&list->lock);
+
+    free_snapshots(unused);
+}
+
+/*
+ * Releases a block of memory the index doesn't use anymore, once the snapshots can't use it either
+ */
+void retire_memory(index_p index, void *memory) {
+    retire(index, RETIRED_MEMORY, memory);
+}
+
+/*
+ * Releases a segment the index doesn't use anymore, once the snapshots can't use it either
+ */
+void retire_segment(index_p index, index_segment_p segment) {
+    retire(index, RETIRED_SEGMENT, copy_memory(segment, sizeof(index_segment_t)));
+}
+
+/*
+ * Releases a set of stopwords the index doesn't use anymore, once the snapshots can't use it either
+ */
+void retire_stopwords(index_p index, stopword_set_p set) {
+    retire(index, RETIRED_STOPWORDS, set);
+}
+
+/*
+ * Returns a block of memory of the index to be changed: a block stamped before the current snapshot was published
+ * may be read by snapshots, the index goes on with a copy of it then and the block is retired
+ *  stamp: number of snapshots published when the block was made, updated for the copy
+ *  size: number of bytes of the block
+ */
+void *own_memory(index_p index, void *memory, int *stamp, size_t size) {
+    if (!memory || *stamp == index->nr_snapshots) {
+        return memory;
+    }
+
+    void *copy = copy_memory(memory, size);
+    retire_memory(index, memory);
+    *stamp = index->nr_snapshots;
+
+    return copy;
+}
+
+/*
+ * Makes sure a word in memory owns its document list before the list is changed: a list stamped before
+ * the current snapshot was published may be read by snapshots, the word goes on with a copy of it then
+ */
+void own_word(index_p index, indexed_word_p w) {
+    if (w->stamp == index->nr_snapshots) {
+        return;
+    }
+
+    indexed_word_t shared = *w;
+    copy_postings(w, &shared);
+    w->stamp = index->nr_snapshots;
+
+    retire_postings(index, &shared);
+}
+
+/*
+ * Releases the words in memory like clear_words, their document lists and stems once the snapshots can't use them
+ * either (the snapshots have vocabularies of their own)
+ */
+void retire_words(index_p index) {
+    int i;
+    for (i = 0; i < index->nr_words; i++) {
+        retire_postings(index, &index->words[i]);
+    }
+    index->nr_words = 0;
+
+    stem_block_p b;
+    while ((b = index->stems)) {
+        index->stems = b->next;
+        retire_memory(index, b);
+    }
+
+    clear_words(index);
+}
+
+/*
+ * Releases all snapshots of the index, none of them may be in use anymore
+ */
+void close_snapshots(index_p index) {
+    snapshot_list_p list = index->snapshots;
+    if (!list) {
+        return;
+    }
+
+    list->current->refs--;
+    free_snapshots(take_unused_snapshots(list));
+
+    pthread_mutex_destroy(&list->lock);
+    free(list);
+    index->snapshots = NULL;
+}
+
+/*
+ * Returns a copy of a block of memory (NULL for NULL)
+ */
+void *copy_memory(void *memory, size_t size) {
+    if (!memory) {
+        return NULL;
+    }
+
+    void *copy = malloc(size + 1);
+    memcpy(copy, memory, size);
+
+    return copy;
+}
+
+/*
+ * Adds an object to the objects retired while the current snapshot is current, or releases it right away
+ * if there is no snapshot
+ */
+void retire(index_p index, int type, void *object) {
+    if (!object) {
+        return;
+    }
+
+    // the current snapshot isn't released while it is current, so it doesn't have to be locked
+    snapshot_p s = index->snapshots ? index->snapshots->current : NULL;
+    if (!s) {
+        release_object(type, object);
+        return;
+    }
+
+    // list full => double the size
+    if (s->nr_retired == s->max_retired) {
+        s->max_retired = s->max_retired ? s->max_retired * 2 : 64;
+        s->retired = (retired_object_p) realloc(s->retired, sizeof(retired_object_t) * s->max_retired);
+    }
+
+    s->retired[s->nr_retired].type = type;
+    s->retired[s->nr_retired].object = object;
+    s->nr_retired++;
+}
+
+/*
+ * Releases the document list of a word like free_postings, once the snapshots can't use it either
+ */
+void retire_postings(index_p index, indexed_word_p w) {
+    // packed blocks in the mapped index file are not owned by the word
+    if (w->max_blocks) {
+        retire_memory(index, w->blocks);
+        retire_memory(index, w->data);
+        retire_memory(index, w->block_positions);
+    }
+
+    if (w->max_positions) {
+        retire_memory(index, w->positions);
+    }
+
+    retire_memory(index, w->tail);
+}
+
+/*
+ * Unlinks the oldest snapshots without readers from the list and returns them, in the order of their age
+ * (a snapshot is kept as long as an older one is in use: the objects it retired may be used by that one)
+ */
+snapshot_p take_unused_snapshots(snapshot_list_p list) {
+    snapshot_p first = list->oldest, last = NULL, s;
+    for (s = list->oldest; s && !s->refs; s = s->next) {
+        last = s;
+    }
+
+    if (!last) {
+        return NULL;
+    }
+
+    list->oldest = last->next;
+    if (!list->oldest) {
+        list->current = NULL;
+    }
+    last->next = NULL;
+
+    return first;
+}
+
+/*
+ * Releases a list of snapshots unlinked by take_unused_snapshots together with the objects they retired
+ */
+void free_snapshots(snapshot_p s) {
+    while (s) {
+        snapshot_p next = s->next;
+
+        // the snapshot owns its tables only
+        free(s->index.documents);
+        free(s->index.norms);
+        free(s->index.segments);
+        free(s->index.words);
+        free(s->index.slots);
+
+        int i;
+        for (i = 0; i < s->nr_retired; i++) {
+            release_object(s->retired[i].type, s->retired[i].object);
+        }
+
+        free(s->retired);
+        free(s);
+        s = next;
+    }
+}
+
+/*
+ * Releases a retired object
+ */
+void release_object(int type, void *object) {
+    if (type == RETIRED_SEGMENT) {
+        index_segment_p segment = (index_segment_p) object;
+        free_removed_df(segment);
+        clear_index(&segment->words);
+        free(segment);
+    } else if (type == RETIRED_STOPWORDS) {
+        free_stopwords((stopword_set_p) object);
+    } else {
+        free(object);
+    }
+}
+
+/*
+ * The server answers search requests of other programs over a unix domain socket or a TCP socket on localhost,
+ * while the REPL keeps changing the index. A polling thread accepts the connections and waits for their requests;
+ * a connection sending one is queued for a fixed number of worker threads, which answer one request at a time
+ * each and hand the connection back to the polling thread, so idle connections don't occupy a worker. Every
+ * request searches the snapshot current when it arrives. The polling thread closes connections idle for
+ * SERVER_IDLE_TIMEOUT seconds, a worker closes a connection sending a request or taking a response slower than
+ * SERVER_IO_TIMEOUT seconds. Requests and responses are frames: the length of the payload (4 bytes, network byte
+ * order) followed by the payload, text without \0. A connection may send any number of requests, each is answered
+ * before the next one is read. Requests:
+ *  search <query>      response "ok <n>\n" followed by n lines "<score>\t<name>\t<terms>\n", best document first
+ *  ping                response "ok 0\n"
+ * Anything else is answered by "error <message>\n".
+ */
+
+/*
+ * Starts serving searches in the background, returns the server (NULL if the socket can't be opened)
+ *  address: port number (TCP on localhost) or path of a unix domain socket
+ *  nr_threads: number of worker threads (0 = one per processor)
+ */
+server_p start_server(index_p index, char *address, int nr_threads) {
+    if (nr_threads <= 0) {
+        nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    server_p server = (server_p) malloc(sizeof(server_t));
+    server->index = index;
+    server->path = NULL;
+    server->nr_connections = 0;
+    server->queue_start = 0;
+    server->queue_size = 0;
+    server->nr_returned = 0;
+    server->stopping = 0;
+
+    if (!open_listen_socket(server, address)) {
+        free(server->path);
+        free(server);
+        return NULL;
+    }
+
+    if (pipe(server->wake)) {
+        printf("Error: couldn't create a pipe.\n");
+        close(server->listen_fd);
+        free(server->path);
+        free(server);
+        return NULL;
+    }
+
+    // workers handing back connections mustn't wait for the polling thread
+    fcntl(server->wake[1], F_SETFL, O_NONBLOCK);
+
+    pthread_mutex_init(&server->lock, NULL);
+    pthread_cond_init(&server->changed, NULL);
+
+    server->nr_workers = nr_threads;
+    server->workers = (pthread_t *) malloc(sizeof(pthread_t) * nr_threads);
+    server->connections = (int *) malloc(sizeof(int) * nr_threads);
+
+    int i;
+    for (i = 0; i < nr_threads; i++) {
+        server_worker_p worker = (server_worker_p) malloc(sizeof(server_worker_t));
+        worker->server = server;
+        worker->nr = i;
+        server->connections[i] = -1;
+        pthread_create(&server->workers[i], NULL, serve_requests, worker);
+    }
+
+    pthread_create(&server->poller, NULL, poll_connections, server);
+
+    printf("Serving searches on %s with %d threads.\n", address, nr_threads);
+    return server;
+}
+
+/*
+ * Stops the server: connections are closed (requests being answered are finished first) and the threads end
+ */
+void stop_server(server_p server) {
+    pthread_mutex_lock(&server->lock);
+    server->stopping = 1;
+
+    // workers waiting for the rest of a request wake up
+    int i;
+    for (i = 0; i < server->nr_workers; i++) {
+        if (server->connections[i] >= 0) {
+            shutdown(server->connections[i], SHUT_RDWR);
         }
+    }
+
+    pthread_cond_broadcast(&server->changed);
+    pthread_mutex_unlock(&server->lock);
+
+    if (write(server->wake[1], "", 1) != 1 && errno != EAGAIN) {
+        printf("Error: couldn't wake the server.\n");
+    }
+
+    pthread_join(server->poller, NULL);
+    for (i = 0; i < server->nr_workers; i++) {
+        pthread_join(server->workers[i], NULL);
+    }
+
+    // connections with requests never answered and connections answered last (the polling thread closed the others)
+    for (i = 0; i < server->queue_size; i++) {
+        close(server->queue[(server->queue_start + i) % SERVER_MAX_CONNECTIONS]);
+    }
+    for (i = 0; i < server->nr_returned; i++) {
+        close(server->returned[i]);
+    }
+
+    close(server->listen_fd);
+    close(server->wake[0]);
+    close(server->wake[1]);
+    if (server->path) {
+        unlink(server->path);
+        free(server->path);
+    }
+
+    pthread_cond_destroy(&server->changed);
+    pthread_mutex_destroy(&server->lock);
+    free(server->workers);
+    free(server->connections);
+    free(server);
+
+    printf("Server stopped.\n");
+}
 
-        euclid_dist[nr_results].dist = sqrtf(euclid_dist[nr_results].dist);
+/*
+ * Waits until the server stops by itself, which it only does if it can't accept connections anymore
+ * (to be released by stop_server afterwards)
+ */
+void wait_for_server(server_p server) {
+    pthread_mutex_lock(&server->lock);
+    while (!server->stopping) {
+        pthread_cond_wait(&server->changed, &server->lock);
+    }
+    pthread_mutex_unlock(&server->lock);
+}
 
-        // overwrite documents above threshold or without any hits in next iteration
-        if (euclid_dist[nr_results].flag && euclid_dist[nr_results].dist < euclid_threshold) {
-            nr_results++;
+/*
+ * Opens the socket accepting connections, returns 1 on success, 0 otherwise
+ */
+int open_listen_socket(server_p server, char *address) {
+    char *end;
+    long port = strtol(address, &end, 10);
+
+    if (*address && !*end) {
+        // port number: TCP, only reachable from this host
+        struct sockaddr_in a;
+        memset(&a, 0, sizeof(a));
+        a.sin_family = AF_INET;
+        a.sin_port = htons(port);
+        a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        server->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+        int on = 1;
+        setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+        if (port <= 0 || port > 65535 || bind(server->listen_fd, (struct sockaddr *) &a, sizeof(a))) {
+            printf("Error: couldn't listen on port %s.\n", address);
+            close(server->listen_fd);
+            return 0;
+        }
+    } else {
+        // anything else is the path of a unix domain socket, a socket left over by an earlier server is replaced
+        struct sockaddr_un a;
+        memset(&a, 0, sizeof(a));
+        a.sun_family = AF_UNIX;
+        if (strlen(address) >= sizeof(a.sun_path)) {
+            printf("Error: socket path %s too long.\n", address);
+            return 0;
+        }
+        strcpy(a.sun_path, address);
+        unlink(address);
+
+        server->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (bind(server->listen_fd, (struct sockaddr *) &a, sizeof(a))) {
+            printf("Error: couldn't listen on %s.\n", address);
+            close(server->listen_fd);
+            return 0;
         }
+
+        server->path = (char *) malloc(strlen(address) + 1);
+        strcpy(server->path, address);
     }
 
-    free(q_tfidf);
-    free(w_offset);
+    if (listen(server->listen_fd, SOMAXCONN)) {
+        printf("Error: couldn't listen on %s.\n", address);
+        close(server->listen_fd);
+        return 0;
+    }
 
-    // sort documents by euclidian distance to query
-    qsort(euclid_dist, nr_results, sizeof(doc_found_t), cmp_doc_found_desc);
+    return 1;
+}
 
-    // create result index
-    index_p result = (index_p) malloc(sizeof(index_t) + sizeof(indexed_document_t) * MAX_SEARCH_RESULTS);
-    result->nr_docs = 0;
-    result->nr_words = 0;
-    result->words = NULL;
+/*
+ * Accepts connections and queues those sending a request for the workers (thread function), until the server stops
+ */
+void *poll_connections(void *arg) {
+    server_p server = (server_p) arg;
 
-    unsigned long last_flag = 0;    // flag of last processed document
-    w = NULL;                       // current group of documents (of the same (sub-)set of search terms)
-    indexed_word_p p = NULL;        // previous group of documents
+    // the listening socket and the pipe, followed by the connections waiting for a request
+    struct pollfd fds[SERVER_MAX_CONNECTIONS + 2];
+    double idle_since[SERVER_MAX_CONNECTIONS + 2];
+    fds[0].fd = server->listen_fd;
+    fds[1].fd = server->wake[0];
+    fds[1].events = POLLIN;
+    int nr_fds = 2, i;
 
-    // create a index_p struct with the results, each 'word' in this index represents a group of documents which contains the same (sub-)set of search terms
-    int i;
-    for (i = 0; i <= MAX_SEARCH_RESULTS && i < nr_results; i++) {
-        if (euclid_dist[i].flag != last_flag || i == 0) {
-            // the flag is not equal to previous one => create new 'group' of documents
-            indexed_word_p w_new = (indexed_word_p) malloc(sizeof(indexed_word_t));
-            w_new->next = NULL;
-            w_new->nr_docs = 0;
-            w_new->stem = (char *) malloc(1);
-            *w_new->stem = '\0';
-
-            // create a string of all search terms found in this document
-            int k;
-            for (k = 0; k < index->documents[0].nr_words; k++) {
-                // check whether k-th most significant bit is set
-                if (euclid_dist[i].flag & (1 << (sizeof(unsigned long) * 8 - 1 - k))) {
-                    w_new->stem = (char *) realloc(w_new->stem, strlen(w_new->stem) + strlen(words[k]) + 3);
-                    strcat(w_new->stem, words[k]);
-                    strcat(w_new->stem, ", ");
-                }
+    for (;;) {
+        pthread_mutex_lock(&server->lock);
+        if (server->stopping) {
+            pthread_mutex_unlock(&server->lock);
+            break;
+        }
+
+        // connections answered by the workers wait for their next request
+        while (server->nr_returned) {
+            fds[nr_fds].fd = server->returned[--server->nr_returned];
+            fds[nr_fds].events = POLLIN;
+            idle_since[nr_fds++] = now_seconds();
+        }
+
+        // new connections wait in the backlog while the server has as many as it keeps open
+        fds[0].events = server->nr_connections < SERVER_MAX_CONNECTIONS ? POLLIN : 0;
+        pthread_mutex_unlock(&server->lock);
+
+        // wake up every second to close idle connections
+        if (poll(fds, nr_fds, 1000) < 0) {
+            if (errno == EINTR) {
+                continue;
             }
+            break;
+        }
 
-            // remove final ', '
-            *(w_new->stem + strlen(w_new->stem) - 1) = '\0';
-            *(w_new->stem + strlen(w_new->stem) - 1) = '\0';
+        if (fds[1].revents) {
+            // woken up by a worker or by stop_server
+            char buffer[256];
+            if (read(server->wake[0], buffer, sizeof(buffer)) <= 0) {
+                break;
+            }
+        }
 
-            // update pointer to this group
-            if (!w) {
-                // first result document: set as first element of linked list
-                result->words = w_new;
+        // requests go to the workers, idle connections are closed (the last connection takes over the entry)
+        double now = now_seconds();
+        for (i = nr_fds - 1; i >= 2; i--) {
+            if (fds[i].revents) {
+                pthread_mutex_lock(&server->lock);
+                server->queue[(server->queue_start + server->queue_size) % SERVER_MAX_CONNECTIONS] = fds[i].fd;
+                server->queue_size++;
+                pthread_cond_broadcast(&server->changed);
+                pthread_mutex_unlock(&server->lock);
+            } else if (now - idle_since[i] > SERVER_IDLE_TIMEOUT) {
+                close(fds[i].fd);
+
+                pthread_mutex_lock(&server->lock);
+                server->nr_connections--;
+                pthread_mutex_unlock(&server->lock);
             } else {
-                w->next = w_new;
+                continue;
             }
 
-            p = w;
-            w = w_new;
-            last_flag = euclid_dist[i].flag;
-            result->nr_words++;
+            nr_fds--;
+            fds[i] = fds[nr_fds];
+            idle_since[i] = idle_since[nr_fds];
         }
 
-        // add document to group
-        w = (indexed_word_p) realloc(w, sizeof(indexed_word_t) + sizeof(doc_t) * (w->nr_docs + 1));
-        w->documents[w->nr_docs].id = i;
-        w->documents[w->nr_docs].tf = 0;
-        w->nr_docs++;
-
-        // copy name of the document into result index
-        char *d = index->documents[euclid_dist[i].doc_id].name;
-        result->documents[i].name = (char *) malloc(strlen(d) + 10);
-        sprintf(result->documents[i].name, "%08.5f %s", euclid_dist[i].dist, d);
-        result->nr_docs++;
+        if (fds[0].revents) {
+            int fd = accept_connection(server);
+            if (fd == -2) {
+                printf("Error: couldn't accept connections.\n");
+                break;
+            }
 
-        // update pointer to this group (needed after realloc)
-        if (!p) {
-            result->words = w;
-        } else {
-            p->next = w;
+            if (fd >= 0) {
+                fds[nr_fds].fd = fd;
+                fds[nr_fds].events = POLLIN;
+                idle_since[nr_fds++] = now;
+            }
         }
     }
 
-    free(euclid_dist);
+    // connections waiting for a request are closed, without new connections the workers stop as well
+    for (i = 2; i < nr_fds; i++) {
+        close(fds[i].fd);
+    }
 
-    remove_file(index, 0);
-    remove("._tmp_search_doc");
+    pthread_mutex_lock(&server->lock);
+    server->stopping = 1;
+    pthread_cond_broadcast(&server->changed);
+    pthread_mutex_unlock(&server->lock);
 
-    return result;
+    return NULL;
 }
 
 /*
- * Compares two doc_found structs based on euclidian distance to the search term (1st priority) and the document id (2nd priority; which is the same as comparing the names)
+ * Accepts a connection, returns its socket, -1 if there was none after all and -2 if the listening socket failed
  */
-int cmp_doc_found_desc(const void *a, const void *b) {
-   doc_found_p aa = (doc_found_p) a;
-   doc_found_p bb = (doc_found_p) b;
+int accept_connection(server_p server) {
+    int fd = accept(server->listen_fd, NULL, NULL);
+    if (fd < 0) {
+        return errno == EINTR || errno == ECONNABORTED || errno == EAGAIN ? -1 : -2;
+    }
 
-   if (aa->dist == bb->dist) {
-       return (aa->doc_id < bb->doc_id) ? -1 : (aa->doc_id > bb->doc_id);
-   } else {
-       return (aa->dist < bb->dist) ? -1 : (aa->dist > bb->dist);
-   }
+    // a client may not keep a worker waiting
+    struct timeval timeout = { SERVER_IO_TIMEOUT, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    pthread_mutex_lock(&server->lock);
+    server->nr_connections++;
+    pthread_mutex_unlock(&server->lock);
+
+    return fd;
 }
 
 /*
- * Regenerates the index based on the files in the filebase
+ * Answers the requests of the queued connections one after another (thread function), until the server stops
  */
-void rebuild_index(index_p index) {
-    // clear index but keep filebase
-    indexed_word_p w;
-    while ((w = index->words)) {
-        index->words = w->next;
+void *serve_requests(void *arg) {
+    server_worker_p worker = (server_worker_p) arg;
+    server_p server = worker->server;
 
-        free(w->stem);
-        free(w);
-    }
+    pthread_mutex_lock(&server->lock);
+    for (;;) {
+        while (!server->queue_size && !server->stopping) {
+            pthread_cond_wait(&server->changed, &server->lock);
+        }
 
-    index->nr_words = 0;
+        if (server->stopping) {
+            break;
+        }
 
-    // rescan every document
-    int i;
-    for (i = 0; i < index->nr_docs; i++) {
-        index->documents[i].nr_words = 0;
-        parse_file_for_index(index, index->documents[i].name);
+        int fd = server->queue[server->queue_start];
+        server->queue_start = (server->queue_start + 1) % SERVER_MAX_CONNECTIONS;
+        server->queue_size--;
+        server->connections[worker->nr] = fd;
+        pthread_mutex_unlock(&server->lock);
+
+        int open = serve_request(server, fd);
+
+        pthread_mutex_lock(&server->lock);
+        server->connections[worker->nr] = -1;
+        hand_back_connection(server, fd, open);
     }
+    pthread_mutex_unlock(&server->lock);
 
-    // save
-    write_index_to_file(index);
+    free(worker);
+    return NULL;
 }
 
 /*
- * Parses a file and adds its words to the index
+ * Answers the next request of a connection, returns 1 if the connection stays open, 0 if the client closed it,
+ * sent an invalid frame or was too slow
  */
-void parse_file_for_index(index_p index, char *file) {
-    // open file or print error message
-    FILE *f = fopen(file, "r");
-    if (!f) {
-        printf("Cannot open %s!\nIndex not updated.\n", file);
-        return;
+int serve_request(server_p server, int fd) {
+    unsigned int length;
+    if (!read_fully(fd, &length, sizeof(length))) {
+        return 0;
     }
 
-    // document id = index of document in list of all documents in filebase (alphabetically ordered)
-    int doc_id = find_str(&index->documents[0].name, sizeof(indexed_document_t), file, 0, index->nr_docs-1);
+    length = ntohl(length);
+    if (length > MAX_REQUEST_SIZE) {
+        return 0;
+    }
 
-    if (doc_id < 0) {
-        printf("Error: %s is not in the filebase!\n", file);
-        return;
+    char *request = (char *) malloc(length + 1);
+    if (!read_fully(fd, request, length)) {
+        free(request);
+        return 0;
     }
+    request[length] = '\0';
 
-    char *l;
-    while ((l = read_line(f))) {
-        // turn non alpha characters into spaces
-        nonalpha_to_space(l);
+    // the response is sent as one frame in one write, a separate write of the length would be held back
+    // by the TCP stack until the client acknowledged it
+    int size;
+    char *response = handle_request(server, request, &size);
+    free(request);
 
-        char *word = strtok(l, " ");
-        while (word) {
-            // ignore stopwords
-            if (is_stopword(word)) {
-                word = strtok(NULL, " ");
-                continue;
-            }
+    length = htonl(size - sizeof(length));
+    memcpy(response, &length, sizeof(length));
+    int ok = write_fully(fd, response, size);
+    free(response);
 
-            char *word_stem = stem(word);
+    return ok;
+}
 
-            if (!strlen(word_stem)) {
-                word = strtok(NULL, " ");
-                continue;
-            }
+/*
+ * Hands a connection answered by a worker back to the polling thread, or closes it (the lock must be held)
+ *  open: 1 = the connection waits for its next request, 0 = the connection is closed
+ */
+void hand_back_connection(server_p server, int fd, int open) {
+    if (open && !server->stopping) {
+        server->returned[server->nr_returned++] = fd;
+    } else {
+        close(fd);
+        server->nr_connections--;
+    }
 
-            // insert document into index / add new stem to index
-            indexed_word_p w = index->words;    // current word
-            indexed_word_p p = NULL;            // previous word
-            int flag = 0;
-            while (w && !flag) {
-                int cmp = strcmp(w->stem, word_stem);
-                if (!cmp) {
-                    // stem is already indexed
-                    flag = 1;
-                    break;
-                } else if (0 < cmp) {
-                    // stem not indexed yet
-                    flag = 2;
-                    break;
-                }
+    // the polling thread may watch the connection or accept another one now (the pipe may be full of wake ups already)
+    if (write(server->wake[1], "", 1) != 1 && errno != EAGAIN) {
+        printf("Error: couldn't wake the server.\n");
+    }
+}
 
-                p = w;
-                w = w->next;
-            }
+/*
+ * Answers a request, returns the response (to be freed by the caller) after 4 bytes left for its length
+ *  size: returns the number of bytes of the response, including these 4 bytes
+ */
+char *handle_request(server_p server, char *request, int *size) {
+    int max_size = 256;
+    char *response = (char *) malloc(max_size);
+    *size = 4;
 
-            if (flag == 1) {
-                // stem indexed, add document to list
-                int i;
-                for (i = 0; i < w->nr_docs; i++) {
-                    if (w->documents[i].id == doc_id) {
-                        // document is already indexed for this stem
-                        flag = 0;
-                        break;
-                    } else if (w->documents[i].id > doc_id) {
-                        break;
-                    }
-                }
+    if (!strcmp(request, "ping")) {
+        return append_text(response, size, &max_size, "ok 0\n");
+    }
 
-                // only add document to list if it's not already in the list
-                if (flag) {
-                    w = (indexed_word_p) realloc(w, sizeof(indexed_word_t) + sizeof(doc_t) * (w->nr_docs + 1));
+    if (!starts_with(request, "search ")) {
+        return append_text(response, size, &max_size, "error unknown request\n");
+    }
 
-                    // update pointer to this group (needed after realloc)
-                    if (!p) {
-                        index->words = w;
-                    } else {
-                        p->next = w;
-                    }
+    index_p snapshot = acquire_snapshot(server->index);
+    search_result_p result = search_index(snapshot, request + 7);
+    release_snapshot(server->index, snapshot);
 
-                    // insert document in list
-                    memmove(&w->documents[i+1], &w->documents[i], sizeof(doc_t) * (w->nr_docs - i));
-                    w->documents[i].id = doc_id;
-                    w->documents[i].tf = 1;
-                    w->nr_docs++;
-                } else {
-                    // increase counter for number of occurances of this word in this document
-                    w->documents[i].tf++;
-                }
+    response = append_text(response, size, &max_size, "ok %d\n", result->nr_hits);
 
-                free(word_stem);
-            } else {
-                // stem is not indexed, add it to index
-                w = (indexed_word_p) malloc(sizeof(indexed_word_t) + sizeof(doc_t));
-                w->stem = word_stem;
-                w->nr_docs = 1;
-                w->documents[0].id = doc_id;
-                w->documents[0].tf = 1;
-
-                index->nr_words++;
-
-                // insert this word in linked list
-                if (!p) {
-                    w->next = index->words;
-                    index->words = w;
-                } else {
-                    w->next = p->next;
-                    p->next = w;
-                }
-            }
+    int i;
+    for (i = 0; i < result->nr_hits; i++) {
+        search_hit_p hit = &result->hits[i];
+        response = append_text(response, size, &max_size, "%.5f\t%s\t%s\n", hit->score, hit->name, hit->terms);
+    }
 
-            // increase counter for total number of words in this document
-            index->documents[doc_id].nr_words++;
+    close_search_result(result);
+    return response;
+}
 
-            // get next word
-            word = strtok(NULL, " ");
+/*
+ * Reads exactly size bytes from a socket, returns 1 on success, 0 if the connection ended
+ */
+int read_fully(int fd, void *buffer, int size) {
+    char *p = (char *) buffer;
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
         }
 
-        free(l);
+        p += n;
+        size -= n;
     }
 
-    fclose(f);
-
-    // finalize computation of TF
-    indexed_word_p w = index->words;
-    while (w) {
-
-        int i = find_int(&w->documents[0].id, sizeof(doc_t), doc_id, 0, w->nr_docs - 1);
+    return 1;
+}
 
-        if (i >= 0) {
-            w->documents[i].tf /= index->documents[doc_id].nr_words;
+/*
+ * Writes exactly size bytes to a socket, returns 1 on success, 0 if the connection ended
+ * (a client gone doesn't raise SIGPIPE)
+ */
+int write_fully(int fd, void *buffer, int size) {
+    char *p = (char *) buffer;
+    while (size > 0) {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
         }
 
-        w = w->next;
+        p += n;
+        size -= n;
     }
+
+    return 1;
 }
 
 /*
- * Writes index to file
+ * Searches the queries in a file and writes their results to another file. Threads take chunks of queries in
+ * the order of the input and search the same snapshot of the index, the results are written in the order
+ * of the input (ranks from 1, best document first):
+ *  tab separated values: <query id>\t<rank>\t<document>\t<score>
+ *  JSON lines:           {"query": "<query id>", "rank": <rank>, "doc": "<document>", "score": <score>}
+ * A line of the input is a query or a query id, a tab and the query; the id of a query without id is the
+ * number of its line. Empty lines are skipped.
+ *  queries, results: names of the files, - = standard input / output
+ *  json: 1 = write JSON lines, 0 = tab separated values
+ *  nr_threads: number of threads searching (0 = one per processor)
  */
-void write_index_to_file(index_p index) {
-    // STEP 1: write filebase to file
-    FILE *fb_file = fopen("filebase", "w");
-    if (!fb_file) {
-        printf("Error: couldn't open filebase file to write.\nUnable to write index to file\n");
+void search_batch(index_p index, char *queries, char *results, int json, int nr_threads) {
+    if (nr_threads <= 0) {
+        nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    FILE *in = strcmp(queries, "-") ? fopen(queries, "r") : stdin;
+    if (!in) {
+        printf("Cannot open %s!\n", queries);
         return;
     }
 
-    // each line contains the name (relative path) to one document in the filebase and the number of words in this document
-    // format: <path/to/file>|<nr_words>
+    FILE *out = strcmp(results, "-") ? fopen(results, "w") : stdout;
+    if (!out) {
+        printf("Cannot open %s!\n", results);
+        if (in != stdin) {
+            fclose(in);
+        }
+        return;
+    }
+
+    double start = now_seconds();
+
+    batch_t batch;
+    batch.index = acquire_snapshot(index);
+    batch.in = in;
+    batch.out = out;
+    batch.json = json;
+    batch.nr_lines = 0;
+    batch.end_of_input = 0;
+    batch.nr_chunks = nr_threads * CHUNKS_AHEAD_PER_THREAD;
+    batch.chunks = (batch_chunk_p) malloc(sizeof(batch_chunk_t) * batch.nr_chunks);
+    batch.next_chunk = 0;
+    batch.next_written = 0;
+    batch.latencies = NULL;
+    batch.nr_queries = 0;
+    batch.max_queries = 0;
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.changed, NULL);
+
     int i;
-    for (i = 0; i < index->nr_docs; i++) {
-        fprintf(fb_file, "%s|%d\n", index->documents[i].name, index->documents[i].nr_words);
+    for (i = 0; i < batch.nr_chunks; i++) {
+        batch_chunk_p chunk = &batch.chunks[i];
+        chunk->lines = (char **) malloc(sizeof(char *) * QUERIES_PER_CHUNK);
+        chunk->line_nrs = (int *) malloc(sizeof(int) * QUERIES_PER_CHUNK);
+        chunk->latencies = (double *) malloc(sizeof(double) * QUERIES_PER_CHUNK);
+        chunk->max_size = 4096;
+        chunk->output = (char *) malloc(chunk->max_size);
+        chunk->size = 0;
+        chunk->done = 0;
     }
 
-    fclose(fb_file);
+    pthread_t *threads = (pthread_t *) malloc(sizeof(pthread_t) * nr_threads);
+    int nr_started = 0;
+    for (i = 0; i < nr_threads; i++) {
+        if (!pthread_create(&threads[nr_started], NULL, search_chunks, &batch)) {
+            nr_started++;
+        }
+    }
 
-    // STEP 2: write index to file
-    FILE *index_file = fopen("index", "w");
-    if (!index_file) {
-        printf("Error: couldn't open index file to write.\nUnable to write index to file\n");
-        return;
+    if (!nr_started) {
+        // no threads available: search all queries in this thread
+        search_chunks(&batch);
     }
 
-    // write one word in each line
-    // format: <stem>:<n>:doc_id_1/<tf_stem_1>|doc_id_2/tf_stem_2>|..|doc_id_n/<tf_stem_n>
-    indexed_word_p w = index->words;
-    while (w) {
-        fprintf(index_file, "%s:%i:%i/%f", w->stem, w->nr_docs, w->documents[0].id, w->documents[0].tf);
+    for (i = 0; i < nr_started; i++) {
+        pthread_join(threads[i], NULL);
+    }
 
-        // list all documents containing this word (or variations of it)
-        int i;
-        for(i = 1; i < w->nr_docs; i++) {
-            fprintf(index_file, "|%i/%f", w->documents[i].id, w->documents[i].tf);
-        }
+    double seconds = now_seconds() - start;
+    release_snapshot(index, batch.index);
+
+    if (out != stdout) {
+        fclose(out);
+    } else {
+        fflush(out);
+    }
+    if (in != stdin) {
+        fclose(in);
+    }
 
-        fprintf(index_file, "\n");
+    printf("Searched %d queries in %.2f s with %d threads (%.0f queries/s).\n", batch.nr_queries, seconds,
+        nr_started ? nr_started : 1, batch.nr_queries / seconds);
+
+    if (batch.nr_queries) {
+        qsort(batch.latencies, batch.nr_queries, sizeof(double), cmp_latency);
+        printf("Latency: p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, p99.9 %.3f ms, max %.3f ms.\n",
+            latency_percentile(batch.latencies, batch.nr_queries, 50) * 1000,
+            latency_percentile(batch.latencies, batch.nr_queries, 90) * 1000,
+            latency_percentile(batch.latencies, batch.nr_queries, 99) * 1000,
+            latency_percentile(batch.latencies, batch.nr_queries, 99.9) * 1000,
+            batch.latencies[batch.nr_queries - 1] * 1000);
+    }
 
-        w = w->next;
+    for (i = 0; i < batch.nr_chunks; i++) {
+        free(batch.chunks[i].lines);
+        free(batch.chunks[i].line_nrs);
+        free(batch.chunks[i].latencies);
+        free(batch.chunks[i].output);
     }
 
-    fclose(index_file);
+    free(threads);
+    free(batch.chunks);
+    free(batch.latencies);
+    pthread_mutex_destroy(&batch.lock);
+    pthread_cond_destroy(&batch.changed);
 }
 
 /*
- * Parses and loads contents of the index file into a index struct
+ * Thread reading the next chunk of queries and searching it until the input ends, the thread finishing
+ * the oldest chunk not written yet writes it and the finished chunks following it
  */
-index_p load_index() {
-    // create index struct
-    index_p index = (index_p) malloc(sizeof(index_t));
-    index->words = NULL;
-    index->nr_docs = 0;
-    index->nr_words = 0;
+void *search_chunks(void *arg) {
+    batch_p batch = (batch_p) arg;
 
-    // STEP 1: populate list of all documents
-    FILE *fb_file = fopen("filebase", "r");
-    if (!fb_file) {
-        printf("Error: filebase file not found.\nIndex not loaded!\n");
-        return index;
-    }
+    pthread_mutex_lock(&batch->lock);
+    for (;;) {
+        // all chunks taken => wait until the oldest one is written
+        while (!batch->end_of_input && batch->next_chunk - batch->next_written == batch->nr_chunks) {
+            pthread_cond_wait(&batch->changed, &batch->lock);
+        }
 
-    // count total number of documents
-    char c;
-    int nr_docs = 0;
-    while ((c = fgetc(fb_file)) != EOF) {
-        if (c == '\n') {
-            nr_docs++;
+        if (batch->end_of_input) {
+            break;
         }
-    }
 
-    rewind(fb_file);
+        // read the queries of the chunk
+        int c = batch->next_chunk;
+        batch_chunk_p chunk = &batch->chunks[c % batch->nr_chunks];
+        chunk->nr_queries = 0;
 
-    // create index struct
-    index = (index_p) realloc(index, sizeof(index_t) + sizeof(indexed_document_t) * nr_docs);
+        char *line;
+        while (chunk->nr_queries < QUERIES_PER_CHUNK && (line = read_line(batch->in))) {
+            batch->nr_lines++;
+            if (!line[0]) {
+                free(line);
+                continue;
+            }
 
-    // load all documents in a list
-    int i;
-    for (i = 0; i < nr_docs; i++) {
-        char *line = read_line(fb_file);
+            chunk->lines[chunk->nr_queries] = line;
+            chunk->line_nrs[chunk->nr_queries] = batch->nr_lines;
+            chunk->nr_queries++;
+        }
 
-        // copy name to index
-        char *tmp;
-        char *doc = strtok(line, "|");
-        index->documents[i].name = malloc(sizeof(char) * strlen(doc) + 1);
-        memcpy(index->documents[i].name, doc, strlen(doc) + 1);
+        if (chunk->nr_queries < QUERIES_PER_CHUNK) {
+            batch->end_of_input = 1;
+            pthread_cond_broadcast(&batch->changed);
 
-        // copy number of words to index
-        doc = strtok(NULL, "|");
-        index->documents[i].nr_words = strtol(doc, &tmp, 10);
-        index->nr_docs++;
+            if (!chunk->nr_queries) {
+                break;
+            }
+        }
 
-        free(line);
-    }
+        batch->next_chunk++;
+        pthread_mutex_unlock(&batch->lock);
 
-    fclose(fb_file);
+        search_chunk(batch, chunk);
 
-    // STEP 2: populate list of all words
-    FILE * index_file = fopen("index", "r");
-    if (!index_file) {
-        printf("Error: index file not found.\nIndex not loaded!\n");
-        return index;
-    }
+        pthread_mutex_lock(&batch->lock);
+        chunk->done = 1;
 
-    indexed_word_p p = NULL;
-    char *line, *stem, *docs, *doc, *tmp;
-    while ((line = read_line(index_file))) {
-        // get the stem
-        stem = strtok(line, ":");
+        // write the finished chunks in the order of the input
+        while (batch->next_written < batch->next_chunk) {
+            batch_chunk_p next = &batch->chunks[batch->next_written % batch->nr_chunks];
+            if (!next->done) {
+                break;
+            }
 
-        // ignore empty lines
-        if (!stem) {
-            continue;
+            fwrite(next->output, 1, next->size, batch->out);
+
+            // list full => double the size
+            if (batch->nr_queries + next->nr_queries > batch->max_queries) {
+                while (batch->nr_queries + next->nr_queries > batch->max_queries) {
+                    batch->max_queries = batch->max_queries ? batch->max_queries * 2 : 1024;
+                }
+                batch->latencies = (double *) realloc(batch->latencies, sizeof(double) * batch->max_queries);
+            }
+            memcpy(batch->latencies + batch->nr_queries, next->latencies, sizeof(double) * next->nr_queries);
+            batch->nr_queries += next->nr_queries;
+
+            next->done = 0;
+            batch->next_written++;
         }
 
-        // get number of documents for this word
-        int nr_docs = strtol(strtok(NULL, ":"), &tmp, 10);
+        pthread_cond_broadcast(&batch->changed);
+    }
+    pthread_mutex_unlock(&batch->lock);
 
-        // create struct for stem
-        indexed_word_p w = (indexed_word_p) malloc(sizeof(indexed_word_t) + sizeof(doc_t) * nr_docs);
-        w->stem = (char *) malloc(sizeof(char) * strlen(stem) + 1);
-        memcpy(w->stem, stem, strlen(stem) + 1);
-        w->nr_docs = nr_docs;
-
-        // insert into index
-        if (!p) {
-            index->words = w;
-            w->next = NULL;
+    return NULL;
+}
+
+/*
+ * Searches the queries of a chunk and writes their results to its output (releases the lines)
+ */
+void search_chunk(batch_p batch, batch_chunk_p chunk) {
+    chunk->size = 0;
+
+    int i;
+    for (i = 0; i < chunk->nr_queries; i++) {
+        char *line = chunk->lines[i];
+
+        // the id of a query is the text before the tab, or the number of its line
+        char *id = line, number[16];
+        char *query = strchr(line, '\t');
+        if (query) {
+            *query++ = '\0';
         } else {
-            w->next = p->next;
-            p->next = w;
+            sprintf(number, "%d", chunk->line_nrs[i]);
+            id = number;
+            query = line;
         }
-        p = w;
 
-        // get list of documents containing this stem
-        docs = strtok(NULL, ":");
-
-        // read each document
-        doc = strtok(docs, "|");
+        double start = now_seconds();
+        search_result_p result = search_index(batch->index, query);
+        chunk->latencies[i] = now_seconds() - start;
 
-        int i = 0;
-        while(doc != NULL) {
-            sscanf(doc, "%i/%lf", &w->documents[i].id, &w->documents[i].tf);
+        int k;
+        for (k = 0; k < result->nr_hits; k++) {
+            search_hit_p hit = &result->hits[k];
 
-            // get next document
-            doc = strtok(NULL, "|");
-            i++;
+            if (batch->json) {
+                chunk->output = append_text(chunk->output, &chunk->size, &chunk->max_size, "{\"query\": ");
+                chunk->output = append_json_string(chunk->output, &chunk->size, &chunk->max_size, id);
+                chunk->output = append_text(chunk->output, &chunk->size, &chunk->max_size, ", \"rank\": %d, \"doc\": ", k + 1);
+                chunk->output = append_json_string(chunk->output, &chunk->size, &chunk->max_size, hit->name);
+                chunk->output = append_text(chunk->output, &chunk->size, &chunk->max_size, ", \"score\": %.5f}\n", hit->score);
+            } else {
+                chunk->output = append_text(chunk->output, &chunk->size, &chunk->max_size, "%s\t%d\t%s\t%.5f\n",
+                    id, k + 1, hit->name, hit->score);
+            }
         }
 
-        index->nr_words++;
+        close_search_result(result);
         free(line);
     }
-
-    fclose(index_file);
-
-	return index;
 }
 
 /*
- * Frees the memory occupied by a index struct
+ * Appends a string to a growing buffer as a JSON string (quoted and escaped), returns the buffer (it may move)
  */
-void close_index(index_p index) {
-    indexed_word_p w;
+char *append_json_string(char *text, int *size, int *max_size, char *s) {
+    text = append_text(text, size, max_size, "\"");
+
+    while (*s) {
+        // characters which don't need escaping are appended at once
+        int len = 0;
+        while (s[len] && s[len] != '"' && s[len] != '\\' && (unsigned char) s[len] >= 0x20) {
+            len++;
+        }
+        if (len) {
+            text = append_text(text, size, max_size, "%.*s", len, s);
+            s += len;
+            continue;
+        }
 
-    int i;
-    for (i = 0; i < index->nr_docs; i++) {
-        free(index->documents[i].name);
+        unsigned char c = *s++;
+        if (c == '"' || c == '\\') {
+            text = append_text(text, size, max_size, "\\%c", c);
+        } else {
+            text = append_text(text, size, max_size, "\\u%04x", c);
+        }
     }
 
-    while ((w = index->words)) {
-        index->words = w->next;
+    return append_text(text, size, max_size, "\"");
+}
 
-        free(w->stem);
-        free(w);
-    }
-    free(index);
+/*
+ * Runtime counters tell where the time goes: what searches scan and score, what parsing documents costs and
+ * how much the index reads and writes. Code counts in local variables and adds them here once per operation
+ * (search, document, file written), so counting costs next to nothing even with many threads.
+ */
+
+/*
+ * Adds n to a counter (STAT_...)
+ */
+void count_stat(int stat, long n) {
+    __atomic_add_fetch(&stat_counters[stat], n, __ATOMIC_RELAXED);
 }
 
 /*
- * Binary search an array for a string
- *  obj: pointer to an array of pointers to strings
-         or array of fixed length structs containing a pointer to a string (in this case the obj pointer should point to the string pointer in the first struct)
- *  struct_len: length of one object in the array in bytes
- *  str: search string
- *  min: minimal index to search
- *  max: maximal index to search
+ * Adds the time passed since start (now_seconds) to a timer (STAT_TIME_...)
  */
-int find_str(void *objs, int struct_len, char *str, int min, int max) {
-    int middle = (min + max) / 2;
-    int cmp = strcmp(*((char **) (((char *) objs) + middle * struct_len)), str);
+void count_time(int stat, double start) {
+    count_stat(stat, (long) ((now_seconds() - start) * 1e9));
+}
 
-    if (!cmp) {
-        // string found
-        return middle;
-    } else if (min != max) {
-        if (cmp > 0 && min != middle) {
-            // continue search in left half
-            return find_str(objs, struct_len, str, min, middle - 1);
-        } else if (max != middle) {
-            // continue search in right half
-            return find_str(objs, struct_len, str, middle + 1, max);
-        }
+/*
+ * Sets all counters to 0
+ */
+void reset_stats() {
+    int i;
+    for (i = 0; i < NR_STATS; i++) {
+        __atomic_store_n(&stat_counters[i], 0, __ATOMIC_RELAXED);
     }
-
-    // finished searching
-    return -1;
 }
 
 /*
- * Binary search an array for an integer
- *  obj: pointer to an array of integers
-         or array of fixed length structs containing an integer (in this case the obj pointer should point to the integer in the first struct)
- *  struct_len: length of one object in the array in bytes
- *  i: search integer
- *  min: minimal index to search
- *  max: maximal index to search
+ * Prints the counters, averages per search and document, and the memory the process has allocated,
+ * one "<name> <value>" per line
  */
-int find_int(void *objs, int struct_len, int i, int min, int max) {
-    int middle = (min + max) / 2;
-    int cmp_val = *((int *) (((char *) objs) + middle * struct_len));
+void print_stats(FILE *f) {
+    long s[NR_STATS];
+    int i;
+    for (i = 0; i < NR_STATS; i++) {
+        s[i] = __atomic_load_n(&stat_counters[i], __ATOMIC_RELAXED);
+    }
 
-    if (cmp_val == i) {
-        // string found
-        return middle;
-    } else if (min != max) {
-        if (cmp_val > i && min != middle) {
-            // continue search in left half
-            return find_int(objs, struct_len, i, min, middle - 1);
-        } else if (max != middle) {
-            // continue search in right half
-            return find_int(objs, struct_len, i, middle + 1, max);
+    for (i = 0; i < NR_STATS; i++) {
+        if (i >= STAT_TIME_PARSE) {
+            fprintf(f, "%-24s %.6f s\n", stat_names[i], s[i] / 1e9);
+        } else {
+            fprintf(f, "%-24s %ld\n", stat_names[i], s[i]);
         }
     }
 
-    // finished searching
-    return -1;
+    if (s[STAT_SEARCHES]) {
+        fprintf(f, "%-24s %.1f\n", "postings_per_search", (double) s[STAT_POSTINGS_SCANNED] / s[STAT_SEARCHES]);
+        fprintf(f, "%-24s %.1f\n", "scored_per_search", (double) s[STAT_DOCS_SCORED] / s[STAT_SEARCHES]);
+        fprintf(f, "%-24s %.3f ms\n", "time_per_search", s[STAT_TIME_SCORE] / 1e6 / s[STAT_SEARCHES]);
+    }
+    if (s[STAT_DOCS_PARSED]) {
+        fprintf(f, "%-24s %.1f\n", "tokens_per_doc", (double) s[STAT_TOKENS] / s[STAT_DOCS_PARSED]);
+        fprintf(f, "%-24s %.3f ms\n", "time_per_doc", s[STAT_TIME_PARSE] / 1e6 / s[STAT_DOCS_PARSED]);
+    }
+
+    // allocations as the allocator sees them: blocks in use and memory held from the system
+    struct mallinfo2 m = mallinfo2();
+    fprintf(f, "%-24s %zu\n", "heap_in_use", m.uordblks + m.hblkhd);
+    fprintf(f, "%-24s %zu\n", "heap_free", m.fordblks);
+    fprintf(f, "%-24s %zu\n", "heap_mmapped_blocks", m.hblks);
 }
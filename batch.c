@@ -0,0 +1,326 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "index.h"
+#include "util.h"
+#include "snapshots.h"
+#include "batch.h"
+
+// queries a thread takes at once, their results are written together
+#define QUERIES_PER_CHUNK 256
+
+// chunks taken per thread before the results of the oldest one are written, threads wait beyond that
+#define CHUNKS_AHEAD_PER_THREAD 4
+
+typedef struct batch_chunk {
+    char **lines;               // lines of the queries ("<id>\t<query>" or "<query>")
+    int *line_nrs;              // per query: number of its line in the input
+    int nr_queries;             // number of queries in the chunk
+    double *latencies;          // per query: seconds the search took
+    char *output;               // results of the queries, in the output format
+    int size;                   // number of bytes of the results
+    int max_size;               // number of bytes the output has room for
+    int done;                   // 1 = all queries of the chunk are searched
+} batch_chunk_t, *batch_chunk_p;
+
+typedef struct batch {
+    index_p index;              // snapshot searched
+    FILE *in;                   // queries, one per line
+    FILE *out;                  // results
+    int json;                   // 1 = JSON lines, 0 = tab separated values
+    int nr_lines;               // number of lines read from the input
+    int end_of_input;           // 1 = all queries are read
+    batch_chunk_p chunks;       // chunks being searched or waiting to be written (ring buffer, by number of chunk)
+    int nr_chunks;              // number of chunks the ring buffer has room for
+    int next_chunk;             // number of the next chunk read from the input
+    int next_written;           // number of the next chunk written to the output
+    double *latencies;          // seconds each query written so far took
+    int nr_queries;             // number of these queries
+    int max_queries;            // number of latencies the list has room for
+    pthread_mutex_t lock;       // protects the input, the output and everything above but index and json
+    pthread_cond_t changed;     // signalled when a chunk is written or the input ends
+} batch_t, *batch_p;
+
+void *search_chunks(void *arg);
+void search_chunk(batch_p batch, batch_chunk_p chunk);
+char *append_json_string(char *text, int *size, int *max_size, char *s);
+
+/*
+ * Searches the queries in a file and writes their results to another file. Threads take chunks of queries in
+ * the order of the input and search the same snapshot of the index, the results are written in the order
+ * of the input (ranks from 1, best document first):
+ *  tab separated values: <query id>\t<rank>\t<document>\t<score>
+ *  JSON lines:           {"query": "<query id>", "rank": <rank>, "doc": "<document>", "score": <score>}
+ * A line of the input is a query or a query id, a tab and the query; the id of a query without id is the
+ * number of its line. Empty lines are skipped.
+ *  queries, results: names of the files, - = standard input / output
+ *  json: 1 = write JSON lines, 0 = tab separated values
+ *  nr_threads: number of threads searching (0 = one per processor)
+ */
+void search_batch(index_p index, char *queries, char *results, int json, int nr_threads) {
+    if (nr_threads <= 0) {
+        nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    FILE *in = strcmp(queries, "-") ? fopen(queries, "r") : stdin;
+    if (!in) {
+        printf("Cannot open %s!\n", queries);
+        return;
+    }
+
+    FILE *out = strcmp(results, "-") ? fopen(results, "w") : stdout;
+    if (!out) {
+        printf("Cannot open %s!\n", results);
+        if (in != stdin) {
+            fclose(in);
+        }
+        return;
+    }
+
+    double start = now_seconds();
+
+    batch_t batch;
+    batch.index = acquire_snapshot(index);
+    batch.in = in;
+    batch.out = out;
+    batch.json = json;
+    batch.nr_lines = 0;
+    batch.end_of_input = 0;
+    batch.nr_chunks = nr_threads * CHUNKS_AHEAD_PER_THREAD;
+    batch.chunks = (batch_chunk_p) malloc(sizeof(batch_chunk_t) * batch.nr_chunks);
+    batch.next_chunk = 0;
+    batch.next_written = 0;
+    batch.latencies = NULL;
+    batch.nr_queries = 0;
+    batch.max_queries = 0;
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.changed, NULL);
+
+    int i;
+    for (i = 0; i < batch.nr_chunks; i++) {
+        batch_chunk_p chunk = &batch.chunks[i];
+        chunk->lines = (char **) malloc(sizeof(char *) * QUERIES_PER_CHUNK);
+        chunk->line_nrs = (int *) malloc(sizeof(int) * QUERIES_PER_CHUNK);
+        chunk->latencies = (double *) malloc(sizeof(double) * QUERIES_PER_CHUNK);
+        chunk->max_size = 4096;
+        chunk->output = (char *) malloc(chunk->max_size);
+        chunk->size = 0;
+        chunk->done = 0;
+    }
+
+    pthread_t *threads = (pthread_t *) malloc(sizeof(pthread_t) * nr_threads);
+    int nr_started = 0;
+    for (i = 0; i < nr_threads; i++) {
+        if (!pthread_create(&threads[nr_started], NULL, search_chunks, &batch)) {
+            nr_started++;
+        }
+    }
+
+    if (!nr_started) {
+        // no threads available: search all queries in this thread
+        search_chunks(&batch);
+    }
+
+    for (i = 0; i < nr_started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    double seconds = now_seconds() - start;
+    release_snapshot(index, batch.index);
+
+    if (out != stdout) {
+        fclose(out);
+    } else {
+        fflush(out);
+    }
+    if (in != stdin) {
+        fclose(in);
+    }
+
+    printf("Searched %d queries in %.2f s with %d threads (%.0f queries/s).\n", batch.nr_queries, seconds,
+        nr_started ? nr_started : 1, batch.nr_queries / seconds);
+
+    if (batch.nr_queries) {
+        qsort(batch.latencies, batch.nr_queries, sizeof(double), cmp_latency);
+        printf("Latency: p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, p99.9 %.3f ms, max %.3f ms.\n",
+            latency_percentile(batch.latencies, batch.nr_queries, 50) * 1000,
+            latency_percentile(batch.latencies, batch.nr_queries, 90) * 1000,
+            latency_percentile(batch.latencies, batch.nr_queries, 99) * 1000,
+            latency_percentile(batch.latencies, batch.nr_queries, 99.9) * 1000,
+            batch.latencies[batch.nr_queries - 1] * 1000);
+    }
+
+    for (i = 0; i < batch.nr_chunks; i++) {
+        free(batch.chunks[i].lines);
+        free(batch.chunks[i].line_nrs);
+        free(batch.chunks[i].latencies);
+        free(batch.chunks[i].output);
+    }
+
+    free(threads);
+    free(batch.chunks);
+    free(batch.latencies);
+    pthread_mutex_destroy(&batch.lock);
+    pthread_cond_destroy(&batch.changed);
+}
+
+/*
+ * Thread reading the next chunk of queries and searching it until the input ends, the thread finishing
+ * the oldest chunk not written yet writes it and the finished chunks following it
+ */
+void *search_chunks(void *arg) {
+    batch_p batch = (batch_p) arg;
+
+    pthread_mutex_lock(&batch->lock);
+    for (;;) {
+        // all chunks taken => wait until the oldest one is written
+        while (!batch->end_of_input && batch->next_chunk - batch->next_written == batch->nr_chunks) {
+            pthread_cond_wait(&batch->changed, &batch->lock);
+        }
+
+        if (batch->end_of_input) {
+            break;
+        }
+
+        // read the queries of the chunk
+        int c = batch->next_chunk;
+        batch_chunk_p chunk = &batch->chunks[c % batch->nr_chunks];
+        chunk->nr_queries = 0;
+
+        char *line;
+        while (chunk->nr_queries < QUERIES_PER_CHUNK && (line = read_line(batch->in))) {
+            batch->nr_lines++;
+            if (!line[0]) {
+                free(line);
+                continue;
+            }
+
+            chunk->lines[chunk->nr_queries] = line;
+            chunk->line_nrs[chunk->nr_queries] = batch->nr_lines;
+            chunk->nr_queries++;
+        }
+
+        if (chunk->nr_queries < QUERIES_PER_CHUNK) {
+            batch->end_of_input = 1;
+            pthread_cond_broadcast(&batch->changed);
+
+            if (!chunk->nr_queries) {
+                break;
+            }
+        }
+
+        batch->next_chunk++;
+        pthread_mutex_unlock(&batch->lock);
+
+        search_chunk(batch, chunk);
+
+        pthread_mutex_lock(&batch->lock);
+        chunk->done = 1;
+
+        // write the finished chunks in the order of the input
+        while (batch->next_written < batch->next_chunk) {
+            batch_chunk_p next = &batch->chunks[batch->next_written % batch->nr_chunks];
+            if (!next->done) {
+                break;
+            }
+
+            fwrite(next->output, 1, next->size, batch->out);
+
+            // list full => double the size
+            if (batch->nr_queries + next->nr_queries > batch->max_queries) {
+                while (batch->nr_queries + next->nr_queries > batch->max_queries) {
+                    batch->max_queries = batch->max_queries ? batch->max_queries * 2 : 1024;
+                }
+                batch->latencies = (double *) realloc(batch->latencies, sizeof(double) * batch->max_queries);
+            }
+            memcpy(batch->latencies + batch->nr_queries, next->latencies, sizeof(double) * next->nr_queries);
+            batch->nr_queries += next->nr_queries;
+
+            next->done = 0;
+            batch->next_written++;
+        }
+
+        pthread_cond_broadcast(&batch->changed);
+    }
+    pthread_mutex_unlock(&batch->lock);
+
+    return NULL;
+}
+
+/*
+ * Searches the queries of a chunk and writes their results to its output (releases the lines)
+ */
+void search_chunk(batch_p batch, batch_chunk_p chunk) {
+    chunk->size = 0;
+
+    int i;
+    for (i = 0; i < chunk->nr_queries; i++) {
+        char *line = chunk->lines[i];
+
+        // the id of a query is the text before the tab, or the number of its line
+        char *id = line, number[16];
+        char *query = strchr(line, '\t');
+        if (query) {
+            *query++ = '\0';
+        } else {
+            sprintf(number, "%d", chunk->line_nrs[i]);
+            id = number;
+            query = line;
+        }
+
+        double start = now_seconds();
+        search_result_p result = search_index(batch->index, query);
+        chunk->latencies[i] = now_seconds() - start;
+
+        int k;
+        for (k = 0; k < result->nr_hits; k++) {
+            search_hit_p hit = &result->hits[k];
+
+            if (batch->json) {
+                chunk->output = append_text(chunk->output, &chunk->size, &chunk->max_size, "{\"query\": ");
+                chunk->output = append_json_string(chunk->output, &chunk->size, &chunk->max_size, id);
+                chunk->output = append_text(chunk->output, &chunk->size, &chunk->max_size, ", \"rank\": %d, \"doc\": ", k + 1);
+                chunk->output = append_json_string(chunk->output, &chunk->size, &chunk->max_size, hit->name);
+                chunk->output = append_text(chunk->output, &chunk->size, &chunk->max_size, ", \"score\": %.5f}\n", hit->score);
+            } else {
+                chunk->output = append_text(chunk->output, &chunk->size, &chunk->max_size, "%s\t%d\t%s\t%.5f\n",
+                    id, k + 1, hit->name, hit->score);
+            }
+        }
+
+        close_search_result(result);
+        free(line);
+    }
+}
+
+/*
+ * Appends a string to a growing buffer as a JSON string (quoted and escaped), returns the buffer (it may move)
+ */
+char *append_json_string(char *text, int *size, int *max_size, char *s) {
+    text = append_text(text, size, max_size, "\"");
+
+    while (*s) {
+        // characters which don't need escaping are appended at once
+        int len = 0;
+        while (s[len] && s[len] != '"' && s[len] != '\\' && (unsigned char) s[len] >= 0x20) {
+            len++;
+        }
+        if (len) {
+            text = append_text(text, size, max_size, "%.*s", len, s);
+            s += len;
+            continue;
+        }
+
+        unsigned char c = *s++;
+        if (c == '"' || c == '\\') {
+            text = append_text(text, size, max_size, "\\%c", c);
+        } else {
+            text = append_text(text, size, max_size, "\\u%04x", c);
+        }
+    }
+
+    return append_text(text, size, max_size, "\"");
+}
@@ -0,0 +1 @@
+void search_batch(index_p index, char *queries, char *results, int json, int nr_threads);
@@ -0,0 +1,420 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <glob.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "index.h"
+#include "util.h"
+#include "segments.h"
+#include "snapshots.h"
+
+// syllables the words of the synthetic vocabulary are made of (no e, s or y: the stemmer leaves the words alone)
+#define CONSONANTS "bcdfghjklmnprtvz"
+#define VOWELS "aiou"
+
+typedef struct bench_config {
+    int nr_docs;                // number of documents in the corpus
+    int doc_words;              // average number of words per document
+    int vocabulary;             // number of different words
+    double zipf;                // exponent of the Zipf distribution of the words
+    unsigned long seed;         // seed of the random numbers, the same seed generates the same corpus
+    int nr_queries;             // number of queries of each kind
+    int nr_updates;             // number of documents added and removed one by one
+    int nr_stopwords;           // number of most frequent words in the stopwords file
+} bench_config_t, *bench_config_p;
+
+typedef struct bench_corpus {
+    bench_config_p config;      // configuration the corpus was generated with
+    double *cumulative;         // per word (by rank): sum of the probabilities of the words up to this one
+    unsigned long random;       // state of the random numbers
+} bench_corpus_t, *bench_corpus_p;
+
+void generate_corpus(bench_corpus_p corpus);
+void make_word(int rank, char *word);
+int random_word(bench_corpus_p corpus);
+unsigned long next_random(bench_corpus_p corpus);
+char *document_file(int doc);
+void remove_index_files();
+void write_stats(FILE *out, char *name, char *extra, double *latencies, int n, double seconds, int last);
+void bench_search(FILE *out, bench_corpus_p corpus, index_p index, char *name, int nr_terms, int first, int last, int zipf,
+    int phrase, int last_phase);
+
+/*
+ * Benchmark of the search engine on a synthetic corpus: generates documents whose words follow a Zipf distribution
+ * (reproducible with the same seed), builds an index of them and times each phase: rebuild_index, add_file and
+ * remove_file of single documents, flush_segment, load_index and search_index with short, long, rare term,
+ * common term and phrase queries. The results are written as JSON, to compare throughput and latencies across versions.
+ * Everything is written to a working directory: the corpus (docs/), the index files and the stopwords.
+ *
+ * build: gcc -O2 -pthread -o bench bench.c $(ls *.c | grep -v 'main.c\|bench.c\|allinone.c') -lm
+ * usage: bench [-d documents] [-w words per document] [-v vocabulary] [-z zipf exponent] [-s seed]
+ *              [-q queries] [-u updates] [-o results file] [working directory]
+ */
+int main(int argc, char **argv) {
+    bench_config_t config;
+    config.nr_docs = 10000;
+    config.doc_words = 200;
+    config.vocabulary = 50000;
+    config.zipf = 1.0;
+    config.seed = 1;
+    config.nr_queries = 1000;
+    config.nr_updates = 100;
+    config.nr_stopwords = 20;
+
+    char *results = "bench.json", *dir = "bench_work";
+    int opt;
+    while ((opt = getopt(argc, argv, "d:w:v:z:s:q:u:o:")) != -1) {
+        if (opt == 'd') {
+            config.nr_docs = atoi(optarg);
+        } else if (opt == 'w') {
+            config.doc_words = atoi(optarg);
+        } else if (opt == 'v') {
+            config.vocabulary = atoi(optarg);
+        } else if (opt == 'z') {
+            config.zipf = atof(optarg);
+        } else if (opt == 's') {
+            config.seed = strtoul(optarg, NULL, 10);
+        } else if (opt == 'q') {
+            config.nr_queries = atoi(optarg);
+        } else if (opt == 'u') {
+            config.nr_updates = atoi(optarg);
+        } else if (opt == 'o') {
+            results = optarg;
+        } else {
+            fprintf(stderr, "usage: %s [-d documents] [-w words per document] [-v vocabulary] [-z zipf exponent] "
+                "[-s seed] [-q queries] [-u updates] [-o results file] [working directory]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind < argc) {
+        dir = argv[optind];
+    }
+
+    if (config.nr_docs < 1 || config.doc_words < 1 || config.vocabulary <= config.nr_stopwords + 100
+        || config.nr_updates < 0 || config.nr_updates * 2 > config.nr_docs || config.nr_queries < 1) {
+        fprintf(stderr, "Invalid configuration.\n");
+        return 1;
+    }
+
+    // the results file is relative to the directory the benchmark is started in
+    FILE *out = fopen(results, "w");
+    if (!out) {
+        fprintf(stderr, "Cannot open %s!\n", results);
+        return 1;
+    }
+
+    mkdir(dir, 0777);
+    if (chdir(dir)) {
+        fprintf(stderr, "Cannot open %s!\n", dir);
+        return 1;
+    }
+
+    bench_corpus_t corpus;
+    corpus.config = &config;
+    corpus.random = config.seed * 0x9E3779B97F4A7C15UL + 1;
+    corpus.cumulative = (double *) malloc(sizeof(double) * config.vocabulary);
+
+    int i;
+    double sum = 0;
+    for (i = 0; i < config.vocabulary; i++) {
+        sum += 1 / pow(i + 1, config.zipf);
+        corpus.cumulative[i] = sum;
+    }
+
+    fprintf(out, "{\n  \"config\": {\"documents\": %d, \"words_per_document\": %d, \"vocabulary\": %d, \"zipf\": %.2f, "
+        "\"seed\": %lu, \"queries\": %d, \"updates\": %d},\n", config.nr_docs, config.doc_words, config.vocabulary,
+        config.zipf, config.seed, config.nr_queries, config.nr_updates);
+
+    // PHASE 1: generate the corpus, the last documents are left out of the filebase for add_file
+    double start = now_seconds();
+    generate_corpus(&corpus);
+    int nr_initial = config.nr_docs - config.nr_updates;
+
+    remove_index_files();
+    FILE *f = fopen("filebase", "w");
+    for (i = 0; i < nr_initial; i++) {
+        fprintf(f, "%s|0\n", document_file(i));
+    }
+    fclose(f);
+    fclose(fopen("index", "w"));
+
+    f = fopen("stopwords", "w");
+    for (i = 0; i < config.nr_stopwords; i++) {
+        char word[32];
+        make_word(i, word);
+        fprintf(f, "%s\n", word);
+    }
+    fclose(f);
+
+    fprintf(out, "  \"phases\": {\n");
+    fprintf(out, "    \"generate_corpus\": {\"seconds\": %.6f},\n", now_seconds() - start);
+
+    // PHASE 2: parse all documents of the filebase
+    index_p index = load_index();
+    start = now_seconds();
+    rebuild_index(index, 0);
+    publish_snapshot(index);
+    double seconds = now_seconds() - start;
+    fprintf(out, "    \"rebuild_index\": {\"documents\": %d, \"seconds\": %.6f, \"documents_per_second\": %.1f},\n",
+        nr_initial, seconds, nr_initial / seconds);
+
+    // PHASE 3: add and remove documents one by one, publishing a snapshot after each change like the REPL does
+    double *latencies = (double *) malloc(sizeof(double) * (config.nr_updates + 1));
+    start = now_seconds();
+    for (i = 0; i < config.nr_updates; i++) {
+        double t = now_seconds();
+        add_file(index, document_file(nr_initial + i));
+        check_merge(index);
+        publish_snapshot(index);
+        latencies[i] = now_seconds() - t;
+    }
+    write_stats(out, "add_file", "", latencies, config.nr_updates, now_seconds() - start, 0);
+
+    start = now_seconds();
+    for (i = 0; i < config.nr_updates; i++) {
+        double t = now_seconds();
+        int doc_id = find_document(index, document_file((long) nr_initial * i / config.nr_updates));
+        if (doc_id >= 0) {
+            remove_file(index, doc_id);
+        }
+        check_merge(index);
+        publish_snapshot(index);
+        latencies[i] = now_seconds() - t;
+    }
+    write_stats(out, "remove_file", "", latencies, config.nr_updates, now_seconds() - start, 0);
+
+    // PHASE 4: write the words added since the rebuild to a segment, then load the index from its files
+    start = now_seconds();
+    flush_segment(index, NULL);
+    fprintf(out, "    \"flush_segment\": {\"seconds\": %.6f},\n", now_seconds() - start);
+
+    close_index(index);
+    start = now_seconds();
+    index = load_index();
+    fprintf(out, "    \"load_index\": {\"seconds\": %.6f},\n", now_seconds() - start);
+
+    // PHASE 5: searches, each kind of query draws its words from a range of ranks (after the stopwords)
+    int first = config.nr_stopwords;
+    bench_search(out, &corpus, index, "search_short", 2, first, config.vocabulary, 1, 0, 0);
+    bench_search(out, &corpus, index, "search_long", 8, first, config.vocabulary, 1, 0, 0);
+    bench_search(out, &corpus, index, "search_rare", 2, config.vocabulary / 2, config.vocabulary, 0, 0, 0);
+    bench_search(out, &corpus, index, "search_common", 2, first, first + 50, 0, 0, 0);
+    bench_search(out, &corpus, index, "search_phrase", 2, first, config.vocabulary, 1, 1, 1);
+
+    fprintf(out, "  }\n}\n");
+    fclose(out);
+
+    close_index(index);
+    free(latencies);
+    free(corpus.cumulative);
+
+    return 0;
+}
+
+/*
+ * Writes the documents of the corpus, docs/<thousands>/<number>.txt: lines of about 12 words, a sentence ends
+ * every 15 words on average
+ */
+void generate_corpus(bench_corpus_p corpus) {
+    bench_config_p config = corpus->config;
+    mkdir("docs", 0777);
+
+    int doc;
+    for (doc = 0; doc < config->nr_docs; doc++) {
+        char *file = document_file(doc);
+
+        // directory of the next thousand documents
+        if (!(doc % 1000)) {
+            *strrchr(file, '/') = '\0';
+            mkdir(file, 0777);
+            file = document_file(doc);
+        }
+
+        FILE *f = fopen(file, "w");
+        if (!f) {
+            fprintf(stderr, "Cannot open %s!\n", file);
+            exit(1);
+        }
+
+        // lengths vary from half to one and a half times the average
+        int nr_words = config->doc_words / 2 + next_random(corpus) % (config->doc_words + 1);
+        int i;
+        for (i = 0; i < nr_words; i++) {
+            char word[32];
+            make_word(random_word(corpus), word);
+            fputs(word, f);
+
+            if (!(next_random(corpus) % 15)) {
+                fputc('.', f);
+            }
+            fputc(i % 12 == 11 ? '\n' : ' ', f);
+        }
+        fputc('\n', f);
+
+        fclose(f);
+    }
+}
+
+/*
+ * Writes the word of a rank to word: the rank written with syllables as digits, at least two syllables
+ * (frequent words are short, as in natural languages)
+ */
+void make_word(int rank, char *word) {
+    int nr_syllables = strlen(CONSONANTS) * strlen(VOWELS);
+    int n = rank + nr_syllables;
+
+    char *w = word;
+    while (n) {
+        int syllable = n % nr_syllables;
+        *w++ = CONSONANTS[syllable / strlen(VOWELS)];
+        *w++ = VOWELS[syllable % strlen(VOWELS)];
+        n /= nr_syllables;
+    }
+    *w = '\0';
+}
+
+/*
+ * Returns the rank of a random word, drawn from the Zipf distribution
+ */
+int random_word(bench_corpus_p corpus) {
+    int n = corpus->config->vocabulary;
+    double x = (next_random(corpus) >> 11) * (1.0 / 9007199254740992.0) * corpus->cumulative[n - 1];
+
+    // first word whose cumulative probability exceeds x
+    int low = 0, high = n - 1;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (corpus->cumulative[mid] > x) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+
+    return low;
+}
+
+/*
+ * Returns the next random number (xorshift64*, the same on every platform)
+ */
+unsigned long next_random(bench_corpus_p corpus) {
+    corpus->random ^= corpus->random >> 12;
+    corpus->random ^= corpus->random << 25;
+    corpus->random ^= corpus->random >> 27;
+
+    return corpus->random * 0x2545F4914F6CDD1DUL;
+}
+
+/*
+ * Returns the file of a document of the corpus (valid until the next call)
+ */
+char *document_file(int doc) {
+    static char file[64];
+    sprintf(file, "docs/%03d/%06d.txt", doc / 1000, doc);
+
+    return file;
+}
+
+/*
+ * Removes the index files of an earlier run, so the index is built from scratch
+ */
+void remove_index_files() {
+    glob_t g;
+    if (!glob("index.bin*", 0, NULL, &g)) {
+        int i;
+        for (i = 0; i < g.gl_pathc; i++) {
+            unlink(g.gl_pathv[i]);
+        }
+    }
+    globfree(&g);
+
+    unlink("index.segments");
+    unlink("index.log");
+}
+
+/*
+ * Writes the statistics of n timed operations as a JSON member (sorts the latencies)
+ *  extra: further members of the statistics, written first ("" = none)
+ *  last: 1 = the last member of the phases, 0 = more follow
+ */
+void write_stats(FILE *out, char *name, char *extra, double *latencies, int n, double seconds, int last) {
+    fprintf(out, "    \"%s\": {%s\"count\": %d, \"seconds\": %.6f", name, extra, n, seconds);
+
+    if (n) {
+        qsort(latencies, n, sizeof(double), cmp_latency);
+        fprintf(out, ", \"per_second\": %.1f, \"p50_ms\": %.4f, \"p99_ms\": %.4f, \"max_ms\": %.4f", n / seconds,
+            latency_percentile(latencies, n, 50) * 1000, latency_percentile(latencies, n, 99) * 1000,
+            latencies[n - 1] * 1000);
+    }
+
+    fprintf(out, "}%s\n", last ? "" : ",");
+}
+
+/*
+ * Times searches of queries with nr_terms words of ranks from first to last - 1, on a snapshot like the REPL
+ *  zipf: 1 = the words follow the distribution of the corpus, 0 = all words of the range are equally likely
+ *  phrase: 1 = the words are searched as a phrase (in quotes)
+ *  last: 1 = the last member of the phases, 0 = more follow
+ */
+void bench_search(FILE *out, bench_corpus_p corpus, index_p index, char *name, int nr_terms, int first, int last, int zipf,
+        int phrase, int last_phase) {
+    int nr_queries = corpus->config->nr_queries;
+
+    // the queries are made before the searches are timed
+    char **queries = (char **) malloc(sizeof(char *) * nr_queries);
+    int i;
+    for (i = 0; i < nr_queries; i++) {
+        queries[i] = (char *) malloc(32 * nr_terms + 3);
+        strcpy(queries[i], phrase ? "\"" : "");
+
+        int k;
+        for (k = 0; k < nr_terms; k++) {
+            int rank;
+            do {
+                rank = zipf ? random_word(corpus) : first + next_random(corpus) % (last - first);
+            } while (rank < first || rank >= last);
+
+            char word[32];
+            make_word(rank, word);
+            if (k) {
+                strcat(queries[i], " ");
+            }
+            strcat(queries[i], word);
+        }
+
+        if (phrase) {
+            strcat(queries[i], "\"");
+        }
+    }
+
+    double *latencies = (double *) malloc(sizeof(double) * nr_queries);
+    long nr_hits = 0;
+
+    index_p snapshot = acquire_snapshot(index);
+    double start = now_seconds();
+
+    for (i = 0; i < nr_queries; i++) {
+        double t = now_seconds();
+        search_result_p result = search_index(snapshot, queries[i]);
+        latencies[i] = now_seconds() - t;
+
+        nr_hits += result->nr_hits;
+        close_search_result(result);
+    }
+
+    double seconds = now_seconds() - start;
+    release_snapshot(index, snapshot);
+
+    char extra[128];
+    sprintf(extra, "\"terms\": %d, \"hits_per_query\": %.2f, ", nr_terms, (double) nr_hits / nr_queries);
+    write_stats(out, name, extra, latencies, nr_queries, seconds, last_phase);
+
+    for (i = 0; i < nr_queries; i++) {
+        free(queries[i]);
+    }
+    free(queries);
+    free(latencies);
+}
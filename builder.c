@@ -0,0 +1,481 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "index.h"
+#include "util.h"
+#include "vocab.h"
+#include "postings.h"
+#include "rebuild.h"
+#include "builder.h"
+#include "segments.h"
+#include "stats.h"
+
+#define RUN_FILE "index.run"
+
+// bytes buffered while a run is written, runs being merged share a quarter of the memory budget (within the limits)
+#define RUN_BUFFER_SIZE (1 << 20)
+#define MIN_RUN_BUFFER_SIZE (1 << 12)
+
+// most documents parsed at once, the documents of a batch are also limited to a quarter of the memory budget
+#define MAX_BATCH_DOCS 10000
+
+void write_run(index_builder_p builder);
+index_run_p add_run(index_builder_p builder);
+void next_run_word(index_run_p run);
+void open_run_postings(index_builder_p builder);
+void push_run(index_builder_p builder, int r);
+int pop_run(index_builder_p builder);
+int cmp_run(index_builder_p builder, int a, int b);
+void write_number(FILE *f, unsigned int n);
+unsigned int read_number(FILE *f);
+
+/*
+ * An index builder keeps the words of the documents it parses in an index of its own until they occupy
+ * half the memory budget of the index. Then it writes them to a run: a temporary file with the words in
+ * alphabetical order, each followed by its document list (numbers in 7 bit groups, ids as gaps) and the
+ * position lists of the documents.
+ * A segment file is written by merging the words in memory, the runs and the words parsed last:
+ * the sources are read one word after another, so memory use doesn't depend on the size of the index.
+ * All documents of a source have lower ids than the documents of the following sources, so the document
+ * lists of a word are merged by reading them one after another, a document at a time. Merging segments works the same way, with the words
+ * of the segments as the runs.
+ */
+
+/*
+ * Parses the documents with ids from first to last - 1 and writes a segment with their words and
+ * the words in memory
+ * the index mustn't contain words of these or later documents
+ *  nr_threads: number of threads parsing documents (0 = one per processor)
+ *  report: 1 = print the progress after each batch of documents
+ */
+void build_index(index_p index, int first, int last, int nr_threads, int report) {
+    double start = now_seconds();
+
+    // the words in memory belong to the documents before the ones parsed
+    index_builder_p builder = new_index_builder(index);
+    add_words_run(builder, index);
+
+    int doc = first;
+    while (doc < last) {
+        // next batch of documents, their text takes at most a quarter of the memory budget
+        long text_size = 0;
+        int end = doc;
+        while (end < last && end - doc < MAX_BATCH_DOCS) {
+            struct stat st;
+            char *name = get_document(index, end)->name;
+            long size = name && !stat(name, &st) ? st.st_size : 0;
+            if (end > doc && text_size + size > index->memory_budget / 4) {
+                break;
+            }
+
+            text_size += size;
+            end++;
+        }
+
+        parse_documents(&builder->words, doc, end, nr_threads);
+        doc = end;
+
+        if (words_memory(&builder->words) > index->memory_budget / 2) {
+            write_run(builder);
+        }
+
+        if (report) {
+            printf(" %d/%d files, %.0f files/s\n", doc - first, last - first, (doc - first) / (now_seconds() - start));
+        }
+    }
+
+    if (report && builder->nr_runs > 1) {
+        printf("Merging %d runs..\n", builder->nr_runs - 1);
+    }
+
+    // the words parsed last stay in memory
+    add_words_run(builder, &builder->words);
+
+    flush_segment(index, builder);
+    free_index_builder(builder);
+}
+
+/*
+ * Creates a builder adding words to an index (without runs)
+ */
+index_builder_p new_index_builder(index_p index) {
+    index_builder_p builder = (index_builder_p) malloc(sizeof(index_builder_t));
+    builder->index = index;
+
+    // the words share the documents (and the way they are parsed) with the index,
+    // the pages of the documents parsed belong to the index already and are changed in place
+    init_words(&builder->words);
+    builder->words.documents = index->documents;
+    builder->words.document_stamps = NULL;
+    builder->words.nr_snapshots = 0;
+    builder->words.nr_doc_ids = index->nr_doc_ids;
+    builder->words.stem_cache = index->stem_cache;
+    builder->words.stopwords = index->stopwords;
+    builder->words.positions = index->positions;
+
+    builder->runs = NULL;
+    builder->nr_runs = 0;
+    builder->heap = NULL;
+    builder->heap_size = 0;
+    builder->merged_stem = NULL;
+    builder->max_merged_stem = 0;
+    builder->merging = -1;
+
+    return builder;
+}
+
+/*
+ * Appends a run with the words of a vocabulary in memory
+ * the words mustn't change until the builder is released
+ */
+void add_words_run(index_builder_p builder, index_p words) {
+    index_run_p run = add_run(builder);
+    run->words = sort_words(words);
+    run->nr_words = words->nr_words;
+}
+
+/*
+ * Releases a builder, its run files are deleted
+ */
+void free_index_builder(index_builder_p builder) {
+    int r;
+    for (r = 0; r < builder->nr_runs; r++) {
+        index_run_p run = &builder->runs[r];
+        if (run->file) {
+            fclose(run->file);
+        } else if (run->fd >= 0) {
+            close(run->fd);
+        }
+
+        if (run->fd >= 0) {
+            free(run->buffer);
+            free(run->stem);
+            free(run->positions);
+        }
+
+        free(run->words);
+    }
+
+    clear_words(&builder->words);
+    free(builder->merged_stem);
+    free(builder->runs);
+    free(builder->heap);
+    free(builder);
+}
+
+/*
+ * Writes the words parsed so far to a new run and clears them
+ */
+void write_run(index_builder_p builder) {
+    // the file is deleted right away, it stays accessible until it is closed
+    char name[sizeof(RUN_FILE) + 12];
+    sprintf(name, "%s.%d", RUN_FILE, builder->nr_runs);
+
+    FILE *f = fopen(name, "w+b");
+    if (!f) {
+        printf("Error: couldn't open %s to write.\nWords kept in memory\n", name);
+        return;
+    }
+    remove(name);
+
+    char *buffer = (char *) malloc(RUN_BUFFER_SIZE);
+    setvbuf(f, buffer, _IOFBF, RUN_BUFFER_SIZE);
+
+    // format: length of the stem, stem, number of documents, id gap, count and position list of each document
+    indexed_word_p *sorted = sort_words(&builder->words);
+    int i;
+    for (i = 0; i < builder->words.nr_words; i++) {
+        indexed_word_p w = sorted[i];
+        int len = strlen(w->stem);
+        write_number(f, len);
+        fwrite(w->stem, 1, len, f);
+        write_number(f, w->nr_docs);
+
+        int prev = 0;
+        posting_cursor_t c;
+        for (open_cursor(&c, w); cursor_doc(&c) != INT_MAX; cursor_next(&c)) {
+            write_number(f, cursor_doc(&c) - prev);
+            write_number(f, cursor_count(&c));
+            prev = cursor_doc(&c);
+
+            int size;
+            unsigned char *list = cursor_position_list(&c, &size);
+            write_number(f, size);
+            if (list) {
+                fwrite(list, 1, size, f);
+            }
+        }
+    }
+
+    // an empty stem ends the run
+    write_number(f, 0);
+    free(sorted);
+
+    // only the file descriptor is kept until the runs are merged, the buffer is released
+    int fd = fflush(f) || ferror(f) ? -1 : dup(fileno(f));
+    count_stat(STAT_BYTES_WRITTEN, ftell(f));
+    fclose(f);
+    free(buffer);
+
+    if (fd < 0) {
+        printf("Error: couldn't write %s.\nWords kept in memory\n", name);
+        return;
+    }
+
+    index_run_p run = add_run(builder);
+    run->fd = fd;
+
+    clear_words(&builder->words);
+    init_words(&builder->words);
+}
+
+/*
+ * Appends an empty run to the runs of a builder
+ */
+index_run_p add_run(index_builder_p builder) {
+    builder->runs = (index_run_p) realloc(builder->runs, sizeof(index_run_t) * (builder->nr_runs + 1));
+
+    index_run_p run = &builder->runs[builder->nr_runs++];
+    memset(run, 0, sizeof(index_run_t));
+    run->fd = -1;
+
+    return run;
+}
+
+/*
+ * Prepares to merge the runs of a builder: the first word of each run is read
+ */
+void start_merge(index_builder_p builder) {
+    builder->heap = (int *) malloc(sizeof(int) * builder->nr_runs);
+    builder->heap_size = 0;
+
+    long buffer_size = builder->index->memory_budget / 4 / builder->nr_runs;
+    if (buffer_size > RUN_BUFFER_SIZE) {
+        buffer_size = RUN_BUFFER_SIZE;
+    } else if (buffer_size < MIN_RUN_BUFFER_SIZE) {
+        buffer_size = MIN_RUN_BUFFER_SIZE;
+    }
+
+    int r;
+    for (r = 0; r < builder->nr_runs; r++) {
+        index_run_p run = &builder->runs[r];
+        if (run->fd >= 0) {
+            lseek(run->fd, 0, SEEK_SET);
+            run->file = fdopen(run->fd, "rb");
+            run->buffer = (char *) malloc(buffer_size);
+            setvbuf(run->file, run->buffer, _IOFBF, buffer_size);
+        }
+
+        next_run_word(run);
+        if (run->stem) {
+            push_run(builder, r);
+        }
+    }
+}
+
+/*
+ * Returns the stem of the alphabetically next word of all runs (NULL = no words left), the stem is valid until the
+ * next call; its documents in all runs are read with next_merged_posting (the ones not read are skipped)
+ */
+char *next_merged_word(index_builder_p builder) {
+    int count, size;
+    unsigned char *list;
+    while (next_merged_posting(builder, &count, &list, &size) != INT_MAX) {
+    }
+
+    if (!builder->heap_size) {
+        return NULL;
+    }
+
+    char *stem = builder->runs[builder->heap[0]].stem;
+    int len = strlen(stem);
+    if (len + 1 > builder->max_merged_stem) {
+        builder->max_merged_stem = len + 1;
+        builder->merged_stem = (char *) realloc(builder->merged_stem, builder->max_merged_stem);
+    }
+    memcpy(builder->merged_stem, stem, len + 1);
+
+    builder->merging = pop_run(builder);
+    open_run_postings(builder);
+
+    return builder->merged_stem;
+}
+
+/*
+ * Reads the next document of the word returned by next_merged_word, returns its id (INT_MAX = no documents left)
+ *  count: returns the number of occurances of the word in the document
+ *  list: returns the encoded position list of the document (as cursor_position_list), valid until the next call
+ *  size: returns the number of bytes of the position list
+ */
+int next_merged_posting(index_builder_p builder, int *count, unsigned char **list, int *size) {
+    while (builder->merging >= 0) {
+        index_run_p run = &builder->runs[builder->merging];
+        if (run->fd < 0) {
+            int doc = cursor_read(&builder->cursor, count, list, size);
+            if (doc != INT_MAX) {
+                return doc;
+            }
+        }
+
+        if (run->fd >= 0 && run->nr_docs) {
+            run->nr_docs--;
+            builder->merged_doc += read_number(run->file);
+            *count = read_number(run->file);
+
+            *size = read_number(run->file);
+            if (*size > run->max_positions) {
+                run->max_positions = *size;
+                run->positions = (unsigned char *) realloc(run->positions, run->max_positions);
+            }
+
+            *list = run->positions;
+            if (fread(run->positions, 1, *size, run->file) != *size) {
+                *size = 0;
+            }
+            return builder->merged_doc;
+        }
+
+        // runs with the same stem come out of the heap in the order of their documents
+        next_run_word(run);
+        if (run->stem) {
+            push_run(builder, builder->merging);
+        }
+
+        builder->merging = -1;
+        if (builder->heap_size && !strcmp(builder->runs[builder->heap[0]].stem, builder->merged_stem)) {
+            builder->merging = pop_run(builder);
+            open_run_postings(builder);
+        }
+    }
+
+    return INT_MAX;
+}
+
+/*
+ * Prepares to read the documents of the current word of the run being merged
+ */
+void open_run_postings(index_builder_p builder) {
+    index_run_p run = &builder->runs[builder->merging];
+    if (run->fd < 0) {
+        open_cursor(&builder->cursor, run->words[run->pos - 1]);
+    }
+    builder->merged_doc = 0;
+}
+
+/*
+ * Moves a run on to its next word (stem = NULL if there is none)
+ */
+void next_run_word(index_run_p run) {
+    if (run->fd < 0) {
+        run->stem = run->pos < run->nr_words ? run->words[run->pos++]->stem : NULL;
+        return;
+    }
+
+    int len = read_number(run->file);
+    if (!len) {
+        free(run->stem);
+        run->stem = NULL;
+        run->max_stem = 0;
+        return;
+    }
+
+    if (len + 1 > run->max_stem) {
+        run->max_stem = len + 1;
+        run->stem = (char *) realloc(run->stem, run->max_stem);
+    }
+
+    if (fread(run->stem, 1, len, run->file) != len) {
+        len = 0;
+    }
+    run->stem[len] = '\0';
+    run->nr_docs = read_number(run->file);
+}
+
+/*
+ * Adds a run to the heap of runs
+ */
+void push_run(index_builder_p builder, int r) {
+    int *heap = builder->heap;
+    int i = builder->heap_size++;
+
+    // move up while the parent comes later
+    while (i && cmp_run(builder, r, heap[(i - 1) / 2]) < 0) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+
+    heap[i] = r;
+}
+
+/*
+ * Removes the run with the alphabetically first stem from the heap of runs and returns it
+ */
+int pop_run(index_builder_p builder) {
+    int *heap = builder->heap;
+    int top = heap[0];
+    int r = heap[--builder->heap_size];
+
+    // move the last run down from the top while a child comes earlier
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= builder->heap_size) {
+            break;
+        }
+
+        if (child + 1 < builder->heap_size && cmp_run(builder, heap[child + 1], heap[child]) < 0) {
+            child++;
+        }
+
+        if (cmp_run(builder, heap[child], r) >= 0) {
+            break;
+        }
+
+        heap[i] = heap[child];
+        i = child;
+    }
+
+    heap[i] = r;
+    return top;
+}
+
+/*
+ * Compares two runs by the stems of their next words, then by their order
+ */
+int cmp_run(index_builder_p builder, int a, int b) {
+    int cmp = strcmp(builder->runs[a].stem, builder->runs[b].stem);
+    return cmp ? cmp : a - b;
+}
+
+/*
+ * Writes a number in groups of 7 bits, lowest first, the highest bit of each byte tells if more follow
+ */
+void write_number(FILE *f, unsigned int n) {
+    while (n >= 0x80) {
+        putc((n & 0x7f) | 0x80, f);
+        n >>= 7;
+    }
+
+    putc(n, f);
+}
+
+/*
+ * Reads a number written by write_number (0 at the end of the file)
+ */
+unsigned int read_number(FILE *f) {
+    unsigned int n = 0;
+    int shift = 0, c;
+    while ((c = getc(f)) != EOF) {
+        n |= (unsigned int) (c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            break;
+        }
+        shift += 7;
+    }
+
+    return n;
+}
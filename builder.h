@@ -0,0 +1,7 @@
+void build_index(index_p index, int first, int last, int nr_threads, int report);
+index_builder_p new_index_builder(index_p index);
+void add_words_run(index_builder_p builder, index_p words);
+void free_index_builder(index_builder_p builder);
+void start_merge(index_builder_p builder);
+char *next_merged_word(index_builder_p builder);
+int next_merged_posting(index_builder_p builder, int *count, unsigned char **list, int *size);
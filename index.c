@@ -2,145 +2,220 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <ctype.h>
 #include <math.h>
 
 #include "index.h"
 #include "stemmer.h"
 #include "util.h"
+#include "vocab.h"
+#include "postings.h"
+#include "indexfile.h"
+#include "journal.h"
+#include "norms.h"
+#include "stemcache.h"
+#include "stopwords.h"
+#include "tokenizer.h"
+#include "builder.h"
+#include "segments.h"
+#include "snapshots.h"
+#include "stats.h"
 
 #define MAX_SEARCH_RESULTS 10
+#define STOPWORD_FILE "stopwords"
 
-void write_index_to_file(index_p index);
-void parse_file_for_index(index_p index, char *file);
-void load_stopwords();
-void release_stopwords();
-int is_stopword(char *word);
-int find_str(void *objs, int struct_len, char *str, int min, int max);
-int find_int(void *objs, int struct_len, int i, int min, int max);
+// the words in memory are written to a segment of their own once the journal exceeds this size
+#define FLUSH_JOURNAL_SIZE (1 << 20)
 
-int cmp_doc_found_desc(const void *a, const void *b);
+// search terms of a query looked for, one bit each in the flag of a document found (further terms are ignored)
+#define MAX_QUERY_TERMS 64
+
+int import_index(index_p index);
+void compact_documents(index_p index);
+int new_document(index_p index, char *file);
+int find_name_pos(index_p index, char *file);
+int cmp_document_name(const void *a, const void *b);
+stopword_set_p read_stopword_file(char *file);
 
-static int nr_stopwords = 0;
-static char **stopwords = NULL;
+int cmp_doc_found_desc(const void *a, const void *b);
+int cmp_term_cursor(const void *a, const void *b);
+int cmp_str(const void *a, const void *b);
+int cmp_occurance(const void *a, const void *b);
+
+typedef struct query_term {
+    char *stem;             // stem of the search term
+    int count;              // number of occurances in the query
+    int nr_docs;            // number of documents containing the search term (0 = not indexed)
+} query_term_t, *query_term_p;
+
+typedef struct query_phrase {
+    int nr_words;           // number of words of the phrase (2 for words joined by NEAR)
+    int *terms;             // per word: number of its search term
+    int *offsets;           // per word: position relative to the first word of the phrase (stopwords count)
+    int distance;           // NEAR/k: most words the two words may be apart (-1 = the words form a phrase)
+} query_phrase_t, *query_phrase_p;
+
+query_term_p parse_query(index_p index, char *query, int *nr_terms, int *nr_words, query_phrase_p *phrases, int *nr_phrases);
+query_phrase_p add_phrase(query_phrase_p *phrases, int *nr_phrases, int distance);
+void add_phrase_word(query_phrase_p phrase, int term, int offset);
+void close_query(query_term_p terms, int nr_terms, query_phrase_p phrases, int nr_phrases);
 
 typedef struct doc_found {
     int doc_id;             // document id
-    double dist;            // euclidian distance to TF-IDF of the words in the queue
+    char *name;             // name of the document
+    double dist;            // euclidian distance to TF-IDF of the words in the queue (negative cosine similarity if ranked by cosine)
     unsigned long flag;     // if the n-th most significant bit is set, the n-th search term was found in this document (ignoring stopwords)
 } doc_found_t, *doc_found_p;
 
+typedef struct document_name {
+    char *name;             // name of the document
+    int doc_id;             // document id
+} document_name_t, *document_name_p;
+
+typedef struct term_cursor {
+    posting_cursor_t postings;  // position in the document list of the word
+    double idf;             // IDF of the word
+    double q_idf;           // IDF of the word if the query counts as a document
+    double q_tfidf;         // TF-IDF of the word in the query
+    double penalty;         // squared distance added to documents not containing the word
+    int qid;                // number of the search term
+    int phrase;             // 1 = the word belongs to a phrase (its cursor leaves a document after scoring it)
+    int *positions;         // positions of the word in the document positions_doc
+    int nr_positions;       // number of these positions (0 = not recorded)
+    int max_positions;      // number of positions the list has room for
+    int positions_doc;      // document the positions were decoded for (-1 = none)
+} term_cursor_t, *term_cursor_p;
+
+int add_to_heap(doc_found_p heap, int *nr_found, int max_found, doc_found_p found);
+int match_phrases(term_cursor_p cursors, int *term_cursors, query_phrase_p phrases, int nr_phrases, int doc_id);
+void term_positions(term_cursor_p c, int doc_id);
+
 /*
- * Loads stopwords array from the stopwords file
+ * Loads a set of stopwords from a file or prints an error message
  */
-void load_stopwords() {
-    // open file or print error message
-    FILE *sw_file = fopen("stopwords", "r");
-    if (!sw_file) {
-        printf("stopwords file not found.\nCan't remove stopwords!\n");
-        return;
-    }
-
-    // count number of stopwords
-    nr_stopwords = 0;
-    char c;
-    while ((c = getc(sw_file)) != EOF) {
-        if (c == '\n') {
-            nr_stopwords++;
-        }
-    }
-
-    stopwords = (char**) malloc(sizeof(char *) * nr_stopwords);
-    rewind(sw_file);
-
-    // load stopwords into array
-    int i;
-    for (i = 0; i < nr_stopwords; i++) {
-        stopwords[i] = read_line(sw_file);
+stopword_set_p read_stopword_file(char *file) {
+    stopword_set_p set = load_stopwords(file);
+    if (!set) {
+        printf("%s file not found.\nCan't remove stopwords!\n", file);
     }
 
-    fclose(sw_file);
+    return set;
 }
 
 /*
- * Releases the memory allocated for the stopwords array
+ * Replaces the stopwords of the index by the ones in a file and rebuilds the index with them
  */
-void release_stopwords() {
-    if (stopwords) {
-        int i;
-        for (i = 0; i < nr_stopwords; i++) {
-            free(stopwords[i]);
-        }
-        free(stopwords);
+void change_stopwords(index_p index, char *file) {
+    stopword_set_p set = load_stopwords(file);
+    if (!set) {
+        printf("Error: couldn't read %s.\nStopwords not changed.\n", file);
+        return;
     }
-}
 
-/*
- * Checks whether a word is a stopwords
- */
-int is_stopword(char *word) {
-    if (!stopwords) {
-        load_stopwords();
-    }
+    retire_stopwords(index, index->stopwords);
+    index->stopwords = set;
 
-    return find_str(stopwords, sizeof(char *), word, 0, nr_stopwords - 1) != -1;
+    // the segment files keep the stopwords the index was built with
+    rebuild_index(index, 0);
 }
 
 /*
  * Adds a file to the index
  */
-index_p add_file(index_p index, char *file) {
+void add_file(index_p index, char *file) {
     // check if file exists and can be read
     FILE *f = fopen(file, "r");
     if (!f) {
         printf("Cannot open %s!\nIndex not updated.\n", file);
-        return index;
+        return;
     }
     fclose(f);
 
-    // insert file into file list (alphabetically ordered)
-    int doc_id = 0;
-
-    // always insert temporary search document in the beginning
-    if (strcmp(file, "._tmp_search_doc")) {
-        for (doc_id = 0; doc_id < index->nr_docs; doc_id++) {
-            int cmp = strcmp(index->documents[doc_id].name, file);
+    int doc_id = insert_document(index, file);
+    if (doc_id < 0) {
+        printf("%s is already in the filebase.\n", file);
+        return;
+    }
 
-            if (!cmp) {
-                printf("%s is already in the filebase.\n", file);
-                return index;
-            } else if (0 < cmp) {
-                // right position in list found
-                break;
-            }
+    // parse file contents and add words to index
+    int *words;
+    int nr_terms = parse_file_for_index(index, doc_id, &words);
+
+    // the document is the only new entry in the lists of its words
+    int k;
+    for (k = 0; k < nr_terms; k++) {
+        indexed_word_p w = &index->words[words[k]];
+        if (index->norms) {
+            update_word_norms(index, w->stem, word_df(index, w->stem) - 1, doc_id);
         }
     }
 
-    // insert document in list
-    index = (index_p) realloc(index, sizeof(index_t) + sizeof(indexed_document_t) * (index->nr_docs + 1));
-    memmove(&index->documents[doc_id+1], &index->documents[doc_id], sizeof(indexed_document_t) * (index->nr_docs - doc_id));
+    // only the document itself is written, the words in memory go to a new segment from time to time
+    journal_add(index, doc_id, words, nr_terms);
+    free(words);
+
+    if (index->journal_size > FLUSH_JOURNAL_SIZE) {
+        flush_segment(index, NULL);
+    }
+}
+
+/*
+ * Adds a document to the filebase (without indexing its words), returns the id of the document
+ * or -1 if the filebase already contains a document with this name
+ */
+int insert_document(index_p index, char *file) {
+    // find position of the file in the alphabetically ordered list of names
+    int pos = find_name_pos(index, file);
+    if (pos < index->nr_docs && !strcmp(get_document(index, index->by_name[pos])->name, file)) {
+        return -1;
+    }
+
+    // the document gets the next free id
+    int doc_id = new_document(index, file);
 
-    index->documents[doc_id].name = (char *) malloc(strlen(file) + 1);
-    memcpy(index->documents[doc_id].name, file, strlen(file) + 1);
-    index->documents[doc_id].nr_words = 0;
+    // insert id in list of names
+    memmove(&index->by_name[pos+1], &index->by_name[pos], sizeof(int) * (index->nr_docs - pos));
+    index->by_name[pos] = doc_id;
     index->nr_docs++;
 
-    // update indices: increase indices which are greater or equal to doc_id of added document
-    indexed_word_p w = index->words;
-    while (w) {
-        int i;
-        for (i = 0; i < w->nr_docs; i++) {
-            if (w->documents[i].id >= doc_id) {
-                w->documents[i].id++;
-            }
-        }
+    return doc_id;
+}
+
+/*
+ * Adds documents to the filebase at once (without indexing their words), returns the id of the first one
+ * the documents get consecutive ids
+ *  files: names of documents not in the filebase yet, alphabetically ordered without duplicates
+ */
+int insert_documents(index_p index, char **files, int nr_files) {
+    int first = index->nr_doc_ids;
+    int *ids = (int *) malloc(sizeof(int) * (nr_files + 1));
+    int i;
+    for (i = 0; i < nr_files; i++) {
+        ids[i] = new_document(index, files[i]);
+    }
+
+    merge_names(index, ids, nr_files);
+    free(ids);
 
-        w = w->next;
+    return first;
+}
+
+/*
+ * Merges documents into the alphabetically ordered list of names
+ *  ids: documents not in the list yet, ordered by name
+ */
+void merge_names(index_p index, int *ids, int nr_ids) {
+    // merge starting at the end, so every name moves once
+    int i, old = index->nr_docs - 1, k = index->nr_docs + nr_ids - 1;
+    for (i = nr_ids - 1; i >= 0; k--) {
+        if (old >= 0 && strcmp(get_document(index, index->by_name[old])->name, get_document(index, ids[i])->name) > 0) {
+            index->by_name[k] = index->by_name[old--];
+        } else {
+            index->by_name[k] = ids[i--];
+        }
     }
 
-    // parse file contents and add words to index
-    parse_file_for_index(index, file);
-    write_index_to_file(index);
-    return index;
+    index->nr_docs += nr_ids;
 }
 
 /*
@@ -153,441 +228,1056 @@ void remove_file(index_p index, int doc_id) {
         return;
     }
 
-    if (doc_id < 0 || doc_id >= index->nr_docs) {
+    if (doc_id < 0 || doc_id >= index->nr_doc_ids || !get_document(index, doc_id)->name) {
         printf("Error: illegal document id. No document removed!\n");
+        return;
     }
 
-    // remove document from list in index
-    free(index->documents[doc_id].name);
-    memmove(&index->documents[doc_id], &index->documents[doc_id+1], sizeof(indexed_document_t) * (index->nr_docs - 1 - doc_id));
+    delete_document(index, doc_id);
+
+    // commit changes to the journal
+    journal_remove(index, doc_id);
+}
+
+/*
+ * Removes a document from the filebase and its words from the index
+ */
+void delete_document(index_p index, int doc_id) {
+    indexed_document_p doc = change_document(index, doc_id);
+
+    // remove document from list of names, its id is not handed out again
+    int pos = find_name_pos(index, doc->name);
+    memmove(&index->by_name[pos], &index->by_name[pos+1], sizeof(int) * (index->nr_docs - 1 - pos));
     index->nr_docs--;
 
-    indexed_word_p w = index->words;    // current word
-    indexed_word_p p = NULL;            // previous word
-
-    // remove document from the list of each indexed word
-    while (w) {
-        // find index of removed document in list (or of first document with higher id)
-        int i;
-        int remove = 0;
-        for (i = 0; i < w->nr_docs; i++) {
-            if (w->documents[i].id == doc_id) {
-                w->nr_docs--;
-                // document found in list, indicate removal
-                remove = 1;
-                break;
-            } else if (w->documents[i].id > doc_id) {
-                break;
+    if (!is_mapped(index, doc->name)) {
+        retire_memory(index, doc->name);
+    }
+    doc->name = NULL;
+    doc->nr_words = 0;
+
+    index_segment_p segment = document_segment(index, doc_id);
+    if (segment) {
+        // the segment keeps the words of the document, they just don't count anymore
+        add_removed(index, doc_id);
+
+        int *words;
+        int nr_terms = remove_segment_document(index, segment, doc_id, &words);
+
+        int k;
+        for (k = 0; k < nr_terms && index->norms; k++) {
+            // the IDF of the word changed for the remaining documents containing it
+            char *stem = segment->words.words[words[k]].stem;
+            int df = word_df(index, stem);
+            if (df) {
+                update_word_norms(index, stem, df + 1, -1);
             }
         }
 
-        // reduce document id of all documents with id > removed document id
-        // and shift array items (in order to remove entry of the document we want to remove) if neccessary
-        for (; i < w->nr_docs; i++) {
-            w->documents[i] = w->documents[i+remove];
-            w->documents[i].id--;
+        free(words);
+        return;
+    }
+
+    // remove document from the list of each word in memory
+    int wid = 0;
+    while (wid < index->nr_words) {
+        indexed_word_p w = &index->words[wid];
+
+        // only the document lists containing the document change, snapshots keep the old ones
+        posting_cursor_t c;
+        open_cursor(&c, w);
+        if (cursor_seek(&c, doc_id) == doc_id) {
+            own_word(index, w);
         }
 
-        if (w->nr_docs == 0) {
-            // only occurance of this word is in removed document -> remove word from index
-            if (!p) {
-                index->words = w->next;
-            } else {
-                p->next = w->next;
+        if (remove_posting(w, doc_id) && index->norms) {
+            // the IDF of the word changed for the remaining documents containing it
+            int df = word_df(index, w->stem);
+            if (df) {
+                update_word_norms(index, w->stem, df + 1, -1);
             }
+        }
 
-            index->nr_words--;
-
-            indexed_word_p n = w->next;
-            free(w->stem);
-            free(w);
-            w = n;
+        if (w->nr_docs == 0) {
+            // only occurance of this word in memory is in removed document -> remove word from the index
+            // (the last word in the list takes over its index, so don't advance)
+            remove_word(index, wid);
         } else {
             // get next indexed word
-            p = w;
-            w = w->next;
+            wid++;
         }
     }
+}
+
+/*
+ * Appends a document to the list of documents, returns the id of the document
+ */
+int new_document(index_p index, char *file) {
+    reserve_documents(index, index->nr_doc_ids + 1);
+
+    int doc_id = index->nr_doc_ids++;
+    if (index->norms) {
+        memset(change_norm(index, doc_id), 0, sizeof(doc_norm_t));
+    }
 
-    // commit changes to file
-    write_index_to_file(index);
+    indexed_document_p doc = change_document(index, doc_id);
+    doc->name = (char *) malloc(strlen(file) + 1);
+    memcpy(doc->name, file, strlen(file) + 1);
+    doc->nr_words = 0;
+
+    return doc_id;
 }
 
 /*
- * Searches index for indexed words and returns documents containing these words
+ * Makes room for the documents with ids up to nr_doc_ids - 1
  */
-index_p search_index(index_p *in, char *query) {
-    nonalpha_to_space(query);
+void reserve_documents(index_p index, int nr_doc_ids) {
+    if (nr_doc_ids <= index->max_doc_ids) {
+        return;
+    }
 
-    FILE *search_file = fopen("._tmp_search_doc", "w");
-    if (!search_file) {
-        printf("Error: couldn't create temporary file to write.\nUnable to search\n");
-        return NULL;
+    // pages full => double the number of pages
+    int nr_pages = index->max_doc_ids / DOCUMENT_PAGE_SIZE;
+    int max_pages = nr_pages ? nr_pages * 2 : 1;
+    while ((long) max_pages * DOCUMENT_PAGE_SIZE < nr_doc_ids) {
+        max_pages *= 2;
+    }
+    index->max_doc_ids = max_pages * DOCUMENT_PAGE_SIZE;
+
+    // snapshots have page tables of their own, only the pages are shared
+    index->documents = (indexed_document_p *) realloc(index->documents, sizeof(indexed_document_p) * max_pages);
+    index->document_stamps = (int *) realloc(index->document_stamps, sizeof(int) * max_pages);
+    index->by_name = (int *) realloc(index->by_name, sizeof(int) * index->max_doc_ids);
+    if (index->norms) {
+        index->norms = (doc_norm_p *) realloc(index->norms, sizeof(doc_norm_p) * max_pages);
+        index->norm_stamps = (int *) realloc(index->norm_stamps, sizeof(int) * max_pages);
     }
 
-    fprintf(search_file, "%s\n", query);
-    fclose(search_file);
+    int p;
+    for (p = nr_pages; p < max_pages; p++) {
+        index->documents[p] = (indexed_document_p) malloc(sizeof(indexed_document_t) * DOCUMENT_PAGE_SIZE);
+        index->document_stamps[p] = index->nr_snapshots;
+        if (index->norms) {
+            index->norms[p] = (doc_norm_p) calloc(DOCUMENT_PAGE_SIZE, sizeof(doc_norm_t));
+            index->norm_stamps[p] = index->nr_snapshots;
+        }
+    }
+}
 
-    *in = add_file(*in, "._tmp_search_doc");
-    index_p index = *in;
+/*
+ * Returns a document of the filebase to be read
+ */
+indexed_document_p get_document(index_p index, int doc_id) {
+    return &index->documents[doc_id / DOCUMENT_PAGE_SIZE][doc_id % DOCUMENT_PAGE_SIZE];
+}
 
-    // compute TF-IDF vector for search document
-    double *q_tfidf = (double *) malloc(sizeof(double) * index->nr_words);
+/*
+ * Returns a document of the filebase to be changed, its page is copied first if snapshots share it
+ * (the pages another index shares with this one are changed in place)
+ */
+indexed_document_p change_document(index_p index, int doc_id) {
+    int page = doc_id / DOCUMENT_PAGE_SIZE;
+    if (index->document_stamps) {
+        index->documents[page] = (indexed_document_p) own_memory(index, index->documents[page],
+            &index->document_stamps[page], sizeof(indexed_document_t) * DOCUMENT_PAGE_SIZE);
+    }
 
-    // threshold for the search, based on the distance of the search term to the empty document
-    double euclid_threshold = 0;
+    return &index->documents[page][doc_id % DOCUMENT_PAGE_SIZE];
+}
 
-    // document offset for each word where we need to continue searching (make use of sorted document ids)
-    int *w_offset = (int *) malloc(sizeof(int) * index->nr_words);
+/*
+ * Looks up the id of a document by its name, returns -1 if the document is not in the filebase
+ */
+int find_document(index_p index, char *file) {
+    int pos = find_name_pos(index, file);
+    if (pos < index->nr_docs && !strcmp(get_document(index, index->by_name[pos])->name, file)) {
+        return index->by_name[pos];
+    }
 
-    // calculate TF-IDF, threshold and offsets
-    int wid = 0;
-    indexed_word_p w = index->words;
-    while (w) {
-        if (!w->documents[0].id) {
-            q_tfidf[wid] = w->documents[0].tf * logf(index->nr_docs / w->nr_docs);
-            euclid_threshold += q_tfidf[wid] * q_tfidf[wid];
-            w_offset[wid] = 1;
+    return -1;
+}
+
+/*
+ * Binary search the alphabetically ordered list of document names for the position of a name
+ * (position of the first name which is not less than the given name)
+ */
+int find_name_pos(index_p index, char *file) {
+    int min = 0, max = index->nr_docs;
+    while (min < max) {
+        int middle = (min + max) / 2;
+        if (strcmp(get_document(index, index->by_name[middle])->name, file) < 0) {
+            min = middle + 1;
         } else {
-            q_tfidf[wid] = 0;
-            w_offset[wid] = 0;
+            max = middle;
         }
+    }
+
+    return min;
+}
+
+/*
+ * Searches index for indexed words and returns documents containing these words
+ */
+search_result_p search_index(index_p index, char *query) {
+    double start = now_seconds();
+
+    int nr_terms, nr_words, nr_phrases;
+    query_phrase_p phrases;
+    query_term_p terms = parse_query(index, query, &nr_terms, &nr_words, &phrases, &nr_phrases);
+
+    // the query is weighted as if it was an additional document of the filebase: IDF = log(N + 1) - log(df)
+    double log_n = log(index->nr_docs + 1);
+    int cosine = index->ranking == RANKING_COSINE;
 
-        w = w->next;
-        wid++;
+    // the TF-IDF vector lengths of the documents are kept up to date from loading the index on
+    update_norms(index);
+
+    // squared length of the TF-IDF vector of the query
+    double q_norm = 0;
+
+    // minimal squared distance of any document: search terms which are not indexed don't occur in any document
+    double min_dist = 0;
+
+    // cursors in the document lists of the indexed search terms
+    term_cursor_p cursors = (term_cursor_p) malloc(sizeof(term_cursor_t) * (nr_terms + 1));
+    int nr_cursors = 0;
+
+    int q;
+    for (q = 0; q < nr_terms; q++) {
+        if (!terms[q].nr_docs) {
+            double q_tfidf = (double) terms[q].count / nr_words * log_n;
+            q_norm += q_tfidf * q_tfidf;
+            min_dist += q_tfidf * q_tfidf;
+            continue;
+        }
+
+        term_cursor_p c = &cursors[nr_cursors++];
+
+        // the query counts as an additional document containing this word
+        // (compared by cosine, query and documents are weighted by the same IDF)
+        c->idf = log_n - log(terms[q].nr_docs);
+        c->q_idf = cosine ? c->idf : log_n - log(terms[q].nr_docs + 1);
+        c->q_tfidf = (double) terms[q].count / nr_words * c->q_idf;
+        c->penalty = c->q_tfidf * c->q_tfidf;
+        c->qid = q;
+        c->phrase = 0;
+        c->positions = NULL;
+        c->nr_positions = 0;
+        c->max_positions = 0;
+        c->positions_doc = -1;
+        q_norm += c->penalty;
     }
 
-    // threshold is the euclidian distance to the empty document
-    euclid_threshold = sqrt(euclid_threshold);
+    // sort cursors by the penalty for documents not containing their word
+    qsort(cursors, nr_cursors, sizeof(term_cursor_t), cmp_term_cursor);
 
-    // euclidian distance of all documents to the search term (based on TF-IDF)
-    doc_found_p euclid_dist = (doc_found_p) malloc(sizeof(doc_found_t) * index->nr_docs);
-    memset(euclid_dist, 0, sizeof(doc_found_t) * index->nr_docs);
+    // the phrases find the cursors of their words by search term, no document matches a phrase with a word not indexed
+    int *term_cursors = (int *) malloc(sizeof(int) * (nr_terms + 1));
+    int i, matchable = 1;
+    for (q = 0; q < nr_terms; q++) {
+        term_cursors[q] = -1;
+    }
+    for (i = 0; i < nr_cursors; i++) {
+        term_cursors[cursors[i].qid] = i;
+    }
+    for (q = 0; q < nr_phrases; q++) {
+        for (i = 0; i < phrases[q].nr_words; i++) {
+            if (term_cursors[phrases[q].terms[i]] < 0) {
+                matchable = 0;
+            } else {
+                cursors[term_cursors[phrases[q].terms[i]]].phrase = 1;
+            }
+        }
+    }
+
+    // penalty[i] = minimal squared distance of documents containing none of the words of cursors i..nr_cursors-1
+    double *penalty = (double *) malloc(sizeof(double) * (nr_cursors + 1));
+    penalty[nr_cursors] = min_dist;
+    for (i = nr_cursors - 1; i >= 0; i--) {
+        penalty[i] = penalty[i+1] + cursors[i].penalty;
+    }
 
-    // array of all search terms without stopwords
-    char *words[index->documents[0].nr_words];
-    memset(words, 0, sizeof(char *) * index->documents[0].nr_words);
+    // threshold for the search: the euclidian distance of the search term to the empty document
+    double euclid_threshold = sqrt(q_norm);
 
-    // index of last processed word in the search term
-    int qid = 0;
+    // squared distance a document has to beat to get into the result (lowered when the heap of results is full)
+    double theta = q_norm;
 
-    // compute euclidian distance for all documents; ignore temporary search document at index 0
-    int d;
+    // the best documents found so far, the worst one of them at the top
+    doc_found_p heap = (doc_found_p) malloc(sizeof(doc_found_t) * MAX_SEARCH_RESULTS);
     int nr_results = 0;
-    for (d = 1; d < index->nr_docs; d++) {
-        euclid_dist[nr_results].dist = 0;
-        euclid_dist[nr_results].flag = 0;
-        euclid_dist[nr_results].doc_id = d;
-
-        // compute TF-IDF for all words and sum the difference to the TF-IDF of the queue in euclid_dist
-        qid = 0;
-        int wid = 0;
-        w = index->words;
-        while (w) {
-            int i = w_offset[wid];
-            if (i < w->nr_docs && w->documents[i].id == d) {
-                // word occurs in document -> calculate TF-IDF and subtract TF-IDF of queue; then square
-                euclid_dist[nr_results].dist += pow(w->documents[i].tf * logf(index->nr_docs / w->nr_docs) - q_tfidf[wid], 2);
+
+    // cursors 0..essential-1 are non-essential: a document containing only their words can't beat the threshold
+    int essential = 0;
+
+    // counted for the runtime counters
+    long nr_candidates = 0, nr_scored = 0, nr_postings = 0;
+
+    // the segments (and the words in memory) are searched one after another, in the order of their documents
+    indexed_word_t none;
+    memset(&none, 0, sizeof(indexed_word_t));
+
+    int s;
+    for (s = 0; s <= index->nr_segments && matchable; s++) {
+        index_p words = s < index->nr_segments ? &index->segments[s].words : index;
+        for (i = 0; i < nr_cursors; i++) {
+            int wid = find_word(words, terms[cursors[i].qid].stem);
+            open_cursor(&cursors[i].postings, wid >= 0 ? &words->words[wid] : &none);
+        }
+
+        int d = -1;
+        for (;;) {
+            // the cursors of essential words of phrases leave the document looked at last
+            // (they stay there until it is scored, so its phrases can be checked)
+            for (i = essential; i < nr_cursors && nr_phrases; i++) {
+                if (cursors[i].phrase && cursor_doc(&cursors[i].postings) == d) {
+                    cursor_next(&cursors[i].postings);
+                    nr_postings++;
+                }
+            }
+
+            // next document containing any essential word
+            d = INT_MAX;
+            for (i = essential; i < nr_cursors; i++) {
+                int id = cursor_doc(&cursors[i].postings);
+                if (id < d) {
+                    d = id;
+                }
+            }
+
+            if (d == INT_MAX) {
+                break;
+            }
+
+            indexed_document_p doc = get_document(index, d);
+            if (!doc->name) {
+                // removed document, its segment still contains it
+                for (i = essential; i < nr_cursors; i++) {
+                    if (cursor_doc(&cursors[i].postings) == d) {
+                        cursor_next(&cursors[i].postings);
+                        nr_postings++;
+                    }
+                }
+                continue;
+            }
+
+            nr_candidates++;
+
+            // lower bound of the squared distance of the document and correction of |d|^2 + |q|^2 by the search terms
+            double bound = min_dist, dist = 0;
+
+            // dot product of the TF-IDF vectors of document and query
+            double dot = 0;
+            unsigned long flag = 0;
+
+            // score essential words first, then probe the non-essential words as long as the document can make it
+            for (i = nr_cursors - 1; i >= 0; i--) {
+                term_cursor_p c = &cursors[i];
+
+                if (i < essential) {
+                    if (bound > theta * (1 + 1e-9)) {
+                        // document can't beat the threshold even if it contains all remaining words
+                        break;
+                    }
+
+                    cursor_seek(&c->postings, d);
+                    nr_postings++;
+                }
+
+                if (cursor_doc(&c->postings) != d) {
+                    // word doesn't occur in document -> just square TF-IDF of queue
+                    bound += c->penalty;
+                    continue;
+                }
+
+                // word occurs in document: replace its contribution to |d|^2 by the squared difference to the query
+                double tf = (double) cursor_count(&c->postings) / doc->nr_words;
+                if (cosine) {
+                    dot += tf * c->idf * c->q_tfidf;
+                } else {
+                    double tfidf = tf * c->idf;
+                    double d_tfidf = tf * c->q_idf;
+                    dist += d_tfidf * d_tfidf - 2 * d_tfidf * c->q_tfidf - tfidf * tfidf;
+                }
 
                 // update bit mask (set qid-th most significant bit to 1)
-                if (!w->documents[0].id) {
-                    euclid_dist[nr_results].flag |= 1 << (sizeof(unsigned long) * 8 - 1 - qid);
+                flag |= 1UL << (sizeof(unsigned long) * 8 - 1 - c->qid);
+
+                if (i >= essential && !c->phrase) {
+                    cursor_next(&c->postings);
+                    nr_postings++;
                 }
+            }
 
-                w_offset[wid]++;
-            } else {
-                // word doesn't occur in document -> TF-IDF = 0 -> just square TF-IDF of queue
-                euclid_dist[nr_results].dist += q_tfidf[wid] * q_tfidf[wid];
+            if (i >= 0) {
+                // document pruned
+                continue;
             }
 
-            if (!w->documents[0].id) {
-                // this word is part of the search term
-                if (!words[qid]) {
-                    words[qid] = w->stem;
+            nr_scored++;
+
+            doc_found_t found;
+            found.doc_id = d;
+            found.name = doc->name;
+            found.flag = flag;
+
+            if (cosine) {
+                // no pruning: every document sharing a word with the query is ranked by the angle between them
+                double d_norm = document_norm(index, d, log_n);
+                if (d_norm <= 0 || q_norm <= 0) {
+                    continue;
+                }
+
+                found.dist = -dot / sqrt(d_norm * q_norm);
+
+                // the positions are only looked at for documents making it into the results
+                if (nr_phrases && (nr_results < MAX_SEARCH_RESULTS || cmp_doc_found_desc(&found, &heap[0]) < 0)
+                        && !match_phrases(cursors, term_cursors, phrases, nr_phrases, d)) {
+                    continue;
                 }
-                qid++;
+
+                add_to_heap(heap, &nr_results, MAX_SEARCH_RESULTS, &found);
+                continue;
             }
 
-            w = w->next;
-            wid++;
-        }
+            // |d - q|^2 = |d|^2 + |q|^2 - 2 d.q, corrected by the partial sums of the search terms
+            dist += document_norm(index, d, log_n) + q_norm;
+            found.dist = sqrt(dist > 0 ? dist : 0);
+
+            // ignore documents above threshold
+            if (found.dist >= euclid_threshold) {
+                continue;
+            }
 
-        euclid_dist[nr_results].dist = sqrtf(euclid_dist[nr_results].dist);
+            // ignore documents without the phrases, for documents making it into the results only
+            if (nr_phrases && (nr_results < MAX_SEARCH_RESULTS || cmp_doc_found_desc(&found, &heap[0]) < 0)
+                    && !match_phrases(cursors, term_cursors, phrases, nr_phrases, d)) {
+                continue;
+            }
 
-        // overwrite documents above threshold or without any hits in next iteration
-        if (euclid_dist[nr_results].flag && euclid_dist[nr_results].dist < euclid_threshold) {
-            nr_results++;
+            // ignore documents worse than the results so far
+            if (!add_to_heap(heap, &nr_results, MAX_SEARCH_RESULTS, &found)) {
+                continue;
+            }
+
+            if (nr_results == MAX_SEARCH_RESULTS) {
+                // raise the bar to the worst result and move words which can't lift a document over it to the non-essential ones
+                theta = heap[0].dist * heap[0].dist;
+                while (essential < nr_cursors && penalty[essential + 1] > theta * (1 + 1e-9)) {
+                    essential++;
+                }
+            }
         }
     }
 
-    free(q_tfidf);
-    free(w_offset);
+    for (i = 0; i < nr_cursors; i++) {
+        free(cursors[i].positions);
+    }
+
+    free(cursors);
+    free(penalty);
+    free(term_cursors);
 
-    // sort documents by euclidian distance to query
+    // sort documents by euclidian distance to query (or by cosine similarity)
+    doc_found_p euclid_dist = heap;
     qsort(euclid_dist, nr_results, sizeof(doc_found_t), cmp_doc_found_desc);
 
-    // create result index
-    index_p result = (index_p) malloc(sizeof(index_t) + sizeof(indexed_document_t) * MAX_SEARCH_RESULTS);
-    result->nr_docs = 0;
-    result->nr_words = 0;
-    result->words = NULL;
 
-    unsigned long last_flag = 0;    // flag of last processed document
-    w = NULL;                       // current group of documents (of the same (sub-)set of search terms)
-    indexed_word_p p = NULL;        // previous group of documents
+    // create result list
+    search_result_p result = (search_result_p) malloc(sizeof(search_result_t) + sizeof(search_hit_t) * nr_results);
+    result->nr_hits = nr_results;
 
-    // create a index_p struct with the results, each 'word' in this index represents a group of documents which contains the same (sub-)set of search terms
-    int i;
-    for (i = 0; i <= MAX_SEARCH_RESULTS && i < nr_results; i++) {
-        if (euclid_dist[i].flag != last_flag || i == 0) {
-            // the flag is not equal to previous one => create new 'group' of documents
-            indexed_word_p w_new = (indexed_word_p) malloc(sizeof(indexed_word_t));
-            w_new->next = NULL;
-            w_new->nr_docs = 0;
-            w_new->stem = (char *) malloc(1);
-            *w_new->stem = '\0';
-
-            // create a string of all search terms found in this document
-            int k;
-            for (k = 0; k < index->documents[0].nr_words; k++) {
-                // check whether k-th most significant bit is set
-                if (euclid_dist[i].flag & (1 << (sizeof(unsigned long) * 8 - 1 - k))) {
-                    w_new->stem = (char *) realloc(w_new->stem, strlen(w_new->stem) + strlen(words[k]) + 3);
-                    strcat(w_new->stem, words[k]);
-                    strcat(w_new->stem, ", ");
-                }
+    for (i = 0; i < nr_results; i++) {
+        search_hit_p hit = &result->hits[i];
+
+        // create a string of all search terms found in this document
+        hit->terms = (char *) malloc(1);
+        *hit->terms = '\0';
+
+        int k;
+        for (k = 0; k < nr_terms; k++) {
+            // check whether k-th most significant bit is set
+            if (euclid_dist[i].flag & (1UL << (sizeof(unsigned long) * 8 - 1 - k))) {
+                hit->terms = (char *) realloc(hit->terms, strlen(hit->terms) + strlen(terms[k].stem) + 3);
+                strcat(hit->terms, terms[k].stem);
+                strcat(hit->terms, ", ");
             }
+        }
 
-            // remove final ', '
-            *(w_new->stem + strlen(w_new->stem) - 1) = '\0';
-            *(w_new->stem + strlen(w_new->stem) - 1) = '\0';
+        // remove final ', '
+        *(hit->terms + strlen(hit->terms) - 2) = '\0';
 
-            // update pointer to this group
-            if (!w) {
-                // first result document: set as first element of linked list
-                result->words = w_new;
-            } else {
-                w->next = w_new;
+        // copy name of the document into result list
+        char *d = euclid_dist[i].name;
+        hit->name = (char *) malloc(strlen(d) + 1);
+        memcpy(hit->name, d, strlen(d) + 1);
+        hit->score = cosine ? -euclid_dist[i].dist : euclid_dist[i].dist;
+    }
+
+    free(euclid_dist);
+    close_query(terms, nr_terms, phrases, nr_phrases);
+
+    count_stat(STAT_SEARCHES, 1);
+    count_stat(STAT_CANDIDATES, nr_candidates);
+    count_stat(STAT_DOCS_SCORED, nr_scored);
+    count_stat(STAT_POSTINGS_SCANNED, nr_postings);
+    count_time(STAT_TIME_SCORE, start);
+
+    return result;
+}
+
+/*
+ * Splits a search query into stemmed search terms (without stopwords), alphabetically ordered
+ * words in double quotes form a phrase: they have to occur in this order, at the same distances as in the query
+ * (stopwords count). NEAR/k (in capitals) between two words means they have to occur at most k words apart.
+ *  nr_terms: returns the number of distinct search terms
+ *  nr_words: returns the total number of words in the query
+ *  phrases: returns the phrases and the words joined by NEAR (NULL = none)
+ *  nr_phrases: returns the number of phrases
+ */
+query_term_p parse_query(index_p index, char *query, int *nr_terms, int *nr_words, query_phrase_p *phrases, int *nr_phrases) {
+    query_term_p terms = NULL;
+    *nr_terms = 0;
+    *nr_words = 0;
+    *phrases = NULL;
+    *nr_phrases = 0;
+
+    // split a copy of the query into words, the query itself stays as typed
+    char *copy = (char *) malloc(strlen(query) + 1);
+    memcpy(copy, query, strlen(query) + 1);
+
+    tokenizer_t t;
+    string_tokenizer(&t, copy);
+
+    // phrase the words in quotes are added to (-1 = none yet) and its first position,
+    // distance of a NEAR waiting for its second word (-1 = none) and the search term before it
+    int phrase = -1, phrase_start = 0, in_quotes = 0, near = -1, last_term = -1;
+
+    // number of words of the query so far, stopwords included, and characters of the query looked at for quotes
+    int position = 0, scanned = 0;
+
+    // number of words of search terms beyond MAX_QUERY_TERMS
+    int ignored = 0;
+
+    char *word;
+    int len;
+    while ((len = next_token(&t, &word))) {
+        // quotes between the previous word and this one open or close a phrase
+        int offset = word - copy;
+        for (; scanned < offset; scanned++) {
+            if (query[scanned] == '"') {
+                in_quotes = !in_quotes;
+                phrase = -1;
             }
+        }
+        scanned = offset + len;
+
+        if (!in_quotes && len == 4 && !strncmp(query + offset, "NEAR", 4) && query[offset + 4] == '/'
+                && isdigit((unsigned char) query[offset + 5])) {
+            near = atoi(query + offset + 5);
+            continue;
+        }
+
+        position++;
 
-            p = w;
-            w = w_new;
-            last_flag = euclid_dist[i].flag;
-            result->nr_words++;
+        // ignore stopwords
+        if (is_stopword(index->stopwords, word, len)) {
+            continue;
         }
 
-        // add document to group
-        w = (indexed_word_p) realloc(w, sizeof(indexed_word_t) + sizeof(doc_t) * (w->nr_docs + 1));
-        w->documents[w->nr_docs].id = i;
-        w->documents[w->nr_docs].tf = 0;
-        w->nr_docs++;
+        // the stem replaces the word in the copy of the query
+        len = cached_stem(index->stem_cache, word, len, word);
 
-        // copy name of the document into result index
-        char *d = index->documents[euclid_dist[i].doc_id].name;
-        result->documents[i].name = (char *) malloc(strlen(d) + 10);
-        sprintf(result->documents[i].name, "%08.5f %s", euclid_dist[i].dist, d);
-        result->nr_docs++;
+        if (!len) {
+            continue;
+        }
+
+        // count occurances of each search term
+        int q;
+        for (q = 0; q < *nr_terms; q++) {
+            if (!strcmp(terms[q].stem, word)) {
+                break;
+            }
+        }
 
-        // update pointer to this group (needed after realloc)
-        if (!p) {
-            result->words = w;
+        if (q < *nr_terms) {
+            terms[q].count++;
+        } else if (*nr_terms == MAX_QUERY_TERMS) {
+            if (!ignored++) {
+                printf("Warning: a query has more than %d search terms, the others are ignored.\n", MAX_QUERY_TERMS);
+            }
+            continue;
         } else {
-            p->next = w;
+            terms = (query_term_p) realloc(terms, sizeof(query_term_t) * (*nr_terms + 1));
+            terms[q].stem = (char *) malloc(len + 1);
+            memcpy(terms[q].stem, word, len + 1);
+            terms[q].count = 1;
+            terms[q].nr_docs = word_df(index, word);
+            (*nr_terms)++;
+        }
+
+        (*nr_words)++;
+
+        if (near >= 0 && last_term >= 0) {
+            query_phrase_p p = add_phrase(phrases, nr_phrases, near);
+            add_phrase_word(p, last_term, 0);
+            add_phrase_word(p, q, 0);
+        }
+        near = -1;
+        last_term = q;
+
+        if (in_quotes) {
+            if (phrase < 0) {
+                add_phrase(phrases, nr_phrases, -1);
+                phrase = *nr_phrases - 1;
+                phrase_start = position;
+            }
+
+            add_phrase_word(&(*phrases)[phrase], q, position - phrase_start);
         }
     }
 
-    free(euclid_dist);
+    close_tokenizer(&t);
+    free(copy);
 
-    remove_file(index, 0);
-    remove("._tmp_search_doc");
+    // a phrase of a single word is just a search term
+    int p, k, nr_kept = 0;
+    for (p = 0; p < *nr_phrases; p++) {
+        if ((*phrases)[p].nr_words < 2) {
+            free((*phrases)[p].terms);
+            free((*phrases)[p].offsets);
+        } else {
+            (*phrases)[nr_kept++] = (*phrases)[p];
+        }
+    }
+    *nr_phrases = nr_kept;
 
-    return result;
+    // number search terms alphabetically, the words of the phrases follow their terms
+    char **stems = (char **) malloc(sizeof(char *) * (*nr_terms + 1));
+    int q;
+    for (q = 0; q < *nr_terms; q++) {
+        stems[q] = terms[q].stem;
+    }
+
+    qsort(terms, *nr_terms, sizeof(query_term_t), cmp_str);
+
+    for (p = 0; p < *nr_phrases; p++) {
+        for (k = 0; k < (*phrases)[p].nr_words; k++) {
+            char *stem = stems[(*phrases)[p].terms[k]];
+            for (q = 0; terms[q].stem != stem; q++);
+            (*phrases)[p].terms[k] = q;
+        }
+    }
+
+    free(stems);
+    return terms;
 }
 
 /*
- * Compares two doc_found structs based on euclidian distance to the search term (1st priority) and the document id (2nd priority; which is the same as comparing the names)
+ * Appends an empty phrase to the phrases of a query, returns the phrase (valid until the next one is added)
+ *  distance: most words the two words joined by NEAR may be apart (-1 = the words form a phrase)
+ */
+query_phrase_p add_phrase(query_phrase_p *phrases, int *nr_phrases, int distance) {
+    *phrases = (query_phrase_p) realloc(*phrases, sizeof(query_phrase_t) * (*nr_phrases + 1));
+
+    query_phrase_p phrase = &(*phrases)[(*nr_phrases)++];
+    phrase->nr_words = 0;
+    phrase->terms = NULL;
+    phrase->offsets = NULL;
+    phrase->distance = distance;
+
+    return phrase;
+}
+
+/*
+ * Appends a word to a phrase
+ *  term: number of the search term of the word
+ *  offset: position of the word relative to the first word of the phrase
+ */
+void add_phrase_word(query_phrase_p phrase, int term, int offset) {
+    phrase->terms = (int *) realloc(phrase->terms, sizeof(int) * (phrase->nr_words + 1));
+    phrase->offsets = (int *) realloc(phrase->offsets, sizeof(int) * (phrase->nr_words + 1));
+    phrase->terms[phrase->nr_words] = term;
+    phrase->offsets[phrase->nr_words] = offset;
+    phrase->nr_words++;
+}
+
+/*
+ * Frees the memory occupied by a list of search terms and the phrases of the query
+ */
+void close_query(query_term_p terms, int nr_terms, query_phrase_p phrases, int nr_phrases) {
+    int q;
+    for (q = 0; q < nr_terms; q++) {
+        free(terms[q].stem);
+    }
+
+    for (q = 0; q < nr_phrases; q++) {
+        free(phrases[q].terms);
+        free(phrases[q].offsets);
+    }
+
+    free(terms);
+    free(phrases);
+}
+
+/*
+ * Checks whether a document contains the phrases of a query, the cursors of the words of the phrases are at
+ * the document if it contains the words; the words of documents without recorded positions are enough
+ *  term_cursors: per search term: index of its cursor
+ */
+int match_phrases(term_cursor_p cursors, int *term_cursors, query_phrase_p phrases, int nr_phrases, int doc_id) {
+    int p;
+    for (p = 0; p < nr_phrases; p++) {
+        query_phrase_p phrase = &phrases[p];
+
+        int k, recorded = 1;
+        for (k = 0; k < phrase->nr_words; k++) {
+            term_cursor_p c = &cursors[term_cursors[phrase->terms[k]]];
+            if (cursor_doc(&c->postings) != doc_id) {
+                return 0;
+            }
+
+            term_positions(c, doc_id);
+            if (!c->nr_positions) {
+                recorded = 0;
+            }
+        }
+
+        if (!recorded) {
+            continue;
+        }
+
+        if (phrase->distance >= 0) {
+            // both lists ascending: move on in the one behind until two positions are close enough
+            term_cursor_p a = &cursors[term_cursors[phrase->terms[0]]];
+            term_cursor_p b = &cursors[term_cursors[phrase->terms[1]]];
+            int i = 0, j = 0;
+            while (i < a->nr_positions && j < b->nr_positions && abs(a->positions[i] - b->positions[j]) > phrase->distance) {
+                if (a->positions[i] < b->positions[j]) {
+                    i++;
+                } else {
+                    j++;
+                }
+            }
+
+            if (i == a->nr_positions || j == b->nr_positions) {
+                return 0;
+            }
+            continue;
+        }
+
+        // each position of the first word gives the positions of the others, which only grow from one to the next
+        term_cursor_p first = &cursors[term_cursors[phrase->terms[0]]];
+        int next[phrase->nr_words];
+        memset(next, 0, sizeof(next));
+
+        int i, found = 0;
+        for (i = 0; i < first->nr_positions && !found; i++) {
+            int start = first->positions[i] - phrase->offsets[0];
+
+            for (k = 1; k < phrase->nr_words; k++) {
+                term_cursor_p c = &cursors[term_cursors[phrase->terms[k]]];
+                int pos = start + phrase->offsets[k];
+                while (next[k] < c->nr_positions && c->positions[next[k]] < pos) {
+                    next[k]++;
+                }
+
+                if (next[k] == c->nr_positions || c->positions[next[k]] != pos) {
+                    break;
+                }
+            }
+
+            found = k == phrase->nr_words;
+        }
+
+        if (!found) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Decodes the positions of the word of a cursor in the document at the cursor, unless they already are
+ */
+void term_positions(term_cursor_p c, int doc_id) {
+    if (c->positions_doc == doc_id) {
+        return;
+    }
+
+    int count = cursor_count(&c->postings);
+    if (count > c->max_positions) {
+        c->max_positions = count;
+        c->positions = (int *) realloc(c->positions, sizeof(int) * c->max_positions);
+    }
+
+    c->nr_positions = cursor_positions(&c->postings, c->positions);
+    c->positions_doc = doc_id;
+}
+
+/*
+ * Frees the memory occupied by a search result
+ */
+void close_search_result(search_result_p result) {
+    int i;
+    for (i = 0; i < result->nr_hits; i++) {
+        free(result->hits[i].name);
+        free(result->hits[i].terms);
+    }
+
+    free(result);
+}
+
+/*
+ * Compares two doc_found structs based on euclidian distance to the search term (1st priority) and the name of the document (2nd priority)
  */
 int cmp_doc_found_desc(const void *a, const void *b) {
    doc_found_p aa = (doc_found_p) a;
    doc_found_p bb = (doc_found_p) b;
 
    if (aa->dist == bb->dist) {
-       return (aa->doc_id < bb->doc_id) ? -1 : (aa->doc_id > bb->doc_id);
+       return strcmp(aa->name, bb->name);
    } else {
        return (aa->dist < bb->dist) ? -1 : (aa->dist > bb->dist);
    }
 }
 
 /*
- * Regenerates the index based on the files in the filebase
+ * Compares two term cursors based on the penalty for documents not containing their word
  */
-void rebuild_index(index_p index) {
-    // clear index but keep filebase
-    indexed_word_p w;
-    while ((w = index->words)) {
-        index->words = w->next;
+int cmp_term_cursor(const void *a, const void *b) {
+    double pa = ((term_cursor_p) a)->penalty;
+    double pb = ((term_cursor_p) b)->penalty;
+
+    return (pa < pb) ? -1 : (pa > pb);
+}
 
-        free(w->stem);
-        free(w);
+/*
+ * Adds a document to a bounded max-heap of the best documents found (worst document at the top)
+ * returns 0 if the heap is full and the document is worse than all documents in the heap, 1 otherwise
+ */
+int add_to_heap(doc_found_p heap, int *nr_found, int max_found, doc_found_p found) {
+    int i;
+    if (*nr_found < max_found) {
+        // heap not full yet: sift up from the end
+        i = (*nr_found)++;
+        while (i > 0 && cmp_doc_found_desc(&heap[(i - 1) / 2], found) < 0) {
+            heap[i] = heap[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+
+        heap[i] = *found;
+        return 1;
     }
 
-    index->nr_words = 0;
+    if (cmp_doc_found_desc(found, &heap[0]) >= 0) {
+        return 0;
+    }
 
-    // rescan every document
-    int i;
-    for (i = 0; i < index->nr_docs; i++) {
-        index->documents[i].nr_words = 0;
-        parse_file_for_index(index, index->documents[i].name);
+    // replace worst document: sift down from the top
+    i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= max_found) {
+            break;
+        }
+
+        if (child + 1 < max_found && cmp_doc_found_desc(&heap[child + 1], &heap[child]) > 0) {
+            child++;
+        }
+
+        if (cmp_doc_found_desc(&heap[child], found) <= 0) {
+            break;
+        }
+
+        heap[i] = heap[child];
+        i = child;
     }
 
-    // save
-    write_index_to_file(index);
+    heap[i] = *found;
+    return 1;
 }
 
 /*
- * Parses a file and adds its words to the index
+ * Compares two occurances of words in a document (see parse_file_for_index) by word, then by position
  */
-void parse_file_for_index(index_p index, char *file) {
-    // open file or print error message
-    FILE *f = fopen(file, "r");
-    if (!f) {
-        printf("Cannot open %s!\nIndex not updated.\n", file);
-        return;
-    }
+int cmp_occurance(const void *a, const void *b) {
+    unsigned long aa = *(unsigned long *) a;
+    unsigned long bb = *(unsigned long *) b;
+
+    return (aa < bb) ? -1 : (aa > bb);
+}
 
-    // document id = index of document in list of all documents in filebase (alphabetically ordered)
-    int doc_id = find_str(&index->documents[0].name, sizeof(indexed_document_t), file, 0, index->nr_docs-1);
+/*
+ * Compares two documents based on their names
+ */
+int cmp_document_name(const void *a, const void *b) {
+    return strcmp(((document_name_p) a)->name, ((document_name_p) b)->name);
+}
 
-    if (doc_id < 0) {
-        printf("Error: %s is not in the filebase!\n", file);
-        return;
+/*
+ * Compares two pointers to strings (or structs starting with a pointer to a string)
+ */
+int cmp_str(const void *a, const void *b) {
+    return strcmp(*(char **) a, *(char **) b);
+}
+
+/*
+ * Regenerates the index based on the files in the filebase
+ *  nr_threads: number of threads parsing the files (0 = one per processor)
+ */
+void rebuild_index(index_p index, int nr_threads) {
+    // clear index but keep filebase
+    clear_segments(index);
+    retire_words(index);
+    init_words(index);
+    clear_norms(index);
+
+    // no words refer to the documents now, so the ids of removed documents can be handed out again
+    compact_documents(index);
+
+    // rescan every document and save them as a single segment
+    build_index(index, 0, index->nr_doc_ids, nr_threads, 0);
+}
+
+/*
+ * Numbers the documents in the filebase from 0 on, leaving out removed documents
+ * the index mustn't contain any words
+ */
+void compact_documents(index_p index) {
+    int *new_id = (int *) malloc(sizeof(int) * (index->nr_doc_ids + 1));
+    int i, nr_ids = 0;
+    for (i = 0; i < index->nr_doc_ids; i++) {
+        new_id[i] = nr_ids;
+
+        indexed_document_t doc = *get_document(index, i);
+        if (doc.name) {
+            *change_document(index, nr_ids++) = doc;
+        }
     }
 
-    char *l;
-    while ((l = read_line(f))) {
-        // turn non alpha characters into spaces
-        nonalpha_to_space(l);
+    for (i = 0; i < index->nr_docs; i++) {
+        index->by_name[i] = new_id[index->by_name[i]];
+    }
 
-        char *word = strtok(l, " ");
-        while (word) {
-            // ignore stopwords
-            if (is_stopword(word)) {
-                word = strtok(NULL, " ");
-                continue;
-            }
+    index->nr_doc_ids = nr_ids;
+    free(new_id);
+}
 
-            char *word_stem = stem(word);
+/*
+ * Parses a file and adds its words to the index, returns the number of different words in the file
+ *  words: returns the indexes of these words if not NULL (to be freed by the caller)
+ */
+int parse_file_for_index(index_p index, int doc_id, int **words) {
+    double start = now_seconds();
 
-            if (!strlen(word_stem)) {
-                word = strtok(NULL, " ");
-                continue;
-            }
+    // words occuring in this document
+    int *doc_words = NULL;
+    int nr_doc_words = 0, max_doc_words = 0;
 
-            // insert document into index / add new stem to index
-            indexed_word_p w = index->words;    // current word
-            indexed_word_p p = NULL;            // previous word
-            int flag = 0;
-            while (w && !flag) {
-                int cmp = strcmp(w->stem, word_stem);
-                if (!cmp) {
-                    // stem is already indexed
-                    flag = 1;
-                    break;
-                } else if (0 < cmp) {
-                    // stem not indexed yet
-                    flag = 2;
-                    break;
-                }
+    // where the words occur: index of the word in the upper, number of the word in the document in the lower 32 bits
+    unsigned long *occurances = NULL;
+    int nr_occurances = 0, max_occurances = 0;
 
-                p = w;
-                w = w->next;
-            }
+    if (words) {
+        *words = NULL;
+    }
 
-            if (flag == 1) {
-                // stem indexed, add document to list
-                int i;
-                for (i = 0; i < w->nr_docs; i++) {
-                    if (w->documents[i].id == doc_id) {
-                        // document is already indexed for this stem
-                        flag = 0;
-                        break;
-                    } else if (w->documents[i].id > doc_id) {
-                        break;
-                    }
-                }
+    // open file or print error message
+    indexed_document_p doc = change_document(index, doc_id);
+    char *file = doc->name;
+    tokenizer_t t;
+    if (!open_tokenizer(&t, file)) {
+        printf("Cannot open %s!\nIndex not updated.\n", file);
+        return 0;
+    }
 
-                // only add document to list if it's not already in the list
-                if (flag) {
-                    w = (indexed_word_p) realloc(w, sizeof(indexed_word_t) + sizeof(doc_t) * (w->nr_docs + 1));
+    char *word;
+    int len, nr_tokens = 0, nr_stopwords = 0;
+    while ((len = next_token(&t, &word))) {
+        nr_tokens++;
 
-                    // update pointer to this group (needed after realloc)
-                    if (!p) {
-                        index->words = w;
-                    } else {
-                        p->next = w;
-                    }
+        // ignore stopwords
+        if (is_stopword(index->stopwords, word, len)) {
+            nr_stopwords++;
+            continue;
+        }
 
-                    // insert document in list
-                    memmove(&w->documents[i+1], &w->documents[i], sizeof(doc_t) * (w->nr_docs - i));
-                    w->documents[i].id = doc_id;
-                    w->documents[i].tf = 1;
-                    w->nr_docs++;
-                } else {
-                    // increase counter for number of occurances of this word in this document
-                    w->documents[i].tf++;
-                }
+        // the stem replaces the word in the buffer of the tokenizer
+        if (!cached_stem(index->stem_cache, word, len, word)) {
+            continue;
+        }
 
-                free(word_stem);
-            } else {
-                // stem is not indexed, add it to index
-                w = (indexed_word_p) malloc(sizeof(indexed_word_t) + sizeof(doc_t));
-                w->stem = word_stem;
-                w->nr_docs = 1;
-                w->documents[0].id = doc_id;
-                w->documents[0].tf = 1;
-
-                index->nr_words++;
-
-                // insert this word in linked list
-                if (!p) {
-                    w->next = index->words;
-                    index->words = w;
-                } else {
-                    w->next = p->next;
-                    p->next = w;
-                }
+        // insert document into index / add new stem to index
+        int wid = find_or_add_word(index, word);
+        if (index->positions) {
+            if (nr_occurances == max_occurances) {
+                max_occurances = max_occurances ? max_occurances * 2 : 256;
+                occurances = (unsigned long *) realloc(occurances, sizeof(unsigned long) * max_occurances);
             }
 
-            // increase counter for total number of words in this document
-            index->documents[doc_id].nr_words++;
+            occurances[nr_occurances++] = (unsigned long) wid << 32 | (nr_tokens - 1);
+        }
 
-            // get next word
-            word = strtok(NULL, " ");
+        // the document list changes, snapshots keep the old one
+        own_word(index, &index->words[wid]);
+        if (add_posting(&index->words[wid], doc_id, 1)) {
+            // first occurance of this word in this document, remember it
+            if (nr_doc_words == max_doc_words) {
+                max_doc_words = max_doc_words ? max_doc_words * 2 : 64;
+                doc_words = (int *) realloc(doc_words, sizeof(int) * max_doc_words);
+            }
+
+            doc_words[nr_doc_words++] = wid;
         }
 
-        free(l);
+        // increase counter for total number of words in this document
+        doc->nr_words++;
     }
 
-    fclose(f);
+    close_tokenizer(&t);
 
-    // finalize computation of TF
-    indexed_word_p w = index->words;
-    while (w) {
+    if (nr_occurances) {
+        // the positions of each word, in ascending order
+        qsort(occurances, nr_occurances, sizeof(unsigned long), cmp_occurance);
 
-        int i = find_int(&w->documents[0].id, sizeof(doc_t), doc_id, 0, w->nr_docs - 1);
+        int *positions = (int *) malloc(sizeof(int) * nr_occurances);
+        int first = 0;
+        while (first < nr_occurances) {
+            int wid = occurances[first] >> 32, nr_positions = 0;
+            while (first + nr_positions < nr_occurances && (int) (occurances[first + nr_positions] >> 32) == wid) {
+                positions[nr_positions] = (int) (occurances[first + nr_positions] & 0xffffffff);
+                nr_positions++;
+            }
 
-        if (i >= 0) {
-            w->documents[i].tf /= index->documents[doc_id].nr_words;
+            set_positions(&index->words[wid], positions, nr_positions);
+            first += nr_positions;
         }
 
-        w = w->next;
+        free(positions);
+    }
+    free(occurances);
+
+    if (words) {
+        *words = doc_words;
+    } else {
+        free(doc_words);
     }
+
+    count_stat(STAT_DOCS_PARSED, 1);
+    count_stat(STAT_TOKENS, nr_tokens);
+    count_stat(STAT_STOPWORD_HITS, nr_stopwords);
+    count_stat(STAT_STEM_CALLS, nr_tokens - nr_stopwords);
+    count_time(STAT_TIME_PARSE, start);
+
+    return nr_doc_words;
 }
 
 /*
- * Writes index to file
+ * Writes index to the text index files (filebase and index)
  */
-void write_index_to_file(index_p index) {
+void export_index(index_p index) {
     // STEP 1: write filebase to file
     FILE *fb_file = fopen("filebase", "w");
     if (!fb_file) {
@@ -597,9 +1287,17 @@ void write_index_to_file(index_p index) {
 
     // each line contains the name (relative path) to one document in the filebase and the number of words in this document
     // format: <path/to/file>|<nr_words>
-    int i;
-    for (i = 0; i < index->nr_docs; i++) {
-        fprintf(fb_file, "%s|%d\n", index->documents[i].name, index->documents[i].nr_words);
+    // ids of removed documents are skipped, so the ids in the file are the ids in memory minus the number of gaps before them
+    int *file_id = (int *) malloc(sizeof(int) * (index->nr_doc_ids + 1));
+    int i, nr_file_ids = 0;
+    for (i = 0; i < index->nr_doc_ids; i++) {
+        file_id[i] = nr_file_ids;
+
+        indexed_document_p doc = get_document(index, i);
+        if (doc->name) {
+            fprintf(fb_file, "%s|%d\n", doc->name, doc->nr_words);
+            nr_file_ids++;
+        }
     }
 
     fclose(fb_file);
@@ -608,91 +1306,181 @@ void write_index_to_file(index_p index) {
     FILE *index_file = fopen("index", "w");
     if (!index_file) {
         printf("Error: couldn't open index file to write.\nUnable to write index to file\n");
+        free(file_id);
         return;
     }
 
-    // write one word in each line
-    // format: <stem>:<n>:doc_id_1/<tf_stem_1>|doc_id_2/tf_stem_2>|..|doc_id_n/<tf_stem_n>
-    indexed_word_p w = index->words;
-    while (w) {
-        fprintf(index_file, "%s:%i:%i/%f", w->stem, w->nr_docs, w->documents[0].id, w->documents[0].tf);
+    // write one word in each line, alphabetically ordered
+    // format: <stem>:<n>:doc_id_1/<count_stem_1>|doc_id_2/<count_stem_2>|..|doc_id_n/<count_stem_n>
+    // (count = number of occurances of the stem in the document, TF = count / nr_words of the document)
+    // the lists of the segments and of the words in memory are merged the same way as when segments are merged
+    index_builder_p builder = new_index_builder(index);
+    for (i = 0; i < index->nr_segments; i++) {
+        add_words_run(builder, &index->segments[i].words);
+    }
+    add_words_run(builder, index);
+    start_merge(builder);
+
+    // the documents of a word are listed in a line of their own before the line is written, as their number comes first
+    int max_line = 1024;
+    char *line = (char *) malloc(max_line);
+    char *stem;
+    while ((stem = next_merged_word(builder))) {
+        // the lists of the segments still contain removed documents, words of removed documents only are left out
+        int nr_docs = 0, line_size = 0, doc, count, size;
+        unsigned char *list;
+        while ((doc = next_merged_posting(builder, &count, &list, &size)) != INT_MAX) {
+            if (!get_document(index, doc)->name) {
+                continue;
+            }
 
-        // list all documents containing this word (or variations of it)
-        int i;
-        for(i = 1; i < w->nr_docs; i++) {
-            fprintf(index_file, "|%i/%f", w->documents[i].id, w->documents[i].tf);
+            // line full => double the size (an entry takes 24 bytes at most)
+            if (line_size + 25 > max_line) {
+                max_line *= 2;
+                line = (char *) realloc(line, max_line);
+            }
+            line_size += sprintf(line + line_size, nr_docs++ ? "|%i/%i" : "%i/%i", file_id[doc], count);
         }
 
-        fprintf(index_file, "\n");
-
-        w = w->next;
+        if (nr_docs) {
+            // list all documents containing this word (or variations of it)
+            fprintf(index_file, "%s:%i:%s\n", stem, nr_docs, line);
+        }
     }
+    free(line);
 
+    free_index_builder(builder);
+    free(file_id);
     fclose(index_file);
 }
 
 /*
- * Parses and loads contents of the index file into a index struct
+ * Loads the index: maps the segment files, or imports the text index files if there are no segments yet
  */
 index_p load_index() {
+    double start = now_seconds();
+
     // create index struct
     index_p index = (index_p) malloc(sizeof(index_t));
-    index->words = NULL;
+    init_index(index);
+    index->stem_cache = new_stem_cache();
+
+    if (load_segments(index)) {
+        // index files written before they kept the stopwords rely on the stopwords file
+        if (!index->stopwords) {
+            index->stopwords = read_stopword_file(STOPWORD_FILE);
+        }
+
+        publish_snapshot(index);
+        count_time(STAT_TIME_LOAD, start);
+        return index;
+    }
+
+    // convert to the binary format, so the next start doesn't have to parse the text files again
+    // the stopwords file only matters for new indexes, afterwards the segment files keep the stopwords
+    index->stopwords = read_stopword_file(STOPWORD_FILE);
+    import_index(index);
+    flush_segment(index, NULL);
+    publish_snapshot(index);
+    count_time(STAT_TIME_LOAD, start);
+
+    return index;
+}
+
+/*
+ * Initializes an empty index
+ */
+void init_index(index_p index) {
+    index->documents = NULL;
+    index->document_stamps = NULL;
+    index->by_name = NULL;
     index->nr_docs = 0;
-    index->nr_words = 0;
+    index->nr_doc_ids = 0;
+    index->max_doc_ids = 0;
+    index->norms = NULL;
+    index->norm_stamps = NULL;
+    index->ranking = RANKING_EUCLID;
+    index->positions = 1;
+    index->stem_cache = NULL;
+    index->stopwords = NULL;
+    index->memory_budget = DEFAULT_MEMORY_BUDGET;
+    index->map = NULL;
+    index->map_size = 0;
+    index->generation = 0;
+    index->journal = NULL;
+    index->journal_size = 0;
+    index->segments = NULL;
+    index->nr_segments = 0;
+    index->next_segment = 1;
+    index->removed = NULL;
+    index->nr_removed = 0;
+    index->max_removed = 0;
+    index->merge = NULL;
+    index->snapshots = NULL;
+    index->nr_snapshots = 0;
+    init_words(index);
+}
 
+/*
+ * Parses and loads contents of the text index files (filebase and index) into an empty index struct
+ * returns 1 if both files were read, 0 otherwise
+ */
+int import_index(index_p index) {
     // STEP 1: populate list of all documents
     FILE *fb_file = fopen("filebase", "r");
     if (!fb_file) {
         printf("Error: filebase file not found.\nIndex not loaded!\n");
-        return index;
+        return 0;
     }
 
-    // count total number of documents
-    char c;
-    int nr_docs = 0;
-    while ((c = fgetc(fb_file)) != EOF) {
-        if (c == '\n') {
-            nr_docs++;
-        }
-    }
-
-    rewind(fb_file);
-
-    // create index struct
-    index = (index_p) realloc(index, sizeof(index_t) + sizeof(indexed_document_t) * nr_docs);
-
-    // load all documents in a list
-    int i;
-    for (i = 0; i < nr_docs; i++) {
-        char *line = read_line(fb_file);
+    // load all documents in a list, the line number is the id of the document
+    char *line;
+    long size = 0;
+    while ((line = read_line(fb_file))) {
+        size += strlen(line) + 1;
 
         // copy name to index
         char *tmp;
         char *doc = strtok(line, "|");
-        index->documents[i].name = malloc(sizeof(char) * strlen(doc) + 1);
-        memcpy(index->documents[i].name, doc, strlen(doc) + 1);
+        int doc_id = new_document(index, doc);
 
         // copy number of words to index
         doc = strtok(NULL, "|");
-        index->documents[i].nr_words = strtol(doc, &tmp, 10);
-        index->nr_docs++;
+        change_document(index, doc_id)->nr_words = strtol(doc, &tmp, 10);
 
         free(line);
     }
 
     fclose(fb_file);
 
+    // create alphabetically ordered list of the documents
+    document_name_p sorted = (document_name_p) malloc(sizeof(document_name_t) * (index->nr_doc_ids + 1));
+    int i;
+    for (i = 0; i < index->nr_doc_ids; i++) {
+        sorted[i].name = get_document(index, i)->name;
+        sorted[i].doc_id = i;
+    }
+
+    qsort(sorted, index->nr_doc_ids, sizeof(document_name_t), cmp_document_name);
+
+    for (i = 0; i < index->nr_doc_ids; i++) {
+        index->by_name[i] = sorted[i].doc_id;
+    }
+
+    index->nr_docs = index->nr_doc_ids;
+    free(sorted);
+
     // STEP 2: populate list of all words
     FILE * index_file = fopen("index", "r");
     if (!index_file) {
         printf("Error: index file not found.\nIndex not loaded!\n");
-        return index;
+        return 0;
     }
 
-    indexed_word_p p = NULL;
-    char *line, *stem, *docs, *doc, *tmp;
+    char *stem, *docs, *doc;
     while ((line = read_line(index_file))) {
+        size += strlen(line) + 1;
+
         // get the stem
         stem = strtok(line, ":");
 
@@ -701,24 +1489,12 @@ index_p load_index() {
             continue;
         }
 
-        // get number of documents for this word
-        int nr_docs = strtol(strtok(NULL, ":"), &tmp, 10);
+        // skip number of documents for this word
+        strtok(NULL, ":");
 
         // create struct for stem
-        indexed_word_p w = (indexed_word_p) malloc(sizeof(indexed_word_t) + sizeof(doc_t) * nr_docs);
-        w->stem = (char *) malloc(sizeof(char) * strlen(stem) + 1);
-        memcpy(w->stem, stem, strlen(stem) + 1);
-        w->nr_docs = nr_docs;
-
-        // insert into index
-        if (!p) {
-            index->words = w;
-            w->next = NULL;
-        } else {
-            w->next = p->next;
-            p->next = w;
-        }
-        p = w;
+        int wid = find_or_add_word(index, stem);
+        indexed_word_p w = &index->words[wid];
 
         // get list of documents containing this stem
         docs = strtok(NULL, ":");
@@ -726,100 +1502,76 @@ index_p load_index() {
         // read each document
         doc = strtok(docs, "|");
 
-        int i = 0;
         while(doc != NULL) {
-            sscanf(doc, "%i/%lf", &w->documents[i].id, &w->documents[i].tf);
+            int id;
+            double count;
+            sscanf(doc, "%i/%lf", &id, &count);
+
+            if (strchr(doc, '.')) {
+                // older files hold the TF (rounded to 6 decimals) instead of the number of occurances
+                count *= get_document(index, id)->nr_words;
+            }
+
+            add_posting(w, id, (int) (count + 0.5));
 
             // get next document
             doc = strtok(NULL, "|");
-            i++;
         }
 
-        index->nr_words++;
         free(line);
     }
 
     fclose(index_file);
+    count_stat(STAT_BYTES_READ, size);
 
-	return index;
+	return 1;
 }
 
 /*
  * Frees the memory occupied by a index struct
  */
 void close_index(index_p index) {
-    indexed_word_p w;
-
-    int i;
-    for (i = 0; i < index->nr_docs; i++) {
-        free(index->documents[i].name);
-    }
-
-    while ((w = index->words)) {
-        index->words = w->next;
-
-        free(w->stem);
-        free(w);
-    }
+    wait_for_merge(index);
+    clear_index(index);
     free(index);
 }
 
 /*
- * Binary search an array for a string
- *  obj: pointer to an array of pointers to strings
-         or array of fixed length structs containing a pointer to a string (in this case the obj pointer should point to the string pointer in the first struct)
- *  struct_len: length of one object in the array in bytes
- *  str: search string
- *  min: minimal index to search
- *  max: maximal index to search
+ * Releases everything the index holds, except the index struct itself
  */
-int find_str(void *objs, int struct_len, char *str, int min, int max) {
-    int middle = (min + max) / 2;
-    int cmp = strcmp(*((char **) (((char *) objs) + middle * struct_len)), str);
+void clear_index(index_p index) {
+    // no search may use a snapshot anymore
+    close_snapshots(index);
 
-    if (!cmp) {
-        // string found
-        return middle;
-    } else if (min != max) {
-        if (cmp > 0 && min != middle) {
-            // continue search in left half
-            return find_str(objs, struct_len, str, min, middle - 1);
-        } else if (max != middle) {
-            // continue search in right half
-            return find_str(objs, struct_len, str, middle + 1, max);
+    int i;
+    for (i = 0; i < index->nr_doc_ids; i++) {
+        indexed_document_p doc = get_document(index, i);
+        if (!is_mapped(index, doc->name)) {
+            free(doc->name);
         }
     }
 
-    // finished searching
-    return -1;
-}
-
-/*
- * Binary search an array for an integer
- *  obj: pointer to an array of integers
-         or array of fixed length structs containing an integer (in this case the obj pointer should point to the integer in the first struct)
- *  struct_len: length of one object in the array in bytes
- *  i: search integer
- *  min: minimal index to search
- *  max: maximal index to search
- */
-int find_int(void *objs, int struct_len, int i, int min, int max) {
-    int middle = (min + max) / 2;
-    int cmp_val = *((int *) (((char *) objs) + middle * struct_len));
-
-    if (cmp_val == i) {
-        // string found
-        return middle;
-    } else if (min != max) {
-        if (cmp_val > i && min != middle) {
-            // continue search in left half
-            return find_int(objs, struct_len, i, min, middle - 1);
-        } else if (max != middle) {
-            // continue search in right half
-            return find_int(objs, struct_len, i, middle + 1, max);
-        }
+    for (i = 0; i < index->max_doc_ids / DOCUMENT_PAGE_SIZE; i++) {
+        free(index->documents[i]);
     }
+    free(index->documents);
+    free(index->document_stamps);
+    free(index->by_name);
 
-    // finished searching
-    return -1;
+    for (i = 0; i < index->nr_segments; i++) {
+        free_removed_df(&index->segments[i]);
+        clear_index(&index->segments[i].words);
+    }
+    free(index->segments);
+    free(index->removed);
+
+    clear_words(index);
+    clear_norms(index);
+    free_stem_cache(index->stem_cache);
+    index->stem_cache = NULL;
+    free_stopwords(index->stopwords);
+    index->stopwords = NULL;
+    close_journal(index);
+    unmap_index_file(index);
 }
+
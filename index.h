@@ -1,30 +1,249 @@
+#define POSTING_BLOCK_SIZE 128         // number of documents in a packed block of a document list
+
+#define RANKING_EUCLID 0                // rank documents by the euclidian distance of their TF-IDF vector to the query
+#define RANKING_COSINE 1                // rank documents by the cosine similarity of their TF-IDF vector to the query
+
+#define STEM_CACHE_WORD_SIZE 31         // longest word kept in the stem cache
+
+#define TOKEN_BUFFER_SIZE (1 << 16)     // number of bytes a tokenizer reads at once, longer words are split
+
+#define DEFAULT_MEMORY_BUDGET (256L << 20)  // bytes the words parsed while building an index may occupy before they are written to a run
+
+#define DOCUMENT_PAGE_SIZE 1024         // documents per page of the document table and of the norms (power of 2), snapshots share unchanged pages
+#define REMOVED_DF_PAGE_SIZE 64         // words per page of the counts of removed documents of a segment
+#define NORM_DF_TOLERANCE 0.01          // change of log(df) of a word the sums of the documents containing it may lag behind
+#define MAX_NORM_DRIFTS 4096            // words whose sums may lag behind their df, then the sums of all of them are updated
+
+// runtime counters (see stats.c), the STAT_TIME_ ones count nanoseconds
+#define STAT_SEARCHES 0                 // searches
+#define STAT_CANDIDATES 1               // documents containing an essential search term, looked at by searches
+#define STAT_DOCS_SCORED 2              // documents whose distance to the query was computed in full
+#define STAT_POSTINGS_SCANNED 3         // documents of document lists the cursors of searches moved to
+#define STAT_DOCS_PARSED 4              // documents parsed
+#define STAT_TOKENS 5                   // words of the documents parsed
+#define STAT_STOPWORD_HITS 6            // words of documents left out as stopwords
+#define STAT_STEM_CALLS 7               // words of documents stemmed
+#define STAT_BYTES_READ 8               // bytes of index files mapped, of journals replayed and of text index files imported
+#define STAT_BYTES_WRITTEN 9            // bytes of index files, runs, manifests and journal records written
+#define STAT_TIME_PARSE 10              // parsing documents: reading, tokenizing, stemming, adding their words
+#define STAT_TIME_SCORE 11              // searching
+#define STAT_TIME_MERGE 12              // merging segments in the background (including writing the merged segment)
+#define STAT_TIME_PERSIST 13            // writing index files, manifests and journal records to disk
+#define STAT_TIME_LOAD 14               // loading the index
+#define NR_STATS 15
+
 typedef struct doc {
     int id;                             // index of the document in the filebase
-    double tf;                          // number of occurances in this document
+    int count;                          // number of occurances in this document
 } doc_t, *doc_p;
 
+typedef struct posting_block {
+    int last_id;                        // id of the last document in the block
+    int offset;                         // position of the packed block in the data of the document list (in 32 bit words)
+    unsigned char nr_docs;              // number of documents in the block (POSTING_BLOCK_SIZE except for the last block)
+    unsigned char id_bits;              // bits per packed id gap
+    unsigned char count_bits;           // bits per packed count
+    unsigned char reserved;
+} posting_block_t, *posting_block_p;
+
 typedef struct indexed_word {
-    struct indexed_word *next;          // next indexed word
-    char *stem;                         // stem of this word
+    char *stem;                         // stem of this word (stored in the stem blocks of the index)
     int nr_docs;                        // number of documents in filebase containing this word or variations of it
-    doc_t documents[];                  // list of these documents' index in the filebase
+    int nr_blocks;                      // number of packed blocks of the document list
+    int max_blocks;                     // number of blocks the list below has room for (0 = blocks and data are not owned by the word)
+    int data_size;                      // number of 32 bit words used by the packed blocks
+    int max_data;                       // number of 32 bit words the packed data has room for
+    int nr_tail;                        // number of documents in the tail
+    int max_tail;                       // number of documents the tail has room for
+    posting_block_p blocks;             // skip list: id range and position of each packed block (ordered by index)
+    unsigned int *data;                 // packed blocks: id gaps followed by the counts, bit packed
+    doc_p tail;                         // documents after the last packed block, not packed yet (ordered by index)
+    int positions_size;                 // number of bytes of the position lists
+    int max_positions;                  // number of bytes the position lists have room for (0 = not owned by the word)
+    int tail_positions;                 // offset of the position list of the first document of the tail
+    int *block_positions;               // per packed block: offset of the position list of its first document (owned with the blocks)
+    unsigned char *positions;           // position lists of the documents, in the order of the list (NULL = none recorded)
+    int stamp;                          // snapshot the document list was last copied for (words in memory, see own_word)
 } indexed_word_t, *indexed_word_p;
 
+typedef struct posting_cursor {
+    indexed_word_p word;                // word of the document list
+    int block;                          // block of the cursor (nr_blocks = tail)
+    int pos;                            // position of the cursor in the block
+    int nr_docs;                        // number of documents in the block
+    doc_t docs[POSTING_BLOCK_SIZE];     // decoded documents of the block
+    int list_doc;                       // document of the block whose position list was looked up last (-1 = none)
+    int list_offset;                    // offset of that position list
+} posting_cursor_t, *posting_cursor_p;
+
+typedef struct doc_norm {
+    double tf2;                         // sum of TF^2 over the words of the document
+    double tf2_log;                     // sum of TF^2 * log(df) over the words of the document
+    double tf2_log2;                    // sum of TF^2 * log(df)^2 over the words of the document
+} doc_norm_t, *doc_norm_p;
+
+typedef struct norm_drift {
+    char *stem;                         // stem of the word (NULL = empty slot)
+    unsigned int hash;                  // hash of the stem
+    int df;                             // number of documents containing the word the sums of these documents use
+} norm_drift_t, *norm_drift_p;
+
+typedef struct stem_cache_entry {
+    unsigned char len;                  // length of the word (0 = empty entry)
+    unsigned char stem_len;             // length of the stem of the word
+    char word[STEM_CACHE_WORD_SIZE];    // the word (not \0 terminated)
+    char stem[STEM_CACHE_WORD_SIZE];    // the stem of the word (not \0 terminated)
+} stem_cache_entry_t, *stem_cache_entry_p;
+
+typedef struct stem_cache {
+    stem_cache_entry_p entries;         // entries of the cache, a word can only be kept in the entry its hash selects
+    int nr_entries;                     // number of entries (power of 2)
+    long hits;                          // number of words whose stem was found in the cache
+    long misses;                        // number of words stemmed
+} stem_cache_t, *stem_cache_p;
+
+typedef struct tokenizer {
+    int fd;                             // file the text is read from (-1 = the text is a string)
+    char *buffer;                       // text read so far, words are turned to lower case in place
+    int pos;                            // position of the next character to look at
+    int end;                            // number of characters in the buffer
+    int eof;                            // 1 if there is no more text to read
+} tokenizer_t, *tokenizer_p;
+
+typedef struct stopword_set {
+    int nr_words;                       // number of stopwords
+    int nr_buckets;                     // number of buckets the first hash distributes the stopwords to
+    int nr_slots;                       // number of slots of the hash table (usually nr_words)
+    int *seeds;                         // per bucket: seed of the second hash placing its stopwords (< 0: -1 - slot of its only stopword)
+    char **slots;                       // per slot: the stopword placed there (NULL = empty slot)
+    int *lengths;                       // per slot: length of the stopword
+    unsigned long length_mask;          // bit n is set if a stopword has n letters (bit 63: 63 letters or more)
+    char *words;                        // \0 terminated stopwords, one after another, alphabetically ordered
+    int size;                           // number of bytes of the stopwords
+} stopword_set_t, *stopword_set_p;
+
+typedef struct stem_block {
+    struct stem_block *next;            // previously filled block
+    int size;                           // number of bytes available in this block
+    int used;                           // number of bytes used in this block
+    char stems[];                       // \0 terminated stems, one after another
+} stem_block_t, *stem_block_p;
+
+typedef struct word_slot {
+    unsigned int hash;                  // hash of the stem of the word in this slot
+    int word;                           // index of the word in the list of indexed words + 1 (0 = empty slot)
+} word_slot_t, *word_slot_p;
+
 typedef struct indexed_document {
-    char *name;                         // name of the document
+    char *name;                         // name of the document (NULL = removed from the filebase)
     int nr_words;                       // number of words in the document
 } indexed_document_t, *indexed_document_p;
 
 typedef struct index {
-   indexed_word_p words;                // linked list of indexed words
+   indexed_word_p words;                // list of indexed words (unordered, see sort_words)
+   word_slot_p slots;                   // open addressing hash table of the indexed words
+   int nr_slots;                        // number of slots in the hash table (power of 2)
+   int max_words;                       // number of words the list of indexed words has room for
+   stem_block_p stems;                  // memory blocks containing the stems of all indexed words
+   doc_norm_p *norms;                   // pages of the sums giving the length of the TF-IDF vector of each document (NULL = not computed)
+   int *norm_stamps;                    // per page of the sums: snapshot the page was last copied for (see own_memory)
+   norm_drift_p norm_drifts;            // open addressing hash table of the words whose df changed after their sums were updated
+   int nr_norm_drifts;                  // number of words in the table (2 * MAX_NORM_DRIFTS slots)
+   int ranking;                         // RANKING_EUCLID or RANKING_COSINE
+   int positions;                       // 1 = record the positions of the words in the documents (for phrases and NEAR)
+   stem_cache_p stem_cache;             // stems of recently parsed words (NULL = stem every word)
+   stopword_set_p stopwords;            // words left out of the index and of search queries (NULL = none)
+   long memory_budget;                  // bytes the words parsed while building the index file may occupy (see index_builder)
    int nr_docs;                         // number of documents in the filebase
    int nr_words;                        // number of different words in the filebase
-   indexed_document_t documents[];      // list of the names of the documents in the filebase
+   int nr_doc_ids;                      // number of document ids handed out (ids of removed documents are not reused)
+   int max_doc_ids;                     // number of documents the lists below have room for (whole pages)
+   indexed_document_p *documents;       // pages of the list of the documents in the filebase, the id of a document is its index (see get_document)
+   int *document_stamps;                // per page of the documents: snapshot the page was last copied for (NULL = pages of another index)
+   int *by_name;                        // ids of the documents in the filebase, alphabetically ordered by name
+   char *map;                           // memory mapped segment file the words are read from, NULL = none
+   size_t map_size;                     // size of the mapped segment file in bytes
+   int generation;                      // number of segments written (the journal belongs to one generation)
+   FILE *journal;                       // journal of the changes since the last segment was written, NULL = none
+   long journal_size;                   // size of the journal in bytes
+   struct index_segment *segments;      // segments holding the words of the documents before the words in memory, ordered by document id
+   int nr_segments;                     // number of segments
+   int next_segment;                    // number of the next segment file
+   int *removed;                        // ids of removed documents whose words are still in segment files
+   int nr_removed;                      // number of these documents
+   int max_removed;                     // number of ids the list above has room for
+   struct segment_merge *merge;         // background merge of segments (NULL = none running)
+   struct snapshot_list *snapshots;     // snapshots of the index published for searches (NULL = none yet)
+   int nr_snapshots;                    // number of snapshots published, memory stamped with a lower number may be shared with them
 } index_t, *index_p;
 
-index_p add_file(index_p db, char *file);
+typedef struct index_segment {
+    int number;                         // number of the segment file (0 = index file written before there were segments)
+    int first_doc;                      // id of the first document of the segment
+    int last_doc;                       // id after the last document of the segment
+    index_t words;                      // words of the segment, read from the mapped segment file (documents are kept by the index)
+    int **removed_df;                   // pages of REMOVED_DF_PAGE_SIZE words of the segment: per word the number of removed documents
+                                        // containing it (NULL = none, a page is NULL if none of its words lost a document)
+    int *removed_df_stamps;             // per page of removed_df: snapshot the page was last copied for (see own_memory)
+    int removed_df_stamp;               // snapshot the list of pages was last copied for
+} index_segment_t, *index_segment_p;
+
+typedef struct index_run {
+    int fd;                             // temporary file the words of the run were written to (-1 = words in memory)
+    FILE *file;                         // the file while the runs are merged
+    char *buffer;                       // buffer of the file while the runs are merged
+    indexed_word_p *words;              // words in memory, alphabetically ordered
+    int nr_words;                       // number of words in memory
+    int pos;                            // position of the next word in memory
+    char *stem;                         // stem of the next word of the run (NULL = no words left)
+    int max_stem;                       // number of bytes stem has room for (words read from the file)
+    int nr_docs;                        // number of documents of the next word (words read from the file)
+    unsigned char *positions;           // position list read from the file
+    int max_positions;                  // number of bytes positions has room for
+} index_run_t, *index_run_p;
+
+typedef struct index_builder {
+    index_p index;                      // index the words are added to
+    index_t words;                      // words of the documents parsed since the last run was written (shares the documents with the index)
+    index_run_p runs;                   // sources of the words in the order of their documents (words in memory, runs written, words parsed last)
+    int nr_runs;                        // number of runs
+    int *heap;                          // runs with words left, ordered by the stem of their next word (then by run)
+    int heap_size;                      // number of runs in the heap
+    char *merged_stem;                  // stem of the word merged, as returned by next_merged_word
+    int max_merged_stem;                // number of bytes merged_stem has room for
+    int merging;                        // run whose documents of the word merged are read (-1 = none left)
+    int merged_doc;                     // id of the last document read from the run (runs written)
+    posting_cursor_t cursor;            // next document of the word merged in the run (words in memory)
+} index_builder_t, *index_builder_p;
+
+typedef struct search_hit {
+    char *name;                         // name of the document
+    double score;                       // euclidian distance or cosine similarity to TF-IDF of the words in the query
+    char *terms;                        // search terms found in this document, separated by ', '
+} search_hit_t, *search_hit_p;
+
+typedef struct search_result {
+    int nr_hits;                        // number of documents found
+    search_hit_t hits[];                // documents found, best first
+} search_result_t, *search_result_p;
+
+void add_file(index_p db, char *file);
 void remove_file(index_p db, int doc_id);
-index_p search_index(index_p *index, char *query);
-void rebuild_index(index_p index);
+search_result_p search_index(index_p index, char *query);
+void close_search_result(search_result_p result);
+void rebuild_index(index_p index, int nr_threads);
 index_p load_index();
+void export_index(index_p db);
 void close_index(index_p db);
+int insert_document(index_p index, char *file);
+int insert_documents(index_p index, char **files, int nr_files);
+void delete_document(index_p index, int doc_id);
+int parse_file_for_index(index_p index, int doc_id, int **words);
+int find_document(index_p db, char *file);
+void change_stopwords(index_p index, char *file);
+void merge_names(index_p index, int *ids, int nr_ids);
+void reserve_documents(index_p index, int nr_doc_ids);
+indexed_document_p get_document(index_p index, int doc_id);
+indexed_document_p change_document(index_p index, int doc_id);
+void init_index(index_p index);
+void clear_index(index_p index);
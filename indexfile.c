@@ -0,0 +1,984 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "index.h"
+#include "util.h"
+#include "vocab.h"
+#include "postings.h"
+#include "indexfile.h"
+#include "stopwords.h"
+#include "builder.h"
+#include "snapshots.h"
+#include "stats.h"
+
+#define INDEX_MAGIC "I2AINDEX"
+#define INDEX_VERSION 6
+#define INDEX_MIN_VERSION 2
+#define INDEX_BYTE_ORDER 0x01020304
+
+/*
+ * Layout of the binary index file of a segment (all numbers in host byte order, sections aligned to 8 bytes):
+ *  header
+ *  document table      nr_doc_ids x file_document_t, entry i belongs to the document with id first_doc + i
+ *  name table          nr_docs x int, ids of the documents ordered by name
+ *  names               \0 terminated names of the documents
+ *  document lists      packed document lists of all words: posting_block_t list followed by the packed blocks,
+ *                      then (since version 5) the offsets of the position lists of the blocks (nr_blocks x int)
+ *                      followed by the position lists, unless no document of the word has positions recorded
+ *  vocabulary table    nr_words x file_word_t, alphabetically ordered
+ *  position table      nr_words x file_positions_t, in the order of the vocabulary table (since version 5)
+ *  slots               nr_slots x word_slot_t, hash table over the vocabulary table
+ *  stems               \0 terminated stems of the words
+ *  stopwords           \0 terminated stopwords the index was built with (since version 3)
+ *  document words      (nr_doc_ids + 1) x long, offset of the words of each document relative to the end of these offsets,
+ *                      followed by the words of each document: their numbers in the vocabulary table in ascending order,
+ *                      as gaps (encode_number), so removing a document needn't look for it in every list (since version 6)
+ *
+ * Up to version 3 a file held all documents with ids from 0 on, without removed documents in between.
+ */
+typedef struct index_header {
+    char magic[8];              // INDEX_MAGIC
+    int version;                // INDEX_VERSION
+    int byte_order;             // INDEX_BYTE_ORDER as written by the host
+    int nr_docs;                // number of documents (not counting removed ones)
+    int nr_words;               // number of words
+    int nr_slots;               // number of slots of the hash table (power of 2)
+    int generation;             // number of checkpoints the index has seen when the file was written
+    long size;                  // total size of the file in bytes
+    long docs;                  // offset of the document table
+    long by_name;               // offset of the name table
+    long names;                 // offset of the names
+    long postings;              // offset of the document lists
+    long words;                 // offset of the vocabulary table
+    long slots;                 // offset of the hash table
+    long stems;                 // offset of the stems
+    long stopwords;             // offset of the stopwords (version 3)
+    long stopwords_size;        // number of bytes of the stopwords (version 3)
+    int first_doc;              // id of the first document of the segment (version 4)
+    int nr_doc_ids;             // number of entries of the document table (version 4)
+    long positions;             // offset of the position table (version 5)
+    long doc_words;             // offset of the words of the documents (version 6)
+} index_header_t, *index_header_p;
+
+typedef struct file_document {
+    int name;                   // offset of the name relative to the names section (-1 = removed document)
+    int nr_words;               // number of words in the document
+} file_document_t, *file_document_p;
+
+typedef struct file_word {
+    int stem;                   // offset of the stem relative to the stems section
+    int nr_docs;                // number of documents containing this word
+    int nr_blocks;              // number of packed blocks of the document list
+    int data_size;              // number of 32 bit words of the packed blocks
+    long documents;             // offset of the document list relative to the document lists section
+} file_word_t, *file_word_p;
+
+typedef struct document_words {
+    unsigned char *list;        // numbers of the words of the document in the vocabulary table not spilled yet, as gaps
+    int size;                   // number of bytes of the list
+    int max_size;               // number of bytes the list has room for
+    int last;                   // number of the last word of the list + 1 (0 = none yet)
+    long total;                 // number of bytes of the whole list, including the parts spilled
+} document_words_t, *document_words_p;
+
+typedef struct document_words_buffer {
+    document_words_p docs;      // lists of the documents of the segment
+    int nr_docs;                // number of documents
+    long size;                  // number of bytes of the lists in memory
+    long max_size;              // number of bytes the lists may occupy before they are spilled
+    char *file;                 // name of the temporary file the lists are spilled to
+    FILE *f;                    // temporary file (NULL = nothing spilled yet)
+    long *runs;                 // offsets of the spills in the temporary file
+    int nr_runs;                // number of spills
+    int failed;                 // 1 if spilling failed
+} document_words_buffer_t, *document_words_buffer_p;
+
+typedef struct list_buffer {
+    unsigned char *bytes;       // bytes in memory
+    long size;                  // number of bytes in memory
+    long max_bytes;             // number of bytes bytes has room for
+    long max_size;              // number of bytes kept in memory before they are spilled
+    char *file;                 // name of the temporary file the bytes are spilled to
+    FILE *f;                    // temporary file (NULL = nothing spilled yet)
+    long spilled;               // number of bytes spilled
+    int failed;                 // 1 if spilling failed
+} list_buffer_t, *list_buffer_p;
+
+typedef struct list_writer {
+    doc_t docs[POSTING_BLOCK_SIZE];     // documents of the block being collected
+    int nr_block_docs;                  // number of documents collected
+    int nr_docs;                        // number of documents of the list
+    int nr_blocks;                      // number of blocks packed
+    int max_blocks;                     // number of blocks the block table has room for
+    posting_block_p blocks;             // block table
+    int *block_positions;               // per block: offset of the position list of its first document
+    int data_size;                      // number of 32 bit words of the packed blocks
+    list_buffer_t data;                 // packed blocks
+    list_buffer_t positions;            // position lists of the documents
+} list_writer_t, *list_writer_p;
+
+typedef struct file_positions {
+    long offset;                // offset of the block offsets relative to the document lists section (-1 = no positions)
+    int size;                   // number of bytes of the position lists following the block offsets
+    int reserved;
+} file_positions_t, *file_positions_p;
+
+long align_file(FILE *f);
+int check_index_file(index_header_p header, char *map, long size);
+int in_file(long offset, long count, long entry_size, long size);
+void add_document_word(document_words_buffer_p buffer, int doc, int word);
+void spill_document_words(document_words_buffer_p buffer);
+int write_document_words(document_words_buffer_p buffer, FILE *f);
+void add_list_posting(list_writer_p w, int doc_id, int count, unsigned char *list, int size);
+void pack_list_block(list_writer_p w);
+void write_list(list_writer_p w, FILE *f, file_word_p fw, file_positions_p fp, long postings);
+void add_list_bytes(list_buffer_p b, void *bytes, long size);
+void write_list_bytes(list_buffer_p b, FILE *f);
+void close_list_buffer(list_buffer_p b);
+
+/*
+ * Writes the documents with ids from first to last - 1 and their words to the binary index file of a segment
+ * the file is written under a temporary name and renamed afterwards, so a mapping of an old file stays valid
+ *  builder: the words are merged from the runs of the builder (NULL = the words of the index)
+ * returns 1 on success, 0 otherwise
+ */
+int write_index_file(index_p index, char *file, index_builder_p builder, int first, int last) {
+    double start = now_seconds();
+
+    char tmp_file[strlen(file) + 5];
+    sprintf(tmp_file, "%s.tmp", file);
+
+    FILE *f = fopen(tmp_file, "wb");
+    if (!f) {
+        printf("Error: couldn't open %s to write.\nUnable to write index to file\n", tmp_file);
+        return 0;
+    }
+
+    index_header_t header;
+    memset(&header, 0, sizeof(index_header_t));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.version = INDEX_VERSION;
+    header.byte_order = INDEX_BYTE_ORDER;
+    header.generation = index->generation;
+    header.first_doc = first;
+    header.nr_doc_ids = last - first;
+
+    // header is rewritten once all offsets are known
+    fwrite(&header, sizeof(index_header_t), 1, f);
+
+    // STEP 1: documents, removed ones keep their entries so the ids stay the same
+    header.docs = align_file(f);
+    int i, name = 0;
+    for (i = first; i < last; i++) {
+        file_document_t doc;
+        doc.name = get_document(index, i)->name ? name : -1;
+        doc.nr_words = get_document(index, i)->name ? get_document(index, i)->nr_words : 0;
+        fwrite(&doc, sizeof(file_document_t), 1, f);
+
+        if (get_document(index, i)->name) {
+            name += strlen(get_document(index, i)->name) + 1;
+        }
+    }
+
+    header.by_name = align_file(f);
+    for (i = 0; i < index->nr_docs; i++) {
+        int id = index->by_name[i];
+        if (id >= first && id < last && get_document(index, id)->name) {
+            fwrite(&id, sizeof(int), 1, f);
+            header.nr_docs++;
+        }
+    }
+
+    header.names = align_file(f);
+    for (i = first; i < last; i++) {
+        if (get_document(index, i)->name) {
+            fwrite(get_document(index, i)->name, strlen(get_document(index, i)->name) + 1, 1, f);
+        }
+    }
+
+    // STEP 2: document lists of the words, alphabetically ordered
+    // (the words of a builder are merged from its runs one after another, so only their stems are kept)
+    indexed_word_p *sorted = NULL;
+    if (builder) {
+        start_merge(builder);
+    } else {
+        sorted = sort_words(index);
+    }
+
+    int max_words = 1024;
+    file_word_p words = (file_word_p) malloc(sizeof(file_word_t) * max_words);
+    file_positions_p positions = (file_positions_p) malloc(sizeof(file_positions_t) * max_words);
+    long stems_size = 0, max_stems = 1 << 16;
+    char *stems = (char *) malloc(max_stems);
+
+    // per document the numbers of its words, they are visited in the order of the vocabulary table
+    // (spilled to a temporary file whenever they outgrow a quarter of the memory budget, or a short list per document)
+    char words_file[strlen(file) + 11];
+    sprintf(words_file, "%s.words.tmp", file);
+
+    document_words_buffer_t doc_words;
+    memset(&doc_words, 0, sizeof(document_words_buffer_t));
+    doc_words.docs = (document_words_p) calloc(last - first + 1, sizeof(document_words_t));
+    doc_words.nr_docs = last - first;
+    doc_words.max_size = index->memory_budget / 4;
+    if (doc_words.max_size < 64L * doc_words.nr_docs) {
+        doc_words.max_size = 64L * doc_words.nr_docs;
+    }
+    doc_words.file = words_file;
+
+    // the documents of a word are packed into blocks as they are read, the packed blocks and the position lists
+    // are kept in memory up to an eighth of the memory budget each, longer lists are spilled to temporary files
+    char data_file[strlen(file) + 10], positions_file[strlen(file) + 15];
+    sprintf(data_file, "%s.data.tmp", file);
+    sprintf(positions_file, "%s.positions.tmp", file);
+
+    list_writer_t list;
+    memset(&list, 0, sizeof(list_writer_t));
+    list.data.max_size = index->memory_budget / 8;
+    list.data.file = data_file;
+    list.positions.max_size = index->memory_budget / 8;
+    list.positions.file = positions_file;
+
+    header.postings = align_file(f);
+    char *stem;
+    posting_cursor_t c;
+    int next = 0;
+    while ((stem = builder ? next_merged_word(builder) : next < index->nr_words ? sorted[next]->stem : NULL)) {
+        if (!builder) {
+            open_cursor(&c, sorted[next++]);
+        }
+
+        // removed documents are left out
+        int doc_id, count, size;
+        unsigned char *position_list;
+        while ((doc_id = builder ? next_merged_posting(builder, &count, &position_list, &size)
+                : cursor_read(&c, &count, &position_list, &size)) != INT_MAX) {
+            if (get_document(index, doc_id)->name) {
+                add_list_posting(&list, doc_id, count, position_list, size);
+                add_document_word(&doc_words, doc_id - first, header.nr_words);
+            }
+        }
+
+        // words of removed documents only are left out
+        if (!list.nr_docs) {
+            continue;
+        }
+
+        // lists full => double the size
+        if (header.nr_words == max_words) {
+            max_words *= 2;
+            words = (file_word_p) realloc(words, sizeof(file_word_t) * max_words);
+            positions = (file_positions_p) realloc(positions, sizeof(file_positions_t) * max_words);
+        }
+
+        int len = strlen(stem);
+        while (stems_size + len + 1 > max_stems) {
+            max_stems *= 2;
+            stems = (char *) realloc(stems, max_stems);
+        }
+
+        file_word_p fw = &words[header.nr_words];
+        fw->stem = stems_size;
+        memcpy(stems + stems_size, stem, len + 1);
+        stems_size += len + 1;
+
+        write_list(&list, f, fw, &positions[header.nr_words], header.postings);
+        header.nr_words++;
+    }
+
+    int lists_written = !list.data.failed && !list.positions.failed;
+    free(list.blocks);
+    free(list.block_positions);
+    close_list_buffer(&list.data);
+    close_list_buffer(&list.positions);
+
+    // STEP 3: vocabulary
+    header.words = align_file(f);
+    fwrite(words, sizeof(file_word_t), header.nr_words, f);
+
+    header.positions = align_file(f);
+    fwrite(positions, sizeof(file_positions_t), header.nr_words, f);
+    free(positions);
+
+    // hash table for the alphabetically ordered words, at most half full
+    header.nr_slots = 1024;
+    while (header.nr_slots < 2 * header.nr_words) {
+        header.nr_slots *= 2;
+    }
+
+    word_slot_p slots = (word_slot_p) calloc(header.nr_slots, sizeof(word_slot_t));
+    for (i = 0; i < header.nr_words; i++) {
+        unsigned int hash = hash_stem(stems + words[i].stem);
+        int s = hash & (header.nr_slots - 1);
+        while (slots[s].word) {
+            s = (s + 1) & (header.nr_slots - 1);
+        }
+
+        slots[s].hash = hash;
+        slots[s].word = i + 1;
+    }
+
+    header.slots = align_file(f);
+    fwrite(slots, sizeof(word_slot_t), header.nr_slots, f);
+    free(slots);
+    free(words);
+
+    header.stems = align_file(f);
+    fwrite(stems, 1, stems_size, f);
+    free(stems);
+
+    // STEP 4: stopwords, so words are left out the same way after the stopwords file changed
+    header.stopwords = align_file(f);
+    if (index->stopwords) {
+        header.stopwords_size = index->stopwords->size;
+        fwrite(index->stopwords->words, index->stopwords->size, 1, f);
+    }
+
+    free(sorted);
+
+    // STEP 5: words of the documents
+    header.doc_words = align_file(f);
+    int words_written = write_document_words(&doc_words, f);
+
+    header.size = ftell(f);
+    rewind(f);
+    fwrite(&header, sizeof(index_header_t), 1, f);
+
+    // the manifest may list the file right after it is renamed
+    if (!lists_written || !words_written || fflush(f) || fsync(fileno(f)) || ferror(f)) {
+        printf("Error: couldn't write %s.\nUnable to write index to file\n", tmp_file);
+        fclose(f);
+        remove(tmp_file);
+        return 0;
+    }
+
+    fclose(f);
+    count_stat(STAT_BYTES_WRITTEN, header.size);
+    count_time(STAT_TIME_PERSIST, start);
+
+    return !rename(tmp_file, file);
+}
+
+/*
+ * Maps the binary index file of a segment into memory and sets up a vocabulary to use its words in place
+ * documents of the file the index doesn't know yet are added to it, known ones take over their names in the file
+ *  words: empty vocabulary for the words of the segment
+ * returns 1 on success, 0 if the file doesn't exist or is not a valid index file
+ */
+int map_index_file(index_p index, index_p words, char *file) {
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size < sizeof(index_header_t)) {
+        close(fd);
+        return 0;
+    }
+
+    char *map = (char *) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        return 0;
+    }
+
+    // check whether the file is an index file this version can read
+    index_header_p header = (index_header_p) map;
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) || header->version < INDEX_MIN_VERSION
+            || header->version > INDEX_VERSION
+            || header->byte_order != INDEX_BYTE_ORDER || header->size != st.st_size
+            || !check_index_file(header, map, st.st_size)) {
+        printf("Error: %s is not a valid index file.\n", file);
+        munmap(map, st.st_size);
+        return 0;
+    }
+
+    words->map = map;
+    words->map_size = st.st_size;
+    count_stat(STAT_BYTES_READ, st.st_size);
+    words->generation = header->generation;
+
+    // STEP 1: documents, names stay in the mapped file
+    int first = header->version >= 4 ? header->first_doc : 0;
+    int nr_doc_ids = header->version >= 4 ? header->nr_doc_ids : header->nr_docs;
+    int known = index->nr_doc_ids;
+    reserve_documents(index, first + nr_doc_ids);
+
+    // documents between the ones known and the segment were removed before it was written
+    for (; index->nr_doc_ids < first; index->nr_doc_ids++) {
+        indexed_document_p doc = change_document(index, index->nr_doc_ids);
+        doc->name = NULL;
+        doc->nr_words = 0;
+    }
+
+    file_document_p docs = (file_document_p) (map + header->docs);
+    int i;
+    for (i = 0; i < nr_doc_ids; i++) {
+        indexed_document_p doc = change_document(index, first + i);
+        char *name = docs[i].name >= 0 ? map + header->names + docs[i].name : NULL;
+
+        if (first + i >= known) {
+            doc->name = name;
+            doc->nr_words = docs[i].nr_words;
+        } else if (doc->name && name) {
+            if (!is_mapped(index, doc->name)) {
+                retire_memory(index, doc->name);
+            }
+            doc->name = name;
+        }
+    }
+
+    if (first + nr_doc_ids > index->nr_doc_ids) {
+        index->nr_doc_ids = first + nr_doc_ids;
+    }
+
+    // the new documents join the list of names
+    int *by_name = (int *) (map + header->by_name);
+    int *ids = (int *) malloc(sizeof(int) * (header->nr_docs + 1));
+    int nr_ids = 0;
+    for (i = 0; i < header->nr_docs; i++) {
+        if (by_name[i] >= known) {
+            ids[nr_ids++] = by_name[i];
+        }
+    }
+
+    merge_names(index, ids, nr_ids);
+    free(ids);
+
+    // STEP 2: vocabulary, stems and document lists stay in the mapped file
+    file_word_p file_words = (file_word_p) (map + header->words);
+    words->max_words = header->nr_words ? header->nr_words : 1;
+    words->words = (indexed_word_p) malloc(sizeof(indexed_word_t) * words->max_words);
+
+    for (i = 0; i < header->nr_words; i++) {
+        indexed_word_p w = &words->words[i];
+        memset(w, 0, sizeof(indexed_word_t));
+        w->stem = map + header->stems + file_words[i].stem;
+        w->nr_docs = file_words[i].nr_docs;
+        w->nr_blocks = file_words[i].nr_blocks;
+        w->data_size = file_words[i].data_size;
+        w->blocks = (posting_block_p) (map + header->postings + file_words[i].documents);
+        w->data = (unsigned int *) (w->blocks + w->nr_blocks);
+
+        // older files have no positions
+        file_positions_p fp = header->version >= 5 ? (file_positions_p) (map + header->positions) + i : NULL;
+        if (fp && fp->offset >= 0) {
+            w->block_positions = (int *) (map + header->postings + fp->offset);
+            w->positions = (unsigned char *) (w->block_positions + w->nr_blocks);
+            w->positions_size = fp->size;
+            w->tail_positions = fp->size;
+        }
+    }
+
+    words->nr_words = header->nr_words;
+
+    free(words->slots);
+    words->nr_slots = header->nr_slots;
+    words->slots = (word_slot_p) malloc(sizeof(word_slot_t) * header->nr_slots);
+    memcpy(words->slots, map + header->slots, sizeof(word_slot_t) * header->nr_slots);
+
+    // STEP 3: stopwords (older files don't have them, their index has to use the stopwords file)
+    if (header->version >= 3) {
+        words->stopwords = new_stopwords(map + header->stopwords, header->stopwords_size);
+    }
+
+    return 1;
+}
+
+/*
+ * Checks that the sections of a mapped index file and the entries of its tables lie within the file, so a truncated
+ * or corrupt file is rejected instead of being read beyond the mapping (the packed blocks themselves aren't checked,
+ * that would read the whole file), returns 1 if the file is usable, 0 otherwise
+ *  size: size of the file in bytes
+ */
+int check_index_file(index_header_p header, char *map, long size) {
+    int nr_doc_ids = header->version >= 4 ? header->nr_doc_ids : header->nr_docs;
+    int first = header->version >= 4 ? header->first_doc : 0;
+    if (first < 0 || nr_doc_ids < 0 || header->nr_docs > nr_doc_ids || (long) first + nr_doc_ids > INT_MAX
+            || header->nr_words < 0 || header->nr_slots <= 0 || (header->nr_slots & (header->nr_slots - 1))
+            || header->nr_slots <= header->nr_words) {
+        return 0;
+    }
+
+    // names and stems end with a \0 before the next section
+    long stems_end = header->version >= 3 ? header->stopwords : size;
+    if (!in_file(header->docs, nr_doc_ids, sizeof(file_document_t), size)
+            || !in_file(header->by_name, header->nr_docs, sizeof(int), size)
+            || !in_file(header->names, header->postings - header->names, 1, size)
+            || !in_file(header->postings, 0, 1, size)
+            || !in_file(header->words, header->nr_words, sizeof(file_word_t), size)
+            || (header->version >= 5 && !in_file(header->positions, header->nr_words, sizeof(file_positions_t), size))
+            || !in_file(header->slots, header->nr_slots, sizeof(word_slot_t), size)
+            || !in_file(header->stems, stems_end - header->stems, 1, size)
+            || (header->version >= 3 && (!in_file(header->stopwords, header->stopwords_size, 1, size)
+                || header->stopwords_size > INT_MAX))
+            || (header->version >= 6 && !in_file(header->doc_words, (long) nr_doc_ids + 1, sizeof(long), size))) {
+        return 0;
+    }
+
+    long names_size = header->postings - header->names;
+    long stems_size = stems_end - header->stems;
+    if ((names_size && map[header->postings - 1]) || (stems_size && map[stems_end - 1])) {
+        return 0;
+    }
+
+    file_document_p docs = (file_document_p) (map + header->docs);
+    int i;
+    for (i = 0; i < nr_doc_ids; i++) {
+        if (docs[i].name >= names_size || docs[i].name < -1) {
+            return 0;
+        }
+    }
+
+    int *by_name = (int *) (map + header->by_name);
+    for (i = 0; i < header->nr_docs; i++) {
+        if (by_name[i] < first || by_name[i] >= first + nr_doc_ids || docs[by_name[i] - first].name < 0) {
+            return 0;
+        }
+    }
+
+    // the document lists and position lists of the words
+    file_word_p words = (file_word_p) (map + header->words);
+    file_positions_p positions = header->version >= 5 ? (file_positions_p) (map + header->positions) : NULL;
+    for (i = 0; i < header->nr_words; i++) {
+        file_word_p w = &words[i];
+        if (w->stem < 0 || w->stem >= stems_size || w->nr_docs < 0 || w->nr_blocks < 0 || w->data_size < 0
+                || !in_file(header->postings + w->documents, w->nr_blocks, sizeof(posting_block_t), size)
+                || !in_file(header->postings + w->documents + (long) w->nr_blocks * sizeof(posting_block_t),
+                    w->data_size, sizeof(unsigned int), size)) {
+            return 0;
+        }
+
+        if (positions && positions[i].offset >= 0 && (positions[i].size < 0
+                || !in_file(header->postings + positions[i].offset, w->nr_blocks, sizeof(int), size)
+                || !in_file(header->postings + positions[i].offset + (long) w->nr_blocks * sizeof(int),
+                    positions[i].size, 1, size))) {
+            return 0;
+        }
+    }
+
+    word_slot_p slots = (word_slot_p) (map + header->slots);
+    for (i = 0; i < header->nr_slots; i++) {
+        if (slots[i].word < 0 || slots[i].word > header->nr_words) {
+            return 0;
+        }
+    }
+
+    // the words of the documents, the last number of the last list ends the section
+    if (header->version >= 6) {
+        long *offsets = (long *) (map + header->doc_words);
+        long lists = header->doc_words + sizeof(long) * ((long) nr_doc_ids + 1);
+        for (i = 0; i < nr_doc_ids; i++) {
+            if (offsets[i] < 0 || offsets[i] > offsets[i + 1]) {
+                return 0;
+            }
+        }
+
+        if (offsets[0] < 0 || !in_file(lists, offsets[nr_doc_ids], 1, size)
+                || (offsets[nr_doc_ids] && (unsigned char) map[lists + offsets[nr_doc_ids] - 1] >= 0x80)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Checks whether a section of count entries of entry_size bytes each at offset lies within a file of size bytes
+ */
+int in_file(long offset, long count, long entry_size, long size) {
+    return offset >= 0 && count >= 0 && offset <= size && count <= (size - offset) / entry_size;
+}
+
+/*
+ * Releases the mapping of the index file
+ */
+void unmap_index_file(index_p index) {
+    if (index->map) {
+        munmap(index->map, index->map_size);
+        index->map = NULL;
+        index->map_size = 0;
+    }
+}
+
+/*
+ * Checks whether a pointer points into a mapped segment file of the index (and must not be freed or modified)
+ */
+int is_mapped(index_p index, void *ptr) {
+    if (index->map && (char *) ptr >= index->map && (char *) ptr < index->map + index->map_size) {
+        return 1;
+    }
+
+    int s;
+    for (s = 0; s < index->nr_segments; s++) {
+        if (is_mapped(&index->segments[s].words, ptr)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Returns the numbers of the words of a document of a segment file in the vocabulary table, in ascending order,
+ * or -1 if the file doesn't record the words of its documents (written before version 6)
+ *  words: vocabulary of the segment (see map_index_file)
+ *  numbers: returns the numbers (to be freed by the caller)
+ */
+int read_document_words(index_p words, int doc_id, int **numbers) {
+    index_header_p header = (index_header_p) words->map;
+    if (header->version < 6) {
+        return -1;
+    }
+
+    long *offsets = (long *) (words->map + header->doc_words);
+    unsigned char *lists = (unsigned char *) (offsets + header->nr_doc_ids + 1);
+    unsigned char *p = lists + offsets[doc_id - header->first_doc];
+    unsigned char *end = lists + offsets[doc_id - header->first_doc + 1];
+
+    // each number takes a byte at least
+    *numbers = (int *) malloc(sizeof(int) * (end - p + 1));
+    int nr_numbers = 0, word = -1;
+    while (p < end) {
+        word += decode_number(&p);
+        if (word < 0 || word >= words->nr_words) {
+            // corrupt list, the caller looks for the document in the lists of the words instead
+            free(*numbers);
+            *numbers = NULL;
+            return -1;
+        }
+        (*numbers)[nr_numbers++] = word;
+    }
+
+    return nr_numbers;
+}
+
+/*
+ * Adds a word to the words of a document written to a segment file, spills the lists if they take too much memory
+ *  doc: index of the document in the lists
+ *  word: number of the word in the vocabulary table, higher than the ones added before
+ */
+void add_document_word(document_words_buffer_p buffer, int doc, int word) {
+    document_words_p d = &buffer->docs[doc];
+
+    // a number takes 5 bytes at most
+    if (d->size + 5 > d->max_size) {
+        int max_size = d->max_size ? d->max_size * 2 : 64;
+        d->list = (unsigned char *) realloc(d->list, max_size);
+        buffer->size += max_size - d->max_size;
+        d->max_size = max_size;
+    }
+
+    int size = encode_number(d->list + d->size, word + 1 - d->last);
+    d->size += size;
+    d->total += size;
+    d->last = word + 1;
+
+    if (buffer->size > buffer->max_size) {
+        spill_document_words(buffer);
+    }
+}
+
+/*
+ * Appends the lists in memory to the temporary file and releases them, the gaps go on from the last words spilled
+ * a spill holds per document the number of bytes of its list followed by the bytes
+ */
+void spill_document_words(document_words_buffer_p buffer) {
+    if (!buffer->f && !buffer->failed) {
+        buffer->f = fopen(buffer->file, "w+b");
+        if (!buffer->f) {
+            printf("Error: couldn't open %s to write.\n", buffer->file);
+            buffer->failed = 1;
+        }
+    }
+
+    if (buffer->f) {
+        buffer->runs = (long *) realloc(buffer->runs, sizeof(long) * (buffer->nr_runs + 1));
+        buffer->runs[buffer->nr_runs++] = ftell(buffer->f);
+    }
+
+    int i;
+    for (i = 0; i < buffer->nr_docs; i++) {
+        document_words_p d = &buffer->docs[i];
+        if (buffer->f) {
+            fwrite(&d->size, sizeof(int), 1, buffer->f);
+            if (d->size) {
+                fwrite(d->list, 1, d->size, buffer->f);
+            }
+        }
+
+        free(d->list);
+        d->list = NULL;
+        d->size = 0;
+        d->max_size = 0;
+    }
+
+    count_stat(STAT_BYTES_WRITTEN, buffer->f ? ftell(buffer->f) - buffer->runs[buffer->nr_runs - 1] : 0);
+    buffer->size = 0;
+}
+
+/*
+ * Writes the words of the documents section: the offsets of the lists, then per document the parts of its list
+ * spilled one after another and the part still in memory; releases the lists and removes the temporary file
+ * returns 1 on success, 0 if the spilled lists couldn't be read back
+ */
+int write_document_words(document_words_buffer_p buffer, FILE *f) {
+    long offset = 0;
+    int i, r;
+    for (i = 0; i <= buffer->nr_docs; i++) {
+        fwrite(&offset, sizeof(long), 1, f);
+        offset += i < buffer->nr_docs ? buffer->docs[i].total : 0;
+    }
+
+    // each spill is read on its own, the lists of a document are taken from all of them in turn
+    FILE **runs = (FILE **) calloc(buffer->nr_runs + 1, sizeof(FILE *));
+    if (buffer->f && !buffer->failed) {
+        if (fflush(buffer->f) || ferror(buffer->f)) {
+            buffer->failed = 1;
+        }
+
+        for (r = 0; r < buffer->nr_runs && !buffer->failed; r++) {
+            runs[r] = fopen(buffer->file, "rb");
+            if (!runs[r] || fseek(runs[r], buffer->runs[r], SEEK_SET)) {
+                buffer->failed = 1;
+            }
+        }
+    }
+
+    int max_copy = 0;
+    unsigned char *copy = NULL;
+    for (i = 0; i < buffer->nr_docs && !buffer->failed; i++) {
+        for (r = 0; r < buffer->nr_runs; r++) {
+            int size;
+            if (fread(&size, sizeof(int), 1, runs[r]) != 1 || size < 0) {
+                buffer->failed = 1;
+                break;
+            }
+
+            if (size > max_copy) {
+                max_copy = size;
+                copy = (unsigned char *) realloc(copy, max_copy);
+            }
+
+            if (size && (fread(copy, 1, size, runs[r]) != (size_t) size || fwrite(copy, 1, size, f) != (size_t) size)) {
+                buffer->failed = 1;
+                break;
+            }
+        }
+
+        if (buffer->docs[i].size) {
+            fwrite(buffer->docs[i].list, 1, buffer->docs[i].size, f);
+        }
+    }
+    free(copy);
+
+    for (r = 0; r < buffer->nr_runs; r++) {
+        if (runs[r]) {
+            fclose(runs[r]);
+        }
+    }
+    free(runs);
+
+    if (buffer->f) {
+        fclose(buffer->f);
+        remove(buffer->file);
+    }
+
+    for (i = 0; i < buffer->nr_docs; i++) {
+        free(buffer->docs[i].list);
+    }
+    free(buffer->docs);
+    free(buffer->runs);
+
+    if (buffer->failed) {
+        printf("Error: couldn't spill the words of the documents to %s.\n", buffer->file);
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Adds a document to the document list being written, the documents are added in the order of their ids
+ *  list: encoded position list of the document (as cursor_position_list)
+ *  size: number of bytes of the position list (0 = no positions recorded)
+ */
+void add_list_posting(list_writer_p w, int doc_id, int count, unsigned char *list, int size) {
+    if (!w->nr_block_docs) {
+        // block table full => double the size
+        if (w->nr_blocks == w->max_blocks) {
+            w->max_blocks = w->max_blocks ? w->max_blocks * 2 : 64;
+            w->blocks = (posting_block_p) realloc(w->blocks, sizeof(posting_block_t) * w->max_blocks);
+            w->block_positions = (int *) realloc(w->block_positions, sizeof(int) * w->max_blocks);
+        }
+
+        w->block_positions[w->nr_blocks] = w->positions.spilled + w->positions.size;
+    }
+
+    w->docs[w->nr_block_docs].id = doc_id;
+    w->docs[w->nr_block_docs].count = count;
+    w->nr_block_docs++;
+    w->nr_docs++;
+
+    // the number of bytes of the position list, followed by the list
+    unsigned char number[5];
+    add_list_bytes(&w->positions, number, encode_number(number, size));
+    if (size) {
+        add_list_bytes(&w->positions, list, size);
+    }
+
+    if (w->nr_block_docs == POSTING_BLOCK_SIZE) {
+        pack_list_block(w);
+    }
+}
+
+/*
+ * Packs the documents collected into the next block of the document list being written
+ */
+void pack_list_block(list_writer_p w) {
+    unsigned int data[2 * POSTING_BLOCK_SIZE];
+    posting_block_p b = &w->blocks[w->nr_blocks];
+    int size = pack_documents(w->docs, w->nr_block_docs, w->nr_blocks ? w->blocks[w->nr_blocks - 1].last_id : -1, b, data);
+    b->offset = w->data_size;
+
+    add_list_bytes(&w->data, data, sizeof(unsigned int) * size);
+    w->data_size += size;
+    w->nr_blocks++;
+    w->nr_block_docs = 0;
+}
+
+/*
+ * Writes the document list being written to the index file and starts the next one:
+ * the block table and the packed blocks, then the block offsets and the position lists (unless all are empty)
+ *  fw: returns the vocabulary entry of the word, except for its stem
+ *  fp: returns the position table entry of the word
+ *  postings: offset of the document lists section
+ */
+void write_list(list_writer_p w, FILE *f, file_word_p fw, file_positions_p fp, long postings) {
+    if (w->nr_block_docs) {
+        pack_list_block(w);
+    }
+
+    fw->nr_docs = w->nr_docs;
+    fw->nr_blocks = w->nr_blocks;
+    fw->data_size = w->data_size;
+    fw->documents = ftell(f) - postings;
+
+    fwrite(w->blocks, sizeof(posting_block_t), w->nr_blocks, f);
+    write_list_bytes(&w->data, f);
+
+    // position lists, left out if all of them are empty (a byte per document)
+    long positions_size = w->positions.spilled + w->positions.size;
+    fp->offset = -1;
+    fp->size = 0;
+    fp->reserved = 0;
+    if (positions_size > w->nr_docs) {
+        fp->offset = ftell(f) - postings;
+        fp->size = positions_size;
+        fwrite(w->block_positions, sizeof(int), w->nr_blocks, f);
+        write_list_bytes(&w->positions, f);
+        align_file(f);
+    } else {
+        write_list_bytes(&w->positions, NULL);
+    }
+
+    w->nr_docs = 0;
+    w->nr_blocks = 0;
+    w->data_size = 0;
+}
+
+/*
+ * Appends bytes to a list buffer, the bytes in memory are spilled to its temporary file first if there are too many
+ */
+void add_list_bytes(list_buffer_p b, void *bytes, long size) {
+    if (b->size && b->size + size > b->max_size && !b->failed) {
+        if (!b->f) {
+            b->f = fopen(b->file, "w+b");
+        }
+
+        if (!b->f || fwrite(b->bytes, 1, b->size, b->f) != b->size) {
+            printf("Error: couldn't write %s.\n", b->file);
+            b->failed = 1;
+        } else {
+            b->spilled += b->size;
+            b->size = 0;
+        }
+    }
+
+    // buffer full => double the size
+    if (b->size + size > b->max_bytes) {
+        while (b->size + size > b->max_bytes) {
+            b->max_bytes = b->max_bytes ? b->max_bytes * 2 : 1 << 12;
+        }
+        b->bytes = (unsigned char *) realloc(b->bytes, b->max_bytes);
+    }
+
+    memcpy(b->bytes + b->size, bytes, size);
+    b->size += size;
+}
+
+/*
+ * Writes the bytes spilled and the bytes in memory of a list buffer to a file and empties the buffer
+ *  f: file to write to (NULL = the bytes are dropped)
+ */
+void write_list_bytes(list_buffer_p b, FILE *f) {
+    if (b->spilled && f && !b->failed) {
+        unsigned char copy[1 << 13];
+        long left = b->spilled;
+        if (fseek(b->f, 0, SEEK_SET)) {
+            b->failed = 1;
+        }
+
+        while (left && !b->failed) {
+            long n = fread(copy, 1, left < sizeof(copy) ? left : sizeof(copy), b->f);
+            if (n <= 0 || fwrite(copy, 1, n, f) != n) {
+                printf("Error: couldn't read %s.\n", b->file);
+                b->failed = 1;
+            }
+            left -= n;
+        }
+    }
+
+    if (f && b->size) {
+        fwrite(b->bytes, 1, b->size, f);
+    }
+
+    // the next list is spilled from the start of the file again
+    if (b->f) {
+        fseek(b->f, 0, SEEK_SET);
+    }
+    b->spilled = 0;
+    b->size = 0;
+}
+
+/*
+ * Releases a list buffer and removes its temporary file
+ */
+void close_list_buffer(list_buffer_p b) {
+    if (b->f) {
+        fclose(b->f);
+        remove(b->file);
+    }
+    free(b->bytes);
+}
+
+/*
+ * Pads the file with zeros to the next multiple of 8 bytes, returns the new position
+ */
+long align_file(FILE *f) {
+    long pos = ftell(f);
+    while (pos % 8) {
+        fputc(0, f);
+        pos++;
+    }
+
+    return pos;
+}
@@ -0,0 +1,5 @@
+int write_index_file(index_p index, char *file, index_builder_p builder, int first, int last);
+int map_index_file(index_p index, index_p words, char *file);
+void unmap_index_file(index_p index);
+int is_mapped(index_p index, void *ptr);
+int read_document_words(index_p words, int doc_id, int **numbers);
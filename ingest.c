@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glob.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "index.h"
+#include "util.h"
+#include "norms.h"
+#include "builder.h"
+#include "ingest.h"
+
+typedef struct file_list {
+    char **files;               // names of the files found
+    int nr_files;               // number of files found
+    int max_files;              // number of names the list has room for
+    long size;                  // total size of the files in bytes
+} file_list_t, *file_list_p;
+
+void collect_files(file_list_p list, char *path);
+void collect_directory(file_list_p list, char *dir);
+void collect_manifest(file_list_p list, char *manifest);
+void add_to_file_list(file_list_p list, char *file, long size);
+int cmp_file_name(const void *a, const void *b);
+
+/*
+ * Adds many files to the index in one pass: the documents get their ids at once, their words are merged
+ * into the index batch by batch (parsed by several threads) and written to a new segment at the end
+ *  spec: a directory (searched recursively), a glob pattern or @ followed by a manifest file listing one path per line
+ *  nr_threads: number of threads parsing documents (0 = one per processor)
+ */
+void add_files(index_p index, char *spec, int nr_threads) {
+    double start = now_seconds();
+
+    // STEP 1: find the files
+    file_list_t list;
+    list.files = NULL;
+    list.nr_files = 0;
+    list.max_files = 0;
+    list.size = 0;
+
+    if (spec[0] == '@') {
+        collect_manifest(&list, spec + 1);
+    } else if (strpbrk(spec, "*?[")) {
+        glob_t g;
+        if (!glob(spec, 0, NULL, &g)) {
+            int i;
+            for (i = 0; i < g.gl_pathc; i++) {
+                collect_files(&list, g.gl_pathv[i]);
+            }
+        }
+        globfree(&g);
+    } else {
+        collect_files(&list, spec);
+    }
+
+    // STEP 2: leave out files found twice and files already in the filebase
+    qsort(list.files, list.nr_files, sizeof(char *), cmp_file_name);
+
+    int i, nr_new = 0, nr_skipped = 0;
+    for (i = 0; i < list.nr_files; i++) {
+        if ((nr_new && !strcmp(list.files[nr_new - 1], list.files[i])) || find_document(index, list.files[i]) >= 0) {
+            nr_skipped++;
+            free(list.files[i]);
+        } else {
+            list.files[nr_new++] = list.files[i];
+        }
+    }
+
+    if (nr_skipped) {
+        printf("%d files skipped (already in the filebase).\n", nr_skipped);
+    }
+
+    if (!nr_new) {
+        printf("No files to add.\nIndex not updated.\n");
+        free(list.files);
+        return;
+    }
+
+    // STEP 3: parse the documents and write their segment, the lengths of the TF-IDF vectors are computed
+    // once the IDFs are known
+    printf("Adding %d files (%.1f MB)..\n", nr_new, list.size / 1048576.0);
+
+    clear_norms(index);
+    int first = insert_documents(index, list.files, nr_new);
+    build_index(index, first, first + nr_new, nr_threads, 1);
+
+    double seconds = now_seconds() - start;
+    printf("Added %d files in %.2f s (%.0f files/s, %.1f MB/s).\n", nr_new, seconds,
+        nr_new / seconds, list.size / 1048576.0 / seconds);
+
+    for (i = 0; i < nr_new; i++) {
+        free(list.files[i]);
+    }
+    free(list.files);
+}
+
+/*
+ * Adds a file to the list, or the files in it if it is a directory
+ */
+void collect_files(file_list_p list, char *path) {
+    struct stat st;
+    if (stat(path, &st)) {
+        printf("Cannot open %s!\n", path);
+        return;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        collect_directory(list, path);
+    } else if (S_ISREG(st.st_mode) && !access(path, R_OK)) {
+        add_to_file_list(list, path, st.st_size);
+    } else {
+        printf("Cannot open %s!\n", path);
+    }
+}
+
+/*
+ * Adds the files in a directory and its subdirectories to the list
+ * (links to directories are not followed, so links can't lead into a cycle)
+ */
+void collect_directory(file_list_p list, char *dir) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        printf("Cannot open %s!\n", dir);
+        return;
+    }
+
+    // the path of an entry is the path of the directory without trailing '/' followed by '/' and the name
+    int dir_len = strlen(dir);
+    while (dir_len > 1 && dir[dir_len - 1] == '/') {
+        dir_len--;
+    }
+
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) {
+            continue;
+        }
+
+        char *path = (char *) malloc(dir_len + strlen(e->d_name) + 2);
+        memcpy(path, dir, dir_len);
+        path[dir_len] = '/';
+        strcpy(path + dir_len + 1, e->d_name);
+
+        struct stat st;
+        if (!lstat(path, &st) && S_ISDIR(st.st_mode)) {
+            collect_directory(list, path);
+        } else if (!stat(path, &st) && S_ISREG(st.st_mode) && !access(path, R_OK)) {
+            add_to_file_list(list, path, st.st_size);
+        }
+
+        free(path);
+    }
+
+    closedir(d);
+}
+
+/*
+ * Adds the files listed in a manifest file to the list, one file (or directory) per line
+ */
+void collect_manifest(file_list_p list, char *manifest) {
+    FILE *f = fopen(manifest, "r");
+    if (!f) {
+        printf("Cannot open %s!\n", manifest);
+        return;
+    }
+
+    char *line;
+    while ((line = read_line(f))) {
+        // ignore empty lines
+        if (line[0]) {
+            collect_files(list, line);
+        }
+
+        free(line);
+    }
+
+    fclose(f);
+}
+
+/*
+ * Appends a copy of a file name to the list
+ */
+void add_to_file_list(file_list_p list, char *file, long size) {
+    // list full => double the size
+    if (list->nr_files == list->max_files) {
+        list->max_files = list->max_files ? list->max_files * 2 : 1024;
+        list->files = (char **) realloc(list->files, sizeof(char *) * list->max_files);
+    }
+
+    list->files[list->nr_files] = (char *) malloc(strlen(file) + 1);
+    memcpy(list->files[list->nr_files], file, strlen(file) + 1);
+    list->nr_files++;
+    list->size += size;
+}
+
+/*
+ * Compares two file names alphabetically
+ */
+int cmp_file_name(const void *a, const void *b) {
+    return strcmp(*(char **) a, *(char **) b);
+}
+
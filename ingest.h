@@ -0,0 +1 @@
+void add_files(index_p index, char *spec, int nr_threads);
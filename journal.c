@@ -0,0 +1,367 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "index.h"
+#include "util.h"
+#include "vocab.h"
+#include "postings.h"
+#include "snapshots.h"
+#include "journal.h"
+#include "stats.h"
+
+#define JOURNAL_MAGIC "I2AJRNAL"
+#define JOURNAL_VERSION 1
+#define JOURNAL_BYTE_ORDER 0x01020304
+
+#define RECORD_ADD 1
+#define RECORD_REMOVE 2
+#define RECORD_ADD_POSITIONS 3
+
+/*
+ * Layout of the journal (all numbers in host byte order):
+ *  header
+ *  records             journal_record_t followed by its payload, one per change of the index since the last segment was written
+ *
+ * payload of RECORD_ADD:    int nr_words, int nr_terms, \0 terminated name of the document,
+ *                           nr_terms x (int count, \0 terminated stem)
+ * payload of RECORD_REMOVE: int doc_id
+ * payload of RECORD_ADD_POSITIONS: as RECORD_ADD, each stem followed by int size and the position list of the word
+ *                           in the document (size bytes, encoded as in the document list)
+ *
+ * The ids of the documents are the ids after loading the segments and replaying the preceding records.
+ */
+typedef struct journal_header {
+    char magic[8];              // JOURNAL_MAGIC
+    int version;                // JOURNAL_VERSION
+    int byte_order;             // JOURNAL_BYTE_ORDER as written by the host
+    int generation;             // generation of the segments the journal continues
+    int reserved;
+} journal_header_t, *journal_header_p;
+
+typedef struct journal_record {
+    int type;                   // RECORD_ADD or RECORD_REMOVE
+    int size;                   // size of the payload in bytes
+    unsigned int checksum;      // checksum of the payload
+    int reserved;
+} journal_record_t, *journal_record_p;
+
+typedef struct journal_buffer {
+    char *data;
+    int size;
+    int max_size;
+} journal_buffer_t, *journal_buffer_p;
+
+int replay_record(index_p index, journal_record_p record, char *payload);
+void append_record(index_p index, int type, journal_buffer_p payload);
+void append_to_buffer(journal_buffer_p buffer, void *data, int size);
+unsigned int journal_checksum(char *data, int size);
+
+/*
+ * Opens the journal of the index and replays the changes recorded since the last segment was written
+ * a journal belonging to another generation of the segments is discarded, a torn record at the end is cut off
+ */
+void open_journal(index_p index, char *file) {
+    FILE *f = fopen(file, "r+b");
+    if (!f) {
+        reset_journal(index, file);
+        return;
+    }
+
+    journal_header_t header;
+    if (fread(&header, sizeof(journal_header_t), 1, f) != 1
+            || memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) || header.version != JOURNAL_VERSION
+            || header.byte_order != JOURNAL_BYTE_ORDER || header.generation != index->generation) {
+        // changes are already part of a segment (or the journal is unusable)
+        fclose(f);
+        reset_journal(index, file);
+        return;
+    }
+
+    // replay records until the end of the journal or the first incomplete record
+    long size = sizeof(journal_header_t);
+
+    struct stat st;
+    long file_size = fstat(fileno(f), &st) ? 0 : st.st_size;
+
+    journal_record_t record;
+    while (fread(&record, sizeof(journal_record_t), 1, f) == 1) {
+        // a payload larger than the rest of the file belongs to a torn record, its size isn't to be trusted
+        if (record.size < 0 || record.size > file_size - size - (long) sizeof(journal_record_t)) {
+            break;
+        }
+
+        char *payload = (char *) malloc(record.size + 1);
+        if (fread(payload, 1, record.size, f) != (size_t) record.size
+                || journal_checksum(payload, record.size) != record.checksum
+                || !replay_record(index, &record, payload)) {
+            free(payload);
+            break;
+        }
+
+        free(payload);
+        size += sizeof(journal_record_t) + record.size;
+    }
+
+    count_stat(STAT_BYTES_READ, size);
+
+    // cut off what couldn't be replayed, new records are appended after the last valid one
+    fflush(f);
+    if (ftruncate(fileno(f), size)) {
+        printf("Error: couldn't truncate %s.\n", file);
+    }
+    fseek(f, size, SEEK_SET);
+
+    index->journal = f;
+    index->journal_size = size;
+}
+
+/*
+ * Starts an empty journal for the current generation of the segments
+ */
+void reset_journal(index_p index, char *file) {
+    close_journal(index);
+
+    FILE *f = fopen(file, "w+b");
+    if (!f) {
+        printf("Error: couldn't open %s to write.\nChanges to the index won't be saved!\n", file);
+        return;
+    }
+
+    journal_header_t header;
+    memset(&header, 0, sizeof(journal_header_t));
+    memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+    header.version = JOURNAL_VERSION;
+    header.byte_order = JOURNAL_BYTE_ORDER;
+    header.generation = index->generation;
+
+    fwrite(&header, sizeof(journal_header_t), 1, f);
+    fflush(f);
+    fsync(fileno(f));
+
+    index->journal = f;
+    index->journal_size = sizeof(journal_header_t);
+}
+
+/*
+ * Closes the journal of the index
+ */
+void close_journal(index_p index) {
+    if (index->journal) {
+        fclose(index->journal);
+        index->journal = NULL;
+        index->journal_size = 0;
+    }
+}
+
+/*
+ * Records a document added to the index together with the number of occurances and the positions of its words
+ *  words: indexes of the words occuring in the document
+ */
+void journal_add(index_p index, int doc_id, int *words, int nr_terms) {
+    journal_buffer_t payload = {NULL, 0, 0};
+    indexed_document_p doc = get_document(index, doc_id);
+
+    append_to_buffer(&payload, &doc->nr_words, sizeof(int));
+    append_to_buffer(&payload, &nr_terms, sizeof(int));
+    append_to_buffer(&payload, doc->name, strlen(doc->name) + 1);
+
+    int k;
+    for (k = 0; k < nr_terms; k++) {
+        indexed_word_p w = &index->words[words[k]];
+
+        // the document has the highest id, so its entry is the last one of the list (in the tail)
+        append_to_buffer(&payload, &w->tail[w->nr_tail - 1].count, sizeof(int));
+        append_to_buffer(&payload, w->stem, strlen(w->stem) + 1);
+
+        int size;
+        unsigned char *list = last_position_list(w, &size);
+        append_to_buffer(&payload, &size, sizeof(int));
+        if (list) {
+            append_to_buffer(&payload, list, size);
+        }
+    }
+
+    append_record(index, RECORD_ADD_POSITIONS, &payload);
+    free(payload.data);
+}
+
+/*
+ * Records a document removed from the index
+ */
+void journal_remove(index_p index, int doc_id) {
+    journal_buffer_t payload = {NULL, 0, 0};
+    append_to_buffer(&payload, &doc_id, sizeof(int));
+
+    append_record(index, RECORD_REMOVE, &payload);
+    free(payload.data);
+}
+
+/*
+ * Applies a record of the journal to the index, returns 0 if the record is malformed
+ */
+int replay_record(index_p index, journal_record_p record, char *payload) {
+    char *end = payload + record->size;
+
+    if (record->type == RECORD_REMOVE) {
+        int doc_id;
+        if (record->size != sizeof(int)) {
+            return 0;
+        }
+
+        memcpy(&doc_id, payload, sizeof(int));
+        if (doc_id < 0 || doc_id >= index->nr_doc_ids) {
+            return 0;
+        }
+
+        // the manifest written by a merge of segments may list the document as removed already
+        if (get_document(index, doc_id)->name) {
+            delete_document(index, doc_id);
+        }
+        return 1;
+    }
+
+    if ((record->type != RECORD_ADD && record->type != RECORD_ADD_POSITIONS) || record->size < 2 * sizeof(int)) {
+        return 0;
+    }
+
+    // records written before positions were recorded have none
+    int positions = record->type == RECORD_ADD_POSITIONS;
+
+    int nr_words, nr_terms;
+    memcpy(&nr_words, payload, sizeof(int));
+    memcpy(&nr_terms, payload + sizeof(int), sizeof(int));
+    payload += 2 * sizeof(int);
+
+    // strings have to be terminated within the record
+    *end = '\0';
+    char *name = payload;
+    payload += strlen(name) + 1;
+    if (payload > end || nr_terms < 0 || (nr_terms && nr_words <= 0)) {
+        return 0;
+    }
+
+    // check the terms before the document is added
+    char *terms = payload;
+    int k;
+    for (k = 0; k < nr_terms; k++) {
+        int count;
+        if (payload + sizeof(int) >= end) {
+            return 0;
+        }
+
+        memcpy(&count, payload, sizeof(int));
+        if (count <= 0) {
+            return 0;
+        }
+
+        payload += sizeof(int);
+        payload += strlen(payload) + 1;
+        if (payload > end) {
+            return 0;
+        }
+
+        if (positions) {
+            int size;
+            if (payload + sizeof(int) > end) {
+                return 0;
+            }
+
+            memcpy(&size, payload, sizeof(int));
+            payload += sizeof(int);
+            if (size < 0 || size > end - payload) {
+                return 0;
+            }
+            payload += size;
+        }
+    }
+
+    int doc_id = insert_document(index, name);
+    if (doc_id < 0) {
+        return 0;
+    }
+
+    change_document(index, doc_id)->nr_words = nr_words;
+
+    payload = terms;
+    for (k = 0; k < nr_terms; k++) {
+        int count;
+        memcpy(&count, payload, sizeof(int));
+        char *stem = payload + sizeof(int);
+        payload = stem + strlen(stem) + 1;
+
+        int wid = find_or_add_word(index, stem);
+        own_word(index, &index->words[wid]);
+        add_posting(&index->words[wid], doc_id, count);
+
+        if (positions) {
+            int size;
+            memcpy(&size, payload, sizeof(int));
+            set_position_list(&index->words[wid], (unsigned char *) payload + sizeof(int), size);
+            payload += sizeof(int) + size;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Appends a record to the journal and forces it to disk
+ */
+void append_record(index_p index, int type, journal_buffer_p payload) {
+    if (!index->journal) {
+        return;
+    }
+
+    double start = now_seconds();
+
+    journal_record_t record;
+    record.type = type;
+    record.size = payload->size;
+    record.checksum = journal_checksum(payload->data, payload->size);
+    record.reserved = 0;
+
+    fwrite(&record, sizeof(journal_record_t), 1, index->journal);
+    fwrite(payload->data, 1, payload->size, index->journal);
+
+    if (fflush(index->journal) || fsync(fileno(index->journal))) {
+        printf("Error: couldn't write to the journal.\nChanges to the index won't be saved!\n");
+        close_journal(index);
+        return;
+    }
+
+    index->journal_size += sizeof(journal_record_t) + payload->size;
+    count_stat(STAT_BYTES_WRITTEN, sizeof(journal_record_t) + payload->size);
+    count_time(STAT_TIME_PERSIST, start);
+}
+
+/*
+ * Appends data to a growing buffer
+ */
+void append_to_buffer(journal_buffer_p buffer, void *data, int size) {
+    if (buffer->size + size > buffer->max_size) {
+        while (buffer->size + size > buffer->max_size) {
+            buffer->max_size = buffer->max_size ? buffer->max_size * 2 : 256;
+        }
+        buffer->data = (char *) realloc(buffer->data, buffer->max_size);
+    }
+
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+}
+
+/*
+ * Computes FNV-1a hash of the payload of a record
+ */
+unsigned int journal_checksum(char *data, int size) {
+    unsigned int hash = 2166136261u;
+    int i;
+    for (i = 0; i < size; i++) {
+        hash ^= (unsigned char) data[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
@@ -0,0 +1,5 @@
+void open_journal(index_p index, char *file);
+void reset_journal(index_p index, char *file);
+void close_journal(index_p index);
+void journal_add(index_p index, int doc_id, int *words, int nr_terms);
+void journal_remove(index_p index, int doc_id);
@@ -5,88 +5,210 @@
 #include "index.h"
 #include "stemmer.h"
 #include "util.h"
+#include "stemcache.h"
+#include "ingest.h"
+#include "segments.h"
+#include "snapshots.h"
+#include "server.h"
+#include "batch.h"
+#include "stats.h"
 
 int main(int argc, void *argv) {
-    load_stopwords();
     index_p index = load_index();
+    struct server *server = NULL;
 
     int exit = 0;
     while (!exit) {
         printf(" > ");
         char *command = read_line(stdin);
+        if (!command) {
+            // end of input: a server goes on serving until the process is ended
+            if (server) {
+                printf("End of input, serving until the process is ended.\n");
+                wait_for_server(server);
+            }
+            break;
+        }
+
+        // commands which change the index set this to 1
+        int changed = 0;
 
         if (!strcmp(command, "exit")) {
             // exit command
             exit = 1;
             printf("Exit requested..\n");
 
-		} else if (!strcmp(command, "rebuild index")) {
-            // rebuild index command
-            rebuild_index(index);
+		} else if (!strcmp(command, "rebuild index") || starts_with(command, "rebuild index ")) {
+            // rebuild index [<number of threads>] command
+            rebuild_index(index, atoi(command + 13));
+            changed = 1;
+        } else if (!strcmp(command, "export index")) {
+            // export index command: write the index in the text format (filebase and index files)
+            export_index(index);
+        } else if (!strcmp(command, "ranking euclid")) {
+            // ranking euclid command: rank search results by euclidian distance of the TF-IDF vectors (default)
+            index->ranking = RANKING_EUCLID;
+            changed = 1;
+        } else if (!strcmp(command, "ranking cosine")) {
+            // ranking cosine command: rank search results by cosine similarity of the TF-IDF vectors
+            index->ranking = RANKING_COSINE;
+            changed = 1;
+        } else if (!strcmp(command, "positions on")) {
+            // positions on command: record where the words occur in the documents parsed from now on (default)
+            index->positions = 1;
+        } else if (!strcmp(command, "positions off")) {
+            // positions off command: don't record positions, phrases only match by their words in the documents parsed from now on
+            index->positions = 0;
+        } else if (!strcmp(command, "stem cache")) {
+            // stem cache command: print how many words were found in the stem cache
+            print_stem_cache(index->stem_cache);
+        } else if (!strcmp(command, "stats")) {
+            // stats command: print the runtime counters
+            print_stats(stdout);
+        } else if (!strcmp(command, "stats reset")) {
+            // stats reset command: start counting from 0
+            reset_stats();
+        } else if (starts_with(command, "stats ")) {
+            // stats <file> command: write the runtime counters to a file
+            FILE *f = fopen(command + 6, "w");
+            if (f) {
+                print_stats(f);
+                fclose(f);
+            } else {
+                printf("Cannot open %s!\n", command + 6);
+            }
+        } else if (starts_with(command, "memory budget ")) {
+            // memory budget <MB> command: memory the words may occupy while building a segment, then they are written to runs
+            long budget = atol(command + 14);
+            index->memory_budget = budget > 0 ? budget << 20 : DEFAULT_MEMORY_BUDGET;
+        } else if (starts_with(command, "stopwords ")) {
+            // stopwords <file> command: rebuild the index leaving out the words in this file instead
+            change_stopwords(index, command + 10);
+            changed = 1;
 		} else if (starts_with(command, "search for ")) {
-            // search for <search_query> command
+            // search for <search_query> command ("words in quotes" are a phrase, <word> NEAR/<k> <word> a proximity search)
             char *query = (char *) malloc(strlen(command) - 10);
             memcpy(query, command+11, strlen(command) - 10);
 
-            index_p result = search_index(&index, query);
+            // the search reads the snapshot published after the last change, not the index itself
+            index_p snapshot = acquire_snapshot(index);
+            search_result_p result = search_index(snapshot, query);
+            release_snapshot(index, snapshot);
 
             printf("Results (showing no more than 10, there might be more):\n");
             if (result) {
                 // print result
-                int count = 0;
-                indexed_word_p w = result->words;
-                if (!w) {
+                if (!result->nr_hits) {
                     printf("No documents found for search term %s\n", query);
                 }
 
-                while (w) {
-                    printf("Documents containing %s:\n", w->stem);
-
-                    int i;
-                    for (i = 0; i < w->nr_docs; i++, count++) {
-                        printf(" [%d] %s\n", count, result->documents[w->documents[i].id].name);
+                int i;
+                for (i = 0; i < result->nr_hits; i++) {
+                    // documents are grouped by the search terms they contain
+                    if (!i || strcmp(result->hits[i].terms, result->hits[i-1].terms)) {
+                        printf("Documents containing %s:\n", result->hits[i].terms);
                     }
 
-                    w = w->next;
+                    printf(" [%d] %08.5f %s\n", i, result->hits[i].score, result->hits[i].name);
                 }
 
-                close_index(result);
+                close_search_result(result);
             } else {
                 printf("No documents found for search term %s\n", query);
             }
 
             free(query);
 
+        } else if (starts_with(command, "search batch ")) {
+            // search batch <queries file> <results file> [tsv|json] [<number of threads>] command: search many queries
+            // in parallel, - = standard input / output
+            char *args[4] = { NULL, NULL, NULL, NULL };
+            int nr_args = 0;
+            char *arg = strtok(command + 13, " ");
+            while (arg && nr_args < 4) {
+                args[nr_args++] = arg;
+                arg = strtok(NULL, " ");
+            }
+
+            if (nr_args < 2 || (args[2] && strcmp(args[2], "tsv") && strcmp(args[2], "json"))) {
+                printf("Usage: search batch <queries file> <results file> [tsv|json] [<number of threads>]\n");
+            } else {
+                search_batch(index, args[0], args[1], args[2] && !strcmp(args[2], "json"), args[3] ? atoi(args[3]) : 0);
+            }
+
+        } else if (starts_with(command, "serve ")) {
+            // serve <port|socket path> [<number of threads>] command: answer searches of other programs in the background
+            char *address = command + 6;
+            char *threads = strchr(address, ' ');
+            if (threads) {
+                *threads++ = '\0';
+            }
+
+            if (server) {
+                printf("Error: already serving.\n");
+            } else {
+                server = start_server(index, address, threads ? atoi(threads) : 0);
+            }
+
+        } else if (!strcmp(command, "stop serving")) {
+            // stop serving command
+            if (server) {
+                stop_server(server);
+                server = NULL;
+            } else {
+                printf("Error: not serving.\n");
+            }
+
+        } else if (starts_with(command, "add files ")) {
+            // add files <directory|glob|@manifest> command: add many files at once, they are written to one new segment
+            add_files(index, command + 10, 0);
+            changed = 1;
+
         } else if (starts_with(command, "add file ")) {
             // add file <file> command
             char *file = (char*) malloc(strlen(command) - 8);
             memcpy(file, command+9, strlen(command) - 8);
 
-			index = add_file(index, file);
+			add_file(index, file);
             free(file);
+            changed = 1;
 
         } else if (starts_with(command, "remove file ")) {
             // remove file <file> command
             char *file = (char*) malloc(strlen(command) - 11);
             memcpy(file, command+12, strlen(command) - 11);
 
-            // obtain document id a.k.a. index in filebase
-            int doc_id = find_str(&index->documents[0].name, sizeof(indexed_document_t), file, 0, index->nr_docs - 1);
+            // obtain document id
+            int doc_id = find_document(index, file);
 
             if (doc_id < 0) {
                 printf("Error: %s is not in the filebase!\n", file);
             } else {
                 remove_file(index, doc_id);
+                changed = 1;
             }
 
             free(file);
         }
 
         free(command);
+
+        // put a background merge of segments into effect once it is done
+        if (check_merge(index)) {
+            changed = 1;
+        }
+
+        // the following searches see the changes
+        if (changed && !exit) {
+            publish_snapshot(index);
+        }
+    }
+
+    if (server) {
+        stop_server(server);
     }
 
     // release memory
-    release_stopwords();
     close_index(index);
 
     return 0;
@@ -0,0 +1,460 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glob.h>
+#include <sys/stat.h>
+
+#include "index.h"
+#include "util.h"
+#include "stemmer.h"
+#include "stemcache.h"
+#include "stopwords.h"
+#include "tokenizer.h"
+#include "vocab.h"
+#include "postings.h"
+
+// each benchmark repeats its pass over the input until it ran this long
+#define MIN_BENCH_SECONDS 0.5
+
+// documents in the list find_document searches, documents in the document list cursor_seek moves through
+#define NR_BENCH_DOCS 100000
+#define NR_BENCH_POSTINGS 1000000
+
+typedef struct micro_input {
+    char **files;               // files the words are taken from
+    int nr_files;               // number of these files
+    char *text;                 // text of all files, one after another
+    int text_size;              // number of bytes of the text
+    char *scratch;              // room for a copy of the text (the tokenizer changes the text in place)
+    char **words;               // words of the text in order, lower case
+    int *lengths;               // per word: its length
+    int nr_words;               // number of words
+    char **stems;               // stems of the words which aren't stopwords, in order
+    int *stem_files;            // per stem: number of the file it is from
+    int nr_stems;               // number of stems
+    stopword_set_p stopwords;   // stopwords of the index
+    stem_cache_p cache;         // stem cache, filled by the first pass of cached_stem
+    index_t vocabulary;         // index with the stems of the text (no documents)
+    index_t names;              // index with NR_BENCH_DOCS documents (no words)
+    char **lookups;             // names of these documents in random order
+    indexed_word_t postings;    // document list of NR_BENCH_POSTINGS documents (every third id)
+    int *seeks;                 // increasing document ids cursor_seek moves to
+    int nr_seeks;               // number of these ids
+} micro_input_t, *micro_input_p;
+
+typedef struct micro_bench {
+    char *name;                         // name printed with the results
+    long (*run)(micro_input_p input);   // one pass over the input, returns the number of operations
+} micro_bench_t, *micro_bench_p;
+
+long bench_stem_word(micro_input_p input);
+long bench_cached_stem(micro_input_p input);
+long bench_string_tokenizer(micro_input_p input);
+long bench_file_tokenizer(micro_input_p input);
+long bench_is_stopword(micro_input_p input);
+long bench_find_word(micro_input_p input);
+long bench_find_document(micro_input_p input);
+long bench_cursor_seek(micro_input_p input);
+long bench_add_posting(micro_input_p input);
+long bench_parse_file(micro_input_p input);
+void load_input(micro_input_p input, char **patterns, int nr_patterns);
+void run_bench(micro_bench_p bench, micro_input_p input);
+int cmp_name(const void *a, const void *b);
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+
+// number of blocks of memory allocated so far (the benchmarks run in one thread)
+long nr_allocs = 0;
+
+micro_bench_t benches[] = {
+    { "stem_word", bench_stem_word },
+    { "cached_stem", bench_cached_stem },
+    { "tokenizer (string)", bench_string_tokenizer },
+    { "tokenizer (files)", bench_file_tokenizer },
+    { "is_stopword", bench_is_stopword },
+    { "find_word", bench_find_word },
+    { "find_document", bench_find_document },
+    { "cursor_seek", bench_cursor_seek },
+    { "add_posting", bench_add_posting },
+    { "parse_file_for_index", bench_parse_file },
+};
+
+/*
+ * Microbenchmarks of the primitives the engine spends its time in: stemming, tokenizing, stopword lookup,
+ * vocabulary lookup, binary search of the document names, skipping through document lists and adding postings.
+ * The words come from text files (by default the documents of texts_project), so they occur as often as in
+ * real text. Each benchmark prints the time per operation and the number of allocations per operation
+ * (malloc, calloc and realloc are counted by replacing them with counting versions of the glibc ones).
+ *
+ * build: gcc -O2 -pthread -o microbench microbench.c $(ls *.c | grep -v 'main.c\|bench.c\|allinone.c') -lm
+ * usage: microbench [benchmark name] [files or glob patterns]
+ */
+int main(int argc, char **argv) {
+    char *only = NULL;
+    char *default_pattern = "texts_project/*.txt";
+    char **patterns = &default_pattern;
+    int nr_patterns = 1;
+
+    // a first argument which isn't a file is the name of the only benchmark to run
+    struct stat st;
+    int i, first = 1;
+    if (argc > 1 && stat(argv[1], &st) && !strpbrk(argv[1], "*?[")) {
+        only = argv[1];
+        first = 2;
+    }
+    if (argc > first) {
+        patterns = argv + first;
+        nr_patterns = argc - first;
+    }
+
+    micro_input_t input;
+    load_input(&input, patterns, nr_patterns);
+    if (!input.nr_words) {
+        fprintf(stderr, "No words found.\n");
+        return 1;
+    }
+
+    printf("%d files, %d words, %d stems, %d different stems\n", input.nr_files, input.nr_words, input.nr_stems,
+        input.vocabulary.nr_words);
+    printf("%-22s %12s %10s %10s\n", "benchmark", "ops", "ns/op", "allocs/op");
+
+    for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        if (!only || !strcmp(only, benches[i].name)) {
+            run_bench(&benches[i], &input);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Counting replacements of the allocation functions
+ */
+void *malloc(size_t size) {
+    nr_allocs++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    nr_allocs++;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) {
+    nr_allocs++;
+    return __libc_realloc(p, size);
+}
+
+/*
+ * Runs a benchmark until it took MIN_BENCH_SECONDS and prints its results (the first pass isn't counted,
+ * it warms up caches)
+ */
+void run_bench(micro_bench_p bench, micro_input_p input) {
+    bench->run(input);
+
+    long nr_ops = 0, allocs = nr_allocs;
+    double start = now_seconds(), seconds;
+    do {
+        nr_ops += bench->run(input);
+        seconds = now_seconds() - start;
+    } while (seconds < MIN_BENCH_SECONDS);
+
+    printf("%-22s %12ld %10.1f %10.3f\n", bench->name, nr_ops, seconds * 1e9 / nr_ops,
+        (double) (nr_allocs - allocs) / nr_ops);
+}
+
+/*
+ * Stems every word of the text
+ */
+long bench_stem_word(micro_input_p input) {
+    char buf[TOKEN_BUFFER_SIZE + 1];
+    int i;
+    for (i = 0; i < input->nr_words; i++) {
+        stem_word(input->words[i], input->lengths[i], buf);
+    }
+
+    return input->nr_words;
+}
+
+/*
+ * Stems every word of the text with the stem cache
+ */
+long bench_cached_stem(micro_input_p input) {
+    char buf[TOKEN_BUFFER_SIZE + 1];
+    int i;
+    for (i = 0; i < input->nr_words; i++) {
+        cached_stem(input->cache, input->words[i], input->lengths[i], buf);
+    }
+
+    return input->nr_words;
+}
+
+/*
+ * Splits the text into words (copying the text first, the tokenizer turns it to lower case)
+ */
+long bench_string_tokenizer(micro_input_p input) {
+    memcpy(input->scratch, input->text, input->text_size + 1);
+
+    tokenizer_t t;
+    string_tokenizer(&t, input->scratch);
+
+    char *word;
+    long n = 0;
+    while (next_token(&t, &word)) {
+        n++;
+    }
+    close_tokenizer(&t);
+
+    return n;
+}
+
+/*
+ * Reads the files and splits them into words
+ */
+long bench_file_tokenizer(micro_input_p input) {
+    long n = 0;
+    int i;
+    for (i = 0; i < input->nr_files; i++) {
+        tokenizer_t t;
+        if (!open_tokenizer(&t, input->files[i])) {
+            continue;
+        }
+
+        char *word;
+        while (next_token(&t, &word)) {
+            n++;
+        }
+        close_tokenizer(&t);
+    }
+
+    return n;
+}
+
+/*
+ * Checks for every word of the text whether it is a stopword
+ */
+long bench_is_stopword(micro_input_p input) {
+    int i;
+    for (i = 0; i < input->nr_words; i++) {
+        is_stopword(input->stopwords, input->words[i], input->lengths[i]);
+    }
+
+    return input->nr_words;
+}
+
+/*
+ * Looks up every stem of the text in the vocabulary
+ */
+long bench_find_word(micro_input_p input) {
+    int i;
+    for (i = 0; i < input->nr_stems; i++) {
+        find_word(&input->vocabulary, input->stems[i]);
+    }
+
+    return input->nr_stems;
+}
+
+/*
+ * Looks up the documents of the name list by name, in random order
+ */
+long bench_find_document(micro_input_p input) {
+    int i;
+    for (i = 0; i < input->names.nr_docs; i++) {
+        find_document(&input->names, input->lookups[i]);
+    }
+
+    return input->names.nr_docs;
+}
+
+/*
+ * Moves a cursor through a long document list by seeks to increasing ids
+ */
+long bench_cursor_seek(micro_input_p input) {
+    posting_cursor_t c;
+    open_cursor(&c, &input->postings);
+
+    int i;
+    for (i = 0; i < input->nr_seeks; i++) {
+        cursor_seek(&c, input->seeks[i]);
+    }
+
+    return input->nr_seeks;
+}
+
+/*
+ * Adds the stems of the text to an empty index, one file after another as one document each
+ * (the part of parse_file_for_index after stemming)
+ */
+long bench_add_posting(micro_input_p input) {
+    index_t words;
+    init_words(&words);
+
+    int i;
+    for (i = 0; i < input->nr_stems; i++) {
+        int wid = find_or_add_word(&words, input->stems[i]);
+        add_posting(&words.words[wid], input->stem_files[i], 1);
+    }
+
+    clear_words(&words);
+    return input->nr_stems;
+}
+
+/*
+ * Parses the files into an empty index, with stopwords and a stem cache like the index has
+ */
+long bench_parse_file(micro_input_p input) {
+    index_t index;
+    init_index(&index);
+    index.stopwords = input->stopwords;
+    index.stem_cache = input->cache;
+
+    int i;
+    for (i = 0; i < input->nr_files; i++) {
+        int doc_id = insert_document(&index, input->files[i]);
+        if (doc_id >= 0) {
+            parse_file_for_index(&index, doc_id, NULL);
+        }
+    }
+
+    // the stopwords and the cache belong to the input
+    index.stopwords = NULL;
+    index.stem_cache = NULL;
+    clear_index(&index);
+
+    return input->nr_words;
+}
+
+/*
+ * Reads the files and prepares the input of the benchmarks
+ */
+void load_input(micro_input_p input, char **patterns, int nr_patterns) {
+    memset(input, 0, sizeof(micro_input_t));
+
+    // STEP 1: the files and their text
+    int i, max_files = 0;
+    for (i = 0; i < nr_patterns; i++) {
+        glob_t g;
+        if (!glob(patterns[i], 0, NULL, &g)) {
+            int k;
+            for (k = 0; k < g.gl_pathc; k++) {
+                if (input->nr_files == max_files) {
+                    max_files = max_files ? max_files * 2 : 64;
+                    input->files = (char **) realloc(input->files, sizeof(char *) * max_files);
+                }
+                input->files[input->nr_files] = (char *) malloc(strlen(g.gl_pathv[k]) + 1);
+                strcpy(input->files[input->nr_files++], g.gl_pathv[k]);
+            }
+        }
+        globfree(&g);
+    }
+
+    input->text = (char *) malloc(1);
+    for (i = 0; i < input->nr_files; i++) {
+        FILE *f = fopen(input->files[i], "r");
+        if (!f) {
+            continue;
+        }
+
+        char buf[1 << 16];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+            input->text = (char *) realloc(input->text, input->text_size + n + 2);
+            memcpy(input->text + input->text_size, buf, n);
+            input->text_size += n;
+        }
+        input->text[input->text_size++] = '\n';
+        fclose(f);
+    }
+    input->text[input->text_size] = '\0';
+    input->scratch = (char *) malloc(input->text_size + 1);
+
+    // STEP 2: the words, and the stems of the words which aren't stopwords (file by file, to know their file)
+    input->stopwords = load_stopwords("stopwords");
+    input->cache = new_stem_cache();
+    init_words(&input->vocabulary);
+
+    int max_words = 0, max_stems = 0;
+    for (i = 0; i < input->nr_files; i++) {
+        tokenizer_t t;
+        if (!open_tokenizer(&t, input->files[i])) {
+            continue;
+        }
+
+        char *word;
+        int len;
+        while ((len = next_token(&t, &word))) {
+            if (input->nr_words == max_words) {
+                max_words = max_words ? max_words * 2 : 4096;
+                input->words = (char **) realloc(input->words, sizeof(char *) * max_words);
+                input->lengths = (int *) realloc(input->lengths, sizeof(int) * max_words);
+            }
+            input->words[input->nr_words] = (char *) malloc(len + 1);
+            memcpy(input->words[input->nr_words], word, len + 1);
+            input->lengths[input->nr_words++] = len;
+
+            if (is_stopword(input->stopwords, word, len) || !stem_word(word, len, word)) {
+                continue;
+            }
+
+            if (input->nr_stems == max_stems) {
+                max_stems = max_stems ? max_stems * 2 : 4096;
+                input->stems = (char **) realloc(input->stems, sizeof(char *) * max_stems);
+                input->stem_files = (int *) realloc(input->stem_files, sizeof(int) * max_stems);
+            }
+            input->stems[input->nr_stems] = (char *) malloc(strlen(word) + 1);
+            strcpy(input->stems[input->nr_stems], word);
+            input->stem_files[input->nr_stems++] = i;
+
+            find_or_add_word(&input->vocabulary, word);
+        }
+        close_tokenizer(&t);
+    }
+
+    // STEP 3: a long list of document names, looked up in random order (fixed seed)
+    init_index(&input->names);
+    char **files = (char **) malloc(sizeof(char *) * NR_BENCH_DOCS);
+    for (i = 0; i < NR_BENCH_DOCS; i++) {
+        char name[64];
+        sprintf(name, "corpus/%03d/%06d.txt", i % 997, i);
+        files[i] = (char *) malloc(strlen(name) + 1);
+        strcpy(files[i], name);
+    }
+    qsort(files, NR_BENCH_DOCS, sizeof(char *), cmp_name);
+    insert_documents(&input->names, files, NR_BENCH_DOCS);
+
+    unsigned int seed = 1;
+    for (i = NR_BENCH_DOCS - 1; i > 0; i--) {
+        int k = rand_r(&seed) % (i + 1);
+        char *tmp = files[i];
+        files[i] = files[k];
+        files[k] = tmp;
+    }
+    input->lookups = files;
+
+    // STEP 4: a long document list and seeks skipping 1 to 64 documents
+    index_t list;
+    init_words(&list);
+    int wid = find_or_add_word(&list, "posting");
+    indexed_word_p w = &list.words[wid];
+    for (i = 0; i < NR_BENCH_POSTINGS; i++) {
+        add_posting(w, i * 3, 1 + i % 5);
+    }
+    seal_postings(w);
+    input->postings = *w;
+
+    input->seeks = (int *) malloc(sizeof(int) * NR_BENCH_POSTINGS);
+    int doc = 0;
+    while (doc < NR_BENCH_POSTINGS * 3) {
+        input->seeks[input->nr_seeks++] = doc;
+        doc += 3 * (1 + rand_r(&seed) % 64) - 1;
+    }
+}
+
+/*
+ * Compares two names alphabetically
+ */
+int cmp_name(const void *a, const void *b) {
+    return strcmp(*(char **) a, *(char **) b);
+}
@@ -0,0 +1,273 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+
+#include "index.h"
+#include "postings.h"
+#include "vocab.h"
+#include "norms.h"
+#include "segments.h"
+#include "snapshots.h"
+
+/*
+ * The TF-IDF weight of a word in a document is TF * (log(N + 1) - log(df)), N being the number of documents
+ * in the filebase (a query counts as an additional document) and df the number of documents containing the word.
+ * Each document keeps the sums of TF^2, TF^2 * log(df) and TF^2 * log(df)^2 over its words, so the length of
+ * its TF-IDF vector follows for any N, and a change of df only concerns the documents containing the word.
+ * The df of a word counts the documents of all segments and of the words in memory (except removed ones).
+ *
+ * Updating the sums of all documents containing a word each time a document with the word is added or removed
+ * would cost the length of its document list per word of the document. Instead the sums of a word lag behind
+ * its df until log(df) moved by more than NORM_DF_TOLERANCE, the df they use is kept in a table of drifts; so
+ * the TF-IDF weight of a word in a document is off by TF * NORM_DF_TOLERANCE at most, and a list of df
+ * documents is gone through about once per df * NORM_DF_TOLERANCE changes. All sums are brought up to date
+ * when the table is full and when the words in memory are written to a segment.
+ */
+
+norm_drift_p find_norm_drift(index_p index, char *stem, int df);
+void settle_word_norms(index_p index, char *stem, int old_df);
+
+/*
+ * Computes the sums of each document, if not done yet
+ */
+void update_norms(index_p index) {
+    if (index->norms) {
+        return;
+    }
+
+    // the sums are kept in pages like the documents
+    int nr_pages = index->max_doc_ids / DOCUMENT_PAGE_SIZE, p;
+    index->norm_drifts = (norm_drift_p) calloc(2 * MAX_NORM_DRIFTS, sizeof(norm_drift_t));
+    index->nr_norm_drifts = 0;
+    index->norms = (doc_norm_p *) malloc(sizeof(doc_norm_p) * (nr_pages + 1));
+    index->norm_stamps = (int *) malloc(sizeof(int) * (nr_pages + 1));
+    for (p = 0; p < nr_pages; p++) {
+        index->norms[p] = (doc_norm_p) calloc(DOCUMENT_PAGE_SIZE, sizeof(doc_norm_t));
+        index->norm_stamps[p] = index->nr_snapshots;
+    }
+
+    int s, wid;
+    for (s = 0; s <= index->nr_segments; s++) {
+        index_p words = s < index->nr_segments ? &index->segments[s].words : index;
+
+        for (wid = 0; wid < words->nr_words; wid++) {
+            indexed_word_p w = &words->words[wid];
+            double log_df = log(word_df(index, w->stem));
+
+            posting_cursor_t c;
+            for (open_cursor(&c, w); cursor_doc(&c) != INT_MAX; cursor_next(&c)) {
+                int d = cursor_doc(&c);
+                indexed_document_p doc = get_document(index, d);
+                if (!doc->name) {
+                    // removed document, still in its segment
+                    continue;
+                }
+
+                double tf = (double) cursor_count(&c) / doc->nr_words;
+
+                doc_norm_p n = &index->norms[d / DOCUMENT_PAGE_SIZE][d % DOCUMENT_PAGE_SIZE];
+                n->tf2 += tf * tf;
+                n->tf2_log += tf * tf * log_df;
+                n->tf2_log2 += tf * tf * log_df * log_df;
+            }
+        }
+    }
+}
+
+/*
+ * Discards the sums of the documents (snapshots may still read their pages)
+ */
+void clear_norms(index_p index) {
+    if (!index->norms) {
+        return;
+    }
+
+    int p;
+    for (p = 0; p < index->max_doc_ids / DOCUMENT_PAGE_SIZE; p++) {
+        retire_memory(index, index->norms[p]);
+    }
+
+    for (p = 0; p < 2 * MAX_NORM_DRIFTS; p++) {
+        free(index->norm_drifts[p].stem);
+    }
+    free(index->norm_drifts);
+    index->norm_drifts = NULL;
+
+    free(index->norms);
+    free(index->norm_stamps);
+    index->norms = NULL;
+    index->norm_stamps = NULL;
+}
+
+/*
+ * Returns the sums of a document to be changed, their page is copied first if snapshots share it
+ * (the sums must have been computed)
+ */
+doc_norm_p change_norm(index_p index, int doc_id) {
+    int page = doc_id / DOCUMENT_PAGE_SIZE;
+    index->norms[page] = (doc_norm_p) own_memory(index, index->norms[page], &index->norm_stamps[page],
+        sizeof(doc_norm_t) * DOCUMENT_PAGE_SIZE);
+
+    return &index->norms[page][doc_id % DOCUMENT_PAGE_SIZE];
+}
+
+/*
+ * Updates the sums of the documents containing a word after the number of these documents changed
+ * (those of the other documents only once the change is large enough, see above)
+ *  old_df: previous number of documents containing the word
+ *  doc_id: document just added to the word (-1 = none), the word is added to its sums
+ */
+void update_word_norms(index_p index, char *stem, int old_df, int doc_id) {
+    if (!index->norms) {
+        return;
+    }
+
+    int df = word_df(index, stem);
+    norm_drift_p drift = find_norm_drift(index, stem, old_df);
+    if (!drift->df) {
+        // new word, the document is the only one containing it
+        drift->df = df;
+    }
+
+    if (doc_id >= 0) {
+        // the document gets the df the sums of the other documents containing the word use
+        int wid = find_word(index, stem);
+        posting_cursor_t c;
+        if (wid >= 0) {
+            open_cursor(&c, &index->words[wid]);
+        }
+
+        if (wid >= 0 && cursor_seek(&c, doc_id) == doc_id) {
+            double tf = (double) cursor_count(&c) / get_document(index, doc_id)->nr_words;
+            double log_df = log(drift->df);
+
+            doc_norm_p n = change_norm(index, doc_id);
+            n->tf2 += tf * tf;
+            n->tf2_log += tf * tf * log_df;
+            n->tf2_log2 += tf * tf * log_df * log_df;
+        }
+    }
+
+    if (df && fabs(log(df) - log(drift->df)) > NORM_DF_TOLERANCE) {
+        settle_word_norms(index, stem, drift->df);
+        drift->df = df;
+    }
+}
+
+/*
+ * Brings the sums of all documents up to date with the df of their words and empties the table of drifts
+ */
+void settle_norms(index_p index) {
+    if (!index->norms) {
+        return;
+    }
+
+    int i;
+    for (i = 0; i < 2 * MAX_NORM_DRIFTS; i++) {
+        norm_drift_p drift = &index->norm_drifts[i];
+        if (!drift->stem) {
+            continue;
+        }
+
+        // words no document contains anymore have no sums to update
+        int df = word_df(index, drift->stem);
+        if (df && df != drift->df) {
+            settle_word_norms(index, drift->stem, drift->df);
+        }
+
+        free(drift->stem);
+        drift->stem = NULL;
+    }
+
+    index->nr_norm_drifts = 0;
+}
+
+/*
+ * Returns the entry of a word in the table of drifts, a word not in the table is added with the df given
+ * (if the table is full, all sums are brought up to date first)
+ */
+norm_drift_p find_norm_drift(index_p index, char *stem, int df) {
+    unsigned int hash = hash_stem(stem);
+    int mask = 2 * MAX_NORM_DRIFTS - 1;
+    int s = hash & mask;
+    while (index->norm_drifts[s].stem) {
+        norm_drift_p drift = &index->norm_drifts[s];
+        if (drift->hash == hash && !strcmp(drift->stem, stem)) {
+            return drift;
+        }
+        s = (s + 1) & mask;
+    }
+
+    if (index->nr_norm_drifts == MAX_NORM_DRIFTS) {
+        settle_norms(index);
+        s = hash & mask;
+    }
+
+    norm_drift_p drift = &index->norm_drifts[s];
+    drift->stem = (char *) malloc(strlen(stem) + 1);
+    strcpy(drift->stem, stem);
+    drift->hash = hash;
+    drift->df = df;
+    index->nr_norm_drifts++;
+
+    return drift;
+}
+
+/*
+ * Updates the sums of the documents containing a word from one df to another
+ *  old_df: number of documents containing the word the sums use
+ */
+void settle_word_norms(index_p index, char *stem, int old_df) {
+    double old_log = old_df ? log(old_df) : 0;
+    double new_log = log(word_df(index, stem));
+
+    // the documents containing the word are spread over the segments
+    int s;
+    for (s = 0; s <= index->nr_segments; s++) {
+        index_p words = s < index->nr_segments ? &index->segments[s].words : index;
+        int wid = find_word(words, stem);
+        if (wid < 0) {
+            continue;
+        }
+
+        // the pages are looked up once for all documents of the list in them
+        int page = -1;
+        indexed_document_p docs = NULL;
+        doc_norm_p norms = NULL;
+
+        posting_cursor_t c;
+        for (open_cursor(&c, &words->words[wid]); cursor_doc(&c) != INT_MAX; cursor_next(&c)) {
+            int d = cursor_doc(&c);
+            if (d / DOCUMENT_PAGE_SIZE != page) {
+                page = d / DOCUMENT_PAGE_SIZE;
+                docs = index->documents[page];
+                norms = change_norm(index, page * DOCUMENT_PAGE_SIZE);
+            }
+
+            indexed_document_p doc = &docs[d % DOCUMENT_PAGE_SIZE];
+            if (!doc->name) {
+                continue;
+            }
+
+            double tf = (double) cursor_count(&c) / doc->nr_words;
+
+            doc_norm_p n = &norms[d % DOCUMENT_PAGE_SIZE];
+            n->tf2_log += tf * tf * (new_log - old_log);
+            n->tf2_log2 += tf * tf * (new_log * new_log - old_log * old_log);
+        }
+    }
+}
+
+/*
+ * Returns the squared length of the TF-IDF vector of a document
+ *  log_n: log(N + 1)
+ */
+double document_norm(index_p index, int doc_id, double log_n) {
+    doc_norm_p n = &index->norms[doc_id / DOCUMENT_PAGE_SIZE][doc_id % DOCUMENT_PAGE_SIZE];
+    double norm = log_n * log_n * n->tf2 - 2 * log_n * n->tf2_log + n->tf2_log2;
+
+    // rounding errors mustn't make it negative
+    return norm > 0 ? norm : 0;
+}
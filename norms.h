@@ -0,0 +1,6 @@
+void update_norms(index_p index);
+void clear_norms(index_p index);
+doc_norm_p change_norm(index_p index, int doc_id);
+void update_word_norms(index_p index, char *stem, int old_df, int doc_id);
+void settle_norms(index_p index);
+double document_norm(index_p index, int doc_id, double log_n);
@@ -0,0 +1,704 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "index.h"
+#include "postings.h"
+
+/*
+ * Document lists are stored as blocks of POSTING_BLOCK_SIZE documents. A block holds the gaps between the ids
+ * (minus 1, starting at the last id of the previous block) and the counts (minus 1), each bit packed with the
+ * smallest number of bits that fits all values of the block, in 32 bit words. A full block of b bit values
+ * takes exactly 4 * b words. All blocks except the last one are full; documents appended to the list are
+ * collected in an unpacked tail until a block is complete.
+ *
+ * Each document of a list has an entry in the position lists of the word, in the same order: the number of
+ * bytes of its positions followed by the positions (numbers of the words in the document, counting stopwords)
+ * as gaps, all in 7 bit groups. An empty entry means the positions weren't recorded. The offset of the entry
+ * of the first document of each block is kept with the block, so a cursor only skips entries of its block.
+ */
+
+void pack_block(indexed_word_p w, doc_p docs, int nr_docs);
+int unpack_block(indexed_word_p w, int block, doc_p docs);
+void pack_bits(unsigned int *data, unsigned int *values, int nr_values, int bits);
+void unpack_bits(unsigned int *data, unsigned int *values, int nr_values, int bits);
+int bits_needed(unsigned int max);
+int packed_size(int nr_values, int bits);
+void load_block(posting_cursor_p c, int block);
+void reserve_positions(indexed_word_p w, int size);
+int number_size(unsigned int n);
+
+/*
+ * Adds occurances of a word in a document to its document list, returns 1 if the document is new in the list
+ * the document mustn't have a lower id than any document in the list
+ */
+int add_posting(indexed_word_p w, int doc_id, int count) {
+    if (w->nr_tail && w->tail[w->nr_tail - 1].id == doc_id) {
+        // document is already indexed for this word
+        w->tail[w->nr_tail - 1].count += count;
+        return 0;
+    }
+
+    own_postings(w);
+
+    if (!w->nr_tail && w->nr_blocks && w->blocks[w->nr_blocks - 1].nr_docs < POSTING_BLOCK_SIZE) {
+        // last block isn't full (list from the index file) => continue it in the tail
+        w->max_tail = POSTING_BLOCK_SIZE;
+        w->tail = (doc_p) realloc(w->tail, sizeof(doc_t) * w->max_tail);
+        w->nr_tail = unpack_block(w, w->nr_blocks - 1, w->tail);
+
+        w->nr_blocks--;
+        w->data_size = w->blocks[w->nr_blocks].offset;
+        w->tail_positions = w->block_positions[w->nr_blocks];
+    }
+
+    if (w->nr_tail == POSTING_BLOCK_SIZE) {
+        // tail complete => pack it
+        pack_block(w, w->tail, w->nr_tail);
+        w->nr_tail = 0;
+    }
+
+    // tail full => double the size
+    if (w->nr_tail == w->max_tail) {
+        w->max_tail = w->max_tail ? w->max_tail * 2 : 4;
+        w->tail = (doc_p) realloc(w->tail, sizeof(doc_t) * w->max_tail);
+    }
+
+    w->tail[w->nr_tail].id = doc_id;
+    w->tail[w->nr_tail].count = count;
+    w->nr_tail++;
+    w->nr_docs++;
+
+    // no positions recorded for the document yet
+    reserve_positions(w, 1);
+    w->positions[w->positions_size++] = 0;
+
+    return 1;
+}
+
+/*
+ * Records the positions of a word in the last document of its list (which has none recorded yet)
+ *  positions: numbers of the words in the document where the word occurs, ascending
+ */
+void set_positions(indexed_word_p w, int *positions, int nr_positions) {
+    if (!nr_positions) {
+        return;
+    }
+
+    int i, size = 0;
+    for (i = 0; i < nr_positions; i++) {
+        size += number_size(i ? positions[i] - positions[i - 1] : positions[0]);
+    }
+
+    // the empty entry of the document is replaced
+    w->positions_size--;
+    reserve_positions(w, number_size(size) + size);
+
+    unsigned char *p = w->positions + w->positions_size;
+    p += encode_number(p, size);
+    for (i = 0; i < nr_positions; i++) {
+        p += encode_number(p, i ? positions[i] - positions[i - 1] : positions[0]);
+    }
+    w->positions_size = p - w->positions;
+}
+
+/*
+ * Gives the last document in the list of a word (which has no positions recorded yet) an encoded position list,
+ * as returned by cursor_position_list
+ */
+void set_position_list(indexed_word_p w, unsigned char *list, int size) {
+    if (!size) {
+        return;
+    }
+
+    w->positions_size--;
+    reserve_positions(w, number_size(size) + size);
+
+    w->positions_size += encode_number(w->positions + w->positions_size, size);
+    memcpy(w->positions + w->positions_size, list, size);
+    w->positions_size += size;
+}
+
+/*
+ * Returns the encoded position list of the last document in the list of a word (as cursor_position_list)
+ * the document has to be in the tail
+ */
+unsigned char *last_position_list(indexed_word_p w, int *size) {
+    *size = 0;
+    if (!w->positions || !w->nr_tail) {
+        return NULL;
+    }
+
+    unsigned char *p = w->positions + w->tail_positions;
+    int i;
+    for (i = 0; i < w->nr_tail - 1; i++) {
+        int n = decode_number(&p);
+        p += n;
+    }
+
+    *size = decode_number(&p);
+    return p;
+}
+
+/*
+ * Appends the document list of another word to the document list of a word,
+ * all documents in the other list have higher ids than the documents in the list of the word
+ */
+void append_postings(indexed_word_p w, indexed_word_p other) {
+    posting_cursor_t c;
+    open_cursor(&c, other);
+
+    while (cursor_doc(&c) != INT_MAX) {
+        int size;
+        unsigned char *list = cursor_position_list(&c, &size);
+
+        add_posting(w, cursor_doc(&c), cursor_count(&c));
+        set_position_list(w, list, size);
+        cursor_next(&c);
+    }
+}
+
+/*
+ * Removes a document from the document list of a word, returns 1 if the list contained the document
+ */
+int remove_posting(indexed_word_p w, int doc_id) {
+    posting_cursor_t c;
+    open_cursor(&c, w);
+    if (cursor_seek(&c, doc_id) != doc_id) {
+        return 0;
+    }
+
+    // blocks before the one containing the document stay as they are, the rest of the list is added again
+    int block = c.block, nr_docs = 0;
+    doc_p docs = (doc_p) malloc(sizeof(doc_t) * (w->nr_docs + 1));
+
+    // position lists of the documents added again, one after another
+    int *list_sizes = (int *) malloc(sizeof(int) * (w->nr_docs + 1));
+    unsigned char *lists = (unsigned char *) malloc(w->positions_size + 1);
+    int lists_size = 0;
+
+    open_cursor(&c, w);
+    load_block(&c, block);
+    while (cursor_doc(&c) != INT_MAX) {
+        if (cursor_doc(&c) != doc_id) {
+            docs[nr_docs].id = cursor_doc(&c);
+            docs[nr_docs].count = cursor_count(&c);
+
+            unsigned char *list = cursor_position_list(&c, &list_sizes[nr_docs]);
+            if (list) {
+                memcpy(lists + lists_size, list, list_sizes[nr_docs]);
+                lists_size += list_sizes[nr_docs];
+            }
+            nr_docs++;
+        }
+        cursor_next(&c);
+    }
+
+    // all blocks but the last one are full
+    own_postings(w);
+    if (block < w->nr_blocks) {
+        w->nr_blocks = block;
+        w->data_size = w->blocks[block].offset;
+        w->tail_positions = w->block_positions[block];
+    }
+    w->nr_docs = w->nr_blocks * POSTING_BLOCK_SIZE;
+    w->nr_tail = 0;
+    w->positions_size = w->tail_positions;
+
+    int i;
+    lists_size = 0;
+    for (i = 0; i < nr_docs; i++) {
+        add_posting(w, docs[i].id, docs[i].count);
+        set_position_list(w, lists + lists_size, list_sizes[i]);
+        lists_size += list_sizes[i];
+    }
+
+    free(docs);
+    free(list_sizes);
+    free(lists);
+    return 1;
+}
+
+/*
+ * Packs the tail of a document list (as the last block), so the list consists of packed blocks only
+ */
+void seal_postings(indexed_word_p w) {
+    if (w->nr_tail) {
+        pack_block(w, w->tail, w->nr_tail);
+        w->nr_tail = 0;
+    }
+}
+
+/*
+ * Releases the document list of a word
+ */
+void free_postings(indexed_word_p w) {
+    // packed blocks in the mapped index file are not owned by the word
+    if (w->max_blocks) {
+        free(w->blocks);
+        free(w->data);
+        free(w->block_positions);
+    }
+
+    if (w->max_positions) {
+        free(w->positions);
+    }
+
+    free(w->tail);
+}
+
+/*
+ * Copies the packed blocks and the position lists of a word to the heap if they are still in the mapped index file,
+ * so they can be modified; a list without positions gets an empty entry for each document
+ */
+void own_postings(indexed_word_p w) {
+    if (!w->max_blocks && w->nr_blocks) {
+        posting_block_p blocks = (posting_block_p) malloc(sizeof(posting_block_t) * w->nr_blocks);
+        memcpy(blocks, w->blocks, sizeof(posting_block_t) * w->nr_blocks);
+
+        unsigned int *data = (unsigned int *) malloc(sizeof(unsigned int) * (w->data_size + 1));
+        memcpy(data, w->data, sizeof(unsigned int) * w->data_size);
+
+        // the empty entries take a byte per document, all blocks but the last one are full
+        int *block_positions = (int *) malloc(sizeof(int) * w->nr_blocks);
+        int b;
+        for (b = 0; b < w->nr_blocks; b++) {
+            block_positions[b] = w->positions ? w->block_positions[b] : b * POSTING_BLOCK_SIZE;
+        }
+
+        w->blocks = blocks;
+        w->max_blocks = w->nr_blocks;
+        w->data = data;
+        w->max_data = w->data_size + 1;
+        w->block_positions = block_positions;
+    }
+
+    if (!w->max_positions) {
+        unsigned char *positions = (unsigned char *) malloc(w->positions ? w->positions_size + 1 : w->nr_docs + 1);
+        if (w->positions) {
+            memcpy(positions, w->positions, w->positions_size);
+        } else {
+            memset(positions, 0, w->nr_docs);
+            w->positions_size = w->nr_docs;
+            w->tail_positions = w->nr_docs - w->nr_tail;
+        }
+
+        w->positions = positions;
+        w->max_positions = w->positions_size + 1;
+    }
+}
+
+/*
+ * Gives a word a copy of the document list of another word (in the heap, even if the other list is mapped)
+ */
+void copy_postings(indexed_word_p w, indexed_word_p other) {
+    w->nr_docs = other->nr_docs;
+    w->nr_blocks = 0;
+    w->max_blocks = 0;
+    w->data_size = 0;
+    w->max_data = 0;
+    w->blocks = NULL;
+    w->data = NULL;
+    w->block_positions = NULL;
+
+    if (other->nr_blocks) {
+        // the blocks are owned by the word as soon as there are any (max_blocks > 0)
+        w->blocks = other->blocks;
+        w->data = other->data;
+        w->block_positions = other->block_positions;
+        w->nr_blocks = other->nr_blocks;
+        w->data_size = other->data_size;
+    }
+
+    w->nr_tail = other->nr_tail;
+    w->max_tail = other->nr_tail;
+    w->tail = (doc_p) malloc(sizeof(doc_t) * (w->nr_tail + 1));
+    memcpy(w->tail, other->tail, sizeof(doc_t) * w->nr_tail);
+
+    // the position lists are copied with the blocks
+    w->positions = other->positions;
+    w->positions_size = other->positions_size;
+    w->max_positions = 0;
+    w->tail_positions = other->tail_positions;
+    own_postings(w);
+}
+
+/*
+ * Positions a cursor at the first document in the document list of a word
+ */
+void open_cursor(posting_cursor_p c, indexed_word_p w) {
+    c->word = w;
+    load_block(c, 0);
+}
+
+/*
+ * Returns the id of the document at the cursor, INT_MAX if the end of the list is reached
+ */
+int cursor_doc(posting_cursor_p c) {
+    return c->pos < c->nr_docs ? c->docs[c->pos].id : INT_MAX;
+}
+
+/*
+ * Returns the number of occurances of the word in the document at the cursor
+ */
+int cursor_count(posting_cursor_p c) {
+    return c->docs[c->pos].count;
+}
+
+/*
+ * Returns the encoded position list of the document at the cursor (NULL and size 0 = no positions recorded),
+ * valid until the document list changes
+ *  size: returns the number of bytes of the list
+ */
+unsigned char *cursor_position_list(posting_cursor_p c, int *size) {
+    indexed_word_p w = c->word;
+    *size = 0;
+    if (!w->positions) {
+        return NULL;
+    }
+
+    // the entries of the block are skipped up to the document, from the one looked up last on
+    if (c->list_doc < 0 || c->list_doc > c->pos) {
+        c->list_doc = 0;
+        c->list_offset = c->block < w->nr_blocks ? w->block_positions[c->block] : w->tail_positions;
+    }
+
+    unsigned char *p = w->positions + c->list_offset;
+    while (c->list_doc < c->pos) {
+        int n = decode_number(&p);
+        p += n;
+        c->list_doc++;
+    }
+    c->list_offset = p - w->positions;
+
+    *size = decode_number(&p);
+    return *size ? p : NULL;
+}
+
+/*
+ * Decodes the positions of the word in the document at the cursor, returns their number (0 = not recorded)
+ *  positions: room for cursor_count positions
+ */
+int cursor_positions(posting_cursor_p c, int *positions) {
+    int size;
+    unsigned char *p = cursor_position_list(c, &size);
+    if (!size) {
+        return 0;
+    }
+
+    unsigned char *end = p + size;
+    int n = 0, pos = 0, count = cursor_count(c);
+    while (p < end && n < count) {
+        pos += decode_number(&p);
+        positions[n++] = pos;
+    }
+
+    return n;
+}
+
+/*
+ * Moves a cursor to the next document
+ */
+void cursor_next(posting_cursor_p c) {
+    c->pos++;
+
+    if (c->pos == c->nr_docs && c->block < c->word->nr_blocks) {
+        load_block(c, c->block + 1);
+    }
+}
+
+/*
+ * Returns the document of a cursor (INT_MAX = end of the list) and moves the cursor to the next document
+ *  count: returns the number of occurances of the word in the document
+ *  list: returns the encoded position list of the document (as cursor_position_list)
+ *  size: returns the number of bytes of the position list
+ */
+int cursor_read(posting_cursor_p c, int *count, unsigned char **list, int *size) {
+    int doc = cursor_doc(c);
+    if (doc != INT_MAX) {
+        *count = cursor_count(c);
+        *list = cursor_position_list(c, size);
+        cursor_next(c);
+    }
+
+    return doc;
+}
+
+/*
+ * Moves a cursor forward to the first document with an id >= doc_id, returns the id of that document
+ */
+int cursor_seek(posting_cursor_p c, int doc_id) {
+    if (cursor_doc(c) >= doc_id) {
+        return cursor_doc(c);
+    }
+
+    indexed_word_p w = c->word;
+    if (c->docs[c->nr_docs - 1].id < doc_id) {
+        if (c->block == w->nr_blocks) {
+            // end of the tail
+            c->pos = c->nr_docs;
+            return INT_MAX;
+        }
+
+        // document is beyond the current block: find the first following block which reaches it in the skip list
+        int min = c->block + 1, max = w->nr_blocks;
+        while (min < max) {
+            int middle = (min + max) / 2;
+            if (w->blocks[middle].last_id < doc_id) {
+                min = middle + 1;
+            } else {
+                max = middle;
+            }
+        }
+
+        // no block left => tail
+        load_block(c, min);
+        if (!c->nr_docs || c->docs[c->nr_docs - 1].id < doc_id) {
+            c->pos = c->nr_docs;
+            return INT_MAX;
+        }
+    }
+
+    // binary search the block
+    int min = c->pos, max = c->nr_docs - 1;
+    while (min < max) {
+        int middle = (min + max) / 2;
+        if (c->docs[middle].id < doc_id) {
+            min = middle + 1;
+        } else {
+            max = middle;
+        }
+    }
+
+    c->pos = min;
+    return cursor_doc(c);
+}
+
+/*
+ * Decodes a block of a document list into the cursor (block nr_blocks is the tail)
+ */
+void load_block(posting_cursor_p c, int block) {
+    indexed_word_p w = c->word;
+
+    c->block = block;
+    c->pos = 0;
+    c->list_doc = -1;
+
+    if (block < w->nr_blocks) {
+        c->nr_docs = unpack_block(w, block, c->docs);
+    } else {
+        c->nr_docs = w->nr_tail;
+        if (w->nr_tail) {
+            memcpy(c->docs, w->tail, sizeof(doc_t) * w->nr_tail);
+        }
+    }
+}
+
+/*
+ * Packs a list of documents into a new block at the end of the document list of a word
+ */
+void pack_block(indexed_word_p w, doc_p docs, int nr_docs) {
+    own_postings(w);
+
+    // block list full => double the size
+    if (w->nr_blocks == w->max_blocks) {
+        w->max_blocks = w->max_blocks ? w->max_blocks * 2 : 4;
+        w->blocks = (posting_block_p) realloc(w->blocks, sizeof(posting_block_t) * w->max_blocks);
+        w->block_positions = (int *) realloc(w->block_positions, sizeof(int) * w->max_blocks);
+    }
+
+    // the documents packed are the ones of the tail
+    w->block_positions[w->nr_blocks] = w->tail_positions;
+    w->tail_positions = w->positions_size;
+
+    unsigned int data[2 * POSTING_BLOCK_SIZE];
+    posting_block_p b = &w->blocks[w->nr_blocks];
+    int size = pack_documents(docs, nr_docs, w->nr_blocks ? w->blocks[w->nr_blocks - 1].last_id : -1, b, data);
+    b->offset = w->data_size;
+    w->nr_blocks++;
+
+    if (w->data_size + size > w->max_data) {
+        while (w->data_size + size > w->max_data) {
+            w->max_data = w->max_data ? w->max_data * 2 : 64;
+        }
+        w->data = (unsigned int *) realloc(w->data, sizeof(unsigned int) * w->max_data);
+    }
+
+    memcpy(&w->data[b->offset], data, sizeof(unsigned int) * size);
+    w->data_size += size;
+}
+
+/*
+ * Packs a list of documents into a block (all fields but the offset of its data),
+ * returns the number of 32 bit words of the data
+ *  prev: id of the last document of the previous block (-1 = first block)
+ *  data: returns the packed data, room for 2 * POSTING_BLOCK_SIZE words
+ */
+int pack_documents(doc_p docs, int nr_docs, int prev, posting_block_p b, unsigned int *data) {
+    unsigned int gaps[POSTING_BLOCK_SIZE], counts[POSTING_BLOCK_SIZE];
+    unsigned int max_gap = 0, max_count = 0;
+
+    int i;
+    for (i = 0; i < nr_docs; i++) {
+        gaps[i] = docs[i].id - prev - 1;
+        counts[i] = docs[i].count - 1;
+        prev = docs[i].id;
+
+        max_gap |= gaps[i];
+        max_count |= counts[i];
+    }
+
+    b->last_id = prev;
+    b->nr_docs = nr_docs;
+    b->id_bits = bits_needed(max_gap);
+    b->count_bits = bits_needed(max_count);
+    b->reserved = 0;
+
+    pack_bits(data, gaps, nr_docs, b->id_bits);
+    pack_bits(&data[packed_size(nr_docs, b->id_bits)], counts, nr_docs, b->count_bits);
+    return packed_size(nr_docs, b->id_bits) + packed_size(nr_docs, b->count_bits);
+}
+
+/*
+ * Decodes a packed block of a document list, returns the number of documents in the block
+ */
+int unpack_block(indexed_word_p w, int block, doc_p docs) {
+    posting_block_p b = &w->blocks[block];
+    unsigned int gaps[POSTING_BLOCK_SIZE], counts[POSTING_BLOCK_SIZE];
+
+    unpack_bits(&w->data[b->offset], gaps, b->nr_docs, b->id_bits);
+    unpack_bits(&w->data[b->offset + packed_size(b->nr_docs, b->id_bits)], counts, b->nr_docs, b->count_bits);
+
+    int i, prev = block ? w->blocks[block - 1].last_id : -1;
+    for (i = 0; i < b->nr_docs; i++) {
+        prev += gaps[i] + 1;
+        docs[i].id = prev;
+        docs[i].count = counts[i] + 1;
+    }
+
+    return b->nr_docs;
+}
+
+/*
+ * Packs values with the given number of bits each into consecutive 32 bit words
+ */
+void pack_bits(unsigned int *data, unsigned int *values, int nr_values, int bits) {
+    unsigned long long buffer = 0;
+    int i, buffered = 0;
+
+    for (i = 0; i < nr_values; i++) {
+        buffer |= (unsigned long long) values[i] << buffered;
+        buffered += bits;
+
+        if (buffered >= 32) {
+            *data++ = (unsigned int) buffer;
+            buffer >>= 32;
+            buffered -= 32;
+        }
+    }
+
+    if (buffered) {
+        *data = (unsigned int) buffer;
+    }
+}
+
+/*
+ * Unpacks values with the given number of bits each from consecutive 32 bit words
+ */
+void unpack_bits(unsigned int *data, unsigned int *values, int nr_values, int bits) {
+    unsigned long long mask = (1ULL << bits) - 1;
+    unsigned long long buffer = 0;
+    int i, buffered = 0;
+
+    for (i = 0; i < nr_values; i++) {
+        if (buffered < bits) {
+            buffer |= (unsigned long long) *data++ << buffered;
+            buffered += 32;
+        }
+
+        values[i] = (unsigned int) (buffer & mask);
+        buffer >>= bits;
+        buffered -= bits;
+    }
+}
+
+/*
+ * Returns the number of bits needed to store a value
+ */
+int bits_needed(unsigned int max) {
+    int bits = 0;
+    while (max) {
+        bits++;
+        max >>= 1;
+    }
+
+    return bits;
+}
+
+/*
+ * Returns the number of 32 bit words taken by packed values
+ */
+int packed_size(int nr_values, int bits) {
+    return (nr_values * bits + 31) / 32;
+}
+
+/*
+ * Makes room for size more bytes of position lists of a word
+ */
+void reserve_positions(indexed_word_p w, int size) {
+    own_postings(w);
+
+    if (w->positions_size + size > w->max_positions) {
+        while (w->positions_size + size > w->max_positions) {
+            w->max_positions = w->max_positions * 2;
+        }
+        w->positions = (unsigned char *) realloc(w->positions, w->max_positions);
+    }
+}
+
+/*
+ * Writes a number in groups of 7 bits, lowest first, the highest bit of each byte tells if more follow,
+ * returns the number of bytes written
+ */
+int encode_number(unsigned char *p, unsigned int n) {
+    int size = 1;
+    while (n >= 0x80) {
+        *p++ = (n & 0x7f) | 0x80;
+        n >>= 7;
+        size++;
+    }
+
+    *p = n;
+    return size;
+}
+
+/*
+ * Reads a number written by encode_number and moves the pointer behind it
+ */
+unsigned int decode_number(unsigned char **p) {
+    unsigned int n = 0;
+    int shift = 0;
+    unsigned char *q = *p;
+    while (*q & 0x80) {
+        n |= (unsigned int) (*q++ & 0x7f) << shift;
+        shift += 7;
+    }
+    n |= (unsigned int) *q++ << shift;
+
+    *p = q;
+    return n;
+}
+
+/*
+ * Returns the number of bytes encode_number takes for a number
+ */
+int number_size(unsigned int n) {
+    int size = 1;
+    while (n >= 0x80) {
+        n >>= 7;
+        size++;
+    }
+
+    return size;
+}
@@ -0,0 +1,21 @@
+int add_posting(indexed_word_p w, int doc_id, int count);
+void set_positions(indexed_word_p w, int *positions, int nr_positions);
+void set_position_list(indexed_word_p w, unsigned char *list, int size);
+unsigned char *last_position_list(indexed_word_p w, int *size);
+void append_postings(indexed_word_p w, indexed_word_p other);
+int remove_posting(indexed_word_p w, int doc_id);
+void seal_postings(indexed_word_p w);
+int pack_documents(doc_p docs, int nr_docs, int prev, posting_block_p b, unsigned int *data);
+void free_postings(indexed_word_p w);
+void own_postings(indexed_word_p w);
+void copy_postings(indexed_word_p w, indexed_word_p other);
+void open_cursor(posting_cursor_p c, indexed_word_p w);
+int cursor_doc(posting_cursor_p c);
+int cursor_count(posting_cursor_p c);
+unsigned char *cursor_position_list(posting_cursor_p c, int *size);
+int cursor_positions(posting_cursor_p c, int *positions);
+void cursor_next(posting_cursor_p c);
+int cursor_read(posting_cursor_p c, int *count, unsigned char **list, int *size);
+int cursor_seek(posting_cursor_p c, int doc_id);
+int encode_number(unsigned char *p, unsigned int n);
+unsigned int decode_number(unsigned char **p);
@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "index.h"
+#include "vocab.h"
+#include "postings.h"
+#include "stemcache.h"
+#include "snapshots.h"
+#include "rebuild.h"
+
+// number of chunks of documents per thread, threads done with short documents take over the remaining chunks
+#define CHUNKS_PER_THREAD 8
+
+typedef struct rebuild_chunk {
+    int first;                  // id of the first document of the chunk
+    int last;                   // id of the first document after the chunk
+    index_t words;              // words of the documents in the chunk (shares the list of documents with the index)
+    int done;                   // 1 = all documents of the chunk are parsed
+} rebuild_chunk_t, *rebuild_chunk_p;
+
+typedef struct rebuild {
+    index_p index;              // index the documents are added to
+    rebuild_chunk_p chunks;     // consecutive ranges of document ids, parsed independently
+    int nr_chunks;              // number of chunks
+    int next_chunk;             // next chunk to be parsed by a thread
+    pthread_mutex_t lock;       // protects next_chunk and the done flags of the chunks
+    pthread_cond_t chunk_done;  // signalled when a chunk is parsed
+} rebuild_t, *rebuild_p;
+
+void *parse_chunks(void *arg);
+void merge_chunk(index_p index, rebuild_chunk_p chunk);
+
+/*
+ * Parses the documents with ids from first to last - 1 and adds their words to the index
+ * the index mustn't contain words of these or later documents yet
+ *  nr_threads: number of threads parsing documents (0 = one per processor)
+ * the result doesn't depend on the number of threads
+ */
+void parse_documents(index_p index, int first, int last, int nr_threads) {
+    if (nr_threads <= 0) {
+        nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    int nr_chunks = nr_threads > 1 ? nr_threads * CHUNKS_PER_THREAD : 1;
+    if (nr_chunks > last - first) {
+        nr_chunks = last - first;
+    }
+
+    if (nr_chunks <= 1) {
+        // nothing to share: parse the documents one after another
+        int i;
+        for (i = first; i < last; i++) {
+            if (get_document(index, i)->name) {
+                change_document(index, i)->nr_words = 0;
+                parse_file_for_index(index, i, NULL);
+            }
+        }
+
+        return;
+    }
+
+    if (nr_threads > nr_chunks) {
+        nr_threads = nr_chunks;
+    }
+
+    rebuild_t rebuild;
+    rebuild.index = index;
+    rebuild.nr_chunks = nr_chunks;
+    rebuild.next_chunk = 0;
+    rebuild.chunks = (rebuild_chunk_p) malloc(sizeof(rebuild_chunk_t) * nr_chunks);
+    pthread_mutex_init(&rebuild.lock, NULL);
+    pthread_cond_init(&rebuild.chunk_done, NULL);
+
+    int c;
+    for (c = 0; c < nr_chunks; c++) {
+        rebuild_chunk_p chunk = &rebuild.chunks[c];
+        chunk->first = first + (long) (last - first) * c / nr_chunks;
+        chunk->last = first + (long) (last - first) * (c + 1) / nr_chunks;
+        chunk->done = 0;
+    }
+
+    pthread_t *threads = (pthread_t *) malloc(sizeof(pthread_t) * nr_threads);
+    int i, nr_started = 0;
+    for (i = 0; i < nr_threads; i++) {
+        if (!pthread_create(&threads[nr_started], NULL, parse_chunks, &rebuild)) {
+            nr_started++;
+        }
+    }
+
+    if (!nr_started) {
+        // no threads available: parse all chunks in this thread
+        parse_chunks(&rebuild);
+    }
+
+    // merge the chunks in the order of their documents while the threads parse the following ones
+    for (c = 0; c < nr_chunks; c++) {
+        pthread_mutex_lock(&rebuild.lock);
+        while (!rebuild.chunks[c].done) {
+            pthread_cond_wait(&rebuild.chunk_done, &rebuild.lock);
+        }
+        pthread_mutex_unlock(&rebuild.lock);
+
+        merge_chunk(index, &rebuild.chunks[c]);
+    }
+
+    for (i = 0; i < nr_started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    free(threads);
+    free(rebuild.chunks);
+    pthread_mutex_destroy(&rebuild.lock);
+    pthread_cond_destroy(&rebuild.chunk_done);
+}
+
+/*
+ * Thread parsing the next unparsed chunk of documents until all chunks are taken
+ */
+void *parse_chunks(void *arg) {
+    rebuild_p rebuild = (rebuild_p) arg;
+    index_p index = rebuild->index;
+
+    // each thread stems with a cache of its own
+    stem_cache_p cache = index->stem_cache ? new_stem_cache() : NULL;
+
+    for (;;) {
+        pthread_mutex_lock(&rebuild->lock);
+        int c = rebuild->next_chunk++;
+        pthread_mutex_unlock(&rebuild->lock);
+
+        if (c >= rebuild->nr_chunks) {
+            break;
+        }
+
+        // the words of the chunk go into a partial index of their own,
+        // the threads only write the word counts of their own documents to the shared list of documents
+        rebuild_chunk_p chunk = &rebuild->chunks[c];
+        init_words(&chunk->words);
+        chunk->words.documents = index->documents;
+        chunk->words.document_stamps = NULL;
+        chunk->words.nr_snapshots = 0;
+        chunk->words.nr_doc_ids = index->nr_doc_ids;
+        chunk->words.stem_cache = cache;
+        chunk->words.stopwords = index->stopwords;
+        chunk->words.positions = index->positions;
+
+        int i;
+        for (i = chunk->first; i < chunk->last; i++) {
+            if (get_document(index, i)->name) {
+                change_document(index, i)->nr_words = 0;
+                parse_file_for_index(&chunk->words, i, NULL);
+            }
+        }
+
+        pthread_mutex_lock(&rebuild->lock);
+        chunk->done = 1;
+        pthread_cond_broadcast(&rebuild->chunk_done);
+        pthread_mutex_unlock(&rebuild->lock);
+    }
+
+    if (cache) {
+        pthread_mutex_lock(&rebuild->lock);
+        index->stem_cache->hits += cache->hits;
+        index->stem_cache->misses += cache->misses;
+        pthread_mutex_unlock(&rebuild->lock);
+
+        free_stem_cache(cache);
+    }
+
+    return NULL;
+}
+
+/*
+ * Adds the words of a parsed chunk to the index and releases the partial index of the chunk
+ * all documents of the chunk have higher ids than the documents merged before
+ */
+void merge_chunk(index_p index, rebuild_chunk_p chunk) {
+    int k;
+    for (k = 0; k < chunk->words.nr_words; k++) {
+        indexed_word_p part = &chunk->words.words[k];
+
+        int wid = find_or_add_word(index, part->stem);
+        indexed_word_p w = &index->words[wid];
+
+        if (!w->nr_docs) {
+            // first occurance of the word: take over the document list of the chunk
+            char *stem = w->stem;
+            *w = *part;
+            w->stem = stem;
+            w->stamp = index->nr_snapshots;
+
+            part->max_blocks = 0;
+            part->max_positions = 0;
+            part->tail = NULL;
+        } else {
+            own_word(index, w);
+            append_postings(w, part);
+        }
+    }
+
+    clear_words(&chunk->words);
+}
@@ -0,0 +1 @@
+void parse_documents(index_p index, int first, int last, int nr_threads);
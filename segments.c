@@ -0,0 +1,743 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glob.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "index.h"
+#include "util.h"
+#include "vocab.h"
+#include "postings.h"
+#include "indexfile.h"
+#include "journal.h"
+#include "builder.h"
+#include "segments.h"
+#include "snapshots.h"
+#include "norms.h"
+#include "stats.h"
+
+#define INDEX_FILE "index.bin"
+#define MANIFEST_FILE "index.segments"
+#define JOURNAL_FILE "index.log"
+
+#define MANIFEST_MAGIC "I2ASEGMT"
+#define MANIFEST_VERSION 1
+#define MANIFEST_BYTE_ORDER 0x01020304
+
+// segments are merged MERGE_FACTOR at a time, once that many neighbouring segments are in the same tier
+#define MERGE_FACTOR 4
+
+// segment files up to this size are in the lowest tier, each tier above holds files MERGE_FACTOR times larger
+#define MIN_TIER_SIZE (1L << 20)
+
+/*
+ * Layout of the manifest (all numbers in host byte order):
+ *  header
+ *  segments            nr_segments x manifest_segment_t, ordered by document id
+ *  removed             nr_removed x int, ids of removed documents whose words are still in the segment files
+ */
+typedef struct manifest_header {
+    char magic[8];              // MANIFEST_MAGIC
+    int version;                // MANIFEST_VERSION
+    int byte_order;             // MANIFEST_BYTE_ORDER as written by the host
+    int generation;             // generation of the index (the journal continues it)
+    int nr_segments;            // number of segments
+    int nr_removed;             // number of removed documents
+    int next_segment;           // number of the next segment file
+} manifest_header_t, *manifest_header_p;
+
+typedef struct manifest_segment {
+    int number;                 // number of the segment file
+    int first_doc;              // id of the first document of the segment
+    int last_doc;               // id after the last document of the segment
+    int reserved;
+} manifest_segment_t, *manifest_segment_p;
+
+typedef struct segment_merge {
+    pthread_t thread;           // thread writing the merged segment
+    int first;                  // position of the first segment merged in the list of segments
+    int nr_segments;            // number of segments merged
+    int first_doc;              // id of the first document of these segments
+    int last_doc;               // id after the last document of these segments
+    char **files;               // files of these segments
+    int number;                 // number of the merged segment file
+    char *file;                 // merged segment file
+    char *removed;              // per document: 1 = removed before the merge started (left out of the merged segment)
+    long memory_budget;         // memory the runs may use while merging (the memory budget of the index)
+    int ok;                     // 1 = merged segment written
+    int done;                   // 1 = thread finished
+    pthread_mutex_t lock;       // protects done
+} segment_merge_t, *segment_merge_p;
+
+char *segment_file(int number);
+index_segment_p add_segment(index_p index, int number, int first_doc, int last_doc);
+int write_manifest(index_p index);
+void remove_unused_segments(index_p index);
+int segment_tier(index_segment_p segment);
+void start_segment_merge(index_p index);
+void *run_segment_merge(void *arg);
+void finish_segment_merge(index_p index);
+void free_segment_merge(segment_merge_p m);
+
+/*
+ * The words of the index are kept in segments: immutable index files, each with the documents of a range of ids.
+ * New documents go to the words in memory (and the journal) until these are written to a segment of their own,
+ * so adding documents never rewrites the words of older ones. Segments aren't modified in memory either, snapshots
+ * of the index share them (see snapshots.c): a removed document stays in its segment, it is just skipped and the
+ * document frequencies of its words are corrected per segment. The manifest names the segments and lists the
+ * documents removed from them; it is replaced at once whenever they change.
+ * Once MERGE_FACTOR neighbouring segments are in the same tier (their files have about the same size), a thread
+ * merges them into one in the background, leaving out removed documents. Merging doesn't change the ids of the
+ * documents, so the words in memory and the journal stay valid meanwhile. Searches and the TF-IDF weights take
+ * the words of all segments together.
+ */
+
+/*
+ * Loads the segments listed in the manifest (or the index file of a version without segments) and replays the journal
+ * returns 1 on success, 0 if there is no index to load
+ */
+int load_segments(index_p index) {
+    FILE *f = fopen(MANIFEST_FILE, "rb");
+    int ok = 1, i;
+
+    if (!f) {
+        // index written before there were segments: a single file with all documents
+        index_segment_p segment = add_segment(index, 0, 0, 0);
+        ok = map_index_file(index, &segment->words, INDEX_FILE);
+        segment->last_doc = index->nr_doc_ids;
+        index->generation = segment->words.generation;
+        index->next_segment = 1;
+    } else {
+        manifest_header_t header;
+        ok = fread(&header, sizeof(manifest_header_t), 1, f) == 1
+            && !memcmp(header.magic, MANIFEST_MAGIC, sizeof(header.magic)) && header.version == MANIFEST_VERSION
+            && header.byte_order == MANIFEST_BYTE_ORDER && header.nr_segments > 0 && header.nr_removed >= 0;
+
+        for (i = 0; ok && i < header.nr_segments; i++) {
+            manifest_segment_t entry;
+            ok = fread(&entry, sizeof(manifest_segment_t), 1, f) == 1;
+            if (ok) {
+                index_segment_p segment = add_segment(index, entry.number, entry.first_doc, entry.last_doc);
+                char *file = segment_file(entry.number);
+                ok = map_index_file(index, &segment->words, file);
+                free(file);
+            }
+        }
+
+        // documents removed after their segment was written
+        for (i = 0; ok && i < header.nr_removed; i++) {
+            int doc_id;
+            ok = fread(&doc_id, sizeof(int), 1, f) == 1;
+            if (ok && doc_id >= 0 && doc_id < index->nr_doc_ids && get_document(index, doc_id)->name) {
+                delete_document(index, doc_id);
+            }
+        }
+
+        fclose(f);
+
+        if (!ok) {
+            printf("Error: %s is not a valid manifest.\n", MANIFEST_FILE);
+        } else {
+            index->generation = header.generation;
+            index->next_segment = header.next_segment;
+        }
+    }
+
+    if (!ok) {
+        // start over with an empty index (keeping the stem cache)
+        stem_cache_p stem_cache = index->stem_cache;
+        index->stem_cache = NULL;
+        clear_index(index);
+        init_index(index);
+        index->stem_cache = stem_cache;
+        return 0;
+    }
+
+    // the index keeps the stopwords of the newest segment
+    index_segment_p last = &index->segments[index->nr_segments - 1];
+    index->stopwords = last->words.stopwords;
+    last->words.stopwords = NULL;
+
+    // apply the changes made since the last segment was written
+    open_journal(index, JOURNAL_FILE);
+    return 1;
+}
+
+/*
+ * Writes the words in memory to a new segment with the documents from the end of the last segment on,
+ * then starts a new journal
+ *  builder: the words of the segment are merged from the runs of the builder instead (NULL = none),
+ *           the runs have to include the words in memory
+ */
+void flush_segment(index_p index, index_builder_p builder) {
+    int first = index->nr_segments ? index->segments[index->nr_segments - 1].last_doc : 0;
+    int last = index->nr_doc_ids;
+
+    index->generation++;
+
+    // the sums of the documents lagging behind the df of their words catch up once per segment
+    settle_norms(index);
+
+    // the first segment is written even without documents, it keeps the stopwords
+    if (last > first || !index->nr_segments) {
+        int number = index->next_segment++;
+        char *file = segment_file(number);
+
+        if (!write_index_file(index, file, builder, first, last)) {
+            index->generation--;
+            free(file);
+            return;
+        }
+
+        index_segment_p segment = add_segment(index, number, first, last);
+        if (!map_index_file(index, &segment->words, file)) {
+            printf("Error: couldn't map %s.\nChanges to the index won't be saved!\n", file);
+            clear_index(&segment->words);
+            index->nr_segments--;
+            index->generation--;
+            close_journal(index);
+            free(file);
+            return;
+        }
+
+        free(file);
+
+        // the words in memory are part of the segment now
+        retire_words(index);
+        init_words(index);
+    }
+
+    // the journal of the previous generation stays valid until the manifest lists the new segment
+    if (!write_manifest(index)) {
+        return;
+    }
+
+    reset_journal(index, JOURNAL_FILE);
+    remove_unused_segments(index);
+    check_merge(index);
+}
+
+/*
+ * Releases all segments (a running merge is finished first), the names of the documents are copied from the
+ * segment files; the files are deleted once the manifest doesn't list them anymore
+ */
+void clear_segments(index_p index) {
+    wait_for_merge(index);
+
+    int i;
+    for (i = 0; i < index->nr_doc_ids; i++) {
+        char *name = get_document(index, i)->name;
+        if (name && is_mapped(index, name)) {
+            change_document(index, i)->name = (char *) malloc(strlen(name) + 1);
+            memcpy(get_document(index, i)->name, name, strlen(name) + 1);
+        }
+    }
+
+    // snapshots may still search the segments
+    for (i = 0; i < index->nr_segments; i++) {
+        retire_segment(index, &index->segments[i]);
+    }
+
+    free(index->segments);
+    index->segments = NULL;
+    index->nr_segments = 0;
+    index->nr_removed = 0;
+}
+
+/*
+ * Returns the segment containing the words of a document, NULL if they are in memory
+ */
+index_segment_p document_segment(index_p index, int doc_id) {
+    // binary search the segments for the first one ending after the document
+    int min = 0, max = index->nr_segments;
+    while (min < max) {
+        int middle = (min + max) / 2;
+        if (index->segments[middle].last_doc <= doc_id) {
+            min = middle + 1;
+        } else {
+            max = middle;
+        }
+    }
+
+    if (min < index->nr_segments && index->segments[min].first_doc <= doc_id) {
+        return &index->segments[min];
+    }
+
+    return NULL;
+}
+
+/*
+ * Takes a removed document out of the document frequencies of the words of its segment (the segment file
+ * keeps its words), returns the number of words of the document
+ *  words: returns the indexes of these words in the segment if not NULL (to be freed by the caller)
+ */
+int remove_segment_document(index_p index, index_segment_p segment, int doc_id, int **words) {
+    int *doc_words = NULL;
+    int nr_doc_words = read_document_words(&segment->words, doc_id, &doc_words);
+
+    if (nr_doc_words < 0) {
+        // older segment files don't record the words of their documents, look for the document in every list
+        int max_doc_words = 0, wid;
+        nr_doc_words = 0;
+        for (wid = 0; wid < segment->words.nr_words; wid++) {
+            posting_cursor_t c;
+            open_cursor(&c, &segment->words.words[wid]);
+            if (cursor_seek(&c, doc_id) != doc_id) {
+                continue;
+            }
+
+            if (nr_doc_words == max_doc_words) {
+                max_doc_words = max_doc_words ? max_doc_words * 2 : 64;
+                doc_words = (int *) realloc(doc_words, sizeof(int) * max_doc_words);
+            }
+
+            doc_words[nr_doc_words++] = wid;
+        }
+    }
+
+    int k;
+    for (k = 0; k < nr_doc_words; k++) {
+        (*change_removed_df(index, segment, doc_words[k]))++;
+    }
+
+    if (words) {
+        *words = doc_words;
+    } else {
+        free(doc_words);
+    }
+
+    return nr_doc_words;
+}
+
+/*
+ * Returns the number of removed documents containing a word of a segment to be changed, the pages of the counts
+ * are copied first if snapshots share them (pages are added as needed)
+ *  wid: index of the word in the segment
+ */
+int *change_removed_df(index_p index, index_segment_p segment, int wid) {
+    int nr_pages = segment->words.nr_words / REMOVED_DF_PAGE_SIZE + 1;
+    if (!segment->removed_df) {
+        segment->removed_df = (int **) calloc(nr_pages, sizeof(int *));
+        segment->removed_df_stamps = (int *) malloc(sizeof(int) * nr_pages);
+        segment->removed_df_stamp = index->nr_snapshots;
+    }
+
+    segment->removed_df = (int **) own_memory(index, segment->removed_df, &segment->removed_df_stamp,
+        sizeof(int *) * nr_pages);
+
+    int page = wid / REMOVED_DF_PAGE_SIZE;
+    if (!segment->removed_df[page]) {
+        segment->removed_df[page] = (int *) calloc(REMOVED_DF_PAGE_SIZE, sizeof(int));
+        segment->removed_df_stamps[page] = index->nr_snapshots;
+    }
+
+    segment->removed_df[page] = (int *) own_memory(index, segment->removed_df[page], &segment->removed_df_stamps[page],
+        sizeof(int) * REMOVED_DF_PAGE_SIZE);
+
+    return &segment->removed_df[page][wid % REMOVED_DF_PAGE_SIZE];
+}
+
+/*
+ * Releases the counts of removed documents of a segment
+ */
+void free_removed_df(index_segment_p segment) {
+    if (!segment->removed_df) {
+        return;
+    }
+
+    int p;
+    for (p = 0; p <= segment->words.nr_words / REMOVED_DF_PAGE_SIZE; p++) {
+        free(segment->removed_df[p]);
+    }
+
+    free(segment->removed_df);
+    free(segment->removed_df_stamps);
+}
+
+/*
+ * Remembers a document removed from a segment, the segment file still contains its words
+ */
+void add_removed(index_p index, int doc_id) {
+    // list full => double the size
+    if (index->nr_removed == index->max_removed) {
+        index->max_removed = index->max_removed ? index->max_removed * 2 : 64;
+        index->removed = (int *) realloc(index->removed, sizeof(int) * index->max_removed);
+    }
+
+    index->removed[index->nr_removed++] = doc_id;
+}
+
+/*
+ * Returns the number of documents of all segments and of the words in memory containing a word (removed ones don't count)
+ */
+int word_df(index_p index, char *stem) {
+    int df = 0, s;
+    for (s = 0; s <= index->nr_segments; s++) {
+        index_p words = s < index->nr_segments ? &index->segments[s].words : index;
+        int wid = find_word(words, stem);
+        if (wid >= 0) {
+            df += words->words[wid].nr_docs;
+
+            int **removed_df = s < index->nr_segments ? index->segments[s].removed_df : NULL;
+            if (removed_df && removed_df[wid / REMOVED_DF_PAGE_SIZE]) {
+                df -= removed_df[wid / REMOVED_DF_PAGE_SIZE][wid % REMOVED_DF_PAGE_SIZE];
+            }
+        }
+    }
+
+    return df;
+}
+
+/*
+ * Puts a finished background merge into effect and starts the next merge if segments are due to be merged
+ * returns 1 if the segments changed, 0 otherwise
+ */
+int check_merge(index_p index) {
+    int merged = 0;
+    if (index->merge) {
+        pthread_mutex_lock(&index->merge->lock);
+        int done = index->merge->done;
+        pthread_mutex_unlock(&index->merge->lock);
+
+        if (!done) {
+            return 0;
+        }
+
+        finish_segment_merge(index);
+        merged = 1;
+    }
+
+    start_segment_merge(index);
+    return merged;
+}
+
+/*
+ * Waits for a running background merge and puts it into effect
+ */
+void wait_for_merge(index_p index) {
+    if (index->merge) {
+        finish_segment_merge(index);
+    }
+}
+
+/*
+ * Returns the name of a segment file (to be freed by the caller)
+ */
+char *segment_file(int number) {
+    char *file = (char *) malloc(sizeof(INDEX_FILE) + 12);
+    if (number) {
+        sprintf(file, "%s.%d", INDEX_FILE, number);
+    } else {
+        strcpy(file, INDEX_FILE);
+    }
+
+    return file;
+}
+
+/*
+ * Appends an empty segment to the segments of the index
+ */
+index_segment_p add_segment(index_p index, int number, int first_doc, int last_doc) {
+    index->segments = (index_segment_p) realloc(index->segments, sizeof(index_segment_t) * (index->nr_segments + 1));
+
+    index_segment_p segment = &index->segments[index->nr_segments++];
+    segment->number = number;
+    segment->first_doc = first_doc;
+    segment->last_doc = last_doc;
+    segment->removed_df = NULL;
+    segment->removed_df_stamps = NULL;
+    init_index(&segment->words);
+
+    return segment;
+}
+
+/*
+ * Writes the manifest, under a temporary name first so the old one stays valid until the new one is complete
+ * returns 1 on success, 0 otherwise
+ */
+int write_manifest(index_p index) {
+    double start = now_seconds();
+
+    char tmp_file[] = MANIFEST_FILE ".tmp";
+
+    FILE *f = fopen(tmp_file, "wb");
+    if (!f) {
+        printf("Error: couldn't open %s to write.\nChanges to the segments won't be saved!\n", tmp_file);
+        return 0;
+    }
+
+    manifest_header_t header;
+    memset(&header, 0, sizeof(manifest_header_t));
+    memcpy(header.magic, MANIFEST_MAGIC, sizeof(header.magic));
+    header.version = MANIFEST_VERSION;
+    header.byte_order = MANIFEST_BYTE_ORDER;
+    header.generation = index->generation;
+    header.nr_segments = index->nr_segments;
+    header.nr_removed = index->nr_removed;
+    header.next_segment = index->next_segment;
+    fwrite(&header, sizeof(manifest_header_t), 1, f);
+
+    int i;
+    for (i = 0; i < index->nr_segments; i++) {
+        manifest_segment_t entry;
+        entry.number = index->segments[i].number;
+        entry.first_doc = index->segments[i].first_doc;
+        entry.last_doc = index->segments[i].last_doc;
+        entry.reserved = 0;
+        fwrite(&entry, sizeof(manifest_segment_t), 1, f);
+    }
+
+    if (index->nr_removed) {
+        fwrite(index->removed, sizeof(int), index->nr_removed, f);
+    }
+
+    if (fflush(f) || fsync(fileno(f)) || ferror(f)) {
+        printf("Error: couldn't write %s.\nChanges to the segments won't be saved!\n", tmp_file);
+        fclose(f);
+        remove(tmp_file);
+        return 0;
+    }
+
+    count_stat(STAT_BYTES_WRITTEN, ftell(f));
+    fclose(f);
+    count_time(STAT_TIME_PERSIST, start);
+
+    return !rename(tmp_file, MANIFEST_FILE);
+}
+
+/*
+ * Deletes the segment files the manifest doesn't list (merged into others or left over from an interrupted write)
+ */
+void remove_unused_segments(index_p index) {
+    glob_t g;
+    if (glob(INDEX_FILE "*", 0, NULL, &g)) {
+        return;
+    }
+
+    int i, s;
+    for (i = 0; i < g.gl_pathc; i++) {
+        // index.bin is segment 0, index.bin.<n> segment n (temporary files are left alone)
+        char *end = g.gl_pathv[i] + strlen(INDEX_FILE);
+        int number = 0;
+        if (*end) {
+            number = *end == '.' ? strtol(end + 1, &end, 10) : 0;
+            if (*end || number <= 0) {
+                continue;
+            }
+        }
+
+        // the merged segment isn't listed until the merge is put into effect
+        if (index->merge && number == index->merge->number) {
+            continue;
+        }
+
+        for (s = 0; s < index->nr_segments && index->segments[s].number != number; s++);
+        if (s == index->nr_segments) {
+            remove(g.gl_pathv[i]);
+        }
+    }
+
+    globfree(&g);
+}
+
+/*
+ * Returns the tier of a segment: 0 for files up to MIN_TIER_SIZE bytes, one more for each factor MERGE_FACTOR
+ */
+int segment_tier(index_segment_p segment) {
+    int tier = 0;
+    long size = MIN_TIER_SIZE;
+    while (segment->words.map_size > size) {
+        tier++;
+        size *= MERGE_FACTOR;
+    }
+
+    return tier;
+}
+
+/*
+ * Starts merging the newest MERGE_FACTOR neighbouring segments of the same tier in the background, if there are any
+ */
+void start_segment_merge(index_p index) {
+    if (index->merge) {
+        return;
+    }
+
+    int first, k;
+    for (first = index->nr_segments - MERGE_FACTOR; first >= 0; first--) {
+        int tier = segment_tier(&index->segments[first]);
+        for (k = 1; k < MERGE_FACTOR && segment_tier(&index->segments[first + k]) == tier; k++);
+        if (k == MERGE_FACTOR) {
+            break;
+        }
+    }
+
+    if (first < 0) {
+        return;
+    }
+
+    segment_merge_p m = (segment_merge_p) malloc(sizeof(segment_merge_t));
+    m->first = first;
+    m->nr_segments = MERGE_FACTOR;
+    m->first_doc = index->segments[first].first_doc;
+    m->last_doc = index->segments[first + MERGE_FACTOR - 1].last_doc;
+    m->files = (char **) malloc(sizeof(char *) * MERGE_FACTOR);
+    for (k = 0; k < MERGE_FACTOR; k++) {
+        m->files[k] = segment_file(index->segments[first + k].number);
+    }
+    m->number = index->next_segment++;
+    m->file = segment_file(m->number);
+    m->memory_budget = index->memory_budget;
+    m->ok = 0;
+    m->done = 0;
+    pthread_mutex_init(&m->lock, NULL);
+
+    // the documents removed by now are left out, the ones removed while merging are taken out afterwards
+    m->removed = (char *) malloc(m->last_doc - m->first_doc + 1);
+    int d;
+    for (d = m->first_doc; d < m->last_doc; d++) {
+        m->removed[d - m->first_doc] = !get_document(index, d)->name;
+    }
+
+    if (pthread_create(&m->thread, NULL, run_segment_merge, m)) {
+        printf("Error: couldn't start merging segments.\n");
+        free_segment_merge(m);
+        return;
+    }
+
+    index->merge = m;
+}
+
+/*
+ * Writes the merged segment (thread function): the segment files are mapped once more, so the thread
+ * doesn't touch anything the index may change meanwhile
+ */
+void *run_segment_merge(void *arg) {
+    segment_merge_p m = (segment_merge_p) arg;
+    double start = now_seconds();
+
+    // the documents of the segments, with the ids they have in the index
+    index_t merged;
+    init_index(&merged);
+    merged.memory_budget = m->memory_budget;
+
+    index_p segments = (index_p) malloc(sizeof(index_t) * m->nr_segments);
+    int i, ok = 1;
+    for (i = 0; i < m->nr_segments; i++) {
+        init_index(&segments[i]);
+        ok = ok && map_index_file(&merged, &segments[i], m->files[i]);
+    }
+
+    if (ok) {
+        int d;
+        for (d = m->first_doc; d < m->last_doc; d++) {
+            if (m->removed[d - m->first_doc]) {
+                change_document(&merged, d)->name = NULL;
+            }
+        }
+
+        merged.stopwords = segments[m->nr_segments - 1].stopwords;
+        segments[m->nr_segments - 1].stopwords = NULL;
+
+        index_builder_p builder = new_index_builder(&merged);
+        for (i = 0; i < m->nr_segments; i++) {
+            add_words_run(builder, &segments[i]);
+        }
+
+        ok = write_index_file(&merged, m->file, builder, m->first_doc, m->last_doc);
+        free_index_builder(builder);
+    }
+
+    // the names of the documents are in the segment files
+    merged.nr_doc_ids = 0;
+    clear_index(&merged);
+
+    for (i = 0; i < m->nr_segments; i++) {
+        clear_index(&segments[i]);
+    }
+    free(segments);
+
+    count_time(STAT_TIME_MERGE, start);
+
+    pthread_mutex_lock(&m->lock);
+    m->ok = ok;
+    m->done = 1;
+    pthread_mutex_unlock(&m->lock);
+
+    return NULL;
+}
+
+/*
+ * Waits for the background merge and replaces the segments merged by the merged segment
+ */
+void finish_segment_merge(index_p index) {
+    segment_merge_p m = index->merge;
+    pthread_join(m->thread, NULL);
+    index->merge = NULL;
+
+    index_segment_t merged;
+    merged.number = m->number;
+    merged.first_doc = m->first_doc;
+    merged.last_doc = m->last_doc;
+    merged.removed_df = NULL;
+    merged.removed_df_stamps = NULL;
+    init_index(&merged.words);
+
+    if (!m->ok || !map_index_file(index, &merged.words, m->file)) {
+        printf("Error: couldn't merge segments.\n");
+        clear_index(&merged.words);
+        remove(m->file);
+        free_segment_merge(m);
+        return;
+    }
+
+    // documents removed while merging are still in the merged segment
+    int d, i;
+    for (d = m->first_doc; d < m->last_doc; d++) {
+        if (!get_document(index, d)->name && !m->removed[d - m->first_doc]) {
+            remove_segment_document(index, &merged, d, NULL);
+        }
+    }
+
+    // the documents left out don't have to be listed in the manifest anymore
+    int nr_removed = 0;
+    for (i = 0; i < index->nr_removed; i++) {
+        d = index->removed[i];
+        if (d < m->first_doc || d >= m->last_doc || !m->removed[d - m->first_doc]) {
+            index->removed[nr_removed++] = d;
+        }
+    }
+    index->nr_removed = nr_removed;
+
+    // the merged segment takes the place of the segments merged (snapshots may still search them)
+    for (i = 0; i < m->nr_segments; i++) {
+        retire_segment(index, &index->segments[m->first + i]);
+    }
+
+    index->segments[m->first] = merged;
+    memmove(&index->segments[m->first + 1], &index->segments[m->first + m->nr_segments],
+        sizeof(index_segment_t) * (index->nr_segments - m->first - m->nr_segments));
+    index->nr_segments -= m->nr_segments - 1;
+
+    if (write_manifest(index)) {
+        remove_unused_segments(index);
+    }
+
+    free_segment_merge(m);
+}
+
+/*
+ * Releases a merge
+ */
+void free_segment_merge(segment_merge_p m) {
+    int i;
+    for (i = 0; i < m->nr_segments; i++) {
+        free(m->files[i]);
+    }
+
+    free(m->files);
+    free(m->file);
+    free(m->removed);
+    pthread_mutex_destroy(&m->lock);
+    free(m);
+}
@@ -0,0 +1,11 @@
+int load_segments(index_p index);
+void flush_segment(index_p index, index_builder_p builder);
+void clear_segments(index_p index);
+index_segment_p document_segment(index_p index, int doc_id);
+int remove_segment_document(index_p index, index_segment_p segment, int doc_id, int **words);
+int *change_removed_df(index_p index, index_segment_p segment, int wid);
+void free_removed_df(index_segment_p segment);
+void add_removed(index_p index, int doc_id);
+int word_df(index_p index, char *stem);
+int check_merge(index_p index);
+void wait_for_merge(index_p index);
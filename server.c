@@ -0,0 +1,544 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "index.h"
+#include "util.h"
+#include "snapshots.h"
+#include "server.h"
+
+// connections open at once, further ones wait in the backlog of the listening socket until one is closed
+#define SERVER_MAX_CONNECTIONS 256
+
+// seconds a connection may wait for its next request, the server closes it afterwards
+#define SERVER_IDLE_TIMEOUT 60
+
+// seconds a worker waits for the rest of a request or for the client to take the response
+#define SERVER_IO_TIMEOUT 5
+
+// longest request accepted, the connection is closed after a longer one
+#define MAX_REQUEST_SIZE (1 << 16)
+
+typedef struct server {
+    index_p index;              // index searched, through its snapshots
+    int listen_fd;              // socket accepting connections
+    char *path;                 // file of the unix domain socket (NULL = TCP socket)
+    int wake[2];                // pipe waking the polling thread when a connection is handed back or the server stops
+    pthread_t poller;           // thread accepting connections and waiting for their requests
+    pthread_t *workers;         // threads answering requests
+    int nr_workers;             // number of these threads
+    int *connections;           // per worker: socket of the connection whose request it answers (-1 = none)
+    int nr_connections;         // number of connections open
+    int queue[SERVER_MAX_CONNECTIONS];  // sockets of the connections with a request not answered yet (ring buffer)
+    int queue_start;            // position of the oldest connection in the queue
+    int queue_size;             // number of connections in the queue
+    int returned[SERVER_MAX_CONNECTIONS];   // sockets of the connections answered, to be watched for the next request
+    int nr_returned;            // number of these connections
+    int stopping;               // 1 = the server is stopping
+    pthread_mutex_t lock;       // protects the queue, the connections and stopping
+    pthread_cond_t changed;     // signalled when the queue changes or the server stops
+} server_t, *server_p;
+
+typedef struct server_worker {
+    server_p server;            // server of the worker
+    int nr;                     // number of the worker
+} server_worker_t, *server_worker_p;
+
+int open_listen_socket(server_p server, char *address);
+void *poll_connections(void *arg);
+int accept_connection(server_p server);
+void *serve_requests(void *arg);
+int serve_request(server_p server, int fd);
+void hand_back_connection(server_p server, int fd, int open);
+char *handle_request(server_p server, char *request, int *size);
+int read_fully(int fd, void *buffer, int size);
+int write_fully(int fd, void *buffer, int size);
+
+/*
+ * The server answers search requests of other programs over a unix domain socket or a TCP socket on localhost,
+ * while the REPL keeps changing the index. A polling thread accepts the connections and waits for their requests;
+ * a connection sending one is queued for a fixed number of worker threads, which answer one request at a time
+ * each and hand the connection back to the polling thread, so idle connections don't occupy a worker. Every
+ * request searches the snapshot current when it arrives. The polling thread closes connections idle for
+ * SERVER_IDLE_TIMEOUT seconds, a worker closes a connection sending a request or taking a response slower than
+ * SERVER_IO_TIMEOUT seconds. Requests and responses are frames: the length of the payload (4 bytes, network byte
+ * order) followed by the payload, text without \0. A connection may send any number of requests, each is answered
+ * before the next one is read. Requests:
+ *  search <query>      response "ok <n>\n" followed by n lines "<score>\t<name>\t<terms>\n", best document first
+ *  ping                response "ok 0\n"
+ * Anything else is answered by "error <message>\n".
+ */
+
+/*
+ * Starts serving searches in the background, returns the server (NULL if the socket can't be opened)
+ *  address: port number (TCP on localhost) or path of a unix domain socket
+ *  nr_threads: number of worker threads (0 = one per processor)
+ */
+server_p start_server(index_p index, char *address, int nr_threads) {
+    if (nr_threads <= 0) {
+        nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    server_p server = (server_p) malloc(sizeof(server_t));
+    server->index = index;
+    server->path = NULL;
+    server->nr_connections = 0;
+    server->queue_start = 0;
+    server->queue_size = 0;
+    server->nr_returned = 0;
+    server->stopping = 0;
+
+    if (!open_listen_socket(server, address)) {
+        free(server->path);
+        free(server);
+        return NULL;
+    }
+
+    if (pipe(server->wake)) {
+        printf("Error: couldn't create a pipe.\n");
+        close(server->listen_fd);
+        free(server->path);
+        free(server);
+        return NULL;
+    }
+
+    // workers handing back connections mustn't wait for the polling thread
+    fcntl(server->wake[1], F_SETFL, O_NONBLOCK);
+
+    pthread_mutex_init(&server->lock, NULL);
+    pthread_cond_init(&server->changed, NULL);
+
+    server->nr_workers = nr_threads;
+    server->workers = (pthread_t *) malloc(sizeof(pthread_t) * nr_threads);
+    server->connections = (int *) malloc(sizeof(int) * nr_threads);
+
+    int i;
+    for (i = 0; i < nr_threads; i++) {
+        server_worker_p worker = (server_worker_p) malloc(sizeof(server_worker_t));
+        worker->server = server;
+        worker->nr = i;
+        server->connections[i] = -1;
+        pthread_create(&server->workers[i], NULL, serve_requests, worker);
+    }
+
+    pthread_create(&server->poller, NULL, poll_connections, server);
+
+    printf("Serving searches on %s with %d threads.\n", address, nr_threads);
+    return server;
+}
+
+/*
+ * Stops the server: connections are closed (requests being answered are finished first) and the threads end
+ */
+void stop_server(server_p server) {
+    pthread_mutex_lock(&server->lock);
+    server->stopping = 1;
+
+    // workers waiting for the rest of a request wake up
+    int i;
+    for (i = 0; i < server->nr_workers; i++) {
+        if (server->connections[i] >= 0) {
+            shutdown(server->connections[i], SHUT_RDWR);
+        }
+    }
+
+    pthread_cond_broadcast(&server->changed);
+    pthread_mutex_unlock(&server->lock);
+
+    if (write(server->wake[1], "", 1) != 1 && errno != EAGAIN) {
+        printf("Error: couldn't wake the server.\n");
+    }
+
+    pthread_join(server->poller, NULL);
+    for (i = 0; i < server->nr_workers; i++) {
+        pthread_join(server->workers[i], NULL);
+    }
+
+    // connections with requests never answered and connections answered last (the polling thread closed the others)
+    for (i = 0; i < server->queue_size; i++) {
+        close(server->queue[(server->queue_start + i) % SERVER_MAX_CONNECTIONS]);
+    }
+    for (i = 0; i < server->nr_returned; i++) {
+        close(server->returned[i]);
+    }
+
+    close(server->listen_fd);
+    close(server->wake[0]);
+    close(server->wake[1]);
+    if (server->path) {
+        unlink(server->path);
+        free(server->path);
+    }
+
+    pthread_cond_destroy(&server->changed);
+    pthread_mutex_destroy(&server->lock);
+    free(server->workers);
+    free(server->connections);
+    free(server);
+
+    printf("Server stopped.\n");
+}
+
+/*
+ * Waits until the server stops by itself, which it only does if it can't accept connections anymore
+ * (to be released by stop_server afterwards)
+ */
+void wait_for_server(server_p server) {
+    pthread_mutex_lock(&server->lock);
+    while (!server->stopping) {
+        pthread_cond_wait(&server->changed, &server->lock);
+    }
+    pthread_mutex_unlock(&server->lock);
+}
+
+/*
+ * Opens the socket accepting connections, returns 1 on success, 0 otherwise
+ */
+int open_listen_socket(server_p server, char *address) {
+    char *end;
+    long port = strtol(address, &end, 10);
+
+    if (*address && !*end) {
+        // port number: TCP, only reachable from this host
+        struct sockaddr_in a;
+        memset(&a, 0, sizeof(a));
+        a.sin_family = AF_INET;
+        a.sin_port = htons(port);
+        a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        server->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+        int on = 1;
+        setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+        if (port <= 0 || port > 65535 || bind(server->listen_fd, (struct sockaddr *) &a, sizeof(a))) {
+            printf("Error: couldn't listen on port %s.\n", address);
+            close(server->listen_fd);
+            return 0;
+        }
+    } else {
+        // anything else is the path of a unix domain socket, a socket left over by an earlier server is replaced
+        struct sockaddr_un a;
+        memset(&a, 0, sizeof(a));
+        a.sun_family = AF_UNIX;
+        if (strlen(address) >= sizeof(a.sun_path)) {
+            printf("Error: socket path %s too long.\n", address);
+            return 0;
+        }
+        strcpy(a.sun_path, address);
+        unlink(address);
+
+        server->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (bind(server->listen_fd, (struct sockaddr *) &a, sizeof(a))) {
+            printf("Error: couldn't listen on %s.\n", address);
+            close(server->listen_fd);
+            return 0;
+        }
+
+        server->path = (char *) malloc(strlen(address) + 1);
+        strcpy(server->path, address);
+    }
+
+    if (listen(server->listen_fd, SOMAXCONN)) {
+        printf("Error: couldn't listen on %s.\n", address);
+        close(server->listen_fd);
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Accepts connections and queues those sending a request for the workers (thread function), until the server stops
+ */
+void *poll_connections(void *arg) {
+    server_p server = (server_p) arg;
+
+    // the listening socket and the pipe, followed by the connections waiting for a request
+    struct pollfd fds[SERVER_MAX_CONNECTIONS + 2];
+    double idle_since[SERVER_MAX_CONNECTIONS + 2];
+    fds[0].fd = server->listen_fd;
+    fds[1].fd = server->wake[0];
+    fds[1].events = POLLIN;
+    int nr_fds = 2, i;
+
+    for (;;) {
+        pthread_mutex_lock(&server->lock);
+        if (server->stopping) {
+            pthread_mutex_unlock(&server->lock);
+            break;
+        }
+
+        // connections answered by the workers wait for their next request
+        while (server->nr_returned) {
+            fds[nr_fds].fd = server->returned[--server->nr_returned];
+            fds[nr_fds].events = POLLIN;
+            idle_since[nr_fds++] = now_seconds();
+        }
+
+        // new connections wait in the backlog while the server has as many as it keeps open
+        fds[0].events = server->nr_connections < SERVER_MAX_CONNECTIONS ? POLLIN : 0;
+        pthread_mutex_unlock(&server->lock);
+
+        // wake up every second to close idle connections
+        if (poll(fds, nr_fds, 1000) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        if (fds[1].revents) {
+            // woken up by a worker or by stop_server
+            char buffer[256];
+            if (read(server->wake[0], buffer, sizeof(buffer)) <= 0) {
+                break;
+            }
+        }
+
+        // requests go to the workers, idle connections are closed (the last connection takes over the entry)
+        double now = now_seconds();
+        for (i = nr_fds - 1; i >= 2; i--) {
+            if (fds[i].revents) {
+                pthread_mutex_lock(&server->lock);
+                server->queue[(server->queue_start + server->queue_size) % SERVER_MAX_CONNECTIONS] = fds[i].fd;
+                server->queue_size++;
+                pthread_cond_broadcast(&server->changed);
+                pthread_mutex_unlock(&server->lock);
+            } else if (now - idle_since[i] > SERVER_IDLE_TIMEOUT) {
+                close(fds[i].fd);
+
+                pthread_mutex_lock(&server->lock);
+                server->nr_connections--;
+                pthread_mutex_unlock(&server->lock);
+            } else {
+                continue;
+            }
+
+            nr_fds--;
+            fds[i] = fds[nr_fds];
+            idle_since[i] = idle_since[nr_fds];
+        }
+
+        if (fds[0].revents) {
+            int fd = accept_connection(server);
+            if (fd == -2) {
+                printf("Error: couldn't accept connections.\n");
+                break;
+            }
+
+            if (fd >= 0) {
+                fds[nr_fds].fd = fd;
+                fds[nr_fds].events = POLLIN;
+                idle_since[nr_fds++] = now;
+            }
+        }
+    }
+
+    // connections waiting for a request are closed, without new connections the workers stop as well
+    for (i = 2; i < nr_fds; i++) {
+        close(fds[i].fd);
+    }
+
+    pthread_mutex_lock(&server->lock);
+    server->stopping = 1;
+    pthread_cond_broadcast(&server->changed);
+    pthread_mutex_unlock(&server->lock);
+
+    return NULL;
+}
+
+/*
+ * Accepts a connection, returns its socket, -1 if there was none after all and -2 if the listening socket failed
+ */
+int accept_connection(server_p server) {
+    int fd = accept(server->listen_fd, NULL, NULL);
+    if (fd < 0) {
+        return errno == EINTR || errno == ECONNABORTED || errno == EAGAIN ? -1 : -2;
+    }
+
+    // a client may not keep a worker waiting
+    struct timeval timeout = { SERVER_IO_TIMEOUT, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    pthread_mutex_lock(&server->lock);
+    server->nr_connections++;
+    pthread_mutex_unlock(&server->lock);
+
+    return fd;
+}
+
+/*
+ * Answers the requests of the queued connections one after another (thread function), until the server stops
+ */
+void *serve_requests(void *arg) {
+    server_worker_p worker = (server_worker_p) arg;
+    server_p server = worker->server;
+
+    pthread_mutex_lock(&server->lock);
+    for (;;) {
+        while (!server->queue_size && !server->stopping) {
+            pthread_cond_wait(&server->changed, &server->lock);
+        }
+
+        if (server->stopping) {
+            break;
+        }
+
+        int fd = server->queue[server->queue_start];
+        server->queue_start = (server->queue_start + 1) % SERVER_MAX_CONNECTIONS;
+        server->queue_size--;
+        server->connections[worker->nr] = fd;
+        pthread_mutex_unlock(&server->lock);
+
+        int open = serve_request(server, fd);
+
+        pthread_mutex_lock(&server->lock);
+        server->connections[worker->nr] = -1;
+        hand_back_connection(server, fd, open);
+    }
+    pthread_mutex_unlock(&server->lock);
+
+    free(worker);
+    return NULL;
+}
+
+/*
+ * Answers the next request of a connection, returns 1 if the connection stays open, 0 if the client closed it,
+ * sent an invalid frame or was too slow
+ */
+int serve_request(server_p server, int fd) {
+    unsigned int length;
+    if (!read_fully(fd, &length, sizeof(length))) {
+        return 0;
+    }
+
+    length = ntohl(length);
+    if (length > MAX_REQUEST_SIZE) {
+        return 0;
+    }
+
+    char *request = (char *) malloc(length + 1);
+    if (!read_fully(fd, request, length)) {
+        free(request);
+        return 0;
+    }
+    request[length] = '\0';
+
+    // the response is sent as one frame in one write, a separate write of the length would be held back
+    // by the TCP stack until the client acknowledged it
+    int size;
+    char *response = handle_request(server, request, &size);
+    free(request);
+
+    length = htonl(size - sizeof(length));
+    memcpy(response, &length, sizeof(length));
+    int ok = write_fully(fd, response, size);
+    free(response);
+
+    return ok;
+}
+
+/*
+ * Hands a connection answered by a worker back to the polling thread, or closes it (the lock must be held)
+ *  open: 1 = the connection waits for its next request, 0 = the connection is closed
+ */
+void hand_back_connection(server_p server, int fd, int open) {
+    if (open && !server->stopping) {
+        server->returned[server->nr_returned++] = fd;
+    } else {
+        close(fd);
+        server->nr_connections--;
+    }
+
+    // the polling thread may watch the connection or accept another one now (the pipe may be full of wake ups already)
+    if (write(server->wake[1], "", 1) != 1 && errno != EAGAIN) {
+        printf("Error: couldn't wake the server.\n");
+    }
+}
+
+/*
+ * Answers a request, returns the response (to be freed by the caller) after 4 bytes left for its length
+ *  size: returns the number of bytes of the response, including these 4 bytes
+ */
+char *handle_request(server_p server, char *request, int *size) {
+    int max_size = 256;
+    char *response = (char *) malloc(max_size);
+    *size = 4;
+
+    if (!strcmp(request, "ping")) {
+        return append_text(response, size, &max_size, "ok 0\n");
+    }
+
+    if (!starts_with(request, "search ")) {
+        return append_text(response, size, &max_size, "error unknown request\n");
+    }
+
+    index_p snapshot = acquire_snapshot(server->index);
+    search_result_p result = search_index(snapshot, request + 7);
+    release_snapshot(server->index, snapshot);
+
+    response = append_text(response, size, &max_size, "ok %d\n", result->nr_hits);
+
+    int i;
+    for (i = 0; i < result->nr_hits; i++) {
+        search_hit_p hit = &result->hits[i];
+        response = append_text(response, size, &max_size, "%.5f\t%s\t%s\n", hit->score, hit->name, hit->terms);
+    }
+
+    close_search_result(result);
+    return response;
+}
+
+/*
+ * Reads exactly size bytes from a socket, returns 1 on success, 0 if the connection ended
+ */
+int read_fully(int fd, void *buffer, int size) {
+    char *p = (char *) buffer;
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+
+        p += n;
+        size -= n;
+    }
+
+    return 1;
+}
+
+/*
+ * Writes exactly size bytes to a socket, returns 1 on success, 0 if the connection ended
+ * (a client gone doesn't raise SIGPIPE)
+ */
+int write_fully(int fd, void *buffer, int size) {
+    char *p = (char *) buffer;
+    while (size > 0) {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+
+        p += n;
+        size -= n;
+    }
+
+    return 1;
+}
@@ -0,0 +1,3 @@
+struct server *start_server(index_p index, char *address, int nr_threads);
+void stop_server(struct server *server);
+void wait_for_server(struct server *server);
@@ -0,0 +1,372 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "index.h"
+#include "vocab.h"
+#include "postings.h"
+#include "norms.h"
+#include "stopwords.h"
+#include "segments.h"
+#include "snapshots.h"
+
+#define RETIRED_MEMORY 0                // memory block, released by free
+#define RETIRED_SEGMENT 1               // segment, its file is unmapped
+#define RETIRED_STOPWORDS 2             // set of stopwords
+
+typedef struct retired_object {
+    int type;                   // RETIRED_MEMORY, RETIRED_SEGMENT or RETIRED_STOPWORDS
+    void *object;               // the object
+} retired_object_t, *retired_object_p;
+
+typedef struct snapshot {
+    index_t index;              // the index as it was published, never changed (first member, readers get a pointer to it)
+    int refs;                   // number of readers using the snapshot, +1 while it is the current snapshot
+    struct snapshot *next;      // next newer snapshot (NULL = current snapshot)
+    retired_object_p retired;   // objects the index let go of while this snapshot was current
+    int nr_retired;             // number of these objects
+    int max_retired;            // number of objects the list above has room for
+} snapshot_t, *snapshot_p;
+
+typedef struct snapshot_list {
+    pthread_mutex_t lock;       // protects the reference counts and the list
+    snapshot_p oldest;          // oldest snapshot kept, the others follow by age
+    snapshot_p current;         // snapshot new readers get
+} snapshot_list_t, *snapshot_list_p;
+
+void *copy_memory(void *memory, size_t size);
+void retire(index_p index, int type, void *object);
+snapshot_p take_unused_snapshots(snapshot_list_p list);
+void free_snapshots(snapshot_p s);
+void release_object(int type, void *object);
+
+/*
+ * Searches don't read the index but a snapshot of it. A snapshot shares everything with the index, copying
+ * only the tables the index changes in place: the page tables of the documents and of the norms, the list
+ * of segments and the vocabulary in memory (but not the document lists of its words). The pages and the
+ * document lists are stamped with the number of snapshots published when the index made them; before the
+ * index changes one stamped earlier, it goes on with a copy (own_memory, own_word), so a change copies
+ * only the pieces it touches. The segments are never modified (see segments.c).
+ * The index publishes a new snapshot after each change; a reader pins the current one and may search it
+ * however long the index keeps changing meanwhile, readers never wait for the index and the index never
+ * waits for readers. Whatever the index lets go of while a snapshot is current (pages it copied, names of
+ * removed documents, merged segments, ..) is retired instead of released: it is released with that snapshot,
+ * once neither the snapshot nor an older one has readers left.
+ */
+
+/*
+ * Publishes a snapshot of the index as it is now, the following searches use it
+ * (only the thread changing the index may call this)
+ */
+void publish_snapshot(index_p index) {
+    // readers don't compute anything, the sums of the documents have to be there
+    update_norms(index);
+
+    snapshot_p s = (snapshot_p) malloc(sizeof(snapshot_t));
+    s->refs = 1;
+    s->next = NULL;
+    s->retired = NULL;
+    s->nr_retired = 0;
+    s->max_retired = 0;
+
+    index_p copy = &s->index;
+    *copy = *index;
+
+    // the pages are shared, searches don't look up documents by name
+    int nr_pages = index->max_doc_ids / DOCUMENT_PAGE_SIZE;
+    copy->documents = (indexed_document_p *) copy_memory(index->documents, sizeof(indexed_document_p) * nr_pages);
+    copy->norms = (doc_norm_p *) copy_memory(index->norms, sizeof(doc_norm_p) * nr_pages);
+    copy->document_stamps = NULL;
+    copy->norm_stamps = NULL;
+    copy->by_name = NULL;
+    copy->segments = (index_segment_p) copy_memory(index->segments, sizeof(index_segment_t) * index->nr_segments);
+
+    // the words in memory with their stems and document lists are shared
+    copy->words = (indexed_word_p) copy_memory(index->words, sizeof(indexed_word_t) * index->nr_words);
+    copy->max_words = index->nr_words;
+    copy->slots = (word_slot_p) copy_memory(index->slots, sizeof(word_slot_t) * index->nr_slots);
+    copy->stems = NULL;
+
+    // readers stem their queries without the stem cache, they'd have to take turns using it
+    copy->stem_cache = NULL;
+    copy->map = NULL;
+    copy->map_size = 0;
+    copy->journal = NULL;
+    copy->removed = NULL;
+    copy->nr_removed = 0;
+    copy->max_removed = 0;
+    copy->merge = NULL;
+    copy->snapshots = NULL;
+
+    // whatever the index made before is shared from now on
+    index->nr_snapshots++;
+
+    if (!index->snapshots) {
+        index->snapshots = (snapshot_list_p) malloc(sizeof(snapshot_list_t));
+        pthread_mutex_init(&index->snapshots->lock, NULL);
+        index->snapshots->oldest = NULL;
+        index->snapshots->current = NULL;
+    }
+
+    snapshot_list_p list = index->snapshots;
+    pthread_mutex_lock(&list->lock);
+
+    if (list->current) {
+        list->current->next = s;
+        list->current->refs--;
+    } else {
+        list->oldest = s;
+    }
+    list->current = s;
+
+    snapshot_p unused = take_unused_snapshots(list);
+    pthread_mutex_unlock(&list->lock);
+
+    free_snapshots(unused);
+}
+
+/*
+ * Pins the current snapshot of the index and returns it, to be searched like the index until it is released
+ * (a snapshot must have been published)
+ */
+index_p acquire_snapshot(index_p index) {
+    snapshot_list_p list = index->snapshots;
+
+    pthread_mutex_lock(&list->lock);
+    snapshot_p s = list->current;
+    s->refs++;
+    pthread_mutex_unlock(&list->lock);
+
+    return &s->index;
+}
+
+/*
+ * Releases a snapshot returned by acquire_snapshot, the last reader of old snapshots releases them
+ */
+void release_snapshot(index_p index, index_p snapshot) {
+    snapshot_list_p list = index->snapshots;
+    snapshot_p s = (snapshot_p) snapshot;
+
+    pthread_mutex_lock(&list->lock);
+    s->refs--;
+    snapshot_p unused = take_unused_snapshots(list);
+    pthread_mutex_unlock(&list->lock);
+
+    free_snapshots(unused);
+}
+
+/*
+ * Releases a block of memory the index doesn't use anymore, once the snapshots can't use it either
+ */
+void retire_memory(index_p index, void *memory) {
+    retire(index, RETIRED_MEMORY, memory);
+}
+
+/*
+ * Releases a segment the index doesn't use anymore, once the snapshots can't use it either
+ */
+void retire_segment(index_p index, index_segment_p segment) {
+    retire(index, RETIRED_SEGMENT, copy_memory(segment, sizeof(index_segment_t)));
+}
+
+/*
+ * Releases a set of stopwords the index doesn't use anymore, once the snapshots can't use it either
+ */
+void retire_stopwords(index_p index, stopword_set_p set) {
+    retire(index, RETIRED_STOPWORDS, set);
+}
+
+/*
+ * Returns a block of memory of the index to be changed: a block stamped before the current snapshot was published
+ * may be read by snapshots, the index goes on with a copy of it then and the block is retired
+ *  stamp: number of snapshots published when the block was made, updated for the copy
+ *  size: number of bytes of the block
+ */
+void *own_memory(index_p index, void *memory, int *stamp, size_t size) {
+    if (!memory || *stamp == index->nr_snapshots) {
+        return memory;
+    }
+
+    void *copy = copy_memory(memory, size);
+    retire_memory(index, memory);
+    *stamp = index->nr_snapshots;
+
+    return copy;
+}
+
+/*
+ * Makes sure a word in memory owns its document list before the list is changed: a list stamped before
+ * the current snapshot was published may be read by snapshots, the word goes on with a copy of it then
+ */
+void own_word(index_p index, indexed_word_p w) {
+    if (w->stamp == index->nr_snapshots) {
+        return;
+    }
+
+    indexed_word_t shared = *w;
+    copy_postings(w, &shared);
+    w->stamp = index->nr_snapshots;
+
+    retire_postings(index, &shared);
+}
+
+/*
+ * Releases the words in memory like clear_words, their document lists and stems once the snapshots can't use them
+ * either (the snapshots have vocabularies of their own)
+ */
+void retire_words(index_p index) {
+    int i;
+    for (i = 0; i < index->nr_words; i++) {
+        retire_postings(index, &index->words[i]);
+    }
+    index->nr_words = 0;
+
+    stem_block_p b;
+    while ((b = index->stems)) {
+        index->stems = b->next;
+        retire_memory(index, b);
+    }
+
+    clear_words(index);
+}
+
+/*
+ * Releases all snapshots of the index, none of them may be in use anymore
+ */
+void close_snapshots(index_p index) {
+    snapshot_list_p list = index->snapshots;
+    if (!list) {
+        return;
+    }
+
+    list->current->refs--;
+    free_snapshots(take_unused_snapshots(list));
+
+    pthread_mutex_destroy(&list->lock);
+    free(list);
+    index->snapshots = NULL;
+}
+
+/*
+ * Returns a copy of a block of memory (NULL for NULL)
+ */
+void *copy_memory(void *memory, size_t size) {
+    if (!memory) {
+        return NULL;
+    }
+
+    void *copy = malloc(size + 1);
+    memcpy(copy, memory, size);
+
+    return copy;
+}
+
+/*
+ * Adds an object to the objects retired while the current snapshot is current, or releases it right away
+ * if there is no snapshot
+ */
+void retire(index_p index, int type, void *object) {
+    if (!object) {
+        return;
+    }
+
+    // the current snapshot isn't released while it is current, so it doesn't have to be locked
+    snapshot_p s = index->snapshots ? index->snapshots->current : NULL;
+    if (!s) {
+        release_object(type, object);
+        return;
+    }
+
+    // list full => double the size
+    if (s->nr_retired == s->max_retired) {
+        s->max_retired = s->max_retired ? s->max_retired * 2 : 64;
+        s->retired = (retired_object_p) realloc(s->retired, sizeof(retired_object_t) * s->max_retired);
+    }
+
+    s->retired[s->nr_retired].type = type;
+    s->retired[s->nr_retired].object = object;
+    s->nr_retired++;
+}
+
+/*
+ * Releases the document list of a word like free_postings, once the snapshots can't use it either
+ */
+void retire_postings(index_p index, indexed_word_p w) {
+    // packed blocks in the mapped index file are not owned by the word
+    if (w->max_blocks) {
+        retire_memory(index, w->blocks);
+        retire_memory(index, w->data);
+        retire_memory(index, w->block_positions);
+    }
+
+    if (w->max_positions) {
+        retire_memory(index, w->positions);
+    }
+
+    retire_memory(index, w->tail);
+}
+
+/*
+ * Unlinks the oldest snapshots without readers from the list and returns them, in the order of their age
+ * (a snapshot is kept as long as an older one is in use: the objects it retired may be used by that one)
+ */
+snapshot_p take_unused_snapshots(snapshot_list_p list) {
+    snapshot_p first = list->oldest, last = NULL, s;
+    for (s = list->oldest; s && !s->refs; s = s->next) {
+        last = s;
+    }
+
+    if (!last) {
+        return NULL;
+    }
+
+    list->oldest = last->next;
+    if (!list->oldest) {
+        list->current = NULL;
+    }
+    last->next = NULL;
+
+    return first;
+}
+
+/*
+ * Releases a list of snapshots unlinked by take_unused_snapshots together with the objects they retired
+ */
+void free_snapshots(snapshot_p s) {
+    while (s) {
+        snapshot_p next = s->next;
+
+        // the snapshot owns its tables only
+        free(s->index.documents);
+        free(s->index.norms);
+        free(s->index.segments);
+        free(s->index.words);
+        free(s->index.slots);
+
+        int i;
+        for (i = 0; i < s->nr_retired; i++) {
+            release_object(s->retired[i].type, s->retired[i].object);
+        }
+
+        free(s->retired);
+        free(s);
+        s = next;
+    }
+}
+
+/*
+ * Releases a retired object
+ */
+void release_object(int type, void *object) {
+    if (type == RETIRED_SEGMENT) {
+        index_segment_p segment = (index_segment_p) object;
+        free_removed_df(segment);
+        clear_index(&segment->words);
+        free(segment);
+    } else if (type == RETIRED_STOPWORDS) {
+        free_stopwords((stopword_set_p) object);
+    } else {
+        free(object);
+    }
+}
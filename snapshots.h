@@ -0,0 +1,11 @@
+void publish_snapshot(index_p index);
+index_p acquire_snapshot(index_p index);
+void release_snapshot(index_p index, index_p snapshot);
+void retire_memory(index_p index, void *memory);
+void retire_segment(index_p index, index_segment_p segment);
+void retire_stopwords(index_p index, stopword_set_p set);
+void *own_memory(index_p index, void *memory, int *stamp, size_t size);
+void own_word(index_p index, indexed_word_p w);
+void retire_words(index_p index);
+void retire_postings(index_p index, indexed_word_p w);
+void close_snapshots(index_p index);
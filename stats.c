@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+
+#include "index.h"
+#include "util.h"
+#include "stats.h"
+
+// names of the counters, by number
+char *stat_names[NR_STATS] = {
+    "searches", "candidates", "docs_scored", "postings_scanned", "docs_parsed", "tokens", "stopword_hits",
+    "stem_calls", "bytes_read", "bytes_written", "time_parse", "time_score", "time_merge", "time_persist", "time_load"
+};
+
+// the counters of the process (all indexes, snapshots and threads count together), changed by atomic operations
+long stat_counters[NR_STATS];
+
+/*
+ * Runtime counters tell where the time goes: what searches scan and score, what parsing documents costs and
+ * how much the index reads and writes. Code counts in local variables and adds them here once per operation
+ * (search, document, file written), so counting costs next to nothing even with many threads.
+ */
+
+/*
+ * Adds n to a counter (STAT_...)
+ */
+void count_stat(int stat, long n) {
+    __atomic_add_fetch(&stat_counters[stat], n, __ATOMIC_RELAXED);
+}
+
+/*
+ * Adds the time passed since start (now_seconds) to a timer (STAT_TIME_...)
+ */
+void count_time(int stat, double start) {
+    count_stat(stat, (long) ((now_seconds() - start) * 1e9));
+}
+
+/*
+ * Sets all counters to 0
+ */
+void reset_stats() {
+    int i;
+    for (i = 0; i < NR_STATS; i++) {
+        __atomic_store_n(&stat_counters[i], 0, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Prints the counters, averages per search and document, and the memory the process has allocated,
+ * one "<name> <value>" per line
+ */
+void print_stats(FILE *f) {
+    long s[NR_STATS];
+    int i;
+    for (i = 0; i < NR_STATS; i++) {
+        s[i] = __atomic_load_n(&stat_counters[i], __ATOMIC_RELAXED);
+    }
+
+    for (i = 0; i < NR_STATS; i++) {
+        if (i >= STAT_TIME_PARSE) {
+            fprintf(f, "%-24s %.6f s\n", stat_names[i], s[i] / 1e9);
+        } else {
+            fprintf(f, "%-24s %ld\n", stat_names[i], s[i]);
+        }
+    }
+
+    if (s[STAT_SEARCHES]) {
+        fprintf(f, "%-24s %.1f\n", "postings_per_search", (double) s[STAT_POSTINGS_SCANNED] / s[STAT_SEARCHES]);
+        fprintf(f, "%-24s %.1f\n", "scored_per_search", (double) s[STAT_DOCS_SCORED] / s[STAT_SEARCHES]);
+        fprintf(f, "%-24s %.3f ms\n", "time_per_search", s[STAT_TIME_SCORE] / 1e6 / s[STAT_SEARCHES]);
+    }
+    if (s[STAT_DOCS_PARSED]) {
+        fprintf(f, "%-24s %.1f\n", "tokens_per_doc", (double) s[STAT_TOKENS] / s[STAT_DOCS_PARSED]);
+        fprintf(f, "%-24s %.3f ms\n", "time_per_doc", s[STAT_TIME_PARSE] / 1e6 / s[STAT_DOCS_PARSED]);
+    }
+
+    // allocations as the allocator sees them: blocks in use and memory held from the system
+    struct mallinfo2 m = mallinfo2();
+    fprintf(f, "%-24s %zu\n", "heap_in_use", m.uordblks + m.hblkhd);
+    fprintf(f, "%-24s %zu\n", "heap_free", m.fordblks);
+    fprintf(f, "%-24s %zu\n", "heap_mmapped_blocks", m.hblks);
+}
@@ -0,0 +1,4 @@
+void count_stat(int stat, long n);
+void count_time(int stat, double start);
+void reset_stats();
+void print_stats(FILE *f);
@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "index.h"
+#include "stemmer.h"
+#include "stemcache.h"
+
+// number of entries of a stem cache (64 bytes each), enough for the vocabulary of most collections
+#define STEM_CACHE_ENTRIES (1 << 14)
+
+/*
+ * Creates an empty stem cache
+ */
+stem_cache_p new_stem_cache() {
+    stem_cache_p cache = (stem_cache_p) malloc(sizeof(stem_cache_t));
+    cache->nr_entries = STEM_CACHE_ENTRIES;
+    cache->entries = (stem_cache_entry_p) calloc(cache->nr_entries, sizeof(stem_cache_entry_t));
+    cache->hits = 0;
+    cache->misses = 0;
+
+    return cache;
+}
+
+/*
+ * Releases a stem cache
+ */
+void free_stem_cache(stem_cache_p cache) {
+    if (cache) {
+        free(cache->entries);
+        free(cache);
+    }
+}
+
+/*
+ * Stems a word like stem_word, words seen before are looked up in the cache instead (cache may be NULL)
+ * a word replaces the word cached in the same entry, words too long for the cache are always stemmed
+ */
+int cached_stem(stem_cache_p cache, char *word, int len, char *buf) {
+    if (!cache) {
+        return stem_word(word, len, buf);
+    }
+
+    if (!len || len > STEM_CACHE_WORD_SIZE) {
+        cache->misses++;
+        return stem_word(word, len, buf);
+    }
+
+    // FNV-1a hash of the word selects the entry
+    unsigned int hash = 2166136261u;
+    int i;
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char) word[i];
+        hash *= 16777619u;
+    }
+
+    stem_cache_entry_p e = &cache->entries[hash & (cache->nr_entries - 1)];
+    if (e->len == len && !memcmp(e->word, word, len)) {
+        cache->hits++;
+        memcpy(buf, e->stem, e->stem_len);
+        buf[e->stem_len] = '\0';
+        return e->stem_len;
+    }
+
+    // the word has to be kept before it is stemmed, buf may be the word itself
+    cache->misses++;
+    e->len = len;
+    memcpy(e->word, word, len);
+    e->stem_len = stem_word(word, len, buf);
+    memcpy(e->stem, buf, e->stem_len);
+
+    return e->stem_len;
+}
+
+/*
+ * Prints how often the cache saved stemming a word
+ */
+void print_stem_cache(stem_cache_p cache) {
+    if (!cache) {
+        printf("No stem cache.\n");
+        return;
+    }
+
+    long lookups = cache->hits + cache->misses;
+    printf("Stem cache: %ld words, %ld found in the cache (%.1f%%), %ld stemmed\n",
+            lookups, cache->hits, lookups ? 100.0 * cache->hits / lookups : 0.0, cache->misses);
+}
@@ -0,0 +1,4 @@
+stem_cache_p new_stem_cache();
+void free_stem_cache(stem_cache_p cache);
+int cached_stem(stem_cache_p cache, char *word, int len, char *buf);
+void print_stem_cache(stem_cache_p cache);
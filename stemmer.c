@@ -1,265 +1,401 @@
-#include <stdlib.h>
 #include <string.h>
-#include <stdio.h>
+#include <limits.h>
 
 #include "stemmer.h"
 
-#define _REPLACE_SUFFIX(__w, __s, __r) \
-BEGIN_REPLACE_SUFFIX(__w, __s, __r) \
-_END_REPLACE_OR
+// number of letters at the end of a word whose consonant/vowel pattern is kept,
+// the steps of the algorithm never look back further than 30 letters from the end of the original word
+#define STEM_WINDOW 64
 
-#define _REPLACE_SUFFIX_COND(__w, __s, __r, __c) \
-_BEGIN_REPLACE_SUFFIX_COND(__w, __s, __r, __c) \
-_END_REPLACE_OR
+// bit i is set if the i-th letter of the alphabet is a vowel (a, e, i, o, u)
+#define VOWELS 0x104111
 
-#define _BEGIN_REPLACE_SUFFIX(__w, __s, __r) \
-if (ends_with(__w, __s)) { \
-    __w = replace_suffix(__w, strlen(__s), __r);
+// condition of a rule: the suffix is only replaced if it follows an s or a t
+#define AFTER_S_OR_T -1
 
-#define _BEGIN_REPLACE_SUFFIX_COND(__w, __s, __r, __c) \
-if (ends_with(__w, __s)) { \
-    if (__c) { \
-        __w = replace_suffix(__w, strlen(__s), __r); \
-    _END_REPLACE_COND
+// replaces a suffix if the m value of the rest of the word exceeds min_m, leaves the switch if the word ends with the suffix
+// (the rules are selected by the last letter, the next to last one rules out most of them before the call)
+#define RULE(__w, __s, __r, __m) \
+if ((__w)->len >= (int) sizeof(__s) - 1 && (__w)->word[(__w)->len - 2] == __s[sizeof(__s) - 3] \
+        && replace_if(__w, __s, sizeof(__s) - 1, __r, sizeof(__r) - 1, __m)) { \
+    break; \
+}
 
-#define _OR_REPLACE_SUFFIX(__w, __s, __r) \
-} else _BEGIN_REPLACE_SUFFIX(__w, __s, __r)
+typedef struct stem_buffer {
+    char *word;                   // word being stemmed
+    int len;                      // current length of the word
+    int nr_pattern;               // number of letters at the start of the word whose pattern is determined
+    int base;                     // position of the first letter whose pattern is kept
+    int first_vowel;              // position of the first vowel among these letters (INT_MAX = none)
+    int head_consonant;           // 1 if the letter before base is a consonant
+    int head_m;                   // m value of the word up to base
+    char consonant[STEM_WINDOW];  // 1 if the letter at base + i is a consonant
+    int m[STEM_WINDOW];           // m value of the word up to and including the letter at base + i
+} stem_buffer_t, *stem_buffer_p;
+
+void set_pattern(stem_buffer_p s);
+int is_consonant(stem_buffer_p s, int i);
+int calculate_m(stem_buffer_p s, int len);
+int contains_vowel(stem_buffer_p s, int len);
+int ends_with(stem_buffer_p s, char *suffix, int suffix_len);
+int ends_with_double_consonant(stem_buffer_p s);
+int ends_with_cvc(stem_buffer_p s, int suffix_len);
+void replace_suffix(stem_buffer_p s, int suffix_len, char *replacement, int replacement_len);
+int replace_if(stem_buffer_p s, char *suffix, int suffix_len, char *replacement, int replacement_len, int min_m);
+void step2(stem_buffer_p s);
+void step3(stem_buffer_p s);
+void step4(stem_buffer_p s);
 
-#define _OR_REPLACE_SUFFIX_COND(__w, __s, __r, __c) \
-_OR_REPLACE_SUFFIX_COND_NE(__w, __s, __r, __c) \
-    _END_REPLACE_COND
+/*
+ * Determines the consonant/vowel pattern and the m values of the letters not determined yet
+ * (only done when needed: most words don't end with a suffix whose removal depends on the pattern)
+ */
+void set_pattern(stem_buffer_p s) {
+    int from = s->nr_pattern;
+    int prev = from > s->base ? s->consonant[from - 1 - s->base] : s->head_consonant;
+    int m = from > s->base ? s->m[from - 1 - s->base] : s->head_m;
+
+    int i;
+    for (i = from; i < s->len; i++) {
+        // y is a vowel if it follows a consonant
+        // (combined without branches, the sequence of vowels and consonants is hard to predict)
+        unsigned int c = s->word[i] - 'a';
+        int consonant = !(((VOWELS >> (c & 31)) & (c < 26)) | ((c == 'y' - 'a') & (i > 0) & prev));
+
+        // each vowel followed by a consonant adds to m
+        m += (i > 0) & !prev & consonant;
+
+        if (!consonant && s->first_vowel > i) {
+            s->first_vowel = i;
+        }
 
-#define _OR_REPLACE_SUFFIX_COND_NE(__w, __s, __r, __c) \
-} else if (ends_with(__w, __s)) { \
-    if (__c) { \
-        __w = replace_suffix(__w, strlen(__s), __r);
+        if (i < s->base) {
+            s->head_consonant = consonant;
+            s->head_m = m;
+        } else {
+            s->consonant[i - s->base] = consonant;
+            s->m[i - s->base] = m;
+        }
 
-#define _END_REPLACE_COND }
-#define _END_REPLACE_OR }
+        prev = consonant;
+    }
 
-int calculate_m(char *word, int suffix_len);
-int is_consonant(char *word, int i);
-int contains_vowel(char *word, int suffix_len);
-int ends_with(char *word, char *suffix);
-int ends_with_double_consonant(char *word);
-int ends_with_cvc(char *word, int suffix_len);
-char *replace_suffix(char *word, int suffix_length, char *replacement);
+    s->nr_pattern = s->len;
+}
 
 /*
- * Calculates m value for a word
+ * Checks whether i-th character of word is a consonant (positions before the start of the word count as consonants)
  */
-int calculate_m(char *word, int suffix_len) {
-    if (strlen(word) <= suffix_len) {
-        return 0;
+int is_consonant(stem_buffer_p s, int i) {
+    if (s->nr_pattern < s->len) {
+        set_pattern(s);
     }
 
-    int parts = 1;
-
-    // type (consonant = 1, vowel = 0) of first letter
-    char first_type = is_consonant(word, 0);
-
-    // type of last checked letter
-    char tmp_type = first_type;
+    return i < 0 || s->consonant[i - s->base];
+}
 
-    int i = 0;
-    while (i < strlen(word) - suffix_len) {
-        // if last checked type is different from current type, we enter a new part of the word
-        if (tmp_type != is_consonant(word, i)) {
-            tmp_type = !tmp_type;
-            parts++;
-        }
-        i++;
+/*
+ * Returns the m value of the first len letters of the word
+ */
+int calculate_m(stem_buffer_p s, int len) {
+    if (s->nr_pattern < s->len) {
+        set_pattern(s);
     }
 
-    //       remove optional initial consonant   remove optional vowel ending
-    return (        parts - first_type         -    (parts - first_type)%2    ) / 2;
+    return len > 0 ? s->m[len - 1 - s->base] : 0;
 }
 
 /*
- * Checkes whether i-th character of word is a consonant
+ * Checks whether the first len letters of the word contain a vowel
  */
-int is_consonant(char *word, int i) {
-    char c = tolower(word[i]);
-    return c != 'a' && c != 'e' && c != 'i' && c != 'o' & c != 'u' && !(c == 'y' && i > 0 && is_consonant(word, i-1));
+int contains_vowel(stem_buffer_p s, int len) {
+    if (s->nr_pattern < s->len) {
+        set_pattern(s);
+    }
+
+    return s->first_vowel < len;
 }
 
 /*
- * Checks whether word contains a vowel
+ * Checks wether the word ends with a specific suffix
  */
-int contains_vowel(char *word, int suffix_len) {
-    if (strlen(word) <= suffix_len) {
+int ends_with(stem_buffer_p s, char *suffix, int suffix_len) {
+    if (s->len < suffix_len) {
         return 0;
     }
 
-    int i = 0;
-    while (i < strlen(word) - suffix_len) {
-        if (!is_consonant(word, i)) {
-            return 1;
+    // compare from the end, most suffixes are ruled out by the last letter
+    char *w = s->word + s->len;
+    int i;
+    for (i = suffix_len - 1; i >= 0; i--) {
+        if (*--w != suffix[i]) {
+            return 0;
         }
-
-        i++;
     }
 
-    return 0;
+    return 1;
 }
 
 /*
- * Checks wether a word ends with a specific suffix
+ * Checks whether word ends with a double consonant
  */
-int ends_with(char *word, char *suffix) {
-    return strlen(word) >= strlen(suffix) && !memcmp(word + strlen(word) - strlen(suffix), suffix, strlen(suffix));
+int ends_with_double_consonant(stem_buffer_p s) {
+    int l = s->len;
+    return l >= 2 && s->word[l-1] == s->word[l-2] && is_consonant(s, l-1);
 }
 
 /*
- * Checks whether word ends with a double consonant
+ * Checks whether word ands with a consonant-vowel-consonant combination where the last consonant is not W, X or Y
  */
-int ends_with_double_consonant(char *word) {
-    int l = strlen(word);
-    return word[l-1] == word[l-2] && is_consonant(word, l-1);
+int ends_with_cvc(stem_buffer_p s, int suffix_len) {
+    if (s->len <= suffix_len) {
+        return 0;
+    }
+
+    int l = s->len - 1 - suffix_len;
+    char c = s->word[l];
+    return is_consonant(s, l-2) && !is_consonant(s, l-1) && is_consonant(s, l) && c != 'w' && c != 'x' && c != 'y';
 }
 
 /*
- * Checks whether word ands with a consonant-vowel-consonant combination where the last consonant is not W, X or Y
+ * Replaces a suffix of the word, the word never grows beyond its original length
+ */
+void replace_suffix(stem_buffer_p s, int suffix_len, char *replacement, int replacement_len) {
+    int from = s->len - suffix_len;
+    memcpy(s->word + from, replacement, replacement_len);
+    s->len = from + replacement_len;
+    s->word[s->len] = '\0';
+
+    // the pattern of the replacement is determined when needed
+    if (s->nr_pattern > from) {
+        s->nr_pattern = from;
+        if (s->first_vowel >= from) {
+            s->first_vowel = INT_MAX;
+        }
+    }
+}
+
+/*
+ * Replaces a suffix of the word if the rest of the word meets a condition, returns 1 if the word ends with the suffix
+ *  min_m: the suffix is replaced if the m value of the rest of the word exceeds this (or AFTER_S_OR_T)
  */
-int ends_with_cvc(char *word, int suffix_len) {
-    if (strlen(word) <= suffix_len) {
+int replace_if(stem_buffer_p s, char *suffix, int suffix_len, char *replacement, int replacement_len, int min_m) {
+    if (!ends_with(s, suffix, suffix_len)) {
         return 0;
     }
 
-    int l = strlen(word) - 1 - suffix_len;
-    return is_consonant(word, l-2) && !is_consonant(word, l-1) && is_consonant(word, l) && word[l] != 'w' && word[l] != 'x' && word[l] != 'y';
+    int len = s->len - suffix_len;
+    if (min_m == AFTER_S_OR_T ? len > 0 && (s->word[len-1] == 's' || s->word[len-1] == 't') : calculate_m(s, len) > min_m) {
+        replace_suffix(s, suffix_len, replacement, replacement_len);
+    }
+
+    return 1;
 }
 
 /*
- * Replaces a suffix of a word
+ * Step 2 of the algorithm: maps double suffixes to single ones
+ * only the first suffix the word ends with is considered, so the rules are grouped by their last letter
  */
-char *replace_suffix(char *word, int suffix_length, char *replacement) {
-    if (suffix_length < strlen(replacement)) {
-        word = (char *) realloc(word, strlen(word) - suffix_length + strlen(replacement) + 1);
+void step2(stem_buffer_p s) {
+    switch (s->word[s->len - 1]) {
+    case 'l':
+        RULE(s, "ational", "ate", 0)
+        RULE(s, "tional", "tion", 0)
+        break;
+    case 'i':
+        RULE(s, "enci", "ence", 0)
+        RULE(s, "anci", "ance", 0)
+        RULE(s, "abli", "able", 0)
+        RULE(s, "alli", "al", 0)
+        RULE(s, "entli", "ent", 0)
+        RULE(s, "eli", "e", 0)
+        RULE(s, "ousli", "ous", 0)
+        RULE(s, "aliti", "al", 0)
+        RULE(s, "iviti", "ive", 0)
+        RULE(s, "biliti", "ble", 0)
+        break;
+    case 'r':
+        RULE(s, "izer", "ize", 0)
+        RULE(s, "ator", "ate", 0)
+        break;
+    case 'n':
+        RULE(s, "ization", "ize", 0)
+        RULE(s, "ation", "ate", 0)
+        break;
+    case 'm':
+        RULE(s, "alism", "al", 0)
+        break;
+    case 's':
+        RULE(s, "ivenes", "ive", 0)
+        RULE(s, "fulness", "ful", 0)
+        RULE(s, "ousness", "ous", 0)
+        break;
     }
+}
 
-    // copy whole replacement string, including \0 string terminator
-    memcpy(word + strlen(word) - suffix_length, replacement, strlen(replacement) + 1);
-    return word;
+/*
+ * Step 3 of the algorithm: removes or shortens -ic-, -full, -ness etc.
+ */
+void step3(stem_buffer_p s) {
+    switch (s->word[s->len - 1]) {
+    case 'e':
+        RULE(s, "icate", "ic", 0)
+        RULE(s, "ative", "", 0)
+        RULE(s, "alize", "al", 0)
+        break;
+    case 'i':
+        RULE(s, "aciti", "ic", 0)
+        break;
+    case 'l':
+        RULE(s, "ical", "ic", 0)
+        RULE(s, "ful", "", 0)
+        break;
+    case 's':
+        RULE(s, "ness", "", 0)
+        break;
+    }
 }
 
 /*
- * Runs Porter Stemming Algorithm on a word
+ * Step 4 of the algorithm: removes -ant, -ence etc. if m > 1
  */
-char *stem(char *word) {
-    // copy word to new memory location
-    char *result = (char *) malloc(strlen(word) + 1);
-    memcpy(result, word, strlen(word) + 1);
+void step4(stem_buffer_p s) {
+    switch (s->word[s->len - 1]) {
+    case 'l':
+        RULE(s, "al", "", 1)
+        break;
+    case 'e':
+        RULE(s, "ance", "", 1)
+        RULE(s, "ence", "", 1)
+        RULE(s, "able", "", 1)
+        RULE(s, "ible", "", 1)
+        RULE(s, "ate", "", 1)
+        RULE(s, "ive", "", 1)
+        RULE(s, "ize", "", 1)
+        break;
+    case 'r':
+        RULE(s, "er", "", 1)
+        break;
+    case 'c':
+        RULE(s, "ic", "", 1)
+        break;
+    case 't':
+        RULE(s, "ant", "", 1)
+        RULE(s, "ement", "", 1)
+        RULE(s, "ment", "", 1)
+        RULE(s, "ent", "", 1)
+        break;
+    case 'n':
+        RULE(s, "ion", "", AFTER_S_OR_T)
+        break;
+    case 'u':
+        RULE(s, "ou", "", 1)
+        break;
+    case 'm':
+        RULE(s, "ism", "", 1)
+        break;
+    case 'i':
+        RULE(s, "iti", "", 1)
+        break;
+    case 's':
+        RULE(s, "ous", "", 1)
+        break;
+    }
+}
+
+/*
+ * Runs Porter Stemming Algorithm on a word of lower case letters, returns the length of the stem
+ *  buf: receives the \0 terminated stem, room for len + 1 characters (may be the word itself)
+ */
+int stem_word(char *word, int len, char *buf) {
+    if (buf != word) {
+        memcpy(buf, word, len);
+    }
+    buf[len] = '\0';
+
+    stem_buffer_t s;
+    s.word = buf;
+    s.len = len;
+    s.base = len > STEM_WINDOW ? len - STEM_WINDOW : 0;
+    s.nr_pattern = 0;
+    s.first_vowel = INT_MAX;
+    s.head_consonant = 1;
+    s.head_m = 0;
 
     /* STEP 1a */
-    _BEGIN_REPLACE_SUFFIX(result, "sses", "ss")
-    _OR_REPLACE_SUFFIX(result, "ies", "i")
-    _OR_REPLACE_SUFFIX(result, "ss", "ss")
-    _OR_REPLACE_SUFFIX(result, "s", "")
-    _END_REPLACE_OR
+    if (ends_with(&s, "sses", 4)) {
+        replace_suffix(&s, 4, "ss", 2);
+    } else if (ends_with(&s, "ies", 3)) {
+        replace_suffix(&s, 3, "i", 1);
+    } else if (!ends_with(&s, "ss", 2) && ends_with(&s, "s", 1)) {
+        replace_suffix(&s, 1, "", 0);
+    }
 
     /* STEP 1b */
     int cont = 0;
-    int vowel = contains_vowel(result, 3);
-    _BEGIN_REPLACE_SUFFIX_COND(result, "eed", "ee", calculate_m(result, 3) > 0)
-    _OR_REPLACE_SUFFIX_COND_NE(result, "ing", "", vowel)
-        cont = 1;
-    _END_REPLACE_COND
-    _OR_REPLACE_SUFFIX_COND_NE(result, "ed", "", vowel || !is_consonant(result, strlen(result) - 3))
-        cont = 1;
-    _END_REPLACE_COND
-    _END_REPLACE_OR
-
-    int l = strlen(result) - 1;
+    if (ends_with(&s, "eed", 3)) {
+        if (calculate_m(&s, s.len - 3) > 0) {
+            replace_suffix(&s, 3, "ee", 2);
+        }
+    } else if (ends_with(&s, "ing", 3)) {
+        if (contains_vowel(&s, s.len - 3)) {
+            replace_suffix(&s, 3, "", 0);
+            cont = 1;
+        }
+    } else if (ends_with(&s, "ed", 2)) {
+        if (contains_vowel(&s, s.len - 2)) {
+            replace_suffix(&s, 2, "", 0);
+            cont = 1;
+        }
+    }
+
     if (cont) {
-        _BEGIN_REPLACE_SUFFIX(result, "at", "ate")
-        _OR_REPLACE_SUFFIX(result, "bl", "ble")
-        _OR_REPLACE_SUFFIX(result, "iz", "ize")
-        _OR_REPLACE_SUFFIX_COND_NE(result, "", "", ends_with_double_consonant(result) && result[l] != 'l' && result[l] != 's' && result[l] != 'z')
+        char last = s.word[s.len - 1];
+        if (ends_with(&s, "at", 2)) {
+            replace_suffix(&s, 2, "ate", 3);
+        } else if (ends_with(&s, "bl", 2)) {
+            replace_suffix(&s, 2, "ble", 3);
+        } else if (ends_with(&s, "iz", 2)) {
+            replace_suffix(&s, 2, "ize", 3);
+        } else if (ends_with_double_consonant(&s) && last != 'l' && last != 's' && last != 'z') {
             // removes the last consonant of the consonant pair at the end of the word
-            result[l] = '\0';
-        _END_REPLACE_COND
-        _OR_REPLACE_SUFFIX_COND(result, "", "e", calculate_m(result, 0) == 1 && ends_with_cvc(result, 0))
-        _END_REPLACE_OR
+            replace_suffix(&s, 1, "", 0);
+        }
+
+        // no e is appended to short stems ending with consonant-vowel-consonant (hop -> hope),
+        // the stems in existing indexes were built that way
     }
 
     /* STEP 1c */
-    _REPLACE_SUFFIX_COND(result, "y", "i", contains_vowel(result, 1))
+    if (ends_with(&s, "y", 1) && contains_vowel(&s, s.len - 1)) {
+        replace_suffix(&s, 1, "i", 1);
+    }
+
+    if (!s.len) {
+        return 0;
+    }
 
     /* STEP 2 */
-    int m7 = calculate_m(result, 7);
-    int m6 = m7 > 0 ? m7 : calculate_m(result, 6);
-    int m5 = m6 > 0 ? m6 : calculate_m(result, 5);
-    int m4 = m5 > 0 ? m5 : calculate_m(result, 4);
-    int m3 = m4 > 0 ? m4 : calculate_m(result, 3);
-    _BEGIN_REPLACE_SUFFIX_COND(result, "ational", "ate", m7 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "tional", "tion", m6 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "enci", "ence", m4 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "anci", "ance", m4 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "izer", "ize", m4 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "abli", "able", m4 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "alli", "al", m4 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "entli", "ent", m5 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "eli", "e", m3 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "ousli", "ous", m5 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "ization", "ize", m7 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "ation", "ate", m5 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "ator", "ate", m4 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "alism", "al", m5 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "ivenes", "ive", m6 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "fulness", "ful", m7 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "ousness", "ous", m7 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "aliti", "al", m5 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "iviti", "ive", m5 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "biliti", "ble", m6 > 0)
-    _END_REPLACE_OR
+    step2(&s);
 
     /* STEP 3 */
-    m5 = calculate_m(result, 5);
-    m4 = m5 > 0 ? m5 : calculate_m(result, 4);
-    m3 = m4 > 0 ? m4 : calculate_m(result, 3);
-    _BEGIN_REPLACE_SUFFIX_COND(result, "icate", "ic", m5 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "ative", "", m5 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "alize", "al", m5 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "aciti", "ic", m5 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "ical", "ic", m4 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "ful", "", m3 > 0)
-    _OR_REPLACE_SUFFIX_COND(result, "ness", "", m4 > 0)
-    _END_REPLACE_OR
+    step3(&s);
 
     /* STEP 4 */
-    l = strlen(result) - 1;
-    m5 = calculate_m(result, 5);
-    m4 = m5 > 1 ? m5 : calculate_m(result, 4);
-    m3 = m4 > 1 ? m4 : calculate_m(result, 3);
-    int m2 = m3 > 1 ? m3 : calculate_m(result, 2);
-    _BEGIN_REPLACE_SUFFIX_COND(result, "al", "", m2 > 1)
-    _OR_REPLACE_SUFFIX_COND(result, "ance", "", m4 > 1)
-    _OR_REPLACE_SUFFIX_COND(result, "ence", "", m4 > 1)
-    _OR_REPLACE_SUFFIX_COND(result, "er", "", m2 > 1)
-    _OR_REPLACE_SUFFIX_COND(result, "ic", "", m2 > 1)
-    _OR_REPLACE_SUFFIX_COND(result, "able", "", m4 > 1)
-    _OR_REPLACE_SUFFIX_COND(result, "ible", "", m4 > 1)
-    _OR_REPLACE_SUFFIX_COND(result, "ant", "", m3 > 1)
-    _OR_REPLACE_SUFFIX_COND(result, "ement", "", m5 > 1)
-    _OR_REPLACE_SUFFIX_COND(result, "ment", "", m4 > 1)
-    _OR_REPLACE_SUFFIX_COND(result, "ent", "", m3 > 1)
-    _OR_REPLACE_SUFFIX_COND(result, "ion", "", result[l-3] == 's' || result[l-3] == 't')
-    _OR_REPLACE_SUFFIX_COND(result, "ou", "", m2 > 1)
-    _OR_REPLACE_SUFFIX_COND(result, "ism", "", m3 > 1)
-    _OR_REPLACE_SUFFIX_COND(result, "ate", "", m3 > 1)
-    _OR_REPLACE_SUFFIX_COND(result, "iti", "", m3 > 1)
-    _OR_REPLACE_SUFFIX_COND(result, "ous", "", m3 > 1)
-    _OR_REPLACE_SUFFIX_COND(result, "ive", "", m3 > 1)
-    _OR_REPLACE_SUFFIX_COND(result, "ize", "", m3 > 1)
-    _END_REPLACE_OR
+    step4(&s);
 
     /* STEP 5a */
-    int m1 = calculate_m(result, 1);
-    _REPLACE_SUFFIX_COND(result, "e", "", m1 > 1 || (m1 == 1 && !ends_with_cvc(result, 1)))
+    if (ends_with(&s, "e", 1)) {
+        int m = calculate_m(&s, s.len - 1);
+        if (m > 1 || (m == 1 && !ends_with_cvc(&s, 1))) {
+            replace_suffix(&s, 1, "", 0);
+        }
+    }
 
     /* STEP 5b */
-    _REPLACE_SUFFIX_COND(result, "l", "", calculate_m(result, 0) > 1 && ends_with_double_consonant(result))
+    if (ends_with(&s, "l", 1) && calculate_m(&s, s.len) > 1 && ends_with_double_consonant(&s)) {
+        replace_suffix(&s, 1, "", 0);
+    }
 
-    return result;
+    return s.len;
 }
@@ -1 +1 @@
-char *stem(char *word);
+int stem_word(char *word, int len, char *buf);
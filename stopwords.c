@@ -0,0 +1,284 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "index.h"
+#include "stopwords.h"
+
+// number of seeds tried for a bucket before the hash table is enlarged
+#define MAX_STOPWORD_SEED (1 << 16)
+
+int build_stopword_table(stopword_set_p set, char **words);
+int cmp_stopword(const void *a, const void *b);
+int cmp_bucket_size_desc(const void *a, const void *b);
+
+typedef struct stopword_bucket {
+    int bucket;             // number of the bucket
+    int size;               // number of stopwords in the bucket
+} stopword_bucket_t, *stopword_bucket_p;
+
+/*
+ * The stopwords are kept in a minimal perfect hash table (hash and displace): a first hash distributes the
+ * stopwords to buckets, each bucket stores the seed of a second hash that places all its stopwords in
+ * different slots (or directly the slot of its only stopword). So a lookup hashes the word at most twice and
+ * compares it to the one stopword in its slot. Most words are ruled out by their length before hashing.
+ */
+
+/*
+ * Loads a set of stopwords from a file (one or more stopwords per line, in any order)
+ * returns NULL if the file can't be read
+ */
+stopword_set_p load_stopwords(char *file) {
+    FILE *f = fopen(file, "r");
+    if (!f) {
+        return NULL;
+    }
+
+    // read the whole file at once
+    int size = 0, max_size = 4096;
+    char *text = (char *) malloc(max_size);
+    int n;
+    while ((n = fread(text + size, 1, max_size - size, f)) > 0) {
+        size += n;
+        if (size == max_size) {
+            max_size *= 2;
+            text = (char *) realloc(text, max_size);
+        }
+    }
+
+    fclose(f);
+
+    stopword_set_p set = new_stopwords(text, size);
+    free(text);
+
+    return set;
+}
+
+/*
+ * Creates a set of stopwords
+ *  text: the stopwords, separated by whitespace or \0 (in any order, duplicates allowed)
+ *  size: length of text in bytes
+ */
+stopword_set_p new_stopwords(char *text, int size) {
+    stopword_set_p set = (stopword_set_p) malloc(sizeof(stopword_set_t));
+
+    // split a lower case copy of the text into words
+    char *copy = (char *) malloc(size + 1);
+    char **words = (char **) malloc(sizeof(char *) * (size / 2 + 1));
+    int i, nr_words = 0;
+    for (i = 0; i < size; i++) {
+        copy[i] = isspace(text[i]) ? '\0' : tolower(text[i]);
+        if (copy[i] && (!i || !copy[i - 1])) {
+            words[nr_words++] = copy + i;
+        }
+    }
+    copy[size] = '\0';
+
+    // order the words and drop duplicates
+    qsort(words, nr_words, sizeof(char *), cmp_stopword);
+
+    set->nr_words = 0;
+    for (i = 0; i < nr_words; i++) {
+        if (!set->nr_words || strcmp(words[set->nr_words - 1], words[i])) {
+            words[set->nr_words++] = words[i];
+        }
+    }
+
+    // keep the words one after another, \0 terminated
+    set->size = 0;
+    for (i = 0; i < set->nr_words; i++) {
+        set->size += strlen(words[i]) + 1;
+    }
+
+    set->words = (char *) malloc(set->size + 1);
+    char *w = set->words;
+    set->length_mask = 0;
+    for (i = 0; i < set->nr_words; i++) {
+        int len = strlen(words[i]);
+        memcpy(w, words[i], len + 1);
+        words[i] = w;
+        w += len + 1;
+
+        set->length_mask |= 1ul << (len < 63 ? len : 63);
+    }
+
+    // at least as many slots as words, there are more only if no seeds could be found for a minimal table
+    set->nr_buckets = set->nr_words ? set->nr_words : 1;
+    set->nr_slots = set->nr_buckets;
+    while (!build_stopword_table(set, words)) {
+        set->nr_slots += set->nr_slots / 4 + 1;
+    }
+
+    free(words);
+    free(copy);
+
+    return set;
+}
+
+/*
+ * Releases a set of stopwords (set may be NULL)
+ */
+void free_stopwords(stopword_set_p set) {
+    if (set) {
+        free(set->seeds);
+        free(set->slots);
+        free(set->lengths);
+        free(set->words);
+        free(set);
+    }
+}
+
+/*
+ * Checks whether a word is a stopword (set may be NULL = no stopwords)
+ *  len: length of the word
+ */
+int is_stopword(stopword_set_p set, char *word, int len) {
+    if (!set || !(set->length_mask & (1ul << (len < 63 ? len : 63)))) {
+        return 0;
+    }
+
+    int seed = set->seeds[stopword_hash(0, word, len) % set->nr_buckets];
+    int slot = seed < 0 ? -1 - seed : stopword_hash(seed, word, len) % set->nr_slots;
+
+    return set->lengths[slot] == len && !memcmp(set->slots[slot], word, len);
+}
+
+/*
+ * FNV-1a hash of a word, the seed selects one of a family of hash functions
+ */
+unsigned int stopword_hash(unsigned int seed, char *word, int len) {
+    unsigned int hash = 2166136261u ^ (seed * 2654435761u);
+    int i;
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char) word[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/*
+ * Places alphabetically ordered stopwords in the slots of the hash table (set->nr_slots), sets the seeds of the buckets
+ * returns 1 on success, 0 if the words of a bucket couldn't be placed
+ */
+int build_stopword_table(stopword_set_p set, char **words) {
+    set->seeds = (int *) calloc(set->nr_buckets, sizeof(int));
+    set->slots = (char **) calloc(set->nr_slots, sizeof(char *));
+    set->lengths = (int *) calloc(set->nr_slots, sizeof(int));
+
+    // group the words by bucket
+    int *bucket_of = (int *) malloc(sizeof(int) * (set->nr_words + 1));
+    int *first = (int *) calloc(set->nr_buckets + 1, sizeof(int));
+    int *members = (int *) malloc(sizeof(int) * (set->nr_words + 1));
+    int i, j;
+    for (i = 0; i < set->nr_words; i++) {
+        bucket_of[i] = stopword_hash(0, words[i], strlen(words[i])) % set->nr_buckets;
+        first[bucket_of[i] + 1]++;
+    }
+
+    for (i = 0; i < set->nr_buckets; i++) {
+        first[i + 1] += first[i];
+    }
+
+    int *fill = (int *) malloc(sizeof(int) * set->nr_buckets);
+    memcpy(fill, first, sizeof(int) * set->nr_buckets);
+    for (i = 0; i < set->nr_words; i++) {
+        members[fill[bucket_of[i]]++] = i;
+    }
+
+    // largest buckets first, while there are many free slots
+    stopword_bucket_p buckets = (stopword_bucket_p) malloc(sizeof(stopword_bucket_t) * set->nr_buckets);
+    for (i = 0; i < set->nr_buckets; i++) {
+        buckets[i].bucket = i;
+        buckets[i].size = first[i + 1] - first[i];
+    }
+
+    qsort(buckets, set->nr_buckets, sizeof(stopword_bucket_t), cmp_bucket_size_desc);
+
+    int ok = 1, free_slot = 0, b;
+    int *placed = (int *) malloc(sizeof(int) * (set->nr_words + 1));
+    for (b = 0; ok && b < set->nr_buckets && buckets[b].size; b++) {
+        int *m = members + first[buckets[b].bucket];
+        int size = buckets[b].size;
+
+        if (size == 1) {
+            // a single word goes to the next free slot, no second hash needed
+            while (set->slots[free_slot]) {
+                free_slot++;
+            }
+
+            set->seeds[buckets[b].bucket] = -1 - free_slot;
+            set->slots[free_slot] = words[m[0]];
+            set->lengths[free_slot] = strlen(words[m[0]]);
+            continue;
+        }
+
+        // try seeds until all words of the bucket get different free slots
+        int seed;
+        for (seed = 1; seed <= MAX_STOPWORD_SEED; seed++) {
+            for (i = 0; i < size; i++) {
+                placed[i] = stopword_hash(seed, words[m[i]], strlen(words[m[i]])) % set->nr_slots;
+                if (set->slots[placed[i]]) {
+                    break;
+                }
+
+                for (j = 0; j < i && placed[j] != placed[i]; j++);
+                if (j < i) {
+                    break;
+                }
+            }
+
+            if (i == size) {
+                break;
+            }
+        }
+
+        if (seed > MAX_STOPWORD_SEED) {
+            ok = 0;
+            break;
+        }
+
+        set->seeds[buckets[b].bucket] = seed;
+        for (i = 0; i < size; i++) {
+            set->slots[placed[i]] = words[m[i]];
+            set->lengths[placed[i]] = strlen(words[m[i]]);
+        }
+    }
+
+    free(placed);
+    free(buckets);
+    free(fill);
+    free(members);
+    free(first);
+    free(bucket_of);
+
+    if (!ok) {
+        free(set->seeds);
+        free(set->slots);
+        free(set->lengths);
+    }
+
+    return ok;
+}
+
+/*
+ * Compares two stopwords alphabetically
+ */
+int cmp_stopword(const void *a, const void *b) {
+    return strcmp(*(char **) a, *(char **) b);
+}
+
+/*
+ * Compares two buckets by their number of stopwords, largest first
+ */
+int cmp_bucket_size_desc(const void *a, const void *b) {
+    stopword_bucket_p ba = (stopword_bucket_p) a;
+    stopword_bucket_p bb = (stopword_bucket_p) b;
+
+    if (ba->size != bb->size) {
+        return bb->size - ba->size;
+    }
+
+    return ba->bucket - bb->bucket;
+}
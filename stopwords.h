@@ -0,0 +1,5 @@
+stopword_set_p load_stopwords(char *file);
+stopword_set_p new_stopwords(char *text, int size);
+void free_stopwords(stopword_set_p set);
+int is_stopword(stopword_set_p set, char *word, int len);
+unsigned int stopword_hash(unsigned int seed, char *word, int len);
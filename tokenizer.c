@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "index.h"
+#include "tokenizer.h"
+
+// letter of the C locale: turning the bit 0x20 on maps 'A'..'Z' to 'a'..'z' and leaves 'a'..'z' as they are
+#define IS_LETTER(c) ((unsigned char) (((c) | 0x20) - 'a') < 26)
+
+int fill_tokenizer(tokenizer_p t);
+
+/*
+ * A tokenizer splits a text into words (runs of letters) and turns them to lower case, every other character
+ * separates words. Files are read in chunks of TOKEN_BUFFER_SIZE bytes, so a tokenizer needs the same memory
+ * for files of any size and lines of any length. The words are returned in place, each tokenizer has a buffer
+ * of its own.
+ */
+
+/*
+ * Sets up a tokenizer reading a file
+ * returns 1 on success, 0 if the file can't be opened
+ */
+int open_tokenizer(tokenizer_p t, char *file) {
+    t->fd = open(file, O_RDONLY);
+    if (t->fd < 0) {
+        return 0;
+    }
+
+    // one more byte to terminate a word at the end of the buffer
+    t->buffer = (char *) malloc(TOKEN_BUFFER_SIZE + 1);
+    t->pos = 0;
+    t->end = 0;
+    t->eof = 0;
+
+    return 1;
+}
+
+/*
+ * Sets up a tokenizer splitting a \0 terminated string, the words are turned to lower case in the string itself
+ */
+void string_tokenizer(tokenizer_p t, char *str) {
+    t->fd = -1;
+    t->buffer = str;
+    t->pos = 0;
+    t->end = strlen(str);
+    t->eof = 1;
+}
+
+/*
+ * Releases a tokenizer (the string of a string tokenizer stays)
+ */
+void close_tokenizer(tokenizer_p t) {
+    if (t->fd >= 0) {
+        close(t->fd);
+        free(t->buffer);
+    }
+
+    t->fd = -1;
+    t->buffer = NULL;
+}
+
+/*
+ * Finds the next word, returns its length (0 = no more words)
+ *  word: returns the \0 terminated lower case word, valid until the next call (room for length + 1 characters)
+ */
+int next_token(tokenizer_p t, char **word) {
+    char *b = t->buffer;
+
+    for (;;) {
+        // skip everything up to the next letter
+        while (t->pos < t->end && !IS_LETTER(b[t->pos])) {
+            t->pos++;
+        }
+
+        if (t->pos == t->end) {
+            // buffer used up, start over with the next chunk
+            t->pos = 0;
+            t->end = 0;
+            if (!fill_tokenizer(t)) {
+                return 0;
+            }
+
+            continue;
+        }
+
+        int start = t->pos;
+        while (t->pos < t->end && IS_LETTER(b[t->pos])) {
+            b[t->pos++] |= 0x20;
+        }
+
+        // the word might go on in the next chunk: move it to the front of the buffer and read on
+        while (t->pos == t->end && !t->eof) {
+            if (start) {
+                memmove(b, b + start, t->end - start);
+                t->end -= start;
+                t->pos = t->end;
+                start = 0;
+            } else if (t->end == TOKEN_BUFFER_SIZE) {
+                // the word fills the whole buffer, it is cut off
+                break;
+            }
+
+            if (fill_tokenizer(t)) {
+                while (t->pos < t->end && IS_LETTER(b[t->pos])) {
+                    b[t->pos++] |= 0x20;
+                }
+            }
+        }
+
+        // the character after the word is no letter (or beyond the text), so it can take the terminating \0
+        *word = b + start;
+        int len = t->pos - start;
+        if (t->pos < t->end) {
+            t->pos++;
+        }
+        b[start + len] = '\0';
+
+        return len;
+    }
+}
+
+/*
+ * Appends the next chunk of the file to the buffer
+ * returns the number of bytes read (0 = end of the file)
+ */
+int fill_tokenizer(tokenizer_p t) {
+    if (t->eof) {
+        return 0;
+    }
+
+    int n;
+    do {
+        n = read(t->fd, t->buffer + t->end, TOKEN_BUFFER_SIZE - t->end);
+    } while (n < 0 && errno == EINTR);
+
+    if (n <= 0) {
+        t->eof = 1;
+        return 0;
+    }
+
+    t->end += n;
+    return n;
+}
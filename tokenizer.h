@@ -0,0 +1,4 @@
+int open_tokenizer(tokenizer_p t, char *file);
+void string_tokenizer(tokenizer_p t, char *str);
+void close_tokenizer(tokenizer_p t);
+int next_token(tokenizer_p t, char **word);
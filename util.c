@@ -1,6 +1,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
+#include <math.h>
 
 #include "util.h"
 
@@ -27,6 +30,7 @@ char *read_line(FILE *ptr) {
         // string buffer full => double the size
         if (--len == 0) {
             len = lenmax;
+            size_t used = line - linep;
             char * linen = realloc(linep, lenmax *= 2);
 
             if (linen == NULL) {
@@ -34,7 +38,7 @@ char *read_line(FILE *ptr) {
                 return NULL;
             }
 
-            line = linen + (line - linep);
+            line = linen + used;
             linep = linen;
         }
 
@@ -47,7 +51,8 @@ char *read_line(FILE *ptr) {
     *line = '\0';
 
     // nothing read => return NULL
-    if (strlen(linep) == 0) {
+    if (line == linep) {
+        free(linep);
         return NULL;
     }
 
@@ -56,7 +61,7 @@ char *read_line(FILE *ptr) {
         *(line - 1) = '\0';
 
         // special case Windows (DOH!) -> remove \r as well
-        if (*(line - 2) == '\r') {
+        if (line - 1 > linep && *(line - 2) == '\r') {
             *(line - 2) = '\0';
         }
     }
@@ -65,22 +70,60 @@ char *read_line(FILE *ptr) {
 }
 
 /*
- * Turns non alpha characters into spaces
+ * Checks if pre is a prefix of str
+ */
+int starts_with(char *str, char *pre) {
+    return strncmp(pre, str, strlen(pre)) == 0;
+}
+
+/*
+ * Returns the time in seconds on a clock that only moves forward (CLOCK_MONOTONIC)
+ */
+double now_seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * Appends formatted text to a growing buffer, returns the buffer (it may move)
+ *  size: number of bytes in the buffer, max_size: number of bytes it has room for
  */
-void nonalpha_to_space(char *str) {
-    char *c;
-    for(c = str; *c; c++) {
-        if(!isalpha(*c)) {
-            *c = ' ';
-        } else {
-            *c = tolower(*c);
+char *append_text(char *text, int *size, int *max_size, char *format, ...) {
+    for (;;) {
+        va_list args;
+        va_start(args, format);
+        int len = vsnprintf(text + *size, *max_size - *size, format, args);
+        va_end(args);
+
+        if (*size + len < *max_size) {
+            *size += len;
+            return text;
+        }
+
+        // buffer full => double the size (room for the \0 vsnprintf writes)
+        while (*size + len >= *max_size) {
+            *max_size *= 2;
         }
+        text = (char *) realloc(text, *max_size);
     }
 }
 
 /*
- * Checks if pre is a prefix of str
+ * Returns the p-th percentile of n sorted latencies (nearest rank)
  */
-int starts_with(char *str, char *pre) {
-    return strncmp(pre, str, strlen(pre)) == 0;
+double latency_percentile(double *sorted, int n, double p) {
+    int rank = (int) ceil(p / 100 * n);
+
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+/*
+ * Compares two latencies, shortest first
+ */
+int cmp_latency(const void *a, const void *b) {
+    double x = *(double *) a, y = *(double *) b;
+
+    return x < y ? -1 : x > y;
 }
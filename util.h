@@ -1,3 +1,6 @@
 char *read_line(FILE *ptr);
-void nonalpha_to_space(char *str);
 int starts_with(char *str, char *pre);
+double now_seconds();
+char *append_text(char *text, int *size, int *max_size, char *format, ...);
+double latency_percentile(double *sorted, int n, double p);
+int cmp_latency(const void *a, const void *b);
@@ -0,0 +1,276 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "index.h"
+#include "vocab.h"
+#include "postings.h"
+#include "snapshots.h"
+
+#define INITIAL_NR_SLOTS 1024
+#define STEM_BLOCK_SIZE 65536
+
+int find_slot(index_p index, char *stem, unsigned int hash);
+void grow_slots(index_p index);
+char *store_stem(index_p index, char *stem);
+int cmp_word_stem(const void *a, const void *b);
+
+/*
+ * Initializes an empty vocabulary
+ */
+void init_words(index_p index) {
+    index->words = NULL;
+    index->max_words = 0;
+    index->nr_words = 0;
+    index->stems = NULL;
+
+    index->nr_slots = INITIAL_NR_SLOTS;
+    index->slots = (word_slot_p) calloc(index->nr_slots, sizeof(word_slot_t));
+}
+
+/*
+ * Releases all indexed words including their document lists
+ */
+void clear_words(index_p index) {
+    int i;
+    for (i = 0; i < index->nr_words; i++) {
+        free_postings(&index->words[i]);
+    }
+
+    stem_block_p b;
+    while ((b = index->stems)) {
+        index->stems = b->next;
+        free(b);
+    }
+
+    free(index->words);
+    free(index->slots);
+
+    index->words = NULL;
+    index->slots = NULL;
+    index->max_words = 0;
+    index->nr_words = 0;
+    index->nr_slots = 0;
+}
+
+/*
+ * Returns the number of bytes occupied by the vocabulary and the document lists it owns
+ */
+long words_memory(index_p index) {
+    long size = sizeof(indexed_word_t) * (long) index->max_words + sizeof(word_slot_t) * (long) index->nr_slots;
+
+    int i;
+    for (i = 0; i < index->nr_words; i++) {
+        indexed_word_p w = &index->words[i];
+        size += sizeof(posting_block_t) * (long) w->max_blocks + sizeof(unsigned int) * (long) w->max_data + sizeof(doc_t) * (long) w->max_tail;
+        size += sizeof(int) * (long) w->max_blocks + w->max_positions;
+    }
+
+    stem_block_p b;
+    for (b = index->stems; b; b = b->next) {
+        size += sizeof(stem_block_t) + b->size;
+    }
+
+    return size;
+}
+
+/*
+ * Looks up a stem in the vocabulary, returns index of the word or -1
+ */
+int find_word(index_p index, char *stem) {
+    int s = find_slot(index, stem, hash_stem(stem));
+    return index->slots[s].word - 1;
+}
+
+/*
+ * Looks up a stem in the vocabulary and adds it if it's not indexed yet, returns index of the word
+ */
+int find_or_add_word(index_p index, char *stem) {
+    // keep the hash table at most half full
+    if ((index->nr_words + 1) * 2 > index->nr_slots) {
+        grow_slots(index);
+    }
+
+    unsigned int hash = hash_stem(stem);
+    int s = find_slot(index, stem, hash);
+
+    if (index->slots[s].word) {
+        // stem is already indexed
+        return index->slots[s].word - 1;
+    }
+
+    // stem is not indexed yet, append it to the list of words
+    if (index->nr_words == index->max_words) {
+        index->max_words = index->max_words ? index->max_words * 2 : INITIAL_NR_SLOTS / 2;
+        index->words = (indexed_word_p) realloc(index->words, sizeof(indexed_word_t) * index->max_words);
+    }
+
+    indexed_word_p w = &index->words[index->nr_words];
+    memset(w, 0, sizeof(indexed_word_t));
+    w->stem = store_stem(index, stem);
+    w->stamp = index->nr_snapshots;
+
+    index->slots[s].hash = hash;
+    index->slots[s].word = ++index->nr_words;
+
+    return index->nr_words - 1;
+}
+
+/*
+ * Removes a word from the vocabulary; the last word in the list takes over its index
+ */
+void remove_word(index_p index, int word) {
+    int mask = index->nr_slots - 1;
+
+    // find slot of the word
+    int i = hash_stem(index->words[word].stem) & mask;
+    while (index->slots[i].word != word + 1) {
+        i = (i + 1) & mask;
+    }
+
+    // close the gap: move back following entries which would be unreachable otherwise
+    int j = i;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (!index->slots[j].word) {
+            break;
+        }
+
+        // home slot of the entry, entry stays where it is if its home lies cyclically in (i, j]
+        int k = index->slots[j].hash & mask;
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) {
+            continue;
+        }
+
+        index->slots[i] = index->slots[j];
+        i = j;
+    }
+    index->slots[i].word = 0;
+
+    // snapshots may still read a document list made before they were published
+    if (index->words[word].stamp == index->nr_snapshots) {
+        free_postings(&index->words[word]);
+    } else {
+        retire_postings(index, &index->words[word]);
+    }
+
+    // move last word into the gap in the list of words
+    int last = index->nr_words - 1;
+    if (word != last) {
+        index->words[word] = index->words[last];
+
+        i = hash_stem(index->words[word].stem) & mask;
+        while (index->slots[i].word != last + 1) {
+            i = (i + 1) & mask;
+        }
+        index->slots[i].word = word + 1;
+    }
+
+    index->nr_words--;
+}
+
+/*
+ * Returns a list of pointers to all indexed words, alphabetically ordered
+ * the list has to be freed by the caller and is invalidated by adding words to the index
+ */
+indexed_word_p *sort_words(index_p index) {
+    indexed_word_p *sorted = (indexed_word_p *) malloc(sizeof(indexed_word_p) * (index->nr_words + 1));
+
+    int i;
+    for (i = 0; i < index->nr_words; i++) {
+        sorted[i] = &index->words[i];
+    }
+
+    qsort(sorted, index->nr_words, sizeof(indexed_word_p), cmp_word_stem);
+    return sorted;
+}
+
+/*
+ * Compares two pointers to indexed words based on their stems
+ */
+int cmp_word_stem(const void *a, const void *b) {
+    return strcmp((*(indexed_word_p *) a)->stem, (*(indexed_word_p *) b)->stem);
+}
+
+/*
+ * Computes FNV-1a hash of a stem
+ */
+unsigned int hash_stem(char *stem) {
+    unsigned int hash = 2166136261u;
+    while (*stem) {
+        hash ^= (unsigned char) *stem++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/*
+ * Finds the slot of a stem in the hash table, or the empty slot where it would be inserted
+ */
+int find_slot(index_p index, char *stem, unsigned int hash) {
+    int mask = index->nr_slots - 1;
+    int s = hash & mask;
+
+    // linear probing
+    while (index->slots[s].word) {
+        if (index->slots[s].hash == hash && !strcmp(index->words[index->slots[s].word - 1].stem, stem)) {
+            break;
+        }
+
+        s = (s + 1) & mask;
+    }
+
+    return s;
+}
+
+/*
+ * Doubles the size of the hash table
+ */
+void grow_slots(index_p index) {
+    word_slot_p old = index->slots;
+    int nr_old = index->nr_slots;
+
+    index->nr_slots *= 2;
+    index->slots = (word_slot_p) calloc(index->nr_slots, sizeof(word_slot_t));
+
+    // reinsert all words, stems are unique so there is no need to compare them
+    int mask = index->nr_slots - 1;
+    int i;
+    for (i = 0; i < nr_old; i++) {
+        if (old[i].word) {
+            int s = old[i].hash & mask;
+            while (index->slots[s].word) {
+                s = (s + 1) & mask;
+            }
+
+            index->slots[s] = old[i];
+        }
+    }
+
+    free(old);
+}
+
+/*
+ * Copies a stem into the stem blocks of the index
+ */
+char *store_stem(index_p index, char *stem) {
+    int len = strlen(stem) + 1;
+
+    stem_block_p b = index->stems;
+    if (!b || b->size - b->used < len) {
+        // current block full => start a new one
+        int size = len > STEM_BLOCK_SIZE ? len : STEM_BLOCK_SIZE;
+        b = (stem_block_p) malloc(sizeof(stem_block_t) + size);
+        b->next = index->stems;
+        b->size = size;
+        b->used = 0;
+        index->stems = b;
+    }
+
+    char *s = b->stems + b->used;
+    memcpy(s, stem, len);
+    b->used += len;
+
+    return s;
+}
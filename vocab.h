@@ -0,0 +1,8 @@
+void init_words(index_p index);
+void clear_words(index_p index);
+long words_memory(index_p index);
+int find_word(index_p index, char *stem);
+int find_or_add_word(index_p index, char *stem);
+void remove_word(index_p index, int word);
+indexed_word_p *sort_words(index_p index);
+unsigned int hash_stem(char *stem);